@@ -5,6 +5,8 @@ extern "C"
 #include <pv_display_helper.h>
 }
 #include "PVChild.h"
+#include "bltregion.hxx"
+#include "bltring.hxx"
 
 //Specify whether hints should be ignored.
 //If set, this ignores all display size hints and uses the default resolution.
@@ -673,6 +675,7 @@ PVChild::PVChild(BASIC_DISPLAY_DRIVER * pBDD, ULONG SourceId /*= 0*/)
 	, _SourceId(SourceId)
 	, _pending(FALSE)
 	, _event_port(0xffffffff)
+	, _damage_forwarder(NULL)
 {
     //Create mutex helpers for child's framebuffer and pointer data
     _fb_mutex = (MutexHelper *) new (NonPagedPoolNx) MutexHelper( );
@@ -686,6 +689,7 @@ PVChild::PVChild(BASIC_DISPLAY_DRIVER * pBDD, ULONG SourceId /*= 0*/)
 PVChild::~PVChild()
 {
     disconnect();
+    destroy_damage_forwarder();
     if(_fb_mutex) delete _fb_mutex;
     if(_cursor_mutex) delete _cursor_mutex;
     if(_mode_mutex) delete _mode_mutex;
@@ -798,6 +802,9 @@ void PVChild::destroy()
     BDD_TRACER;
 
     HoldScopedMutex fb_mutex(_fb_mutex, __FUNCTION__, _TargetId);
+    //The forwarder thread never takes fb_mutex, what it still has queued
+    //goes out before the display is gone
+    destroy_damage_forwarder();
     if(_connected)
     {
         _connected = FALSE;
@@ -836,19 +843,55 @@ void PVChild::update_connection_status(BOOL connected)
         load_cursor_image();
 }
 
-void PVChild::register_display(DHDisplay * display, UINT32 width, UINT32 height)
+/**
+ * The display handler's invalidate_region as the damage forwarder calls it,
+ * on its own thread and without fb_mutex.
+ * @param context the PVChild
+**/
+static int dh_forward_rect(VOID * context, UINT32 x, UINT32 y, UINT32 width, UINT32 height)
 {
-    _display = display;
-    if(_display_lock) delete _display_lock;
-    _display_lock = (MutexHelper *)new (NonPagedPoolNx)MutexHelper(&_display->lock);
-    _pointer->_mutex = _cursor_mutex;
-    _key = display->key;
+    PVChild * child((PVChild *)context);
+    DHDisplay * display(child->display_handler());
+
+    if (!child->connected() || !display || x >= display->width || y >= display->height)
+        return STATUS_SUCCESS;
+
+    //Also clips a record of the whole screen, see BLT_DAMAGE_FULL
+    width = min(width, display->width - x);
+    height = min(height, display->height - y);
+    return display->invalidate_region(display, x, y, width, height);
+}
 
-    display->set_driver_data(display, (PVOID)this);
+void PVChild::register_display(DHDisplay * display, UINT32 width, UINT32 height)
+{
+    {
+        //Presents may still be sending damage on a reconnect, they have to
+        //see either the old display and forwarder or the new ones
+        HoldScopedMutex fb_mutex(_fb_mutex, __FUNCTION__, _TargetId);
+        destroy_damage_forwarder();
+        _display = display;
+        if(_display_lock) delete _display_lock;
+        _display_lock = (MutexHelper *)new (NonPagedPoolNx)MutexHelper(&_display->lock);
+        _pointer->_mutex = _cursor_mutex;
+        _key = display->key;
+
+        display->set_driver_data(display, (PVOID)this);
+        if (_pBDD->GetCurrentMode(_TargetId)->Flags.DamageRing)
+        {
+            //Falls back to sending the damage from the present if it fails
+            _damage_forwarder = BltCreateDamageForwarder(dh_forward_rect, this);
+        }
+    }
     _pBDD->MapFramebuffer(_TargetId, width, height);
     update_mode(width, height);
 }
 
+void PVChild::destroy_damage_forwarder()
+{
+    BltDestroyDamageForwarder(_damage_forwarder);
+    _damage_forwarder = NULL;
+}
+
 void PVChild::reset_guest_mode()
 {
     HoldScopedMutex fb_mutex(_fb_mutex, __FUNCTION__, _TargetId);
@@ -990,6 +1033,7 @@ int PVChild::blank_display(BOOLEAN bSleep, BOOLEAN blanked)
             pCurrentMode->DispInfo.Width, pCurrentMode->DispInfo.Height,
             _display->width, _display->height);
     }
+    //Not always under fb_mutex, so it does not go on the damage ring
     send_dirty_rect(0, 0, pCurrentMode->DispInfo.Width, pCurrentMode->DispInfo.Height);
     _blanked = blanked;
 #endif
@@ -1056,6 +1100,34 @@ int PVChild::send_dirty_rect(UINT32 x, UINT32 y, UINT32 width, UINT32 height)
     return STATUS_SUCCESS;
 }
 
+/**
+ * The display handler's invalidate_region as BltRegionSend calls it.
+ * @param context the DHDisplay
+**/
+static int dh_invalidate_rect(VOID * context, UINT32 x, UINT32 y, UINT32 width, UINT32 height)
+{
+    DHDisplay * display((DHDisplay *)context);
+    return display->invalidate_region(display, x, y, width, height);
+}
+
+int PVChild::send_dirty_region(CONST BLT_REGION * region)
+{
+    if (!_connected)
+        return STATUS_SUCCESS;
+
+    //Every invalidate_region is a round trip over IVC, so a flush is a
+    //handful of them whatever the present did. The rects of a region never
+    //overlap, the host reads every pixel once.
+    if (_damage_forwarder)
+    {
+        //Only ever called with fb_mutex held, which makes this the ring's
+        //one producer
+        BltDamageForward(_damage_forwarder, region, MAX_DIRTY_RECTS_PER_FLUSH);
+        return STATUS_SUCCESS;
+    }
+    return BltRegionSend(region, MAX_DIRTY_RECTS_PER_FLUSH, dh_invalidate_rect, _display);
+}
+
 NTSTATUS PVChild::connect_resume()
 {
     NTSTATUS Status(STATUS_SUCCESS);
@@ -19,6 +19,10 @@
 
 #define UNINITIALIZED_INT              0xFFFFFFFF
 
+//Invalidation messages a flush of damage sends at most, a region with more
+//rects is sent as its bounding box
+#define MAX_DIRTY_RECTS_PER_FLUSH      8
+
 typedef struct pv_display_provider DHProvider;
 typedef struct pv_display          DHDisplay;
 typedef struct dh_add_display      AddDisplay;
@@ -79,6 +83,18 @@ struct monitor_config_escape
     INT32   _ioctl;
 };
 
+// Sets the channel order a display handler reads the framebuffer in, _order
+// is a BLT_CHANNEL_ORDER. Laid out like monitor_config_escape so _ioctl is at
+// the same offset in both.
+#define CHANNEL_ORDER_ESCAPE 0x10002
+struct channel_order_escape
+{
+    INT32   _id;
+    INT32   _order;
+    INT32   _unused[3];
+    INT32   _ioctl;
+};
+
 void dpcb_host_displays_changed(DHProvider * provider, DisplayInfo * displays, UINT32 num_displays);
 void dpcb_add_display_request(DHProvider * provider, AddDisplay * request);
 void dpcb_remove_display_request(DHProvider * provider, RemoveDisplay * request);
@@ -150,6 +166,7 @@ public:
     UINT        mode_height(UINT index) { return index < _num_resolutions ? _available_resolutions[index].height : 0; }
     DHDisplay * display_handler() { return _display; }
     int         send_dirty_rect(UINT32 x, UINT32 y, UINT32 width, UINT32 height);
+    int         send_dirty_region(CONST struct _BLT_REGION * region);
     NTSTATUS    connect_resume();
     BOOL        connected() { return _connected; }
     void        update_available_resolutions(UINT32 width, UINT32 height);
@@ -191,6 +208,7 @@ public:
 private:
     void        set_event();
     void        initialize_available_resolutions();
+    void        destroy_damage_forwarder();
 
 private:
     BASIC_DISPLAY_DRIVER  *      _pBDD;
@@ -212,6 +230,7 @@ private:
     POINT                        _layout;
     BOOL                         _pending;
 	int                          _event_port;
+    struct _BLT_DAMAGE_FORWARDER * _damage_forwarder;
 };
 typedef struct _Mode
 {
@@ -9,6 +9,9 @@
 
 #include "BDD.hxx"
 #include "PVChild.h"
+#include "bltsimd.hxx"
+#include "bltengine.hxx"
+#include "blttile.hxx"
 extern "C"
 {
 #include <pv_display_helper.h>
@@ -53,6 +56,8 @@ BASIC_DISPLAY_DRIVER::BASIC_DISPLAY_DRIVER(_In_ DEVICE_OBJECT* pPhysicalDeviceOb
     m_AddDisplayMutexHelper = NULL;
     m_dh_mutex = NULL;
     m_dh_lock = NULL;
+    m_pBltEngine = NULL;
+    m_CoalesceWastePercent = 0;
 
     RtlZeroMemory(&m_DxgkInterface, sizeof(m_DxgkInterface));
     RtlZeroMemory(&m_StartInfo, sizeof(m_StartInfo));
@@ -73,6 +78,15 @@ BASIC_DISPLAY_DRIVER::~BASIC_DISPLAY_DRIVER()
     PAGED_CODE();
     BDD_LOG_ERROR("XENWDDM!%s bye bye\n", __FUNCTION__);
     DestroyProvider();
+
+    BltDestroyEngine(m_pBltEngine);
+    m_pBltEngine = NULL;
+
+    for (UINT i = 0; i < MAX_VIEWS; i++)
+    {
+        delete m_CurrentModes[i].pColorLut;
+        m_CurrentModes[i].pColorLut = NULL;
+    }
 }
 
 NTSTATUS BASIC_DISPLAY_DRIVER::StartDevice(_In_  DXGK_START_INFO*   pDxgkStartInfo,
@@ -103,6 +117,8 @@ NTSTATUS BASIC_DISPLAY_DRIVER::StartDevice(_In_  DXGK_START_INFO*   pDxgkStartIn
     // Ignore return value, since it's not the end of the world if we failed to write these values to the registry
     RegisterHWInfo();
 
+    ReadDisplaySettings();
+
     // TODO: Uncomment the line below after updating the TODOs in the function CheckHardware
     Status = CheckHardware();
     if (!NT_SUCCESS(Status))
@@ -152,6 +168,10 @@ NTSTATUS BASIC_DISPLAY_DRIVER::StopDevice(VOID)
     BDD_TRACER;
     CleanUp();
 
+    // No present can come in until the device is started again
+    BltDestroyEngine(m_pBltEngine);
+    m_pBltEngine = NULL;
+
     m_Flags.DriverStarted = FALSE;
 
     return STATUS_SUCCESS;
@@ -418,7 +438,7 @@ NTSTATUS BASIC_DISPLAY_DRIVER::QueryAdapterInfo(_In_ CONST DXGKARG_QUERYADAPTERI
 
             // Nearly all fields must be initialized to zero, so zero out to start and then change those that are non-zero.
             // Fields are zero since BDD is Display-Only and therefore does not support any of the render related fields.
-            // It also doesn't support hardware interrupts, gamma ramps, etc.
+            // It also doesn't support hardware interrupts, etc.
             RtlZeroMemory(pDriverCaps, sizeof(DXGK_DRIVERCAPS));
 
             pDriverCaps->WDDMVersion = DXGKDDI_WDDMv1_2;
@@ -427,6 +447,9 @@ NTSTATUS BASIC_DISPLAY_DRIVER::QueryAdapterInfo(_In_ CONST DXGKARG_QUERYADAPTERI
             pDriverCaps->SupportNonVGA = FALSE;
             pDriverCaps->SupportSmoothRotation = TRUE;
 
+            // Gamma is applied by the present blts, see SetGammaRamp
+            pDriverCaps->GammaRampCaps.Gamma_Rgb256x3x16 = 1;
+
             //Pointer support
             pDriverCaps->PointerCaps.Color = 1;
             pDriverCaps->PointerCaps.Monochrome = 0;
@@ -557,6 +580,23 @@ NTSTATUS BASIC_DISPLAY_DRIVER::SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERP
 
     if(!pChild->connected()) return STATUS_SUCCESS;
 
+    // The position is in source coordinates, a stretched framebuffer is a different size
+    CONST CURRENT_BDD_MODE* pMode = &m_CurrentModes[TargetId];
+    INT X = pSetPointerPosition->X;
+    INT Y = pSetPointerPosition->Y;
+    if ((pMode->Scaling == D3DKMDT_VPPS_STRETCHED) && (pMode->SrcModeWidth != 0) && (pMode->SrcModeHeight != 0))
+    {
+        X = (INT)(((LONG64)X * pMode->DispInfo.Width) / pMode->SrcModeWidth);
+        Y = (INT)(((LONG64)Y * pMode->DispInfo.Height) / pMode->SrcModeHeight);
+    }
+
+    if (m_HardwareBlt[TargetId].HasSoftwareCursor())
+    {
+        HoldScopedMutex HeldMutex(fb_mutex(TargetId), __FUNCTION__, TargetId);
+        m_HardwareBlt[TargetId].SetCursorPosition((BOOLEAN)pSetPointerPosition->Flags.Visible, X, Y);
+        return STATUS_SUCCESS;
+    }
+
     if(pSetPointerPosition->Flags.Visible != display->cursor.visible)
     {
         pChild->set_cursor_state(pSetPointerPosition->Flags.Visible);
@@ -564,7 +604,7 @@ NTSTATUS BASIC_DISPLAY_DRIVER::SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERP
 
     if((pSetPointerPosition->Flags.Visible))
     {
-        display->move_cursor(display,pSetPointerPosition->X, pSetPointerPosition->Y);
+        display->move_cursor(display, X, Y);
     }
 
     return STATUS_SUCCESS;
@@ -589,6 +629,36 @@ NTSTATUS BASIC_DISPLAY_DRIVER::SetPointerShape(_In_ CONST DXGKARG_SETPOINTERSHAP
 
     pChild->update_hotspot(pSetPointerShape);
 
+    // Color shapes are blended into the framebuffer where the host can not
+    // composite a cursor plane, monochrome ones still need the host's
+    if (m_CurrentModes[Target].Flags.SoftwareCursor && pSetPointerShape->Flags.Color)
+    {
+        // The software cursor blends straight from the pointer's bits, so
+        // they are only written with the framebuffer mutex held
+        HoldScopedMutex HeldMutex(fb_mutex(Target), __FUNCTION__, Target);
+        pChild->save_cursor((PVOID) pSetPointerShape->pPixels, width, height);
+        pChild->pointer()->set(pSetPointerShape);
+
+        NTSTATUS SwStatus = m_HardwareBlt[Target].SetCursorShape(pChild->pointer()->_bits, width, height);
+        if (NT_SUCCESS(SwStatus))
+        {
+            if (display->cursor.visible)
+            {
+                pChild->set_cursor_state(FALSE);
+            }
+            return STATUS_SUCCESS;
+        }
+
+        // An older shape would still be blended from bits written below without the mutex
+        m_HardwareBlt[Target].SetCursorShape(NULL, 0, 0);
+        BDD_LOG_WARNING("XENWDDM!%s no software cursor on %u, Status = 0x%x\n", __FUNCTION__, Target, SwStatus);
+    }
+    else if (m_HardwareBlt[Target].HasSoftwareCursor())
+    {
+        HoldScopedMutex HeldMutex(fb_mutex(Target), __FUNCTION__, Target);
+        m_HardwareBlt[Target].SetCursorShape(NULL, 0, 0);
+    }
+
     Status = display->load_cursor_image(display, (void *) pSetPointerShape->pPixels, 
                                         (UINT8) pSetPointerShape->Width, (UINT8) pSetPointerShape->Height);
 
@@ -612,6 +682,25 @@ NTSTATUS BASIC_DISPLAY_DRIVER::Escape(_In_ CONST DXGKARG_ESCAPE* pEscape)
     
     size_t data_size(sizeof(uint32_t));
     monitor_config_escape* pmonitor_escape((monitor_config_escape*) pEscape->pPrivateDriverData);
+    if (pEscape->PrivateDriverDataSize < sizeof(monitor_config_escape))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Both escapes keep _ioctl at the same offset
+    C_ASSERT(FIELD_OFFSET(channel_order_escape, _ioctl) == FIELD_OFFSET(monitor_config_escape, _ioctl));
+    C_ASSERT(sizeof(channel_order_escape) == sizeof(monitor_config_escape));
+    if (pmonitor_escape->_ioctl == CHANNEL_ORDER_ESCAPE)
+    {
+        channel_order_escape* porder_escape((channel_order_escape*) pEscape->pPrivateDriverData);
+        if (pEscape->PrivateDriverDataSize != sizeof(channel_order_escape))
+        {
+            BDD_LOG_ERROR("XENWDDM: %s: data_size is bad %d vs %d\n", __FUNCTION__, pEscape->PrivateDriverDataSize, sizeof(channel_order_escape));
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+        return SetChannelOrder(porder_escape->_id, porder_escape->_order);
+    }
+
     if (pmonitor_escape->_ioctl != MONITOR_CONFIG_ESCAPE)
     {
         return STATUS_INVALID_PARAMETER;
@@ -645,6 +734,82 @@ NTSTATUS BASIC_DISPLAY_DRIVER::Escape(_In_ CONST DXGKARG_ESCAPE* pEscape)
     return status;
 }
 
+NTSTATUS BASIC_DISPLAY_DRIVER::SetChannelOrder(UINT32 Key, UINT32 Order)
+{
+    PAGED_CODE();
+
+    if (Order >= BLT_CHANNEL_ORDER_COUNT)
+    {
+        BDD_LOG_ERROR("XENWDDM!%s monitor 0x%x asked for unknown channel order %u\n", __FUNCTION__, Key, Order);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CONST BLT_SWIZZLE* pSwizzle = BltGetSwizzle((BLT_CHANNEL_ORDER)Order);
+    for (UINT32 i = 0; i < MAX_CHILDREN; i++)
+    {
+        PVChild* pChild = m_CurrentModes[i].pPVChild;
+        if (pChild->key() != Key)
+        {
+            continue;
+        }
+
+        HoldScopedMutex HeldMutex(fb_mutex(i), __FUNCTION__, i);
+        CONST BLT_SWIZZLE* pOldSwizzle = m_CurrentModes[i].pSwizzle;
+        if (pOldSwizzle == pSwizzle)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        // The pixels kept under the software cursor are in the old order,
+        // they go back before the swizzle and are saved again after it
+        RECT Hidden;
+        m_HardwareBlt[i].HideCursor(&Hidden);
+        m_CurrentModes[i].pSwizzle = pSwizzle;
+
+        // Take what is already on screen over to the new order instead of
+        // waiting for every part of it to be presented again
+        if (m_CurrentModes[i].Flags.FrameBufferIsActive &&
+            (BPPFromPixelFormat(m_CurrentModes[i].DispInfo.ColorFormat) == 32))
+        {
+            BLT_INFO FbInfo;
+            RtlZeroMemory(&FbInfo, sizeof(FbInfo));
+            FbInfo.pBits = m_CurrentModes[i].FrameBuffer.Ptr;
+            FbInfo.Pitch = m_CurrentModes[i].DispInfo.Pitch;
+            FbInfo.BitsPerPel = 32;
+            FbInfo.Format = m_CurrentModes[i].DispInfo.ColorFormat;
+            FbInfo.Rotation = D3DKMDT_VPPR_IDENTITY;
+            FbInfo.Width = m_CurrentModes[i].DispInfo.Width;
+            FbInfo.Height = m_CurrentModes[i].DispInfo.Height;
+            if (pOldSwizzle != NULL)
+            {
+                BltSwizzleBits(&FbInfo, pOldSwizzle);
+            }
+            if (pSwizzle != NULL)
+            {
+                BltSwizzleBits(&FbInfo, pSwizzle);
+            }
+        }
+
+        RECT Shown;
+        m_HardwareBlt[i].ShowCursor(&Shown);
+
+        m_HardwareBlt[i].InvalidateRegion(&Hidden);
+        m_HardwareBlt[i].InvalidateRegion(&Shown);
+        if (m_CurrentModes[i].Flags.FrameBufferIsActive)
+        {
+            RECT Screen = { 0, 0, (LONG)m_CurrentModes[i].DispInfo.Width, (LONG)m_CurrentModes[i].DispInfo.Height };
+            m_HardwareBlt[i].InvalidateRegion(&Screen);
+        }
+        m_HardwareBlt[i].FlushDamage();
+
+        BDD_LOG_EVENT("XENWDDM!%s monitor 0x%x channel order %u\n", __FUNCTION__, Key, Order);
+        return STATUS_SUCCESS;
+    }
+
+    BDD_LOG_ERROR("XENWDDM!%s no monitor 0x%x\n", __FUNCTION__, Key);
+    return STATUS_INVALID_PARAMETER;
+}
+
 NTSTATUS BASIC_DISPLAY_DRIVER::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresentDisplayOnly)
 {
     PAGED_CODE();
@@ -654,9 +819,49 @@ NTSTATUS BASIC_DISPLAY_DRIVER::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DIS
 
     UINT32  TargetId(m_CurrentModes[pPresentDisplayOnly->VidPnSourceId].TargetId);
 
+    // A cloned source is read once for all of its targets
+    UINT32  CloneTargets(m_CurrentModes[pPresentDisplayOnly->VidPnSourceId].CloneTargets);
+    if (CloneTargets != 0)
+    {
+        return PresentClones(pPresentDisplayOnly, CloneTargets | (1 << TargetId), 0);
+    }
+
     //grab the mutex just in case IVC wants to change the frame buffer
     HoldScopedMutex HeldMutex(fb_mutex(TargetId),  __FUNCTION__, TargetId);
 
+    BOOLEAN Present;
+    NTSTATUS Status = CheckPresentTarget(pPresentDisplayOnly, TargetId, &Present);
+    if (!NT_SUCCESS(Status) || !Present)
+    {
+        return Status;
+    }
+
+    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION RotationNeededByFb = pPresentDisplayOnly->Flags.Rotate ?
+                                                         m_CurrentModes[TargetId].Rotation :
+                                                         D3DKMDT_VPPR_IDENTITY;
+    BYTE* pDst = (BYTE*)m_CurrentModes[TargetId].FrameBuffer.Ptr;
+    UINT DstBitPerPixel = BPPFromPixelFormat(m_CurrentModes[TargetId].DispInfo.ColorFormat);
+
+    return m_HardwareBlt[TargetId].ExecutePresentDisplayOnly(pDst,
+                                                            DstBitPerPixel,
+                                                            (BYTE*)pPresentDisplayOnly->pSource,
+                                                            pPresentDisplayOnly->BytesPerPixel,
+                                                            pPresentDisplayOnly->Pitch,
+                                                            pPresentDisplayOnly->NumMoves,
+                                                            pPresentDisplayOnly->pMoves,
+                                                            pPresentDisplayOnly->NumDirtyRects,
+                                                            pPresentDisplayOnly->pDirtyRect,
+                                                            RotationNeededByFb);
+}
+
+NTSTATUS BASIC_DISPLAY_DRIVER::CheckPresentTarget(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresentDisplayOnly,
+                                                  UINT32 TargetId,
+                                                  _Out_ BOOLEAN* pPresent)
+{
+    PAGED_CODE();
+
+    *pPresent = FALSE;
+
     //Is this source active?
     if(!m_CurrentModes[TargetId].Flags.FrameBufferIsActive)
     {
@@ -670,6 +875,13 @@ NTSTATUS BASIC_DISPLAY_DRIVER::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DIS
         BDD_LOG_ERROR("pPresentDisplayOnly->BytesPerPixel is 0x%x, which is lower than the allowed.", pPresentDisplayOnly->BytesPerPixel);
         return STATUS_INVALID_PARAMETER;
     }
+    if ((m_CurrentModes[TargetId].SrcModeFormat != D3DDDIFMT_UNKNOWN) &&
+        (pPresentDisplayOnly->BytesPerPixel * BITS_PER_BYTE != BPPFromPixelFormat(m_CurrentModes[TargetId].SrcModeFormat)))
+    {
+        BDD_LOG_ERROR("pPresentDisplayOnly->BytesPerPixel is 0x%x, which does not match source format %u.",
+                      pPresentDisplayOnly->BytesPerPixel, m_CurrentModes[TargetId].SrcModeFormat);
+        return STATUS_INVALID_PARAMETER;
+    }
 
     // If it is in monitor off state or source is not supposed to be visible, don't present anything to the screen
     if ((m_MonitorPowerState[TargetId] > PowerDeviceD0) ||
@@ -678,29 +890,61 @@ NTSTATUS BASIC_DISPLAY_DRIVER::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DIS
         return STATUS_SUCCESS;
     }
 
-    // Present is only valid if the target is actively connected to this source
-    if (m_CurrentModes[TargetId].Flags.FrameBufferIsActive)
+    *pPresent = TRUE;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS BASIC_DISPLAY_DRIVER::PresentClones(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresentDisplayOnly,
+                                             UINT32 Targets,
+                                             UINT32 Locked)
+{
+    PAGED_CODE();
+
+    // Every present takes the framebuffer mutexes lowest target first, so two can not deadlock
+    UINT32 ToLock = Targets & ~Locked;
+    if (ToLock != 0)
     {
+        UINT32 TargetId = 0;
+        while (!(ToLock & (1 << TargetId)))
+        {
+            TargetId++;
+        }
 
-            D3DKMDT_VIDPN_PRESENT_PATH_ROTATION RotationNeededByFb = pPresentDisplayOnly->Flags.Rotate ?
-                                                                 m_CurrentModes[TargetId].Rotation :
-                                                                 D3DKMDT_VPPR_IDENTITY;
-            BYTE* pDst = (BYTE*)m_CurrentModes[TargetId].FrameBuffer.Ptr;
-            UINT DstBitPerPixel = BPPFromPixelFormat(m_CurrentModes[TargetId].DispInfo.ColorFormat);
+        HoldScopedMutex HeldMutex(fb_mutex(TargetId), __FUNCTION__, TargetId);
+        return PresentClones(pPresentDisplayOnly, Targets, Locked | (1 << TargetId));
+    }
 
-            return m_HardwareBlt[TargetId].ExecutePresentDisplayOnly(pDst,
-                                                                    DstBitPerPixel,
-                                                                    (BYTE*)pPresentDisplayOnly->pSource,
-                                                                    pPresentDisplayOnly->BytesPerPixel,
-                                                                    pPresentDisplayOnly->Pitch,
-                                                                    pPresentDisplayOnly->NumMoves,
-                                                                    pPresentDisplayOnly->pMoves,
-                                                                    pPresentDisplayOnly->NumDirtyRects,
-                                                                    pPresentDisplayOnly->pDirtyRect,
-                                                                    RotationNeededByFb);
+    BDD_HWBLT* pClones[MAX_CHILDREN];
+    UINT NumClones = 0;
+    for (UINT32 TargetId = 0; TargetId < MAX_CHILDREN; TargetId++)
+    {
+        if (!(Targets & (1 << TargetId)))
+        {
+            continue;
+        }
+
+        BOOLEAN Present;
+        NTSTATUS Status = CheckPresentTarget(pPresentDisplayOnly, TargetId, &Present);
+        if (!NT_SUCCESS(Status))
+        {
+            return Status;
+        }
+        if (Present)
+        {
+            pClones[NumClones++] = &m_HardwareBlt[TargetId];
+        }
     }
 
-    return STATUS_SUCCESS;
+    return BDD_HWBLT::ExecutePresentClones(pClones,
+                                           NumClones,
+                                           (BYTE*)pPresentDisplayOnly->pSource,
+                                           pPresentDisplayOnly->BytesPerPixel,
+                                           pPresentDisplayOnly->Pitch,
+                                           pPresentDisplayOnly->NumMoves,
+                                           pPresentDisplayOnly->pMoves,
+                                           pPresentDisplayOnly->NumDirtyRects,
+                                           pPresentDisplayOnly->pDirtyRect,
+                                           (BOOLEAN)pPresentDisplayOnly->Flags.Rotate);
 }
 
 // To indicate to the operating system that this function is supported, 
@@ -747,8 +991,8 @@ NTSTATUS BASIC_DISPLAY_DRIVER::QueryVidPnHWCapability(_Inout_ DXGKARG_QUERYVIDPN
     BDD_ASSERT(pVidPnHWCaps->TargetId < MAX_CHILDREN);
 
     pVidPnHWCaps->VidPnHWCaps.DriverRotation             = 0; // BDD does not support rotation in software
-    pVidPnHWCaps->VidPnHWCaps.DriverScaling              = 0; // BDD does not support scaling
-    pVidPnHWCaps->VidPnHWCaps.DriverCloning              = 0; // BDD does not support clone
+    pVidPnHWCaps->VidPnHWCaps.DriverScaling              = (m_CurrentModes[pVidPnHWCaps->TargetId].Scaling == D3DKMDT_VPPS_STRETCHED) ? 1 : 0; // Stretching is done in software during Present
+    pVidPnHWCaps->VidPnHWCaps.DriverCloning              = 1; // Cloned targets are written from one read of the source during Present
     pVidPnHWCaps->VidPnHWCaps.DriverColorConvert         = 1; // BDD does color conversions in software
     pVidPnHWCaps->VidPnHWCaps.DriverLinkedAdapaterOutput = 0; // BDD does not support linked adapters
     pVidPnHWCaps->VidPnHWCaps.DriverRemoteDisplay        = 0; // BDD does not support remote displays
@@ -787,8 +1031,17 @@ VOID BASIC_DISPLAY_DRIVER::BlackOutScreen(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceI
     {
         BYTE* MappedAddr = reinterpret_cast<BYTE*>(m_CurrentModes[TargetId].FrameBuffer.Ptr);
         RtlZeroMemory(MappedAddr, ScreenHeight * ScreenPitch);
-        m_CurrentModes[TargetId].pPVChild->send_dirty_rect(0, 0, m_CurrentModes[TargetId].DispInfo.Width,
-            m_CurrentModes[TargetId].DispInfo.Height);
+        m_HardwareBlt[TargetId].ForgetTiles(NULL);
+
+        // What was under the software cursor is black now too
+        RECT Shown;
+        m_HardwareBlt[TargetId].ForgetCursor();
+        m_HardwareBlt[TargetId].ShowCursor(&Shown);
+
+        RECT Screen = { 0, 0, (LONG)m_CurrentModes[TargetId].DispInfo.Width, (LONG)m_CurrentModes[TargetId].DispInfo.Height };
+        m_HardwareBlt[TargetId].InvalidateRegion(&Shown);
+        m_HardwareBlt[TargetId].InvalidateRegion(&Screen);
+        m_HardwareBlt[TargetId].FlushDamage();
     }
 }
 
@@ -896,6 +1149,137 @@ NTSTATUS BASIC_DISPLAY_DRIVER::RegisterHWInfo()
     return Status;
 }
 
+// Leaves *pValue alone unless the key has a REG_DWORD called Name
+static VOID ReadRegistryDword(HANDLE hKey, PCWSTR Name, _Inout_ ULONG* pValue)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING ValueName;
+    RtlInitUnicodeString(&ValueName, Name);
+
+    BYTE Buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+    PKEY_VALUE_PARTIAL_INFORMATION pValueInfo = (PKEY_VALUE_PARTIAL_INFORMATION)Buffer;
+    ULONG ResultLength;
+    NTSTATUS Status = ZwQueryValueKey(hKey, &ValueName, KeyValuePartialInformation, pValueInfo, sizeof(Buffer), &ResultLength);
+    if (NT_SUCCESS(Status) && (pValueInfo->Type == REG_DWORD) && (pValueInfo->DataLength == sizeof(ULONG)))
+    {
+        *pValue = *(UNALIGNED ULONG*)pValueInfo->Data;
+    }
+}
+
+VOID BASIC_DISPLAY_DRIVER::ReadDisplaySettings()
+{
+    PAGED_CODE();
+
+    // DitherDisplays is a bit mask of the targets whose presents are dithered
+    // when they are converted to 16 or 8bpp. Dithering costs about as much as
+    // the truncating conversion, so it is on for every target by default.
+    // MapFramebuffer always sets up an A8R8G8B8 framebuffer though, so no
+    // present or SystemDisplayWrite reaches the dithered R5G6B5 and P8
+    // kernels until a 16 or 8bpp framebuffer can be agreed with the host.
+    ULONG DitherDisplays = MAXULONG;
+
+    // CompareDisplays is a bit mask of the targets whose presents only write
+    // and invalidate the pixels that changed. The framebuffer lines are read
+    // for the write anyway, so comparing first is on for every target.
+    ULONG CompareDisplays = MAXULONG;
+
+    // SoftwareCursorDisplays is a bit mask of the targets whose color pointer
+    // is blended into the framebuffer instead of shown on the host's cursor
+    // plane. Only hosts that can not composite a cursor need it.
+    ULONG SoftwareCursorDisplays = 0;
+
+    // CoalesceDisplays is a bit mask of the targets whose presents have their
+    // dirty rects merged where one bigger blt is cheaper, see bltcoalesce.hxx.
+    // CoalesceWastePercent is how much of the bounding box of a present may be
+    // copied for nothing to do the whole present as a single rect.
+    ULONG CoalesceDisplays = MAXULONG;
+    ULONG CoalesceWastePercent = 25;
+
+    // TileHashDisplays is a bit mask of the targets whose presents hash the
+    // tiles they touch and only copy the ones that changed, see blttile.hxx.
+    // TileHashSize0 to TileHashSize5 are the tile sizes of each target. The
+    // hashing is wasted on a source that really changes everywhere it is
+    // dirty, so it is off by default.
+    ULONG TileHashDisplays = 0;
+    ULONG TileHashSizes[MAX_VIEWS];
+    for (UINT i = 0; i < MAX_VIEWS; i++)
+    {
+        TileHashSizes[i] = BLT_TILE_DEFAULT_SIZE;
+    }
+
+    // DamageRingDisplays is a bit mask of the targets whose damage is queued
+    // on a ring and sent to the display handler by a thread of its own, so
+    // presents do not wait for the round trips, see bltring.hxx. It takes
+    // effect when the display is next created.
+    ULONG DamageRingDisplays = 0;
+
+    // BltEngine picks what the present blts run on, see BLT_ENGINE_TYPE. The
+    // offload engine is a simulation of a DMA engine and not faster, the
+    // presents are still done inline by default.
+    ULONG BltEngine = BLT_ENGINE_INLINE;
+
+    HANDLE DevInstRegKeyHandle;
+    NTSTATUS Status = IoOpenDeviceRegistryKey(m_pPhysicalDevice, PLUGPLAY_REGKEY_DRIVER, KEY_READ, &DevInstRegKeyHandle);
+    if (NT_SUCCESS(Status))
+    {
+        ReadRegistryDword(DevInstRegKeyHandle, L"DitherDisplays", &DitherDisplays);
+        ReadRegistryDword(DevInstRegKeyHandle, L"CompareDisplays", &CompareDisplays);
+        ReadRegistryDword(DevInstRegKeyHandle, L"SoftwareCursorDisplays", &SoftwareCursorDisplays);
+        ReadRegistryDword(DevInstRegKeyHandle, L"CoalesceDisplays", &CoalesceDisplays);
+        ReadRegistryDword(DevInstRegKeyHandle, L"CoalesceWastePercent", &CoalesceWastePercent);
+        ReadRegistryDword(DevInstRegKeyHandle, L"TileHashDisplays", &TileHashDisplays);
+        for (UINT i = 0; i < MAX_VIEWS; i++)
+        {
+            WCHAR Name[16];
+            if (NT_SUCCESS(RtlStringCchPrintfW(Name, ARRAYSIZE(Name), L"TileHashSize%u", i)))
+            {
+                ReadRegistryDword(DevInstRegKeyHandle, Name, &TileHashSizes[i]);
+            }
+        }
+        ReadRegistryDword(DevInstRegKeyHandle, L"DamageRingDisplays", &DamageRingDisplays);
+        ReadRegistryDword(DevInstRegKeyHandle, L"BltEngine", &BltEngine);
+        ZwClose(DevInstRegKeyHandle);
+    }
+    else
+    {
+        BDD_LOG_WARNING("IoOpenDeviceRegistryKey failed for PDO: 0x%p, Status: 0x%x, using the default display settings", m_pPhysicalDevice, Status);
+    }
+
+    for (UINT i = 0; i < MAX_VIEWS; i++)
+    {
+        m_CurrentModes[i].Flags.Dither = (DitherDisplays >> i) & 1;
+        m_CurrentModes[i].Flags.CompareWrites = (CompareDisplays >> i) & 1;
+        m_CurrentModes[i].Flags.SoftwareCursor = (SoftwareCursorDisplays >> i) & 1;
+        m_CurrentModes[i].Flags.CoalesceRects = (CoalesceDisplays >> i) & 1;
+        m_CurrentModes[i].Flags.TileHash = (TileHashDisplays >> i) & 1;
+        m_CurrentModes[i].Flags.DamageRing = (DamageRingDisplays >> i) & 1;
+        m_CurrentModes[i].TileSize = (TileHashSizes[i] < BLT_TILE_MIN_SIZE) ? BLT_TILE_MIN_SIZE :
+                                     (TileHashSizes[i] > BLT_TILE_MAX_SIZE) ? BLT_TILE_MAX_SIZE : TileHashSizes[i];
+        if (m_CurrentModes[i].Flags.TileHash)
+        {
+            BDD_LOG_EVENT("XENWDDM!%s target %u hashes %ux%u tiles\n", __FUNCTION__, i,
+                          m_CurrentModes[i].TileSize, m_CurrentModes[i].TileSize);
+        }
+    }
+    m_CoalesceWastePercent = (CoalesceWastePercent < 100) ? CoalesceWastePercent : 100;
+    BDD_LOG_EVENT("XENWDDM!%s DitherDisplays 0x%x CompareDisplays 0x%x SoftwareCursorDisplays 0x%x\n",
+                  __FUNCTION__, DitherDisplays, CompareDisplays, SoftwareCursorDisplays);
+    BDD_LOG_EVENT("XENWDDM!%s CoalesceDisplays 0x%x CoalesceWastePercent %u\n",
+                  __FUNCTION__, CoalesceDisplays, m_CoalesceWastePercent);
+    BDD_LOG_EVENT("XENWDDM!%s DamageRingDisplays 0x%x\n", __FUNCTION__, DamageRingDisplays);
+
+    BltDestroyEngine(m_pBltEngine);
+    m_pBltEngine = (BltEngine < BLT_ENGINE_COUNT) ? BltCreateEngine((BLT_ENGINE_TYPE)BltEngine) : NULL;
+    if (m_pBltEngine == NULL)
+    {
+        // Presents run their commands themselves without an engine
+        BDD_LOG_WARNING("XENWDDM!%s BltEngine %u is not usable, presenting inline\n", __FUNCTION__, BltEngine);
+        m_pBltEngine = BltCreateEngine(BLT_ENGINE_INLINE);
+    }
+    BDD_LOG_EVENT("XENWDDM!%s BltEngine %u\n", __FUNCTION__, BltEngine);
+}
+
 INT32 BASIC_DISPLAY_DRIVER::InitPVChildren()
 {
     PAGED_CODE();
@@ -1052,23 +1436,32 @@ VOID BASIC_DISPLAY_DRIVER::SystemDisplayWrite(_In_reads_bytes_(SourceHeight * So
     DstBltInfo.pBits = m_CurrentModes[m_SystemDisplaySourceId].FrameBuffer.Ptr;
     DstBltInfo.Pitch = m_CurrentModes[m_SystemDisplaySourceId].DispInfo.Pitch;
     DstBltInfo.BitsPerPel = BPPFromPixelFormat(m_CurrentModes[m_SystemDisplaySourceId].DispInfo.ColorFormat);
+    DstBltInfo.Format = m_CurrentModes[m_SystemDisplaySourceId].DispInfo.ColorFormat;
     DstBltInfo.Offset.x = 0;
     DstBltInfo.Offset.y = 0;
     DstBltInfo.Rotation = m_CurrentModes[m_SystemDisplaySourceId].Rotation;
     DstBltInfo.Width = m_CurrentModes[m_SystemDisplaySourceId].DispInfo.Width;
     DstBltInfo.Height = m_CurrentModes[m_SystemDisplaySourceId].DispInfo.Height;
+    DstBltInfo.pColorLut = NULL;
+    DstBltInfo.Dither = (BOOLEAN)m_CurrentModes[m_SystemDisplaySourceId].Flags.Dither;
+    DstBltInfo.pSwizzle = m_CurrentModes[m_SystemDisplaySourceId].pSwizzle;
 
     // Set up source blt info
     BLT_INFO SrcBltInfo;
     SrcBltInfo.pBits = pSource;
     SrcBltInfo.Pitch = SourceStride;
-    SrcBltInfo.BitsPerPel = 32;
+    // The source is in the format handed out by SystemDisplayEnable
+    SrcBltInfo.BitsPerPel = DstBltInfo.BitsPerPel;
+    SrcBltInfo.Format = DstBltInfo.Format;
 
     SrcBltInfo.Offset.x = -PositionX;
     SrcBltInfo.Offset.y = -PositionY;
     SrcBltInfo.Rotation = D3DKMDT_VPPR_IDENTITY;
     SrcBltInfo.Width = SourceWidth;
     SrcBltInfo.Height = SourceHeight;
+    SrcBltInfo.pColorLut = NULL;
+    SrcBltInfo.Dither = FALSE;
+    SrcBltInfo.pSwizzle = NULL;
 
     BltBits(&DstBltInfo,
             &SrcBltInfo,
@@ -1076,8 +1469,9 @@ VOID BASIC_DISPLAY_DRIVER::SystemDisplayWrite(_In_reads_bytes_(SourceHeight * So
             &Rect);
 
     //Send dirty rects to display handler
-    m_CurrentModes[m_SystemDisplaySourceId].pPVChild->send_dirty_rect(
-        PositionX, PositionY, SourceWidth, SourceHeight);
+    m_HardwareBlt[m_SystemDisplaySourceId].ForgetTiles(&Rect);
+    m_HardwareBlt[m_SystemDisplaySourceId].InvalidateRegion(&Rect);
+    m_HardwareBlt[m_SystemDisplaySourceId].FlushDamage();
 }
 
 PVChild * BASIC_DISPLAY_DRIVER::GetPVChild(UINT32 SourceID)
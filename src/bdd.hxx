@@ -67,22 +67,14 @@ extern "C"
 #define MAX_INVALID_INHERITED_WIDTH 1024
 #define MAX_INVALID_INHERITED_HEIGHT 768
 
-#define BITS_PER_BYTE                  8
-
-typedef struct _BLT_INFO
-{
-    PVOID pBits;
-    UINT Pitch;
-    UINT BitsPerPel;
-    POINT Offset; // To unrotated top-left of dirty rects
-    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation;
-    UINT Width; // For the unrotated image
-    UINT Height; // For the unrotated image
-} BLT_INFO;
+#include "bltfuncs.hxx"
 
 #define MAX_CHILDREN                   6
 #define MAX_VIEWS                      6
 
+// A present fans out to every child at most
+C_ASSERT(MAX_CHILDREN <= BLT_MAX_CLONES);
+
 // Pool allocation tag for the xenwddm driver. All allocations use this tag.
 #define BDDTAG 'DDVS'
 
@@ -107,6 +99,7 @@ typedef struct _CURRENT_BDD_MODE
     // This mode might be different from one which are supported for HW frame buffer
      UINT SrcModeWidth;
     UINT SrcModeHeight;
+    D3DDDIFORMAT SrcModeFormat;
 
     // Various boolean flags the struct uses
     struct _CURRENT_BDD_MODE_FLAGS
@@ -115,9 +108,18 @@ typedef struct _CURRENT_BDD_MODE
         UINT FrameBufferIsActive  : 1; // 0 if not currently active (i.e. target not connected to source)
         UINT IsInternal           : 1; // 1 if it was determined (i.e. through ACPI) that an internal panel is being driven
         UINT OwnPostDisplay       : 1; // 1 if using the post device
-        UINT Unused               : 26;
+        UINT Dither               : 1; // 1 if presents to a 16 or 8bpp framebuffer are dithered
+        UINT CompareWrites        : 1; // 1 if presents only write and invalidate the pixels that changed
+        UINT SoftwareCursor       : 1; // 1 if a color pointer is blended into the framebuffer
+        UINT CoalesceRects        : 1; // 1 if the dirty rects of presents are coalesced, see bltcoalesce.hxx
+        UINT TileHash             : 1; // 1 if presents skip the tiles whose hash did not change, see blttile.hxx
+        UINT DamageRing           : 1; // 1 if damage goes to the display handler from a thread of its own, see bltring.hxx
+        UINT Unused               : 20;
     } Flags;
 
+    // Width and height of the tiles hashed for TileHash
+    UINT TileSize;
+
 
     // Linear frame buffer pointer
     // A union with a ULONG64 is used here to ensure this struct looks the same on 32bit and 64bit builds
@@ -128,26 +130,34 @@ typedef struct _CURRENT_BDD_MODE
         ULONG64                          Force8Bytes;
     } FrameBuffer;
     UINT32    TargetId;
+
+    // On a source's entry, a bit for every target other than TargetId that the source is cloned to
+    UINT32    CloneTargets;
     
     //Class wrapper for display-driver-helper functions.
     PVChild * pPVChild;
 
+    // Gamma ramp of the path as a lookup for the present blts, NULL for the default ramp.
+    // Only changed with the framebuffer mutex held.
+    struct _BLT_COLOR_LUT * pColorLut;
+
+    // Channel order the display handler reads the framebuffer in, NULL for B G R A.
+    // Only changed with the framebuffer mutex held.
+    CONST struct _BLT_SWIZZLE * pSwizzle;
+
 } CURRENT_BDD_MODE;
 
 class BASIC_DISPLAY_DRIVER;
 
+class BLT_ENGINE;
+struct _BLT_COMMAND;
+
+// Runs the blts of the presents to a target on the adapter's blit engine, see bltengine.hxx
 class BDD_HWBLT
 {
 public:
     D3DDDI_VIDEO_PRESENT_SOURCE_ID  m_SourceId;
     BASIC_DISPLAY_DRIVER*           m_BDD;
-    BOOLEAN                         m_SynchExecution;
-    HANDLE                          m_hPresentWorkerThread;
-    PVOID                           m_pPresentWorkerThread;
-
-    //  Events to contol thread execution
-    KEVENT                          m_hThreadStartupEvent;
-    KEVENT                          m_hThreadSuspendEvent;
 
     BDD_HWBLT();
 
@@ -162,9 +172,128 @@ public:
                                        _In_ ULONG             NumMoves,
                                        _In_ D3DKMT_MOVE_RECT* pMoves,
                                        _In_ ULONG             NumDirtyRects,
-                                       _In_ RECT*             pDirtyRect,
+                                       _In_ CONST RECT*       pDirtyRect,
                                        _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation);
-    int InvalidateRegion(CONST RECT * region);
+
+    // Presents a source to every target it is cloned to, each one's framebuffer mutex is held
+    static NTSTATUS ExecutePresentClones(_In_reads_(NumClones) BDD_HWBLT** ppClones,
+                                         _In_ UINT              NumClones,
+                                         _In_ BYTE*             SrcAddr,
+                                         _In_ UINT              SrcBytesPerPixel,
+                                         _In_ LONG              SrcPitch,
+                                         _In_ ULONG             NumMoves,
+                                         _In_ D3DKMT_MOVE_RECT* pMoves,
+                                         _In_ ULONG             NumDirtyRects,
+                                         _In_ CONST RECT*       pDirtyRect,
+                                         _In_ BOOLEAN           Rotate);
+
+    // Adds a framebuffer rect to what the display handler has to be told about
+    VOID InvalidateRegion(CONST RECT * region);
+
+    // Sends everything invalidated since the last flush to the display
+    // handler in at most MAX_DIRTY_RECTS_PER_FLUSH messages, a present
+    // flushes once for all of its rects. Every producer of damage calls it
+    // before it lets go of the framebuffer mutex.
+    VOID FlushDamage(VOID);
+
+    // Makes the presents copy the tiles of pRect, all of them for NULL, the
+    // next time they are dirty. Called with the framebuffer mutex held by
+    // everything but the presents that writes to the framebuffer.
+    VOID ForgetTiles(_In_opt_ CONST RECT* pRect);
+
+    // Software cursor, the pointer blended into the framebuffer instead of
+    // shown on the host's cursor plane. Called with the framebuffer mutex held.
+    // pImage is a premultiplied A8R8G8B8 shape that stays valid until the
+    // next call, NULL takes the cursor out of the framebuffer for good.
+    NTSTATUS SetCursorShape(_In_opt_ CONST BYTE* pImage, UINT Width, UINT Height);
+    VOID SetCursorPosition(BOOLEAN Visible, INT X, INT Y);
+    BOOLEAN HasSoftwareCursor() CONST { return m_pCursorImage != NULL; }
+
+    // For whatever rewrites all of the framebuffer in place: HideCursor puts
+    // back the pixels under the software cursor first, ShowCursor saves them
+    // again and blends the cursor over them after. ForgetCursor is for a
+    // framebuffer that was cleared, what was under the cursor is gone with
+    // the rest of it. Each gets the rect it changed, empty if none, for the
+    // caller to invalidate.
+    VOID HideCursor(_Out_ RECT* pHidden);
+    VOID ShowCursor(_Out_ RECT* pShown);
+    VOID ForgetCursor(VOID) { m_CursorDrawn = FALSE; }
+
+private:
+    // The framebuffer as the software cursor sees it, FALSE if the current mode can not have one
+    BOOLEAN GetCursorFb(_Out_ BLT_INFO* pFb);
+
+    // Puts back the pixels under the software cursor, gets the rect they cover or an empty one
+    VOID RestoreCursor(_Out_ RECT* pRestored);
+
+    // Saves the pixels under the software cursor and blends it over them
+    VOID DrawCursor(VOID);
+
+    // Takes the software cursor out of the framebuffer if a present is going
+    // to read or write under it, returns TRUE if it has to be drawn again
+    BOOLEAN HideCursorForPresent(BOOLEAN Stretched,
+                                 _In_ ULONG             NumMoves,
+                                 _In_reads_opt_(NumMoves) CONST D3DKMT_MOVE_RECT* pMoves,
+                                 _In_ ULONG             NumDirtyRects,
+                                 _In_reads_opt_(NumDirtyRects) CONST RECT* pDirtyRect);
+    VOID RedrawCursorAfterPresent(BOOLEAN Hidden);
+
+    // Invalidates where the software cursor was and where it is now and flushes it, either may be empty
+    VOID InvalidateCursor(_In_ CONST RECT* pOld, _In_ CONST RECT* pNew);
+
+    // Fills in the blt infos for a present, returns TRUE if the path is stretched
+    BOOLEAN GetPresentBltInfo(_In_ BYTE*  DstAddr,
+                              _In_ UINT   DstBitPerPixel,
+                              _In_ BYTE*  SrcAddr,
+                              _In_ UINT   SrcBytesPerPixel,
+                              _In_ LONG   SrcPitch,
+                              _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation,
+                              _Out_ BLT_INFO* pDstBltInfo,
+                              _Out_ BLT_INFO* pSrcBltInfo);
+
+    // Returns the engine to submit a present's commands to with its source
+    // readable from there, or NULL if they have to run on the calling thread
+    BLT_ENGINE* LockPresentSource(_In_ UINT              NumSrcs,
+                                  _Inout_updates_(NumSrcs) BLT_INFO* pSrcs,
+                                  _In_ UINT              NumRects,
+                                  _In_reads_(NumRects) CONST RECT* pRects,
+                                  _Out_ PMDL*            ppMdl);
+
+    // Submits a command to pEngine, or runs it right away if that is NULL
+    static UINT64 RunPresentCommand(_In_opt_ BLT_ENGINE*   pEngine,
+                                    _In_ CONST struct _BLT_COMMAND* pCommand);
+
+    // Runs a command with a framebuffer rect for each rect on the present's rects a chunk at a time
+    static VOID RunPresentChunks(_In_opt_ BLT_ENGINE*   pEngine,
+                                 _In_ CONST struct _BLT_COMMAND* pCommand,
+                                 _In_ ULONG             NumMoves,
+                                 _In_reads_opt_(NumMoves) CONST D3DKMT_MOVE_RECT* pMoves,
+                                 _In_ ULONG             NumDirtyRects,
+                                 _In_reads_(NumDirtyRects) CONST RECT* pDirtyRect);
+
+    // Completion routine of the present commands, invalidates what they wrote
+    static VOID PresentDone(_In_ VOID*             pContext,
+                            _In_ CONST struct _BLT_COMMAND* pCommand);
+
+    // Software cursor state, only touched with the framebuffer mutex held
+    CONST BYTE*     m_pCursorImage;     // NULL unless the cursor is drawn in software
+    UINT            m_CursorWidth;
+    UINT            m_CursorHeight;
+    POINT           m_CursorPos;        // Framebuffer position of the shape's top left
+    BOOLEAN         m_CursorVisible;
+    BOOLEAN         m_CursorDrawn;      // m_pCursorUnder holds what m_CursorRect of m_CursorFb covers
+    RECT            m_CursorRect;
+    BLT_INFO        m_CursorFb;
+    UINT32*         m_pCursorUnder;     // MAX_CURSOR_WIDTH * MAX_CURSOR_HEIGHT pixels
+
+    // Invalidated and not sent yet. Only touched with the framebuffer mutex
+    // held, or by the completion routines of a present's commands while the
+    // presenting thread holds it for them.
+    BLT_REGION      m_Damage;
+
+    // What the presents put in the framebuffer, only touched with the
+    // framebuffer mutex held
+    BLT_TILE_MAP    m_TileMap;
 };
 
 //Debugging mutexes
@@ -295,6 +424,13 @@ private:
 
     BDD_HWBLT        m_HardwareBlt[MAX_VIEWS];
 
+    // What the presents of every target run their blts on, BltEngine in the registry
+    BLT_ENGINE*      m_pBltEngine;
+
+    // Share of a present's bounding box that may be copied for nothing to blt
+    // it as one rect, CoalesceWastePercent in the registry
+    UINT             m_CoalesceWastePercent;
+
     // Current monitor power state 
     DEVICE_POWER_STATE m_MonitorPowerState[MAX_VIEWS];
 
@@ -355,6 +491,8 @@ public:
         return (SourceId < MAX_VIEWS)?&m_CurrentModes[SourceId]:NULL;
     }
     const DXGKRNL_INTERFACE* GetDxgkInterface() const { return &m_DxgkInterface;}
+    BLT_ENGINE* GetBltEngine() const { return m_pBltEngine; }
+    UINT GetCoalesceWastePercent() const { return m_CoalesceWastePercent; }
 
     // Not implemented since no IOCTLs currently handled.
     NTSTATUS DispatchIoRequest(_In_  ULONG                 VidPnSourceId,
@@ -475,7 +613,9 @@ private:
             case D3DDDIFMT_R5G6B5: return 16;
             case D3DDDIFMT_R8G8B8: return 24;
             case D3DDDIFMT_X8R8G8B8: // fall through
-            case D3DDDIFMT_A8R8G8B8: return 32;
+            case D3DDDIFMT_A8R8G8B8: // fall through
+            case D3DDDIFMT_A2R10G10B10: return 32;
+            case D3DDDIFMT_A16B16G16R16F: return 64;
             default: BDD_LOG_ASSERTION("Unknown D3DDDIFORMAT 0x%I64x", Format); return 0;
         }
     }
@@ -489,15 +629,20 @@ private:
             case 16: return D3DDDIFMT_R5G6B5;
             case 24: return D3DDDIFMT_R8G8B8;
             case 32: return D3DDDIFMT_X8R8G8B8;
+            case 64: return D3DDDIFMT_A16B16G16R16F;
             default: BDD_LOG_ASSERTION("A bit per pixel of 0x%I64x is not supported.", BPP); return D3DDDIFMT_UNKNOWN;
         }
     }
 
     // These two functions make checks on the values of some of the fields of their respective structures to ensure
-    // that the specified fields are supported by BDD, i.e. gamma ramp must be D3DDDI_GAMMARAMP_DEFAULT
+    // that the specified fields are supported by BDD, i.e. gamma ramp must be D3DDDI_GAMMARAMP_DEFAULT or RGB256x3x16
     NTSTATUS IsVidPnPathFieldsValid(CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath) const;
     NTSTATUS IsVidPnSourceModeFieldsValid(CONST D3DKMDT_VIDPN_SOURCE_MODE* pSourceMode) const;
 
+    // Turns the path's (already validated) gamma ramp into the color lookup the presents to TargetId use.
+    // Caller must hold the target's framebuffer mutex if it has one.
+    NTSTATUS SetGammaRamp(UINT32 TargetId, CONST D3DKMDT_GAMMA_RAMP* pGammaRamp);
+
     VOID BlackOutScreen(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
 
     // Returns the index into gBddBiosData.BddModes of the VBE mode that matches the given VidPnSourceMode.
@@ -508,9 +653,30 @@ private:
     // Returns the SourceId that has TargetId as a valid frame buffer or D3DDDI_ID_UNINITIALIZED if no such SourceId exists
     D3DDDI_VIDEO_PRESENT_SOURCE_ID FindSourceForTarget(D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId, BOOLEAN DefaultToZero);
 
-    // Set the given source mode on the given path
+    // Set the given source mode on the given path. pTargetSize is the pinned target mode's size, only needed for stretched paths.
+    // Clone is TRUE for every path of the source after its first.
     NTSTATUS SetSourceModeAndPath(CONST D3DKMDT_VIDPN_SOURCE_MODE* pSourceMode,
-                                  CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath);
+                                  CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath,
+                                  _In_opt_ CONST D3DKMDT_2DREGION* pTargetSize,
+                                  BOOLEAN Clone);
+
+    // Checks a present can go to TargetId, whose framebuffer mutex is held. *pPresent
+    // is FALSE if there is nothing to draw on it.
+    NTSTATUS CheckPresentTarget(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresentDisplayOnly,
+                                UINT32 TargetId,
+                                _Out_ BOOLEAN* pPresent);
+
+    // Present for a source cloned to Targets, locks the framebuffer of each
+    // one not already in Locked lowest target first and then presents to all.
+    NTSTATUS PresentClones(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresentDisplayOnly,
+                           UINT32 Targets,
+                           UINT32 Locked);
+
+    // Returns the active size of the target mode pinned on TargetId in hVidPn
+    NTSTATUS GetPinnedTargetSize(CONST DXGK_VIDPN_INTERFACE* pVidPnInterface,
+                                 D3DKMDT_HVIDPN hVidPn,
+                                 D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId,
+                                 _Out_ D3DKMDT_2DREGION* pSize);
 
     // Add the current mode to the given monitor source mode set
     NTSTATUS AddSingleMonitorMode(_In_ CONST DXGKARG_RECOMMENDMONITORMODES* CONST pRecommendMonitorModes, UINT32 width, UINT32 height, bool bPreferred);
@@ -538,6 +704,12 @@ private:
     // Set the information in the registry as described here: http://msdn.microsoft.com/en-us/library/windows/hardware/ff569240(v=vs.85).aspx
     NTSTATUS RegisterHWInfo();
 
+    // Sets the per display flags that are configured in the registry
+    VOID ReadDisplaySettings();
+
+    // Handles CHANNEL_ORDER_ESCAPE for the display with key Key
+    NTSTATUS SetChannelOrder(UINT32 Key, UINT32 Order);
+
     //SV Display Handler Interface
     INT32           InitPVChildren();
     INT32           CreateProvider();
@@ -550,17 +722,6 @@ private:
 
 };
 
-//
-// Blt functions
-//
-
-// Must be Non-Paged
-VOID BltBits(
-    BLT_INFO* pDst,
-    CONST BLT_INFO* pSrc,
-    UINT  NumRects,
-    _In_reads_(NumRects) CONST RECT *pRects);
-
 //
 // Driver Entry point
 //
@@ -8,6 +8,9 @@
 \**************************************************************************/
 
 #include "BDD.hxx"
+#include "bltsimd.hxx"
+#include "bltpar.hxx"
+#include "bltcoalesce.hxx"
 
 
 #pragma code_seg(push)
@@ -26,6 +29,11 @@ DriverEntry(
 {
     PAGED_CODE();
 
+    // Pick the blt kernels for this CPU before any present can come in
+    BltSimdInitialize();
+
+    // Time the blts while nothing else is running, before the workers start
+    BltCoalesceInitialize();
 
     // Initialize DDI function pointers and dxgkrnl
     KMDDOD_INITIALIZATION_DATA InitialData = {0};
@@ -68,6 +76,9 @@ DriverEntry(
         return Status;
     }
 
+    // Big blts are split across the other processors. Without workers they
+    // just run on the presenting thread, so a failure here is not fatal.
+    BltParallelInitialize(0);
 
     return Status;
 }
@@ -85,6 +96,8 @@ VOID
 BddDdiUnload(VOID)
 {
     PAGED_CODE();
+
+    BltParallelShutdown();
 }
 
 NTSTATUS
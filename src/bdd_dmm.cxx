@@ -9,15 +9,18 @@
 
 #include "BDD.hxx"
 #include "PVChild.h"
+#include "bltsimd.hxx"
 
 #pragma warning(push)
 #pragma warning(disable:4390)
 
 #pragma code_seg("PAGE")
 
-// Display-Only Devices can only return display modes of D3DDDIFMT_A8R8G8B8.
-// Color conversion takes place if the app's fullscreen backbuffer has different format.
-// Full display drivers can add more if the hardware supports them.
+// Display-Only Devices can only return display modes of D3DDDIFMT_A8R8G8B8,
+// and dxgkrnl only hands their presents 4 bytes per pixel of it whatever
+// the app draws in. Color conversion takes place if the app's fullscreen
+// backbuffer has different format. The 10 bit and FP16 blt kernels are
+// keyed on BLT_INFO::Format and are not offered as source modes.
 D3DDDIFORMAT gBddPixelFormats[] = {
     D3DDDIFMT_A8R8G8B8
 };
@@ -56,7 +59,8 @@ NTSTATUS BASIC_DISPLAY_DRIVER::IsSupportedVidPn(_Inout_ DXGKARG_ISSUPPORTEDVIDPN
         return Status;
     }
 
-    // For every source in this topology, make sure they don't have more paths than there are targets
+    // For every source in this topology, make sure they don't have more paths than there are targets.
+    // A source with several paths is cloned by the presents, see PresentClones.
     for (D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId = 0; SourceId < MAX_VIEWS; ++SourceId)
     {
         SIZE_T NumPathsFromSource = 0;
@@ -367,10 +371,13 @@ NTSTATUS BASIC_DISPLAY_DRIVER::EnumVidPnCofuncModality(_In_ CONST DXGKARG_ENUMVI
             // If the scaling is unpinned, then modify the scaling support field
             if (pVidPnPresentPath->ContentTransformation.Scaling == D3DKMDT_VPPS_UNPINNED)
             {
-                // Identity and centered scaling are supported, but not any stretch modes
+                // Identity, centered and stretched scaling are supported, the aspect ratio preserving modes are not.
+                // Stretching is done by the present blts, which can not also rotate.
                 RtlZeroMemory(&(LocalVidPnPresentPath.ContentTransformation.ScalingSupport), sizeof(D3DKMDT_VIDPN_PRESENT_PATH_SCALING_SUPPORT));
                 LocalVidPnPresentPath.ContentTransformation.ScalingSupport.Identity = 1;
                 LocalVidPnPresentPath.ContentTransformation.ScalingSupport.Centered = 1;
+                LocalVidPnPresentPath.ContentTransformation.ScalingSupport.Stretched =
+                    (pVidPnPresentPath->ContentTransformation.Rotation != D3DKMDT_VPPR_ROTATE90) ? 1 : 0;
                 SupportFieldsModified = TRUE;
             }
         } // End: SCALING
@@ -384,8 +391,9 @@ NTSTATUS BASIC_DISPLAY_DRIVER::EnumVidPnCofuncModality(_In_ CONST DXGKARG_ENUMVI
             if (pVidPnPresentPath->ContentTransformation.Rotation == D3DKMDT_VPPR_UNPINNED)
             {
                 LocalVidPnPresentPath.ContentTransformation.RotationSupport.Identity = 1;
-                // Sample supports only Rotate90
-                LocalVidPnPresentPath.ContentTransformation.RotationSupport.Rotate90 = 1;
+                // Sample supports only Rotate90, and not on a stretched path
+                LocalVidPnPresentPath.ContentTransformation.RotationSupport.Rotate90 =
+                    (pVidPnPresentPath->ContentTransformation.Scaling != D3DKMDT_VPPS_STRETCHED) ? 1 : 0;
                 LocalVidPnPresentPath.ContentTransformation.RotationSupport.Rotate180 = 0;
                 LocalVidPnPresentPath.ContentTransformation.RotationSupport.Rotate270 = 0;
 
@@ -562,6 +570,9 @@ NTSTATUS BASIC_DISPLAY_DRIVER::CommitVidPn(_In_ CONST DXGKARG_COMMITVIDPN* CONST
         goto CommitVidPnExit;
     }
 
+    // The paths from this source are set again below, the first one is its TargetId and the rest are its clones
+    m_CurrentModes[pCommitVidPn->AffectedVidPnSourceId].CloneTargets = 0;
+
     if (NumPaths != 0)
     {
         // Get the Source Mode Set interface so we can get the pinned mode
@@ -645,7 +656,20 @@ NTSTATUS BASIC_DISPLAY_DRIVER::CommitVidPn(_In_ CONST DXGKARG_COMMITVIDPN* CONST
             return STATUS_GRAPHICS_INVALID_VIDPN_TOPOLOGY;
         }
 
-        Status = SetSourceModeAndPath(pPinnedVidPnSourceModeInfo, pVidPnPresentPath);
+        // A stretched path's framebuffer is the size of the target mode rather than the source mode
+        D3DKMDT_2DREGION TargetSize;
+        BOOLEAN HaveTargetSize = FALSE;
+        if (pVidPnPresentPath->ContentTransformation.Scaling == D3DKMDT_VPPS_STRETCHED)
+        {
+            Status = GetPinnedTargetSize(pVidPnInterface, pCommitVidPn->hFunctionalVidPn, TargetId, &TargetSize);
+            if (!NT_SUCCESS(Status))
+            {
+                goto CommitVidPnExit;
+            }
+            HaveTargetSize = TRUE;
+        }
+
+        Status = SetSourceModeAndPath(pPinnedVidPnSourceModeInfo, pVidPnPresentPath, HaveTargetSize ? &TargetSize : NULL, PathIndex != 0);
         if (!NT_SUCCESS(Status))
         {
             goto CommitVidPnExit;
@@ -710,37 +734,123 @@ NTSTATUS BASIC_DISPLAY_DRIVER::UpdateActiveVidPnPresentPath(_In_ CONST DXGKARG_U
     m_CurrentModes[pUpdateActiveVidPnPresentPath->VidPnPresentPathInfo.VidPnSourceId].Rotation = 
         pUpdateActiveVidPnPresentPath->VidPnPresentPathInfo.ContentTransformation.Rotation;
 
-    return STATUS_SUCCESS;
+    // The lookup is used by the presents, which run on the target's mode with its framebuffer mutex held
+    UINT32 TargetId = m_CurrentModes[pUpdateActiveVidPnPresentPath->VidPnPresentPathInfo.VidPnSourceId].TargetId;
+    PVChild * pTarget(m_CurrentModes[TargetId].pPVChild);
+    if (pTarget == NULL)
+    {
+        return SetGammaRamp(TargetId, &pUpdateActiveVidPnPresentPath->VidPnPresentPathInfo.GammaRamp);
+    }
+
+    HoldScopedMutex fb_mutex(pTarget->fb_mutex(), __FUNCTION__, pTarget->target_id());
+    return SetGammaRamp(TargetId, &pUpdateActiveVidPnPresentPath->VidPnPresentPathInfo.GammaRamp);
 }
 
 //
 // Private BDD DMM functions
 //
 
+NTSTATUS BASIC_DISPLAY_DRIVER::GetPinnedTargetSize(CONST DXGK_VIDPN_INTERFACE* pVidPnInterface,
+                                                   D3DKMDT_HVIDPN hVidPn,
+                                                   D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId,
+                                                   _Out_ D3DKMDT_2DREGION* pSize)
+{
+    PAGED_CODE();
+
+    D3DKMDT_HVIDPNTARGETMODESET              hVidPnTargetModeSet = 0;
+    CONST DXGK_VIDPNTARGETMODESET_INTERFACE* pVidPnTargetModeSetInterface = NULL;
+    CONST D3DKMDT_VIDPN_TARGET_MODE*         pPinnedVidPnTargetModeInfo = NULL;
+
+    NTSTATUS Status = pVidPnInterface->pfnAcquireTargetModeSet(hVidPn, TargetId, &hVidPnTargetModeSet, &pVidPnTargetModeSetInterface);
+    if (!NT_SUCCESS(Status))
+    {
+        BDD_LOG_ERROR("pfnAcquireTargetModeSet failed with Status = 0x%x, hVidPn = 0x%p, TargetId = 0x%x", Status, hVidPn, TargetId);
+        return Status;
+    }
+
+    Status = pVidPnTargetModeSetInterface->pfnAcquirePinnedModeInfo(hVidPnTargetModeSet, &pPinnedVidPnTargetModeInfo);
+    if (NT_SUCCESS(Status) && (pPinnedVidPnTargetModeInfo == NULL))
+    {
+        BDD_LOG_ERROR("Stretched path to target 0x%x has no pinned target mode", TargetId);
+        Status = STATUS_GRAPHICS_VIDPN_MODALITY_NOT_SUPPORTED;
+    }
+    else if (!NT_SUCCESS(Status))
+    {
+        BDD_LOG_ERROR("pfnAcquirePinnedModeInfo failed with Status = 0x%x, hVidPnTargetModeSet = 0x%p", Status, hVidPnTargetModeSet);
+    }
+    else
+    {
+        *pSize = pPinnedVidPnTargetModeInfo->VideoSignalInfo.ActiveSize;
+
+        NTSTATUS TempStatus = pVidPnTargetModeSetInterface->pfnReleaseModeInfo(hVidPnTargetModeSet, pPinnedVidPnTargetModeInfo);
+        UNREFERENCED_PARAMETER(TempStatus);
+        NT_ASSERT(NT_SUCCESS(TempStatus));
+    }
+
+    NTSTATUS TempStatus = pVidPnInterface->pfnReleaseTargetModeSet(hVidPn, hVidPnTargetModeSet);
+    UNREFERENCED_PARAMETER(TempStatus);
+    NT_ASSERT(NT_SUCCESS(TempStatus));
+
+    return Status;
+}
+
 NTSTATUS BASIC_DISPLAY_DRIVER::SetSourceModeAndPath(CONST D3DKMDT_VIDPN_SOURCE_MODE* pSourceMode,
-                                                    CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath)
+                                                    CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath,
+                                                    _In_opt_ CONST D3DKMDT_2DREGION* pTargetSize,
+                                                    BOOLEAN Clone)
 {
     PAGED_CODE();
     BOOLEAN bNewMode = FALSE;
 
     //Set Path
     CURRENT_BDD_MODE* pCurrentBddMode = &m_CurrentModes[pPath->VidPnSourceId];
-    pCurrentBddMode->TargetId = pPath->VidPnTargetId;
+    if (Clone)
+    {
+        pCurrentBddMode->CloneTargets |= (1 << pPath->VidPnTargetId);
+    }
+    else
+    {
+        pCurrentBddMode->TargetId = pPath->VidPnTargetId;
+    }
+
+    //A target only shows one source, it is not a clone of any other one any more
+    for (UINT32 SourceId = 0; SourceId < MAX_VIEWS; SourceId++)
+    {
+        if (SourceId != pPath->VidPnSourceId)
+        {
+            m_CurrentModes[SourceId].CloneTargets &= ~(1 << pPath->VidPnTargetId);
+        }
+    }
     pCurrentBddMode = &m_CurrentModes[pPath->VidPnTargetId];
 
     BDD_TRACE_SOURCE(pPath->VidPnSourceId); 
 
+    //Only the 8 bit source is filtered when stretching
+    if ((pPath->ContentTransformation.Scaling == D3DKMDT_VPPS_STRETCHED) &&
+        (pSourceMode->Format.Graphics.PixelFormat != D3DDDIFMT_A8R8G8B8))
+    {
+        BDD_LOG_ERROR("XENWDDM!%s can not stretch source format %u\n", __FUNCTION__, pSourceMode->Format.Graphics.PixelFormat);
+        return STATUS_GRAPHICS_VIDPN_MODALITY_NOT_SUPPORTED;
+    }
+
+    //The framebuffer is the size of the source, unless the presents stretch it to the target's size
+    UINT32 FbWidth = pSourceMode->Format.Graphics.PrimSurfSize.cx;
+    UINT32 FbHeight = pSourceMode->Format.Graphics.PrimSurfSize.cy;
+    if ((pPath->ContentTransformation.Scaling == D3DKMDT_VPPS_STRETCHED) && (pTargetSize != NULL))
+    {
+        FbWidth = pTargetSize->cx;
+        FbHeight = pTargetSize->cy;
+    }
+
     //Update target Mode
-    bNewMode = UpdateCurrentMode(pPath->VidPnTargetId, pSourceMode->Format.Graphics.PrimSurfSize.cx,
-                      pSourceMode->Format.Graphics.PrimSurfSize.cy);
+    bNewMode = UpdateCurrentMode(pPath->VidPnTargetId, FbWidth, FbHeight);
     
     //This is the actual target for this SOURCE VIDPN
     PVChild * pTarget(m_CurrentModes[pPath->VidPnTargetId].pPVChild);
     HoldScopedMutex fb_mutex(pTarget->fb_mutex(), __FUNCTION__, pTarget->target_id());
     NTSTATUS Status;
 
-    Status = pTarget->update_mode(pSourceMode->Format.Graphics.PrimSurfSize.cx,
-                        pSourceMode->Format.Graphics.PrimSurfSize.cy);
+    Status = pTarget->update_mode(FbWidth, FbHeight);
 
     if(!NT_SUCCESS(Status))
     {
@@ -752,8 +862,15 @@ NTSTATUS BASIC_DISPLAY_DRIVER::SetSourceModeAndPath(CONST D3DKMDT_VIDPN_SOURCE_M
     pCurrentBddMode->Scaling = pPath->ContentTransformation.Scaling;
     pCurrentBddMode->SrcModeWidth = pSourceMode->Format.Graphics.PrimSurfSize.cx;
     pCurrentBddMode->SrcModeHeight = pSourceMode->Format.Graphics.PrimSurfSize.cy;
+    pCurrentBddMode->SrcModeFormat = pSourceMode->Format.Graphics.PixelFormat;
     pCurrentBddMode->Rotation = pPath->ContentTransformation.Rotation;
 
+    Status = SetGammaRamp(pPath->VidPnTargetId, &pPath->GammaRamp);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
     if(!pCurrentBddMode->Flags.FrameBufferIsActive)
     {
         BDD_LOG_ERROR("XENWDDM!%s source %d mapping inactive framebuffer \n", __FUNCTION__, pPath->VidPnSourceId);
@@ -766,6 +883,52 @@ NTSTATUS BASIC_DISPLAY_DRIVER::SetSourceModeAndPath(CONST D3DKMDT_VIDPN_SOURCE_M
 }
 
 
+NTSTATUS BASIC_DISPLAY_DRIVER::SetGammaRamp(UINT32 TargetId, CONST D3DKMDT_GAMMA_RAMP* pGammaRamp)
+{
+    PAGED_CODE();
+
+    CURRENT_BDD_MODE* pCurrentBddMode = &m_CurrentModes[TargetId];
+    BOOLEAN Identity = TRUE;
+
+    if (pGammaRamp->Type == D3DDDI_GAMMARAMP_RGB256x3x16)
+    {
+        if (pCurrentBddMode->pColorLut == NULL)
+        {
+            pCurrentBddMode->pColorLut = new (NonPagedPoolNx) BLT_COLOR_LUT;
+            if (pCurrentBddMode->pColorLut == NULL)
+            {
+                BDD_LOG_ERROR("XENWDDM!%s failed to allocate the gamma lookup of target %d\n", __FUNCTION__, TargetId);
+                return STATUS_NO_MEMORY;
+            }
+        }
+
+        // The framebuffer has 8 bits per channel, so only the top 8 bits of each ramp entry are used
+        CONST D3DDDI_GAMMA_RAMP_RGB256x3x16* pRamp = pGammaRamp->Data.pRgb256x3x16;
+        BLT_COLOR_LUT* pLut = pCurrentBddMode->pColorLut;
+        for (UINT i = 0; i < 256; i++)
+        {
+            pLut->Red[i] = (UINT32)(pRamp->Red[i] >> 8) << 16;
+            pLut->Green[i] = (UINT32)(pRamp->Green[i] >> 8) << 8;
+            pLut->Blue[i] = (UINT32)(pRamp->Blue[i] >> 8);
+            Identity = Identity &&
+                       (pLut->Red[i] == (i << 16)) &&
+                       (pLut->Green[i] == (i << 8)) &&
+                       (pLut->Blue[i] == i);
+        }
+    }
+
+    // An identity ramp is left to the plain copies, which are faster than any lookup
+    if (Identity && (pCurrentBddMode->pColorLut != NULL))
+    {
+        delete pCurrentBddMode->pColorLut;
+        pCurrentBddMode->pColorLut = NULL;
+    }
+
+    // The framebuffer has the old ramp until every tile is presented again
+    m_HardwareBlt[TargetId].ForgetTiles(NULL);
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS BASIC_DISPLAY_DRIVER::IsVidPnPathFieldsValid(CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath) const
 {
     PAGED_CODE();
@@ -782,17 +945,33 @@ NTSTATUS BASIC_DISPLAY_DRIVER::IsVidPnPathFieldsValid(CONST D3DKMDT_VIDPN_PRESEN
             pPath->VidPnTargetId, MAX_CHILDREN);
         return STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_TARGET;
     }
-    else if (pPath->GammaRamp.Type != D3DDDI_GAMMARAMP_DEFAULT)
+    else if ((pPath->GammaRamp.Type != D3DDDI_GAMMARAMP_DEFAULT) &&
+        (pPath->GammaRamp.Type != D3DDDI_GAMMARAMP_RGB256x3x16))
     {
-        BDD_LOG_ERROR("pPath contains a gamma ramp (0x%x)", pPath->GammaRamp.Type);
+        BDD_LOG_ERROR("pPath contains an unsupported gamma ramp (0x%x)", pPath->GammaRamp.Type);
         return STATUS_GRAPHICS_GAMMA_RAMP_NOT_SUPPORTED;
     }
+    else if ((pPath->GammaRamp.Type == D3DDDI_GAMMARAMP_RGB256x3x16) &&
+        ((pPath->GammaRamp.Data.pRgb256x3x16 == NULL) ||
+         (pPath->GammaRamp.DataSize < sizeof(D3DDDI_GAMMA_RAMP_RGB256x3x16))))
+    {
+        BDD_LOG_ERROR("pPath contains a gamma ramp with 0x%I64x bytes of data", pPath->GammaRamp.DataSize);
+        return STATUS_INVALID_PARAMETER;
+    }
     else if ((pPath->ContentTransformation.Scaling != D3DKMDT_VPPS_IDENTITY) &&
         (pPath->ContentTransformation.Scaling != D3DKMDT_VPPS_CENTERED) &&
+        (pPath->ContentTransformation.Scaling != D3DKMDT_VPPS_STRETCHED) &&
         (pPath->ContentTransformation.Scaling != D3DKMDT_VPPS_NOTSPECIFIED) &&
         (pPath->ContentTransformation.Scaling != D3DKMDT_VPPS_UNINITIALIZED))
     {
-        BDD_LOG_ERROR("pPath contains a non-identity scaling (0x%x)", pPath->ContentTransformation.Scaling);
+        BDD_LOG_ERROR("pPath contains a not-supported scaling (0x%x)", pPath->ContentTransformation.Scaling);
+        return STATUS_GRAPHICS_VIDPN_MODALITY_NOT_SUPPORTED;
+    }
+    else if ((pPath->ContentTransformation.Scaling == D3DKMDT_VPPS_STRETCHED) &&
+        (pPath->ContentTransformation.Rotation == D3DKMDT_VPPR_ROTATE90))
+    {
+        // BltStretchBits only works on unrotated framebuffers
+        BDD_LOG_ERROR("pPath is both stretched and rotated");
         return STATUS_GRAPHICS_VIDPN_MODALITY_NOT_SUPPORTED;
     }
     else if ((pPath->ContentTransformation.Rotation != D3DKMDT_VPPR_IDENTITY) &&
@@ -865,37 +1044,41 @@ NTSTATUS BASIC_DISPLAY_DRIVER::AddAvailableModes(_In_ CONST DXGK_VIDPNSOURCEMODE
     //Add available modes    
     for(UINT32 i = 0; i <modes.modes(); i++)
     {
-        Status = pVidPnSourceModeSetInterface->pfnCreateNewModeInfo(hVidPnSourceModeSet, &pVidPnSourceModeInfo);
-        if (!NT_SUCCESS(Status))
-        {
-            // If failed to create a new mode info, mode doesn't need to be released since it was never created
-            BDD_LOG_ERROR("pfnCreateNewModeInfo failed with Status = 0x%x, hVidPnSourceModeSet = 0x%p", Status, hVidPnSourceModeSet);
-            return Status;
-        }
-
-        // Populate mode info with values from mode at ModeIndex and hard-coded values
-        // Always report 32 bpp format, this will be color converted during the present if the mode at ModeIndex was < 32bpp
-        pVidPnSourceModeInfo->Type = D3DKMDT_RMT_GRAPHICS;
-        pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cx = modes.width(i);
-        pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cy = modes.height(i);
-        pVidPnSourceModeInfo->Format.Graphics.VisibleRegionSize = pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize;
-        pVidPnSourceModeInfo->Format.Graphics.Stride = modes.stride(i);
-        pVidPnSourceModeInfo->Format.Graphics.PixelFormat = gBddPixelFormats[0];
-        pVidPnSourceModeInfo->Format.Graphics.ColorBasis = D3DKMDT_CB_SCRGB;
-        pVidPnSourceModeInfo->Format.Graphics.PixelValueAccessMode = D3DKMDT_PVAM_DIRECT;
-
-        // Add the mode to the source mode set
-        Status = pVidPnSourceModeSetInterface->pfnAddMode(hVidPnSourceModeSet, pVidPnSourceModeInfo);
-        if(!NT_SUCCESS(Status))
+        for (UINT PelFmtIdx = 0; PelFmtIdx < ARRAYSIZE(gBddPixelFormats); ++PelFmtIdx)
         {
-            if(Status != STATUS_GRAPHICS_MODE_ALREADY_IN_MODESET)
+            Status = pVidPnSourceModeSetInterface->pfnCreateNewModeInfo(hVidPnSourceModeSet, &pVidPnSourceModeInfo);
+            if (!NT_SUCCESS(Status))
             {
-                BDD_LOG_ERROR("pfnAddMode failed with Status = 0x%x, hVidPnSourceModeSet = 0x%p, pVidPnSourceModeInfo = 0x%p", Status, hVidPnSourceModeSet, pVidPnSourceModeInfo);
+                // If failed to create a new mode info, mode doesn't need to be released since it was never created
+                BDD_LOG_ERROR("pfnCreateNewModeInfo failed with Status = 0x%x, hVidPnSourceModeSet = 0x%p", Status, hVidPnSourceModeSet);
+                return Status;
             }
 
-            // If adding the mode failed, release the mode, if this doesn't work there is nothing that can be done, some memory will get leaked, continue to next mode anyway
-            Status = pVidPnSourceModeSetInterface->pfnReleaseModeInfo(hVidPnSourceModeSet, pVidPnSourceModeInfo);
-            BDD_ASSERT_CHK(NT_SUCCESS(Status));
+            // Populate mode info with values from mode at ModeIndex and hard-coded values
+            // The framebuffer is always 32 bpp, other formats are color converted during the present
+            pVidPnSourceModeInfo->Type = D3DKMDT_RMT_GRAPHICS;
+            pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cx = modes.width(i);
+            pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cy = modes.height(i);
+            pVidPnSourceModeInfo->Format.Graphics.VisibleRegionSize = pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize;
+            pVidPnSourceModeInfo->Format.Graphics.Stride = (gBddPixelFormats[PelFmtIdx] == D3DDDIFMT_A8R8G8B8) ?
+                modes.stride(i) : modes.width(i) * BPPFromPixelFormat(gBddPixelFormats[PelFmtIdx]) / BITS_PER_BYTE;
+            pVidPnSourceModeInfo->Format.Graphics.PixelFormat = gBddPixelFormats[PelFmtIdx];
+            pVidPnSourceModeInfo->Format.Graphics.ColorBasis = D3DKMDT_CB_SCRGB;
+            pVidPnSourceModeInfo->Format.Graphics.PixelValueAccessMode = D3DKMDT_PVAM_DIRECT;
+
+            // Add the mode to the source mode set
+            Status = pVidPnSourceModeSetInterface->pfnAddMode(hVidPnSourceModeSet, pVidPnSourceModeInfo);
+            if(!NT_SUCCESS(Status))
+            {
+                if(Status != STATUS_GRAPHICS_MODE_ALREADY_IN_MODESET)
+                {
+                    BDD_LOG_ERROR("pfnAddMode failed with Status = 0x%x, hVidPnSourceModeSet = 0x%p, pVidPnSourceModeInfo = 0x%p", Status, hVidPnSourceModeSet, pVidPnSourceModeInfo);
+                }
+
+                // If adding the mode failed, release the mode, if this doesn't work there is nothing that can be done, some memory will get leaked, continue to next mode anyway
+                Status = pVidPnSourceModeSetInterface->pfnReleaseModeInfo(hVidPnSourceModeSet, pVidPnSourceModeInfo);
+                BDD_ASSERT_CHK(NT_SUCCESS(Status));
+            }
         }
     }
     BDD_LOG_INFORMATION("pfnAddMode SourceId %d added %d modes \n", SourceId, modes.modes());
@@ -923,12 +1106,14 @@ NTSTATUS BASIC_DISPLAY_DRIVER::AddAvailableSourceModes(_In_ CONST DXGK_VIDPNSOUR
         }
 
         // Populate mode info with values from current mode and hard-coded values
-        // Always report 32 bpp format, this will be color converted during the present if the mode is < 32bpp
+        // The framebuffer is always 32 bpp, other formats are color converted during the present
         pVidPnSourceModeInfo->Type = D3DKMDT_RMT_GRAPHICS;
         pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cx = m_CurrentModes[SourceId].DispInfo.Width;
         pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize.cy = m_CurrentModes[SourceId].DispInfo.Height;
         pVidPnSourceModeInfo->Format.Graphics.VisibleRegionSize = pVidPnSourceModeInfo->Format.Graphics.PrimSurfSize;
-        pVidPnSourceModeInfo->Format.Graphics.Stride = m_CurrentModes[SourceId].DispInfo.Pitch;
+        pVidPnSourceModeInfo->Format.Graphics.Stride = (gBddPixelFormats[PelFmtIdx] == D3DDDIFMT_A8R8G8B8) ?
+            m_CurrentModes[SourceId].DispInfo.Pitch :
+            m_CurrentModes[SourceId].DispInfo.Width * BPPFromPixelFormat(gBddPixelFormats[PelFmtIdx]) / BITS_PER_BYTE;
         pVidPnSourceModeInfo->Format.Graphics.PixelFormat = gBddPixelFormats[PelFmtIdx];
         pVidPnSourceModeInfo->Format.Graphics.ColorBasis = D3DKMDT_CB_SCRGB;
         pVidPnSourceModeInfo->Format.Graphics.PixelValueAccessMode = D3DKMDT_PVAM_DIRECT;
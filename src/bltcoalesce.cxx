@@ -0,0 +1,269 @@
+/******************************Module*Header*******************************\
+* Module Name: bltcoalesce.cxx
+*
+* Dirty rect coalescing, see bltcoalesce.hxx.
+*
+* A blt of a rect is modelled as g_BltRectCostBytes plus the bytes it
+* copies. Two rects are merged into their bounding box whenever that one
+* copy costs no more than the two of them, which always holds for rects
+* that share a whole edge or lie inside one another, and holds for rects
+* close enough that what the box adds costs less than a rect. Merging is
+* repeated until no pair is left that pays for it.
+*
+* BltCoalesceInitialize measures g_BltRectCostBytes by timing a big copy,
+* which gives the cost of a byte, against a batch of tiny rects, which is
+* almost all fixed cost.
+*
+\**************************************************************************/
+
+#include "bltcoalesce.hxx"
+
+// Used when the blts can not be timed
+#define BLT_DEFAULT_RECT_COST_BYTES     4096
+
+// The calibration copies a BLT_CALIBRATE_WIDTH x BLT_CALIBRATE_HEIGHT 32bpp
+// surface and BLT_CALIBRATE_RECTS rects of 2x2 pixels each. Both surfaces
+// are flushed from the caches before every run, so the copies go to memory
+// the way presents do, however big the caches are. The best of
+// BLT_CALIBRATE_RUNS runs counts.
+#define BLT_CALIBRATE_WIDTH     1024
+#define BLT_CALIBRATE_HEIGHT    768
+#define BLT_CALIBRATE_RECTS     64
+#define BLT_CALIBRATE_RUNS      4
+
+UINT g_BltRectCostBytes = BLT_DEFAULT_RECT_COST_BYTES;
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+static FORCEINLINE UINT64 RectArea(CONST RECT* pRect)
+{
+    return (UINT64)(pRect->right - pRect->left) * (UINT64)(pRect->bottom - pRect->top);
+}
+
+static FORCEINLINE VOID UnionRect(RECT* pRect, CONST RECT* pOther)
+{
+    pRect->left = (pOther->left < pRect->left) ? pOther->left : pRect->left;
+    pRect->top = (pOther->top < pRect->top) ? pOther->top : pRect->top;
+    pRect->right = (pOther->right > pRect->right) ? pOther->right : pRect->right;
+    pRect->bottom = (pOther->bottom > pRect->bottom) ? pOther->bottom : pRect->bottom;
+}
+
+// TRUE if one copy of the bounding box of pA and pB costs no more than two
+static FORCEINLINE BOOLEAN WorthMerging(CONST RECT* pA, CONST RECT* pB, UINT BytesPerPixel)
+{
+    RECT Union = *pA;
+    UnionRect(&Union, pB);
+
+    UINT64 Apart = 2 * (UINT64)g_BltRectCostBytes + (RectArea(pA) + RectArea(pB)) * BytesPerPixel;
+    UINT64 Merged = (UINT64)g_BltRectCostBytes + RectArea(&Union) * BytesPerPixel;
+    return Merged <= Apart;
+}
+
+/****************************Internal*Routine******************************\
+ * BltCoalesceRects
+ *
+ *
+ * Empty rects are dropped. The bounding box is checked first since it
+ * needs a single pass; the pairwise merging only runs on lists that fit
+ * pOut. The areas of rects that overlap are counted twice towards what is
+ * not wasted, which is what copying them apart would cost anyway.
+ *
+\**************************************************************************/
+BOOLEAN BltCoalesceRects(
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    UINT  BytesPerPixel,
+    UINT  WastePercent,
+    _Out_writes_(BLT_COALESCE_RECTS) RECT *pOut,
+    _Out_ UINT* pNumOut)
+{
+    *pNumOut = 0;
+    if (NumRects < 2)
+    {
+        return FALSE;
+    }
+
+    RECT Bounds = { MAXLONG, MAXLONG, MINLONG, MINLONG };
+    UINT64 Area = 0;
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        RECT Rect;
+        copy_rect(&Rect, &pRects[i]);
+        if ((Rect.left < Rect.right) && (Rect.top < Rect.bottom))
+        {
+            UnionRect(&Bounds, &Rect);
+            Area += RectArea(&Rect);
+        }
+    }
+    if (Bounds.left >= Bounds.right)
+    {
+        return FALSE;
+    }
+
+    UINT64 BoundsArea = RectArea(&Bounds);
+    UINT64 Wasted = (Area < BoundsArea) ? BoundsArea - Area : 0;
+    if (Wasted * 100 <= BoundsArea * WastePercent)
+    {
+        pOut[0] = Bounds;
+        *pNumOut = 1;
+        return TRUE;
+    }
+
+    if (NumRects > BLT_COALESCE_RECTS)
+    {
+        return FALSE;
+    }
+
+    UINT NumOut = 0;
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        copy_rect(&pOut[NumOut], &pRects[i]);
+        if ((pOut[NumOut].left < pOut[NumOut].right) && (pOut[NumOut].top < pOut[NumOut].bottom))
+        {
+            NumOut++;
+        }
+    }
+
+    // A rect that grew can now be worth merging with ones it was checked against before
+    BOOLEAN Merged;
+    do
+    {
+        Merged = FALSE;
+        for (UINT i = 0; i < NumOut; i++)
+        {
+            for (UINT j = i + 1; j < NumOut; )
+            {
+                if (WorthMerging(&pOut[i], &pOut[j], BytesPerPixel))
+                {
+                    UnionRect(&pOut[i], &pOut[j]);
+                    pOut[j] = pOut[--NumOut];
+                    Merged = TRUE;
+                    j = i + 1;
+                }
+                else
+                {
+                    j++;
+                }
+            }
+        }
+    } while (Merged);
+
+    *pNumOut = NumOut;
+    return TRUE;
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+#pragma code_seg(push)
+#pragma code_seg("PAGE")
+// BEGIN: Paged Code
+
+static VOID BltFlushSurface(CONST BLT_INFO* pBltInfo)
+{
+    PAGED_CODE();
+
+    CONST BYTE* pBytes = (CONST BYTE*)pBltInfo->pBits;
+    SIZE_T Bytes = (SIZE_T)pBltInfo->Pitch * pBltInfo->Height;
+    for (SIZE_T i = 0; i < Bytes; i += BLT_CACHE_LINE)
+    {
+        _mm_clflush(pBytes + i);
+    }
+}
+
+// Nanoseconds the best of BLT_CALIBRATE_RUNS batched blts of pRects takes,
+// each from cold caches
+static UINT64 BltTimeRects(BLT_INFO* pDst, CONST BLT_INFO* pSrc, UINT NumRects, CONST RECT* pRects)
+{
+    PAGED_CODE();
+
+    UINT64 Best = MAXUINT64;
+    for (UINT Run = 0; Run < BLT_CALIBRATE_RUNS; Run++)
+    {
+        BltFlushSurface(pSrc);
+        BltFlushSurface(pDst);
+        _mm_mfence();
+
+        UINT64 Start = BltQueryTimeNs();
+        BltBitsBatch(pDst, pSrc, NumRects, pRects);
+        UINT64 Time = BltQueryTimeNs() - Start;
+        Best = (Time < Best) ? Time : Best;
+    }
+    return Best;
+}
+
+VOID BltCoalesceInitialize(VOID)
+{
+    PAGED_CODE();
+
+    SIZE_T Bytes = BLT_CALIBRATE_WIDTH * BLT_CALIBRATE_HEIGHT * 4;
+    VOID* pSrcBits = BltAllocate(Bytes);
+    VOID* pDstBits = BltAllocate(Bytes);
+    if ((pSrcBits == NULL) || (pDstBits == NULL))
+    {
+        BDD_LOG_WARNING("XENWDDM!%s no memory to time the blts, a rect costs %u bytes\n",
+                        __FUNCTION__, g_BltRectCostBytes);
+        if (pSrcBits != NULL)
+        {
+            BltFree(pSrcBits);
+        }
+        if (pDstBits != NULL)
+        {
+            BltFree(pDstBits);
+        }
+        return;
+    }
+    RtlZeroMemory(pSrcBits, Bytes);
+    RtlZeroMemory(pDstBits, Bytes);
+
+    BLT_INFO Src;
+    RtlZeroMemory(&Src, sizeof(Src));
+    Src.pBits = pSrcBits;
+    Src.Pitch = BLT_CALIBRATE_WIDTH * 4;
+    Src.BitsPerPel = 32;
+    Src.Format = D3DDDIFMT_X8R8G8B8;
+    Src.Rotation = D3DKMDT_VPPR_IDENTITY;
+    Src.Width = BLT_CALIBRATE_WIDTH;
+    Src.Height = BLT_CALIBRATE_HEIGHT;
+    BLT_INFO Dst = Src;
+    Dst.pBits = pDstBits;
+
+    RECT Whole = { 0, 0, BLT_CALIBRATE_WIDTH, BLT_CALIBRATE_HEIGHT };
+    UINT64 WholeNs = BltTimeRects(&Dst, &Src, 1, &Whole);
+
+    // Spread out so they neither share rows nor get merged by the blt
+    RECT Tiny[BLT_CALIBRATE_RECTS];
+    for (UINT i = 0; i < BLT_CALIBRATE_RECTS; i++)
+    {
+        Tiny[i].left = (LONG)((i * 37) % (BLT_CALIBRATE_WIDTH - 2));
+        Tiny[i].top = (LONG)((i * BLT_CALIBRATE_HEIGHT) / BLT_CALIBRATE_RECTS);
+        Tiny[i].right = Tiny[i].left + 2;
+        Tiny[i].bottom = Tiny[i].top + 2;
+    }
+    UINT64 TinyNs = BltTimeRects(&Dst, &Src, BLT_CALIBRATE_RECTS, Tiny);
+
+    BltFree(pSrcBits);
+    BltFree(pDstBits);
+
+    if ((WholeNs == 0) || (TinyNs == 0))
+    {
+        BDD_LOG_WARNING("XENWDDM!%s the clock is too coarse to time the blts, a rect costs %u bytes\n",
+                        __FUNCTION__, g_BltRectCostBytes);
+        return;
+    }
+
+    // Bytes the big copy moves in the time one tiny rect takes, which is
+    // bounded so a bad measurement can neither merge everything nor nothing
+    UINT64 CostBytes = (TinyNs * Bytes) / (WholeNs * BLT_CALIBRATE_RECTS);
+    CostBytes = (CostBytes < 64) ? 64 : CostBytes;
+    CostBytes = (CostBytes > 1024 * 1024) ? 1024 * 1024 : CostBytes;
+    g_BltRectCostBytes = (UINT)CostBytes;
+
+    BDD_LOG_EVENT("XENWDDM!%s %Iu bytes in %I64u ns, %u rects in %I64u ns, a rect costs %u bytes\n",
+                  __FUNCTION__, Bytes, WholeNs, BLT_CALIBRATE_RECTS, TinyNs, g_BltRectCostBytes);
+}
+
+// END: Paged Code
+#pragma code_seg(pop)
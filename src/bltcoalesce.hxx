@@ -0,0 +1,41 @@
+/******************************Module*Header*******************************\
+* Module Name: bltcoalesce.hxx
+*
+* Coalescing of the dirty rects of a present before they are blted and
+* invalidated. Every rect a present copies costs a fixed amount on top of
+* the bytes it moves, so overlapping, touching and nearby rects are cheaper
+* as one bigger copy. The fixed cost is measured once when the driver loads.
+*
+\**************************************************************************/
+
+#ifndef _BLTCOALESCE_HXX_
+#define _BLTCOALESCE_HXX_
+
+#include "bltport.hxx"
+
+// Size of the rect array BltCoalesceRects fills in. Longer lists are only
+// ever collapsed into their bounding box.
+#define BLT_COALESCE_RECTS  64
+
+// What one more rect costs a blt, as the number of bytes it could have
+// copied in the same time
+extern UINT g_BltRectCostBytes;
+
+// Times a few blts to fill in g_BltRectCostBytes, before presents come in
+VOID BltCoalesceInitialize(VOID);
+
+// Merges rects wherever one copy of their bounding box costs no more than
+// copying them apart, and collapses all of them into their bounding box if
+// no more than WastePercent of it would be copied for nothing. Returns
+// FALSE if the rects are better used as they are, otherwise pOut holds
+// *pNumOut of them. The rects only tell what to copy, so they are only
+// for presents whose source holds the whole image.
+BOOLEAN BltCoalesceRects(
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    UINT  BytesPerPixel,
+    UINT  WastePercent,
+    _Out_writes_(BLT_COALESCE_RECTS) RECT *pOut,
+    _Out_ UINT* pNumOut);
+
+#endif // _BLTCOALESCE_HXX_
@@ -0,0 +1,357 @@
+/******************************Module*Header*******************************\
+* Module Name: bltengine.cxx
+*
+* The inline and the offload blit engines, see bltengine.hxx.
+*
+* The offload engine's ring has BLT_ENGINE_RING_SIZE slots. Submit writes a
+* command to the slot after the last one queued, waiting for one to free up
+* if the ring is full, and wakes the engine thread. The thread runs the
+* commands in ring order and only then moves the completed fence past them,
+* which is what frees their slots. A thread waiting for a fence hangs an
+* event on that command's slot, the engine thread sets it once the command
+* is done.
+*
+* Only the thread creation differs between the driver and BLT_HOST_BUILD.
+*
+\**************************************************************************/
+
+#include "bltengine.hxx"
+
+#ifdef BLT_HOST_BUILD
+typedef pthread_t BLT_THREAD;
+#else
+typedef PKTHREAD BLT_THREAD;
+#endif
+
+#define BLT_ENGINE_RING_SIZE    16
+
+typedef struct _BLT_ENGINE_SLOT
+{
+    BLT_COMMAND     Command;
+    BLT_EVENT*      pWaiter;    // Set once the command is done, if anybody waits for it
+} BLT_ENGINE_SLOT;
+
+class BLT_INLINE_ENGINE : public BLT_ENGINE
+{
+public:
+    BLT_INLINE_ENGINE() : m_Fence(0) {}
+
+    BOOLEAN IsInline() CONST { return TRUE; }
+    UINT64 Submit(_In_ CONST BLT_COMMAND* pCommand);
+    UINT64 CompletedFence() CONST { return (UINT64)m_Fence; }
+    VOID WaitForFence(UINT64 Fence) { UNREFERENCED_PARAMETER(Fence); }
+
+private:
+    // Only moved past a command once it is done, presents of different
+    // sources submit at the same time
+    volatile LONG64 m_Fence;
+};
+
+class BLT_OFFLOAD_ENGINE : public BLT_ENGINE
+{
+public:
+    BLT_OFFLOAD_ENGINE();
+
+    NTSTATUS Start(VOID);
+    VOID Stop(VOID);
+
+    BOOLEAN IsInline() CONST { return FALSE; }
+    UINT64 Submit(_In_ CONST BLT_COMMAND* pCommand);
+    UINT64 CompletedFence() CONST { return m_Completed; }
+    VOID WaitForFence(UINT64 Fence);
+
+    VOID Run(VOID);
+
+private:
+    BLT_LOCK            m_Lock;         // Guards m_Submitted, m_Completed and the slots' pWaiter
+    BLT_EVENT           m_Work;         // Set for every command queued and by Stop
+    BLT_EVENT           m_SlotFree;     // Set for every command done
+    UINT64              m_Submitted;    // Fence of the last command queued
+    volatile UINT64     m_Completed;
+    volatile LONG       m_Stop;
+    BOOLEAN             m_Started;
+    BLT_THREAD          m_Thread;
+    BLT_ENGINE_SLOT     m_Ring[BLT_ENGINE_RING_SIZE];
+};
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+VOID BltRunCommand(_In_ CONST BLT_COMMAND* pCommand)
+{
+    switch (pCommand->Type)
+    {
+    case BLT_COMMAND_MOVE:
+        BltMoveBits(&pCommand->pDsts[0], pCommand->NumRects, pCommand->pMoves);
+        break;
+
+    case BLT_COMMAND_COPY:
+        if (pCommand->NumDsts == 1)
+        {
+            BltBitsBatch(&pCommand->pDsts[0], &pCommand->pSrcs[0], pCommand->NumRects, pCommand->pRects);
+        }
+        else
+        {
+            BltBitsClone(pCommand->NumDsts, pCommand->pDsts, pCommand->pSrcs, pCommand->NumRects, pCommand->pRects);
+        }
+        break;
+
+    case BLT_COMMAND_STRETCH:
+        BltStretchBits(&pCommand->pDsts[0], &pCommand->pSrcs[0], pCommand->NumRects, pCommand->pRects, pCommand->pDstRects);
+        break;
+
+    case BLT_COMMAND_COPY_CHANGED:
+        BltBitsChanged(&pCommand->pDsts[0], &pCommand->pSrcs[0], pCommand->NumRects, pCommand->pRects, pCommand->pDstRects);
+        break;
+
+    default:
+        NT_ASSERT(FALSE);
+        break;
+    }
+
+    if (pCommand->pfnDone != NULL)
+    {
+        pCommand->pfnDone(pCommand->pDoneContext, pCommand);
+    }
+}
+
+UINT64 BLT_INLINE_ENGINE::Submit(_In_ CONST BLT_COMMAND* pCommand)
+{
+    BltRunCommand(pCommand);
+    return (UINT64)InterlockedIncrement64(&m_Fence);
+}
+
+UINT64 BLT_OFFLOAD_ENGINE::Submit(_In_ CONST BLT_COMMAND* pCommand)
+{
+    BLT_LOCK_STATE LockState;
+    BltLockAcquire(&m_Lock, &LockState);
+    while (m_Submitted - m_Completed == BLT_ENGINE_RING_SIZE)
+    {
+        BltLockRelease(&m_Lock, LockState);
+        BltEventWait(&m_SlotFree);
+        BltLockAcquire(&m_Lock, &LockState);
+    }
+
+    // The engine thread does not look at a slot until m_Submitted is past it
+    BLT_ENGINE_SLOT* pSlot = &m_Ring[m_Submitted % BLT_ENGINE_RING_SIZE];
+    pSlot->Command = *pCommand;
+    pSlot->pWaiter = NULL;
+    UINT64 Fence = ++m_Submitted;
+    BltLockRelease(&m_Lock, LockState);
+
+    BltEventSet(&m_Work);
+    return Fence;
+}
+
+VOID BLT_OFFLOAD_ENGINE::WaitForFence(UINT64 Fence)
+{
+    NT_ASSERT(Fence <= m_Submitted);
+
+    BLT_EVENT Done;
+    BltEventInitialize(&Done);
+
+    BLT_LOCK_STATE LockState;
+    BltLockAcquire(&m_Lock, &LockState);
+    if (m_Completed >= Fence)
+    {
+        BltLockRelease(&m_Lock, LockState);
+        return;
+    }
+
+    // The slot stays this command's until it is done
+    m_Ring[(Fence - 1) % BLT_ENGINE_RING_SIZE].pWaiter = &Done;
+    BltLockRelease(&m_Lock, LockState);
+
+    BltEventWait(&Done);
+}
+
+VOID BLT_OFFLOAD_ENGINE::Run(VOID)
+{
+    for (;;)
+    {
+        BltEventWait(&m_Work);
+
+        // m_Work is only set once for several commands queued in a row
+        for (;;)
+        {
+            BLT_LOCK_STATE LockState;
+            BltLockAcquire(&m_Lock, &LockState);
+            BOOLEAN Idle = (m_Completed == m_Submitted);
+            BLT_ENGINE_SLOT* pSlot = &m_Ring[m_Completed % BLT_ENGINE_RING_SIZE];
+            BltLockRelease(&m_Lock, LockState);
+            if (Idle)
+            {
+                break;
+            }
+
+            BltRunCommand(&pSlot->Command);
+
+            BltLockAcquire(&m_Lock, &LockState);
+            BLT_EVENT* pWaiter = pSlot->pWaiter;
+            m_Completed++;
+            BltLockRelease(&m_Lock, LockState);
+
+            if (pWaiter != NULL)
+            {
+                BltEventSet(pWaiter);
+            }
+            BltEventSet(&m_SlotFree);
+        }
+
+        // Everything submitted before Stop is done by now
+        if (m_Stop)
+        {
+            break;
+        }
+    }
+}
+
+#ifdef BLT_HOST_BUILD
+static VOID* BltEngineThread(VOID* pContext)
+{
+    ((BLT_OFFLOAD_ENGINE*)pContext)->Run();
+    return NULL;
+}
+#else
+static KSTART_ROUTINE BltEngineThread;
+
+static VOID BltEngineThread(PVOID pContext)
+{
+    // Presents wait on the engine with the framebuffer mutex held
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    ((BLT_OFFLOAD_ENGINE*)pContext)->Run();
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+#endif
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+#pragma code_seg(push)
+#pragma code_seg("PAGE")
+// BEGIN: Paged Code
+
+BLT_OFFLOAD_ENGINE::BLT_OFFLOAD_ENGINE() : m_Submitted(0),
+                                           m_Completed(0),
+                                           m_Stop(0),
+                                           m_Started(FALSE)
+{
+    PAGED_CODE();
+
+    BltLockInitialize(&m_Lock);
+    BltEventInitialize(&m_Work);
+    BltEventInitialize(&m_SlotFree);
+    RtlZeroMemory(m_Ring, sizeof(m_Ring));
+}
+
+NTSTATUS BLT_OFFLOAD_ENGINE::Start(VOID)
+{
+    PAGED_CODE();
+
+#ifdef BLT_HOST_BUILD
+    if (pthread_create(&m_Thread, NULL, BltEngineThread, this) != 0)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+#else
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hThread;
+    NTSTATUS Status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, BltEngineThread, this);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    // Keep the thread object around so Stop can wait for it
+    Status = ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID*)&m_Thread, NULL);
+    NT_ASSERT(NT_SUCCESS(Status));
+    ZwClose(hThread);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+#endif
+
+    m_Started = TRUE;
+    return STATUS_SUCCESS;
+}
+
+VOID BLT_OFFLOAD_ENGINE::Stop(VOID)
+{
+    PAGED_CODE();
+
+    if (!m_Started)
+    {
+        return;
+    }
+    m_Started = FALSE;
+
+    InterlockedExchange(&m_Stop, 1);
+    BltEventSet(&m_Work);
+
+#ifdef BLT_HOST_BUILD
+    pthread_join(m_Thread, NULL);
+#else
+    KeWaitForSingleObject(m_Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(m_Thread);
+#endif
+}
+
+BLT_ENGINE* BltCreateEngine(BLT_ENGINE_TYPE Type)
+{
+    PAGED_CODE();
+
+    if (Type == BLT_ENGINE_OFFLOAD)
+    {
+#ifdef BLT_HOST_BUILD
+        BLT_OFFLOAD_ENGINE* pEngine = new BLT_OFFLOAD_ENGINE();
+#else
+        BLT_OFFLOAD_ENGINE* pEngine = new (NonPagedPoolNx) BLT_OFFLOAD_ENGINE();
+#endif
+        if (pEngine == NULL)
+        {
+            return NULL;
+        }
+
+        NTSTATUS Status = pEngine->Start();
+        if (!NT_SUCCESS(Status))
+        {
+            BDD_LOG_ERROR("XENWDDM!%s failed to start the offload engine thread, Status = 0x%I64x\n", __FUNCTION__, Status);
+            delete pEngine;
+            return NULL;
+        }
+
+        BDD_LOG_EVENT("XENWDDM!%s offload engine, %u commands deep\n", __FUNCTION__, BLT_ENGINE_RING_SIZE);
+        return pEngine;
+    }
+
+    NT_ASSERT(Type == BLT_ENGINE_INLINE);
+#ifdef BLT_HOST_BUILD
+    return new BLT_INLINE_ENGINE();
+#else
+    return new (NonPagedPoolNx) BLT_INLINE_ENGINE();
+#endif
+}
+
+VOID BltDestroyEngine(_In_opt_ BLT_ENGINE* pEngine)
+{
+    PAGED_CODE();
+
+    if (pEngine == NULL)
+    {
+        return;
+    }
+
+    if (!pEngine->IsInline())
+    {
+        ((BLT_OFFLOAD_ENGINE*)pEngine)->Stop();
+    }
+    delete pEngine;
+}
+
+// END: Paged Code
+#pragma code_seg(pop)
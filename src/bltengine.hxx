@@ -0,0 +1,89 @@
+/******************************Module*Header*******************************\
+* Module Name: bltengine.hxx
+*
+* Blit engines that BDD_HWBLT runs the blts of a present on. An engine takes
+* commands and completes them in the order they were submitted, every
+* command gets a fence value that counts as completed once it is done.
+*
+* The inline engine does a command on the submitting thread before Submit
+* returns. The offload engine stands in for a DMA engine: commands are
+* written to a ring, a thread of its own takes them from there and calls
+* each command's completion routine once it is done.
+*
+* Like the blt kernels the engines build as a normal program with
+* BLT_HOST_BUILD, the offload engine then runs on a pthread.
+*
+\**************************************************************************/
+
+#ifndef _BLTENGINE_HXX_
+#define _BLTENGINE_HXX_
+
+#include "bltport.hxx"
+
+typedef enum _BLT_ENGINE_TYPE
+{
+    BLT_ENGINE_INLINE = 0,
+    BLT_ENGINE_OFFLOAD,
+    BLT_ENGINE_COUNT
+} BLT_ENGINE_TYPE;
+
+typedef enum _BLT_COMMAND_TYPE
+{
+    BLT_COMMAND_MOVE,       // pMoves within pDsts[0], see BltMoveBits
+    BLT_COMMAND_COPY,       // pRects from the source to every destination, see BltBitsClone
+    BLT_COMMAND_STRETCH,    // pRects scaled to pDsts[0], see BltStretchBits
+    BLT_COMMAND_COPY_CHANGED, // pRects to pDsts[0] writing only what changed, see BltBitsChanged
+} BLT_COMMAND_TYPE;
+
+struct _BLT_COMMAND;
+
+// Called on the engine's thread once a command is done, before its fence completes
+typedef VOID (*PFN_BLT_COMMAND_DONE)(VOID* pContext, CONST struct _BLT_COMMAND* pCommand);
+
+// Everything a command points at has to stay valid until its fence has
+// completed, and the offload engine's thread has to be able to read it.
+typedef struct _BLT_COMMAND
+{
+    BLT_COMMAND_TYPE        Type;
+    UINT                    NumDsts;
+    BLT_INFO*               pDsts;
+    CONST BLT_INFO*         pSrcs;          // One per destination, unused for a move
+    UINT                    NumRects;
+    CONST RECT*             pRects;         // Unused for a move
+    CONST D3DKMT_MOVE_RECT* pMoves;         // NumRects of them for a move
+    RECT*                   pDstRects;      // Stretch and changed copy, gets the framebuffer rect written for each of pRects
+    PFN_BLT_COMMAND_DONE    pfnDone;        // Optional
+    VOID*                   pDoneContext;
+} BLT_COMMAND;
+
+class BLT_ENGINE
+{
+public:
+    virtual ~BLT_ENGINE() {}
+
+    // TRUE if commands run on the submitting thread, so their source does
+    // not have to be readable from anywhere else
+    virtual BOOLEAN IsInline() CONST = 0;
+
+    // Queues a command and returns its fence. The command itself is copied.
+    virtual UINT64 Submit(_In_ CONST BLT_COMMAND* pCommand) = 0;
+
+    // Fence of the last command that is done
+    virtual UINT64 CompletedFence() CONST = 0;
+
+    // Returns once the command with this fence is done. Only the thread that
+    // submitted it waits for a fence.
+    virtual VOID WaitForFence(UINT64 Fence) = 0;
+};
+
+// Does a command and calls its completion routine on the calling thread,
+// what the engines end up doing with every command
+VOID BltRunCommand(_In_ CONST BLT_COMMAND* pCommand);
+
+// Returns NULL if the engine can not be created, BLT_ENGINE_INLINE always works
+BLT_ENGINE* BltCreateEngine(BLT_ENGINE_TYPE Type);
+
+// Waits for every command submitted to it first
+VOID BltDestroyEngine(_In_opt_ BLT_ENGINE* pEngine);
+
+#endif // _BLTENGINE_HXX_
@@ -7,7 +7,9 @@
  * Copyright (c) 2010 Microsoft Corporation
 \**************************************************************************/
 
-#include "BDD.hxx"
+#include "bltport.hxx"
+#include "bltsimd.hxx"
+#include "bltpar.hxx"
 
 // For the following macros, c must be a UCHAR.
 #define UPPER_6_BITS(c)   (((c) & rMaskTable[6 - 1]) >> 2)
@@ -31,15 +33,17 @@
 // The 6 levels per color is the reason for dividing below by 43 (43 * 6 == 258, closest multiple of 6 to 256)
 // It is also the reason for multiplying the red channel by 36 (== 6*6) and the green channel by 6, as this is the
 // equivalent to bit shifting in a 3:3:2 model. Changes to this must be reflected in vesasup.cxx with the Blues/Greens/Reds arrays
-#define CONVERT_32BPP_TO_8BPP(pPixel) (((pPixel[2] / 43) * 36) + \
-                                       ((pPixel[1] / 43) * 6) + \
-                                       ((pPixel[0] / 43)))
+// The divide is done as a multiply and shift, see BLT_DIV43, which is also what the SIMD quantizer uses.
+#define CONVERT_32BPP_TO_8BPP(pPixel) ((BLT_DIV43(pPixel[2]) * 36) + \
+                                       (BLT_DIV43(pPixel[1]) * 6) + \
+                                       (BLT_DIV43(pPixel[0])))
 
 // 4bpp is done with strict grayscale since this has been found to be usable
 // 30% of the red value, 59% of the green value, and 11% of the blue value is the standard way to convert true color to grayscale
-#define CONVERT_32BPP_TO_4BPP(pPixel) ((BYTE)(((pPixel[2] * 30) + \
-                                               (pPixel[1] * 59) + \
-                                               (pPixel[0] * 11)) / (100 * 16)))
+// The sum is at most 25500, for which * 10486 >> 24 gives exactly the same result as / (100 * 16)
+#define CONVERT_32BPP_TO_4BPP(pPixel) ((BYTE)((((pPixel[2] * 30) + \
+                                                (pPixel[1] * 59) + \
+                                                (pPixel[0] * 11)) * 10486) >> 24))
 
 
 // For the following macro, Pixel must be a WORD representing a 16 bit pixel
@@ -69,6 +73,73 @@ void copy_rect(RECT *pRect, CONST RECT * pSrcRect)
     pRect->bottom = (pSrcRect->top < pSrcRect->bottom)? pSrcRect->bottom : pSrcRect->top;
 }
 
+//
+// Clipping
+//
+// Every rect is normalized and clipped to both surfaces before it gets to a
+// kernel, and the empty ones are dropped. The kernels take their rects as
+// they are: left < right, top < bottom and every pixel inside both surfaces.
+//
+
+// The rect of a surface in the desktop coordinates blts are given in
+static FORCEINLINE VOID GetBltExtent(CONST BLT_INFO* pBltInfo, RECT* pExtent)
+{
+    BOOLEAN Swapped = (pBltInfo->Rotation == D3DKMDT_VPPR_ROTATE90) ||
+                      (pBltInfo->Rotation == D3DKMDT_VPPR_ROTATE270);
+    pExtent->left = -pBltInfo->Offset.x;
+    pExtent->top = -pBltInfo->Offset.y;
+    pExtent->right = (LONG)(Swapped ? pBltInfo->Height : pBltInfo->Width) - pBltInfo->Offset.x;
+    pExtent->bottom = (LONG)(Swapped ? pBltInfo->Width : pBltInfo->Height) - pBltInfo->Offset.y;
+}
+
+static FORCEINLINE VOID IntersectRect(RECT* pRect, CONST RECT* pClip)
+{
+    pRect->left = (pRect->left > pClip->left) ? pRect->left : pClip->left;
+    pRect->top = (pRect->top > pClip->top) ? pRect->top : pClip->top;
+    pRect->right = (pRect->right < pClip->right) ? pRect->right : pClip->right;
+    pRect->bottom = (pRect->bottom < pClip->bottom) ? pRect->bottom : pClip->bottom;
+}
+
+/****************************Internal*Routine******************************\
+ * BltClipRect
+ *
+ *
+ * Normalizes pRect like copy_rect and clips it to pDst and, if it is not
+ * NULL, to pSrc. Returns FALSE if nothing is left of it.
+ *
+\**************************************************************************/
+BOOLEAN BltClipRect(
+    CONST BLT_INFO* pDst,
+    _In_opt_ CONST BLT_INFO* pSrc,
+    CONST RECT* pRect,
+    _Out_ RECT* pClipped)
+{
+    RECT Extent;
+    copy_rect(pClipped, pRect);
+
+    GetBltExtent(pDst, &Extent);
+    IntersectRect(pClipped, &Extent);
+    if (pSrc != NULL)
+    {
+        GetBltExtent(pSrc, &Extent);
+        IntersectRect(pClipped, &Extent);
+    }
+
+    return (pClipped->left < pClipped->right) && (pClipped->top < pClipped->bottom);
+}
+
+// The format whose kernels a surface uses
+static FORCEINLINE D3DDDIFORMAT BltKernelFormat(CONST BLT_INFO* pBltInfo)
+{
+    return (pBltInfo->Format == D3DDDIFMT_A8R8G8B8) ? D3DDDIFMT_X8R8G8B8 : pBltInfo->Format;
+}
+
+// Formats with more than 8 bits per channel, CopyBitsGeneric can not do them
+static FORCEINLINE BOOLEAN BltIsWideFormat(CONST BLT_INFO* pBltInfo)
+{
+    return (pBltInfo->Format == D3DDDIFMT_A2R10G10B10) || (pBltInfo->Format == D3DDDIFMT_A16B16G16R16F);
+}
+
 /****************************Internal*Routine******************************\
  * CopyBits32_32
  *
@@ -78,6 +149,10 @@ void copy_rect(RECT *pRect, CONST RECT * pSrcRect)
  *
  * OffsetX, OffsetY - to add to the rectangle coordinates.
  *
+ * Rows are copied with the SIMD kernels selected at DriverEntry, rects
+ * bigger than the last level cache use non-temporal stores. A destination
+ * with a color lookup gets it applied while the rows are copied.
+ *
  * Copied from %SDXROOT%\windows\Core\dxkernel\cdd\enable.cxx (CopySurfBits)
  *
 \**************************************************************************/
@@ -86,7 +161,8 @@ VOID CopyBits32_32(
     BLT_INFO* pDst,
     CONST BLT_INFO* pSrc,
     UINT  NumRects,
-    _In_reads_(NumRects) CONST RECT *pRects)
+    _In_reads_(NumRects) CONST RECT *pRects,
+    CONST BLT_SIMD_CONTEXT* pSimd)
 {
     NT_ASSERT((pDst->BitsPerPel == 32) &&
               (pSrc->BitsPerPel == 32));
@@ -95,12 +171,7 @@ VOID CopyBits32_32(
 
     for (UINT iRect = 0; iRect < NumRects; iRect++)
     {
-        RECT  rect;
-        RECT * pRect = &rect;
-        copy_rect(pRect, &pRects[iRect]);
-
-        NT_ASSERT(pRect->right >= pRect->left);
-        NT_ASSERT(pRect->bottom >= pRect->top);
+        CONST RECT* pRect = &pRects[iRect];
 
         UINT NumPixels = pRect->right - pRect->left;
         UINT NumRows = pRect->bottom - pRect->top;
@@ -112,11 +183,179 @@ VOID CopyBits32_32(
                                 (pRect->top + pSrc->Offset.y) * pSrc->Pitch +
                                 (pRect->left + pSrc->Offset.x) * 4);
 
-        for (UINT i = 0; i < NumRows; ++i)
+        if (pDst->pColorLut != NULL)
+        {
+            // The lookup is done on the way through, the rect is still only read and written once
+            PFN_BLT_COLOR_LUT_ROW32 pfnColorLutRow = pSimd->pDispatch->ColorLutRow32;
+            for (UINT y = 0; y < NumRows; y++)
+            {
+                pfnColorLutRow(pStartDst, pStartSrc, NumPixels, pDst->pColorLut);
+                if (pDst->pSwizzle != NULL)
+                {
+                    // The row is still in the cache
+                    pSimd->pDispatch->SwizzleRow32(pStartDst, pStartDst, NumPixels, pDst->pSwizzle);
+                }
+                pStartDst += pDst->Pitch;
+                pStartSrc += pSrc->Pitch;
+            }
+            continue;
+        }
+
+        if (pDst->pSwizzle != NULL)
+        {
+            // Same as the lookup, the channels are reordered on the way through
+            PFN_BLT_SWIZZLE_ROW32 pfnSwizzleRow = pSimd->pDispatch->SwizzleRow32;
+            for (UINT y = 0; y < NumRows; y++)
+            {
+                pfnSwizzleRow(pStartDst, pStartSrc, NumPixels, pDst->pSwizzle);
+                pStartDst += pDst->Pitch;
+                pStartSrc += pSrc->Pitch;
+            }
+            continue;
+        }
+
+        BltSimdCopyRows(pSimd,
+                        pStartDst, pDst->Pitch,
+                        pStartSrc, pSrc->Pitch,
+                        BytesToCopy, NumRows);
+    }
+}
+
+//
+// Small rects
+//
+// Text and caret updates are mostly rects a few pixels wide. For those the
+// cost is in the per-row call and in saving the SIMD state, not in moving
+// the bytes, so rows of up to BLT_SMALL_ROW_BYTES are copied with fixed
+// size general purpose register moves. A row of Bytes, Width <= Bytes <=
+// 2 * Width, is a Width-byte copy from its start and one from its end.
+//
+
+#define BLT_SMALL_ROW_BYTES 64
+
+template <UINT Width>
+FORCEINLINE VOID CopyFixed(BYTE* pDst, CONST BYTE* pSrc)
+{
+    for (UINT i = 0; i < Width; i += 8)
+    {
+        *(UINT64*)(pDst + i) = *(CONST UINT64*)(pSrc + i);
+    }
+}
+
+template <>
+FORCEINLINE VOID CopyFixed<4>(BYTE* pDst, CONST BYTE* pSrc)
+{
+    *(UINT32*)pDst = *(CONST UINT32*)pSrc;
+}
+
+template <UINT Width>
+struct BLT_SMALL_ROW
+{
+    static FORCEINLINE VOID Copy(BYTE* pDst, CONST BYTE* pSrc, UINT Bytes)
+    {
+        CopyFixed<Width>(pDst, pSrc);
+        CopyFixed<Width>(pDst + Bytes - Width, pSrc + Bytes - Width);
+    }
+};
+
+// 1 to 3 bytes, only possible at 24bpp
+template <>
+struct BLT_SMALL_ROW<1>
+{
+    static FORCEINLINE VOID Copy(BYTE* pDst, CONST BYTE* pSrc, UINT Bytes)
+    {
+        pDst[0] = pSrc[0];
+        pDst[Bytes / 2] = pSrc[Bytes / 2];
+        pDst[Bytes - 1] = pSrc[Bytes - 1];
+    }
+};
+
+template <UINT Width>
+static VOID CopySmallRows(BYTE* pDst, LONG DstPitch, CONST BYTE* pSrc, LONG SrcPitch, UINT Bytes, UINT NumRows)
+{
+    for (UINT y = 0; y < NumRows; y++)
+    {
+        BLT_SMALL_ROW<Width>::Copy(pDst, pSrc, Bytes);
+        pDst += DstPitch;
+        pSrc += SrcPitch;
+    }
+}
+
+// Plain copies without a color lookup where every rect is at most BLT_SMALL_ROW_BYTES wide
+BOOLEAN IsSmallBlt(CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc, UINT NumRects, _In_reads_(NumRects) CONST RECT *pRects)
+{
+    if ((BltKernelFormat(pDst) != BltKernelFormat(pSrc)) ||
+        ((pDst->BitsPerPel != 32) && (pDst->BitsPerPel != 24)) ||
+        (pDst->pColorLut != NULL) ||
+        (pDst->pSwizzle != NULL) ||
+        (pDst->Rotation != D3DKMDT_VPPR_IDENTITY) ||
+        (pSrc->Rotation != D3DKMDT_VPPR_IDENTITY))
+    {
+        return FALSE;
+    }
+
+    LONG MaxPixels = BLT_SMALL_ROW_BYTES / (pDst->BitsPerPel / BITS_PER_BYTE);
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        if (pRects[iRect].right - pRects[iRect].left > MaxPixels)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/****************************Internal*Routine******************************\
+ * CopyBitsSmall
+ *
+ *
+ * Same as CopyBits32_32 (and the unrotated 24bpp copy) for rects picked by
+ * IsSmallBlt. Each rect goes to the copy loop for its width class. No SIMD
+ * registers are used so there is no extended state to save.
+ *
+\**************************************************************************/
+
+VOID CopyBitsSmall(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    CONST LONG BytesPerPixel = pDst->BitsPerPel / BITS_PER_BYTE;
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        CONST RECT* pRect = &pRects[iRect];
+
+        UINT Bytes = (pRect->right - pRect->left) * BytesPerPixel;
+        UINT NumRows = pRect->bottom - pRect->top;
+        BYTE* pStartDst = ((BYTE*)pDst->pBits +
+                          (pRect->top + pDst->Offset.y) * pDst->Pitch +
+                          (pRect->left + pDst->Offset.x) * BytesPerPixel);
+        CONST BYTE* pStartSrc = ((BYTE*)pSrc->pBits +
+                                (pRect->top + pSrc->Offset.y) * pSrc->Pitch +
+                                (pRect->left + pSrc->Offset.x) * BytesPerPixel);
+
+        if (Bytes >= 32)
+        {
+            CopySmallRows<32>(pStartDst, pDst->Pitch, pStartSrc, pSrc->Pitch, Bytes, NumRows);
+        }
+        else if (Bytes >= 16)
+        {
+            CopySmallRows<16>(pStartDst, pDst->Pitch, pStartSrc, pSrc->Pitch, Bytes, NumRows);
+        }
+        else if (Bytes >= 8)
+        {
+            CopySmallRows<8>(pStartDst, pDst->Pitch, pStartSrc, pSrc->Pitch, Bytes, NumRows);
+        }
+        else if (Bytes >= 4)
+        {
+            CopySmallRows<4>(pStartDst, pDst->Pitch, pStartSrc, pSrc->Pitch, Bytes, NumRows);
+        }
+        else
         {
-            RtlCopyMemory(pStartDst, pStartSrc, BytesToCopy);
-            pStartDst += pDst->Pitch;
-            pStartSrc += pSrc->Pitch;
+            CopySmallRows<1>(pStartDst, pDst->Pitch, pStartSrc, pSrc->Pitch, Bytes, NumRows);
         }
     }
 }
@@ -211,7 +450,9 @@ BYTE* GetRowStart(_In_ CONST BLT_INFO* pBltInfo, CONST RECT* pRect)
  *
  *
  * Blt function which can handle a rotated dst/src, offset rects in dst/src
- * and bpp combinations of:
+ * and bpp combinations of the list below. Only used for a rotated source,
+ * everything else goes through the specialized kernels of CopyBitsRotated.
+ *
  *   dst | src
  *    32 | 32   // For identity rotation this is much faster in CopyBits32_32
  *    32 | 24
@@ -219,7 +460,7 @@ BYTE* GetRowStart(_In_ CONST BLT_INFO* pBltInfo, CONST RECT* pRect)
  *    24 | 32
  *    16 | 32
  *     8 | 32
- *    24 | 24   // untested
+ *    24 | 24
  *
 \**************************************************************************/
 
@@ -239,12 +480,7 @@ VOID CopyBitsGeneric(
 
     for (UINT iRect = 0; iRect < NumRects; iRect++)
     {
-        RECT rect;
-        RECT *pRect = &rect;
-        copy_rect(pRect, &pRects[iRect]);
-
-        NT_ASSERT(pRect->right >= pRect->left);
-        NT_ASSERT(pRect->bottom >= pRect->top);
+        CONST RECT* pRect = &pRects[iRect];
 
         UINT NumPixels = pRect->right - pRect->left;
         UINT NumRows = pRect->bottom - pRect->top;
@@ -316,42 +552,1999 @@ VOID CopyBitsGeneric(
     }
 }
 
-/****************************Internal*Routine******************************\
- * BltBits
- *
- *
- * Logic to decide which of the above functions to call based on Rotation/BPP
- *
-\**************************************************************************/
-VOID BltBits(
-    BLT_INFO* pDst,
-    CONST BLT_INFO* pSrc,
-    UINT  NumRects,
-    _In_reads_(NumRects) CONST RECT *pRects)
+//
+// Pixel formats
+//
+// The kernels below are templates on the D3DDDIFORMAT of each surface and
+// get everything they need to know about a format from BLT_FORMAT at compile
+// time. A new format is a BLT_FORMAT specialization, plus the conversions it
+// needs, and gets kernels of its own from the same templates without adding
+// branches to the existing ones. A8R8G8B8 surfaces use the X8R8G8B8 kernels,
+// see BltKernelFormat.
+//
+// Formats other than X8R8G8B8 convert a row at a time to and from X8R8G8B8.
+// The 24bpp rows only ever move the three color bytes, the alpha byte of a
+// 32bpp pixel is left alone. Formats with fewer than 8 bits per channel also
+// have a DitherRow, see CopyBitsDithered.
+//
+
+template <D3DDDIFORMAT Format>
+struct BLT_FORMAT;
+
+template <>
+struct BLT_FORMAT<D3DDDIFMT_X8R8G8B8>
 {
-    // pSrc->pBits might be coming from user-mode. User-mode addresses when accessed by kernel need to be protected by a __try/__except.
-    // This usage is redundant in the sample driver since it is already being used for MmProbeAndLockPages. However, it is very important
-    // to have this in place and to make sure developers don't miss it, it is in these two locations.
-    __try
+    static CONST UINT Bpp = 32;
+};
+
+template <>
+struct BLT_FORMAT<D3DDDIFMT_R8G8B8>
+{
+    static CONST UINT Bpp = 24;
+    static FORCEINLINE VOID UnpackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->Unpack24Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID PackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)   { pSimd->pDispatch->Pack24Row(pDst, pSrc, NumPixels); }
+};
+
+template <>
+struct BLT_FORMAT<D3DDDIFMT_R5G6B5>
+{
+    static CONST UINT Bpp = 16;
+    static FORCEINLINE VOID UnpackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->Unpack565Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID PackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)   { pSimd->pDispatch->Pack565Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID DitherRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, UINT X, UINT Y, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->Dither565Row(pDst, pSrc, NumPixels, X, Y); }
+};
+
+// Write only, blts never read from a palettized surface
+template <>
+struct BLT_FORMAT<D3DDDIFMT_P8>
+{
+    static CONST UINT Bpp = 8;
+    static FORCEINLINE VOID PackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)   { pSimd->pDispatch->Quantize8Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID DitherRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, UINT X, UINT Y, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->Dither8Row(pDst, pSrc, NumPixels, X, Y); }
+};
+
+template <>
+struct BLT_FORMAT<D3DDDIFMT_A2R10G10B10>
+{
+    static CONST UINT Bpp = 32;
+    static FORCEINLINE VOID UnpackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->Unpack2101010Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID PackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)   { pSimd->pDispatch->Pack2101010Row(pDst, pSrc, NumPixels); }
+};
+
+template <>
+struct BLT_FORMAT<D3DDDIFMT_A16B16G16R16F>
+{
+    static CONST UINT Bpp = 64;
+    static FORCEINLINE VOID UnpackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd) { pSimd->pDispatch->UnpackFp16Row(pDst, pSrc, NumPixels); }
+    static FORCEINLINE VOID PackRow(BYTE* pDst, CONST BYTE* pSrc, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)   { pSimd->pDispatch->PackFp16Row(pDst, pSrc, NumPixels); }
+};
+
+//
+// Pixel conversions for the rotated kernels that go a pixel at a time. Each
+// does exactly what the matching branch of CopyBitsGeneric's inner loop does.
+//
+
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+struct BLT_CONVERT;
+
+template <>
+struct BLT_CONVERT<D3DDDIFMT_X8R8G8B8, D3DDDIFMT_X8R8G8B8>
+{
+    static FORCEINLINE VOID Pixel(BYTE* pDstPixel, CONST BYTE* pSrcPixel)
+    {
+        *(UINT32*)pDstPixel = *(CONST UINT32*)pSrcPixel;
+    }
+};
+
+template <>
+struct BLT_CONVERT<D3DDDIFMT_X8R8G8B8, D3DDDIFMT_R5G6B5>
+{
+    static FORCEINLINE VOID Pixel(BYTE* pDstPixel, CONST BYTE* pSrcPixel)
+    {
+        *(UINT32*)pDstPixel = CONVERT_16BPP_TO_32BPP(*(CONST UINT16*)pSrcPixel);
+    }
+};
+
+template <>
+struct BLT_CONVERT<D3DDDIFMT_R5G6B5, D3DDDIFMT_X8R8G8B8>
+{
+    static FORCEINLINE VOID Pixel(BYTE* pDstPixel, CONST BYTE* pSrcPixel)
+    {
+        *(UINT16*)pDstPixel = (UINT16)CONVERT_32BPP_TO_16BPP(pSrcPixel);
+    }
+};
+
+template <>
+struct BLT_CONVERT<D3DDDIFMT_P8, D3DDDIFMT_X8R8G8B8>
+{
+    static FORCEINLINE VOID Pixel(BYTE* pDstPixel, CONST BYTE* pSrcPixel)
+    {
+        *pDstPixel = (BYTE)CONVERT_32BPP_TO_8BPP(pSrcPixel);
+    }
+};
+
+template <>
+struct BLT_CONVERT<D3DDDIFMT_A16B16G16R16F, D3DDDIFMT_A16B16G16R16F>
+{
+    static FORCEINLINE VOID Pixel(BYTE* pDstPixel, CONST BYTE* pSrcPixel)
+    {
+        *(UINT64*)pDstPixel = *(CONST UINT64*)pSrcPixel;
+    }
+};
+
+//
+// Compile-time version of GetPitches. Only the pitch of the surface is known
+// at runtime, so for ROTATE90/270 the pixel step stays a runtime value but
+// the row step, and the sign of both, are constants.
+//
+
+template <D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation, UINT Bpp>
+struct BLT_ROTATION;
+
+template <UINT Bpp>
+struct BLT_ROTATION<D3DKMDT_VPPR_IDENTITY, Bpp>
+{
+    static FORCEINLINE LONG PixelPitch(LONG Pitch) { UNREFERENCED_PARAMETER(Pitch); return (LONG)(Bpp / BITS_PER_BYTE); }
+    static FORCEINLINE LONG RowPitch(LONG Pitch)   { return Pitch; }
+};
+
+template <UINT Bpp>
+struct BLT_ROTATION<D3DKMDT_VPPR_ROTATE90, Bpp>
+{
+    static FORCEINLINE LONG PixelPitch(LONG Pitch) { return -Pitch; }
+    static FORCEINLINE LONG RowPitch(LONG Pitch)   { UNREFERENCED_PARAMETER(Pitch); return (LONG)(Bpp / BITS_PER_BYTE); }
+};
+
+template <UINT Bpp>
+struct BLT_ROTATION<D3DKMDT_VPPR_ROTATE180, Bpp>
+{
+    static FORCEINLINE LONG PixelPitch(LONG Pitch) { UNREFERENCED_PARAMETER(Pitch); return -(LONG)(Bpp / BITS_PER_BYTE); }
+    static FORCEINLINE LONG RowPitch(LONG Pitch)   { return -Pitch; }
+};
+
+template <UINT Bpp>
+struct BLT_ROTATION<D3DKMDT_VPPR_ROTATE270, Bpp>
+{
+    static FORCEINLINE LONG PixelPitch(LONG Pitch) { return Pitch; }
+    static FORCEINLINE LONG RowPitch(LONG Pitch)   { UNREFERENCED_PARAMETER(Pitch); return -(LONG)(Bpp / BITS_PER_BYTE); }
+};
+
+//
+// Per-rect copy loops for CopyBitsRotated. The pointers are at the first
+// pixel of the rect, the pitches are the rotated ones.
+//
+
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+FORCEINLINE VOID CopyRectRows(
+    BYTE* pDstRow,
+    LONG DstPixelPitch,
+    LONG DstRowPitch,
+    CONST BYTE* pSrcRow,
+    LONG SrcRowPitch,
+    UINT NumPixels,
+    UINT NumRows)
+{
+    typedef BLT_CONVERT<DstFormat, SrcFormat> CONVERT;
+    CONST LONG SrcPixelPitch = BLT_FORMAT<SrcFormat>::Bpp / BITS_PER_BYTE;
+
+    for (UINT y = 0; y < NumRows; y++)
     {
-        if (pDst->BitsPerPel == 32 &&
-            pSrc->BitsPerPel == 32 &&
-            pDst->Rotation == D3DKMDT_VPPR_IDENTITY &&
-            pSrc->Rotation == D3DKMDT_VPPR_IDENTITY)
+        BYTE* pDstPixel = pDstRow;
+        CONST BYTE* pSrcPixel = pSrcRow;
+        UINT x = NumPixels;
+
+        for (; x >= 4; x -= 4)
         {
-            // This is by far the most common copy function being called
-            CopyBits32_32(pDst, pSrc, NumRects, pRects);
+            CONVERT::Pixel(pDstPixel, pSrcPixel);
+            CONVERT::Pixel(pDstPixel + DstPixelPitch, pSrcPixel + SrcPixelPitch);
+            CONVERT::Pixel(pDstPixel + 2 * DstPixelPitch, pSrcPixel + 2 * SrcPixelPitch);
+            CONVERT::Pixel(pDstPixel + 3 * DstPixelPitch, pSrcPixel + 3 * SrcPixelPitch);
+            pDstPixel += 4 * DstPixelPitch;
+            pSrcPixel += 4 * SrcPixelPitch;
         }
-        else
+        for (; x > 0; x--)
         {
-            CopyBitsGeneric(pDst, pSrc, NumRects, pRects);
+            CONVERT::Pixel(pDstPixel, pSrcPixel);
+            pDstPixel += DstPixelPitch;
+            pSrcPixel += SrcPixelPitch;
         }
+
+        pDstRow += DstRowPitch;
+        pSrcRow += SrcRowPitch;
     }
-    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
-    __except(EXCEPTION_EXECUTE_HANDLER)
+}
+
+// IDENTITY and ROTATE180 write the destination a row at a time
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+struct BLT_RECT_COPY
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
     {
-        BDD_LOG_ERROR("Either dst (0x%p) or src (0x%p) bits encountered exception during access.", pDst->pBits, pSrc->pBits);
+        UNREFERENCED_PARAMETER(pSimd);
+        CopyRectRows<DstFormat, SrcFormat>(pDstRow, DstPixelPitch, DstRowPitch, pSrcRow, SrcRowPitch, NumPixels, NumRows);
+    }
+};
+
+// ROTATE90 and ROTATE270 write a source row down a destination column, i.e.
+// one cache line per pixel. Going through the rect in BLT_ROTATE_TILE square
+// tiles keeps the destination lines of a tile in the cache until they are full.
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+struct BLT_TILED_RECT_COPY
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(pSimd);
+        CONST LONG SrcPixelPitch = BLT_FORMAT<SrcFormat>::Bpp / BITS_PER_BYTE;
+
+        for (UINT ty = 0; ty < NumRows; ty += BLT_ROTATE_TILE)
+        {
+            UINT TileRows = (NumRows - ty < BLT_ROTATE_TILE) ? NumRows - ty : BLT_ROTATE_TILE;
+            for (UINT tx = 0; tx < NumPixels; tx += BLT_ROTATE_TILE)
+            {
+                UINT TilePixels = (NumPixels - tx < BLT_ROTATE_TILE) ? NumPixels - tx : BLT_ROTATE_TILE;
+                CopyRectRows<DstFormat, SrcFormat>(pDstRow + (LONG_PTR)tx * DstPixelPitch + (LONG_PTR)ty * DstRowPitch,
+                                                   DstPixelPitch,
+                                                   DstRowPitch,
+                                                   pSrcRow + (LONG_PTR)tx * SrcPixelPitch + (LONG_PTR)ty * SrcRowPitch,
+                                                   SrcRowPitch,
+                                                   TilePixels,
+                                                   TileRows);
+            }
+        }
+    }
+};
+
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+struct BLT_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE90> : BLT_TILED_RECT_COPY<DstFormat, SrcFormat> {};
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+struct BLT_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE270> : BLT_TILED_RECT_COPY<DstFormat, SrcFormat> {};
+
+//
+// Unrotated rows are contiguous on both sides. A copy within one format is
+// a plain row copy, anything else is a row conversion to or from X8R8G8B8,
+// all of them go to the SIMD tier.
+//
+
+template <D3DDDIFORMAT Format>
+struct BLT_ROW_COPY_RECT_COPY
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(DstPixelPitch);
+
+        BltSimdCopyRows(pSimd, pDstRow, DstRowPitch, pSrcRow, SrcRowPitch,
+                        (SIZE_T)NumPixels * (BLT_FORMAT<Format>::Bpp / BITS_PER_BYTE), NumRows);
+    }
+};
+
+template <D3DDDIFORMAT SrcFormat>
+struct BLT_RECT_COPY<D3DDDIFMT_X8R8G8B8, SrcFormat, D3DKMDT_VPPR_IDENTITY>
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(DstPixelPitch);
+
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            BLT_FORMAT<SrcFormat>::UnpackRow(pDstRow, pSrcRow, NumPixels, pSimd);
+            pDstRow += DstRowPitch;
+            pSrcRow += SrcRowPitch;
+        }
+    }
+};
+
+template <D3DDDIFORMAT DstFormat>
+struct BLT_RECT_COPY<DstFormat, D3DDDIFMT_X8R8G8B8, D3DKMDT_VPPR_IDENTITY>
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(DstPixelPitch);
+
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            BLT_FORMAT<DstFormat>::PackRow(pDstRow, pSrcRow, NumPixels, pSimd);
+            pDstRow += DstRowPitch;
+            pSrcRow += SrcRowPitch;
+        }
+    }
+};
+
+// Within one format, X8R8G8B8 has to be spelled out as it also matches both of the above
+template <D3DDDIFORMAT Format>
+struct BLT_RECT_COPY<Format, Format, D3DKMDT_VPPR_IDENTITY> : BLT_ROW_COPY_RECT_COPY<Format> {};
+template <>
+struct BLT_RECT_COPY<D3DDDIFMT_X8R8G8B8, D3DDDIFMT_X8R8G8B8, D3DKMDT_VPPR_IDENTITY> : BLT_ROW_COPY_RECT_COPY<D3DDDIFMT_X8R8G8B8> {};
+
+//
+// 32bpp rotations within one format are pure moves and go to the SIMD tier
+//
+
+template <D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+struct BLT_SIMD_ROTATE_RECT_COPY
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        pSimd->pDispatch->Rotate32(pDstRow, DstPixelPitch, DstRowPitch, pSrcRow, SrcRowPitch, NumPixels, NumRows);
+    }
+};
+
+template <>
+struct BLT_SIMD_ROTATE_RECT_COPY<D3DKMDT_VPPR_ROTATE180>
+{
+    static FORCEINLINE VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                                 CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                                 UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(DstPixelPitch);
+
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            pSimd->pDispatch->ReverseRow32(pDstRow, pSrcRow, NumPixels);
+            pDstRow += DstRowPitch;
+            pSrcRow += SrcRowPitch;
+        }
+    }
+};
+
+#define BLT_SIMD_ROTATE_RECT_COPIES(Format)                                                                                                     \
+    template <> struct BLT_RECT_COPY<Format, Format, D3DKMDT_VPPR_ROTATE90>  : BLT_SIMD_ROTATE_RECT_COPY<D3DKMDT_VPPR_ROTATE90> {};             \
+    template <> struct BLT_RECT_COPY<Format, Format, D3DKMDT_VPPR_ROTATE180> : BLT_SIMD_ROTATE_RECT_COPY<D3DKMDT_VPPR_ROTATE180> {};            \
+    template <> struct BLT_RECT_COPY<Format, Format, D3DKMDT_VPPR_ROTATE270> : BLT_SIMD_ROTATE_RECT_COPY<D3DKMDT_VPPR_ROTATE270> {};
+
+BLT_SIMD_ROTATE_RECT_COPIES(D3DDDIFMT_X8R8G8B8)
+BLT_SIMD_ROTATE_RECT_COPIES(D3DDDIFMT_A2R10G10B10)
+
+//
+// Scratch tiles
+//
+// Rotations that have no per pixel conversion are done a BLT_ROTATE_TILE
+// square tile at a time through X8R8G8B8 scratch tiles: the source tile is
+// unpacked to X8R8G8B8 if needed, rotated with the 32bpp kernels so every
+// destination row of the tile is contiguous, and each of those rows is then
+// converted into the destination.
+//
+
+#define BLT_TILE_PITCH (BLT_ROTATE_TILE * 4)
+
+// Gets the source tile as X8R8G8B8 pixels
+template <D3DDDIFORMAT SrcFormat>
+struct BLT_TILE_SOURCE
+{
+    static FORCEINLINE CONST BYTE* Load(BYTE* pScratch, LONG* pPitch, CONST BYTE* pSrc, UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            BLT_FORMAT<SrcFormat>::UnpackRow(pScratch + y * BLT_TILE_PITCH, pSrc, NumPixels, pSimd);
+            pSrc += *pPitch;
+        }
+        *pPitch = BLT_TILE_PITCH;
+        return pScratch;
+    }
+};
+
+template <>
+struct BLT_TILE_SOURCE<D3DDDIFMT_X8R8G8B8>
+{
+    static FORCEINLINE CONST BYTE* Load(BYTE* pScratch, LONG* pPitch, CONST BYTE* pSrc, UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(pScratch);
+        UNREFERENCED_PARAMETER(pPitch);
+        UNREFERENCED_PARAMETER(NumPixels);
+        UNREFERENCED_PARAMETER(NumRows);
+        UNREFERENCED_PARAMETER(pSimd);
+        return pSrc;
+    }
+};
+
+// Writes one contiguous destination row of a tile
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat>
+struct BLT_TILE_STORE
+{
+    static FORCEINLINE VOID Row(BYTE* pDst, CONST BYTE* pTileRow, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        BLT_FORMAT<DstFormat>::PackRow(pDst, pTileRow, NumPixels, pSimd);
+    }
+};
+
+template <D3DDDIFORMAT SrcFormat>
+struct BLT_TILE_STORE<D3DDDIFMT_X8R8G8B8, SrcFormat>
+{
+    static FORCEINLINE VOID Row(BYTE* pDst, CONST BYTE* pTileRow, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        pSimd->pDispatch->CopyRow(pDst, pTileRow, (SIZE_T)NumPixels * 4);
     }
+};
+
+template <>
+struct BLT_TILE_STORE<D3DDDIFMT_X8R8G8B8, D3DDDIFMT_R8G8B8>
+{
+    static FORCEINLINE VOID Row(BYTE* pDst, CONST BYTE* pTileRow, UINT NumPixels, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        pSimd->pDispatch->CopyRgb32Row(pDst, pTileRow, NumPixels);
+    }
+};
+
+// Where a NumPixels x NumRows source tile ends up. Rotate fills the scratch
+// tile so that its row r is the destination row starting at DstOffset(r).
+template <D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+struct BLT_TILE_LAYOUT;
+
+template <>
+struct BLT_TILE_LAYOUT<D3DKMDT_VPPR_ROTATE90>
+{
+    static FORCEINLINE VOID Rotate(BYTE* pTile, CONST BYTE* pSrc, LONG SrcPitch, UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        pSimd->pDispatch->Rotate32(pTile, BLT_TILE_PITCH, 4, pSrc, SrcPitch, NumPixels, NumRows);
+    }
+    static FORCEINLINE UINT Rows(UINT NumPixels, UINT NumRows)   { UNREFERENCED_PARAMETER(NumRows); return NumPixels; }
+    static FORCEINLINE UINT Pixels(UINT NumPixels, UINT NumRows) { UNREFERENCED_PARAMETER(NumPixels); return NumRows; }
+    static FORCEINLINE LONG_PTR DstOffset(LONG DstPixelPitch, LONG DstRowPitch, UINT NumPixels, UINT NumRows, UINT r)
+    {
+        UNREFERENCED_PARAMETER(DstRowPitch);
+        UNREFERENCED_PARAMETER(NumPixels);
+        UNREFERENCED_PARAMETER(NumRows);
+        return (LONG_PTR)r * DstPixelPitch;
+    }
+};
+
+template <>
+struct BLT_TILE_LAYOUT<D3DKMDT_VPPR_ROTATE180>
+{
+    static FORCEINLINE VOID Rotate(BYTE* pTile, CONST BYTE* pSrc, LONG SrcPitch, UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            pSimd->pDispatch->ReverseRow32(pTile + y * BLT_TILE_PITCH + (NumPixels - 1) * 4, pSrc, NumPixels);
+            pSrc += SrcPitch;
+        }
+    }
+    static FORCEINLINE UINT Rows(UINT NumPixels, UINT NumRows)   { UNREFERENCED_PARAMETER(NumPixels); return NumRows; }
+    static FORCEINLINE UINT Pixels(UINT NumPixels, UINT NumRows) { UNREFERENCED_PARAMETER(NumRows); return NumPixels; }
+    static FORCEINLINE LONG_PTR DstOffset(LONG DstPixelPitch, LONG DstRowPitch, UINT NumPixels, UINT NumRows, UINT r)
+    {
+        UNREFERENCED_PARAMETER(NumRows);
+        return (LONG_PTR)(NumPixels - 1) * DstPixelPitch + (LONG_PTR)r * DstRowPitch;
+    }
+};
+
+template <>
+struct BLT_TILE_LAYOUT<D3DKMDT_VPPR_ROTATE270>
+{
+    static FORCEINLINE VOID Rotate(BYTE* pTile, CONST BYTE* pSrc, LONG SrcPitch, UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        pSimd->pDispatch->Rotate32(pTile + (NumRows - 1) * 4, BLT_TILE_PITCH, -4, pSrc, SrcPitch, NumPixels, NumRows);
+    }
+    static FORCEINLINE UINT Rows(UINT NumPixels, UINT NumRows)   { UNREFERENCED_PARAMETER(NumRows); return NumPixels; }
+    static FORCEINLINE UINT Pixels(UINT NumPixels, UINT NumRows) { UNREFERENCED_PARAMETER(NumPixels); return NumRows; }
+    static FORCEINLINE LONG_PTR DstOffset(LONG DstPixelPitch, LONG DstRowPitch, UINT NumPixels, UINT NumRows, UINT r)
+    {
+        UNREFERENCED_PARAMETER(NumPixels);
+        return (LONG_PTR)r * DstPixelPitch + (LONG_PTR)(NumRows - 1) * DstRowPitch;
+    }
+};
+
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+struct BLT_SCRATCH_TILE_RECT_COPY
+{
+    static VOID Copy(BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                     CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                     UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        typedef BLT_TILE_LAYOUT<Rotation> LAYOUT;
+
+        DECLSPEC_ALIGN(BLT_CACHE_LINE) BYTE SrcTile[BLT_ROTATE_TILE * BLT_TILE_PITCH];
+        DECLSPEC_ALIGN(BLT_CACHE_LINE) BYTE DstTile[BLT_ROTATE_TILE * BLT_TILE_PITCH];
+
+        for (UINT ty = 0; ty < NumRows; ty += BLT_ROTATE_TILE)
+        {
+            UINT TileRows = (NumRows - ty < BLT_ROTATE_TILE) ? NumRows - ty : BLT_ROTATE_TILE;
+            for (UINT tx = 0; tx < NumPixels; tx += BLT_ROTATE_TILE)
+            {
+                UINT TilePixels = (NumPixels - tx < BLT_ROTATE_TILE) ? NumPixels - tx : BLT_ROTATE_TILE;
+
+                LONG TileSrcPitch = SrcRowPitch;
+                CONST BYTE* pTileSrc = BLT_TILE_SOURCE<SrcFormat>::Load(SrcTile,
+                                                                        &TileSrcPitch,
+                                                                        pSrcRow + (LONG_PTR)tx * (BLT_FORMAT<SrcFormat>::Bpp / BITS_PER_BYTE) + (LONG_PTR)ty * SrcRowPitch,
+                                                                        TilePixels,
+                                                                        TileRows,
+                                                                        pSimd);
+                LAYOUT::Rotate(DstTile, pTileSrc, TileSrcPitch, TilePixels, TileRows, pSimd);
+
+                BYTE* pTileDst = pDstRow + (LONG_PTR)tx * DstPixelPitch + (LONG_PTR)ty * DstRowPitch;
+                for (UINT r = 0; r < LAYOUT::Rows(TilePixels, TileRows); r++)
+                {
+                    BLT_TILE_STORE<DstFormat, SrcFormat>::Row(pTileDst + LAYOUT::DstOffset(DstPixelPitch, DstRowPitch, TilePixels, TileRows, r),
+                                                              DstTile + r * BLT_TILE_PITCH,
+                                                              LAYOUT::Pixels(TilePixels, TileRows),
+                                                              pSimd);
+                }
+            }
+        }
+    }
+};
+
+#define BLT_SCRATCH_TILE_RECT_COPIES(DstFormat, SrcFormat)                                                                                          \
+    template <> struct BLT_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE90>  : BLT_SCRATCH_TILE_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE90> {};   \
+    template <> struct BLT_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE180> : BLT_SCRATCH_TILE_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE180> {};  \
+    template <> struct BLT_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE270> : BLT_SCRATCH_TILE_RECT_COPY<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE270> {};
+
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_X8R8G8B8, D3DDDIFMT_R8G8B8)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_R8G8B8, D3DDDIFMT_X8R8G8B8)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_R8G8B8, D3DDDIFMT_R8G8B8)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_X8R8G8B8, D3DDDIFMT_A2R10G10B10)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_A2R10G10B10, D3DDDIFMT_X8R8G8B8)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_X8R8G8B8, D3DDDIFMT_A16B16G16R16F)
+BLT_SCRATCH_TILE_RECT_COPIES(D3DDDIFMT_A16B16G16R16F, D3DDDIFMT_X8R8G8B8)
+
+//
+// Dithered conversions
+//
+// The dither matrix is anchored to the destination surface, so the pattern
+// does not move between rects or presents. Each destination row works out
+// where it is from its address, the same way for every rotation, and the
+// rotated ones go through X8R8G8B8 scratch tiles like the other conversions.
+//
+
+static FORCEINLINE VOID GetDitherPosition(CONST BLT_INFO* pDst, CONST BYTE* pDstRow, UINT* pX, UINT* pY)
+{
+    SIZE_T Offset = (SIZE_T)(pDstRow - (CONST BYTE*)pDst->pBits);
+    *pY = (UINT)(Offset / pDst->Pitch);
+    *pX = (UINT)((Offset % pDst->Pitch) / (pDst->BitsPerPel / BITS_PER_BYTE));
+}
+
+template <D3DDDIFORMAT DstFormat, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+struct BLT_DITHER_RECT_COPY
+{
+    static VOID Copy(CONST BLT_INFO* pDst, BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                     CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                     UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        typedef BLT_TILE_LAYOUT<Rotation> LAYOUT;
+
+        DECLSPEC_ALIGN(BLT_CACHE_LINE) BYTE DstTile[BLT_ROTATE_TILE * BLT_TILE_PITCH];
+
+        for (UINT ty = 0; ty < NumRows; ty += BLT_ROTATE_TILE)
+        {
+            UINT TileRows = (NumRows - ty < BLT_ROTATE_TILE) ? NumRows - ty : BLT_ROTATE_TILE;
+            for (UINT tx = 0; tx < NumPixels; tx += BLT_ROTATE_TILE)
+            {
+                UINT TilePixels = (NumPixels - tx < BLT_ROTATE_TILE) ? NumPixels - tx : BLT_ROTATE_TILE;
+
+                LAYOUT::Rotate(DstTile, pSrcRow + (LONG_PTR)tx * 4 + (LONG_PTR)ty * SrcRowPitch, SrcRowPitch, TilePixels, TileRows, pSimd);
+
+                BYTE* pTileDst = pDstRow + (LONG_PTR)tx * DstPixelPitch + (LONG_PTR)ty * DstRowPitch;
+                for (UINT r = 0; r < LAYOUT::Rows(TilePixels, TileRows); r++)
+                {
+                    BYTE* pRowDst = pTileDst + LAYOUT::DstOffset(DstPixelPitch, DstRowPitch, TilePixels, TileRows, r);
+                    UINT X, Y;
+                    GetDitherPosition(pDst, pRowDst, &X, &Y);
+                    BLT_FORMAT<DstFormat>::DitherRow(pRowDst, DstTile + r * BLT_TILE_PITCH, LAYOUT::Pixels(TilePixels, TileRows), X, Y, pSimd);
+                }
+            }
+        }
+    }
+};
+
+template <D3DDDIFORMAT DstFormat>
+struct BLT_DITHER_RECT_COPY<DstFormat, D3DKMDT_VPPR_IDENTITY>
+{
+    static VOID Copy(CONST BLT_INFO* pDst, BYTE* pDstRow, LONG DstPixelPitch, LONG DstRowPitch,
+                     CONST BYTE* pSrcRow, LONG SrcRowPitch,
+                     UINT NumPixels, UINT NumRows, CONST BLT_SIMD_CONTEXT* pSimd)
+    {
+        UNREFERENCED_PARAMETER(DstPixelPitch);
+
+        UINT X, Y;
+        GetDitherPosition(pDst, pDstRow, &X, &Y);
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            BLT_FORMAT<DstFormat>::DitherRow(pDstRow, pSrcRow, NumPixels, X, Y + y, pSimd);
+            pDstRow += DstRowPitch;
+            pSrcRow += SrcRowPitch;
+        }
+    }
+};
+
+/****************************Internal*Routine******************************\
+ * CopyBitsRotated
+ *
+ *
+ * Specialized version of CopyBitsGeneric for one dst/src format pair and one
+ * destination rotation, the source must not be rotated. Formats and pitches
+ * are resolved at compile time so the inner loop has no branches, and it is
+ * unrolled by 4. ROTATE90/270 are cache blocked, see BLT_TILED_RECT_COPY.
+ *
+\**************************************************************************/
+
+template <D3DDDIFORMAT DstFormat, D3DDDIFORMAT SrcFormat, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+VOID CopyBitsRotated(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    typedef BLT_ROTATION<Rotation, BLT_FORMAT<DstFormat>::Bpp> DST_ROTATION;
+
+    NT_ASSERT(pDst->BitsPerPel == BLT_FORMAT<DstFormat>::Bpp && pSrc->BitsPerPel == BLT_FORMAT<SrcFormat>::Bpp);
+    NT_ASSERT(pDst->Rotation == Rotation && pSrc->Rotation == D3DKMDT_VPPR_IDENTITY);
+
+    CONST LONG DstPixelPitch = DST_ROTATION::PixelPitch((LONG)pDst->Pitch);
+    CONST LONG DstRowPitch = DST_ROTATION::RowPitch((LONG)pDst->Pitch);
+    CONST LONG SrcRowPitch = (LONG)pSrc->Pitch;
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        CONST RECT* pRect = &pRects[iRect];
+
+        UINT NumPixels = pRect->right - pRect->left;
+        UINT NumRows = pRect->bottom - pRect->top;
+
+        BLT_RECT_COPY<DstFormat, SrcFormat, Rotation>::Copy(GetRowStart(pDst, pRect),
+                                                            DstPixelPitch,
+                                                            DstRowPitch,
+                                                            GetRowStart(pSrc, pRect),
+                                                            SrcRowPitch,
+                                                            NumPixels,
+                                                            NumRows,
+                                                            pSimd);
+    }
+}
+
+/****************************Internal*Routine******************************\
+ * CopyBitsDithered
+ *
+ *
+ * CopyBitsRotated for an X8R8G8B8 source and a destination that is dithered,
+ * see BLT_DITHER_RECT_COPY.
+ *
+\**************************************************************************/
+
+template <D3DDDIFORMAT DstFormat, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation>
+VOID CopyBitsDithered(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    typedef BLT_ROTATION<Rotation, BLT_FORMAT<DstFormat>::Bpp> DST_ROTATION;
+
+    NT_ASSERT(pDst->BitsPerPel == BLT_FORMAT<DstFormat>::Bpp && pSrc->BitsPerPel == 32);
+    NT_ASSERT(pDst->Rotation == Rotation && pSrc->Rotation == D3DKMDT_VPPR_IDENTITY);
+
+    CONST LONG DstPixelPitch = DST_ROTATION::PixelPitch((LONG)pDst->Pitch);
+    CONST LONG DstRowPitch = DST_ROTATION::RowPitch((LONG)pDst->Pitch);
+    CONST LONG SrcRowPitch = (LONG)pSrc->Pitch;
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        CONST RECT* pRect = &pRects[iRect];
+
+        UINT NumPixels = pRect->right - pRect->left;
+        UINT NumRows = pRect->bottom - pRect->top;
+
+        BLT_DITHER_RECT_COPY<DstFormat, Rotation>::Copy(pDst,
+                                                        GetRowStart(pDst, pRect),
+                                                        DstPixelPitch,
+                                                        DstRowPitch,
+                                                        GetRowStart(pSrc, pRect),
+                                                        SrcRowPitch,
+                                                        NumPixels,
+                                                        NumRows,
+                                                        pSimd);
+    }
+}
+
+typedef VOID (*PFN_COPY_BITS)(BLT_INFO* pDst, CONST BLT_INFO* pSrc, UINT NumRects, CONST RECT *pRects, CONST BLT_SIMD_CONTEXT* pSimd);
+
+#define BLT_ROTATION_COUNT (D3DKMDT_VPPR_ROTATE270 - D3DKMDT_VPPR_IDENTITY + 1)
+
+typedef struct _BLT_KERNEL
+{
+    D3DDDIFORMAT  DstFormat;
+    D3DDDIFORMAT  SrcFormat;
+    PFN_COPY_BITS pfnCopyBits[BLT_ROTATION_COUNT]; // Indexed by Rotation - D3DKMDT_VPPR_IDENTITY
+} BLT_KERNEL;
+
+#define BLT_KERNEL_ENTRY(DstFormat, SrcFormat)                                  \
+    { DstFormat, SrcFormat,                                                     \
+      { CopyBitsRotated<DstFormat, SrcFormat, D3DKMDT_VPPR_IDENTITY>,           \
+        CopyBitsRotated<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE90>,           \
+        CopyBitsRotated<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE180>,          \
+        CopyBitsRotated<DstFormat, SrcFormat, D3DKMDT_VPPR_ROTATE270> } }
+
+// Every dst | src combination CopyBitsGeneric handles, then the 10 bit and
+// FP16 ones, which go to and from X8R8G8B8 or stay in their own format
+static CONST BLT_KERNEL g_BltKernels[] =
+{
+    BLT_KERNEL_ENTRY(D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_R5G6B5),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_R8G8B8,        D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_R5G6B5,        D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_P8,            D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_R8G8B8,        D3DDDIFMT_R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_A2R10G10B10),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_A2R10G10B10,   D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_A2R10G10B10,   D3DDDIFMT_A2R10G10B10),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_A16B16G16R16F),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_A16B16G16R16F, D3DDDIFMT_X8R8G8B8),
+    BLT_KERNEL_ENTRY(D3DDDIFMT_A16B16G16R16F, D3DDDIFMT_A16B16G16R16F),
+};
+
+#define BLT_DITHER_KERNEL_ENTRY(DstFormat)                                      \
+    { DstFormat, D3DDDIFMT_X8R8G8B8,                                            \
+      { CopyBitsDithered<DstFormat, D3DKMDT_VPPR_IDENTITY>,                     \
+        CopyBitsDithered<DstFormat, D3DKMDT_VPPR_ROTATE90>,                     \
+        CopyBitsDithered<DstFormat, D3DKMDT_VPPR_ROTATE180>,                    \
+        CopyBitsDithered<DstFormat, D3DKMDT_VPPR_ROTATE270> } }
+
+// Used instead of g_BltKernels when the destination is dithered
+static CONST BLT_KERNEL g_BltDitherKernels[] =
+{
+    BLT_DITHER_KERNEL_ENTRY(D3DDDIFMT_R5G6B5),
+    BLT_DITHER_KERNEL_ENTRY(D3DDDIFMT_P8),
+};
+
+static PFN_COPY_BITS FindBltKernel(CONST BLT_KERNEL* pKernels, UINT NumKernels, CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc)
+{
+    for (UINT i = 0; i < NumKernels; i++)
+    {
+        if ((pKernels[i].DstFormat == BltKernelFormat(pDst)) &&
+            (pKernels[i].SrcFormat == BltKernelFormat(pSrc)))
+        {
+            return pKernels[i].pfnCopyBits[pDst->Rotation - D3DKMDT_VPPR_IDENTITY];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the specialized kernel for this blt, or NULL if CopyBitsGeneric has to do it
+PFN_COPY_BITS GetBltKernel(CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc)
+{
+    if ((pSrc->Rotation != D3DKMDT_VPPR_IDENTITY) ||
+        (pDst->Rotation < D3DKMDT_VPPR_IDENTITY) ||
+        (pDst->Rotation > D3DKMDT_VPPR_ROTATE270))
+    {
+        return NULL;
+    }
+
+    if (pDst->Dither)
+    {
+        PFN_COPY_BITS pfnCopyBits = FindBltKernel(g_BltDitherKernels, ARRAYSIZE(g_BltDitherKernels), pDst, pSrc);
+        if (pfnCopyBits != NULL)
+        {
+            return pfnCopyBits;
+        }
+    }
+
+    return FindBltKernel(g_BltKernels, ARRAYSIZE(g_BltKernels), pDst, pSrc);
+}
+
+// Number of rows of the next rect prefetched while the current one is copied
+#define BLT_PREFETCH_ROWS   4
+
+static FORCEINLINE VOID BltPrefetchRect(CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc, CONST RECT* pRect)
+{
+    // Prefetches never fault, so a bad rect costs nothing here
+    CONST BYTE* pDstRow = GetRowStart(pDst, pRect);
+    CONST BYTE* pSrcRow = GetRowStart(pSrc, pRect);
+    LONG DstPixelPitch, DstRowPitch, SrcPixelPitch, SrcRowPitch;
+    GetPitches(pDst, &DstPixelPitch, &DstRowPitch);
+    GetPitches(pSrc, &SrcPixelPitch, &SrcRowPitch);
+
+    for (UINT y = 0; y < BLT_PREFETCH_ROWS; y++)
+    {
+        _mm_prefetch((CONST char*)pSrcRow, _MM_HINT_T0);
+        _mm_prefetch((CONST char*)pDstRow, _MM_HINT_T0);
+        pSrcRow += SrcRowPitch;
+        pDstRow += DstRowPitch;
+    }
+}
+
+static VOID GetPhysicalRect(CONST BLT_INFO* pBltInfo, CONST RECT* pRect, RECT* pPhysical);
+
+// Applies the destination's color lookup and channel order in place to a
+// rect that was just written. Only the kernels that can not fuse them into
+// their copy need this, they are all for rotated or less common formats.
+static VOID BltFinishRect(CONST BLT_INFO* pDst, CONST RECT* pRect, CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    RECT Physical;
+    GetPhysicalRect(pDst, pRect, &Physical);
+
+    UINT NumPixels = Physical.right - Physical.left;
+    BYTE* pRow = (BYTE*)pDst->pBits + (LONG_PTR)Physical.top * pDst->Pitch + (LONG_PTR)Physical.left * 4;
+    for (LONG y = Physical.top; y < Physical.bottom; y++)
+    {
+        if (pDst->pColorLut != NULL)
+        {
+            pSimd->pDispatch->ColorLutRow32(pRow, pRow, NumPixels, pDst->pColorLut);
+        }
+        if (pDst->pSwizzle != NULL)
+        {
+            pSimd->pDispatch->SwizzleRow32(pRow, pRow, NumPixels, pDst->pSwizzle);
+        }
+        pRow += pDst->Pitch;
+    }
+}
+
+// Picks the kernel for this blt once, the kernels themselves do not branch on
+// format or rotation. The first rows of each rect are prefetched while the
+// one before it is copied.
+static VOID BltRects(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    PFN_COPY_BITS pfnCopyBits;
+    if (BltKernelFormat(pDst) == D3DDDIFMT_X8R8G8B8 &&
+        BltKernelFormat(pSrc) == D3DDDIFMT_X8R8G8B8 &&
+        pDst->Rotation == D3DKMDT_VPPR_IDENTITY &&
+        pSrc->Rotation == D3DKMDT_VPPR_IDENTITY)
+    {
+        // This is by far the most common copy function being called
+        pfnCopyBits = CopyBits32_32;
+    }
+    else
+    {
+        pfnCopyBits = GetBltKernel(pDst, pSrc);
+    }
+
+    // CopyBits32_32 does the lookup and the swizzle itself, both are only done on X8R8G8B8 framebuffers
+    BOOLEAN Finish = ((pDst->pColorLut != NULL) || (pDst->pSwizzle != NULL)) &&
+                     (BltKernelFormat(pDst) == D3DDDIFMT_X8R8G8B8) &&
+                     (pfnCopyBits != CopyBits32_32);
+
+    if (pfnCopyBits == NULL)
+    {
+        if (BltIsWideFormat(pDst) || BltIsWideFormat(pSrc))
+        {
+            BDD_LOG_ERROR("No blt from format %u (rotation %u) to format %u (rotation %u)",
+                          pSrc->Format, pSrc->Rotation, pDst->Format, pDst->Rotation);
+            return;
+        }
+        CopyBitsGeneric(pDst, pSrc, NumRects, pRects);
+        for (UINT iRect = 0; Finish && (iRect < NumRects); iRect++)
+        {
+            BltFinishRect(pDst, &pRects[iRect], pSimd);
+        }
+        return;
+    }
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        if (iRect + 1 < NumRects)
+        {
+            BltPrefetchRect(pDst, pSrc, &pRects[iRect + 1]);
+        }
+        pfnCopyBits(pDst, pSrc, 1, &pRects[iRect], pSimd);
+        if (Finish)
+        {
+            BltFinishRect(pDst, &pRects[iRect], pSimd);
+        }
+    }
+}
+
+//
+// Clones
+//
+// A source shown on more than one display is copied to all of them a band
+// of source rows at a time. The band is read from memory for the first
+// clone and is still in the cache for the others, so the source is only
+// read once however many displays it is cloned to.
+//
+
+// Source bytes per band, small enough to stay in the cache while every clone is written
+#define BLT_CLONE_BAND_BYTES    (64 * 1024)
+
+static VOID BltCloneRect(
+    UINT NumClones,
+    _In_reads_(NumClones) BLT_INFO* pDsts,
+    _In_reads_(NumClones) CONST BLT_INFO* pSrcs,
+    CONST RECT* pRect,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    if (NumClones == 1)
+    {
+        BltRects(pDsts, pSrcs, 1, pRect, pSimd);
+        return;
+    }
+
+    // Whole rotate tiles per band, so the rotated clones do not copy part tiles
+    SIZE_T RowBytes = (SIZE_T)(pRect->right - pRect->left) * (pSrcs[0].BitsPerPel / BITS_PER_BYTE);
+    LONG BandRows = (LONG)((BLT_CLONE_BAND_BYTES / RowBytes) & ~(SIZE_T)(BLT_ROTATE_TILE - 1));
+    if (BandRows < BLT_ROTATE_TILE)
+    {
+        BandRows = BLT_ROTATE_TILE;
+    }
+
+    RECT Band = *pRect;
+    for (LONG Top = pRect->top; Top < pRect->bottom; Top += BandRows)
+    {
+        Band.top = Top;
+        Band.bottom = (pRect->bottom - Top > BandRows) ? Top + BandRows : pRect->bottom;
+        for (UINT iClone = 0; iClone < NumClones; iClone++)
+        {
+            BltRects(&pDsts[iClone], &pSrcs[iClone], 1, &Band, pSimd);
+        }
+    }
+}
+
+//
+// Parallel blts
+//
+// Every rect is cut into the same number of row bands, band i of a blt is
+// band i of each of its rects. Rows are in source rect coordinates so this
+// works for any rotation.
+//
+
+typedef struct _BLT_BAND_JOB
+{
+    UINT            NumDsts;
+    BLT_INFO*       pDsts;      // Clones of the same source
+    CONST BLT_INFO* pSrcs;      // One per destination, all with the same bits
+    UINT            NumRects;
+    CONST RECT*     pRects;
+} BLT_BAND_JOB;
+
+// Band Band of NumBands of *pRect, FALSE if it has no rows
+static FORCEINLINE BOOLEAN BltBandRect(CONST RECT* pRect, UINT Band, UINT NumBands, RECT* pBandRect)
+{
+    LONG NumRows = pRect->bottom - pRect->top;
+
+    *pBandRect = *pRect;
+    pBandRect->bottom = pRect->top + (LONG)(((LONG64)NumRows * (Band + 1)) / NumBands);
+    pBandRect->top = pRect->top + (LONG)(((LONG64)NumRows * Band) / NumBands);
+    return (pBandRect->top < pBandRect->bottom);
+}
+
+static VOID BltBand(VOID* pContext, UINT Band, UINT NumBands)
+{
+    BLT_BAND_JOB* pJob = (BLT_BAND_JOB*)pContext;
+
+    // Each participant has its own extended state to save
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    __try
+    {
+        for (UINT iRect = 0; iRect < pJob->NumRects; iRect++)
+        {
+            RECT BandRect;
+            if (BltBandRect(&pJob->pRects[iRect], Band, NumBands, &BandRect))
+            {
+                BltCloneRect(pJob->NumDsts, pJob->pDsts, pJob->pSrcs, &BandRect, &SimdContext);
+            }
+        }
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "The source is locked down by BltBitsParallel, this only guards against a bad destination");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Band %u of %u, either dst (0x%p) or src (0x%p) bits encountered exception during access.",
+                      Band, NumBands, pJob->pDsts[0].pBits, pJob->pSrcs[0].pBits);
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+#ifndef BLT_HOST_BUILD
+// Locks a user-mode range and maps it into system space. Returns NULL on failure.
+static PMDL BltLockPages(CONST BYTE* pStart, SIZE_T Length, BYTE** ppSystemStart)
+{
+    PMDL pMdl = IoAllocateMdl((PVOID)pStart, (ULONG)Length, FALSE, FALSE, NULL);
+    if (pMdl == NULL)
+    {
+        return NULL;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(pMdl, UserMode, IoReadAccess);
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "MmProbeAndLockPages raises on a bad user-mode range");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(pMdl);
+        return NULL;
+    }
+
+    *ppSystemStart = (BYTE*)MmGetSystemAddressForMdlSafe(pMdl, NormalPagePriority | MdlMappingNoExecute);
+    if (*ppSystemStart == NULL)
+    {
+        MmUnlockPages(pMdl);
+        IoFreeMdl(pMdl);
+        return NULL;
+    }
+
+    return pMdl;
+}
+
+/****************************Internal*Routine******************************\
+ * BltLockSource
+ *
+ *
+ * Other threads run in the system process, so a user-mode source has to be
+ * locked and mapped into system space before they can read it. Only the
+ * rows the rects touch are locked. *ppSystemBits is what pSrc->pBits becomes
+ * for the other thread, *ppMdl is NULL if the source was not in user mode.
+ * Returns FALSE if the source can not be locked, the caller then has to
+ * read it itself.
+ *
+\**************************************************************************/
+BOOLEAN BltLockSource(
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_ VOID** ppSystemBits,
+    _Out_ PMDL* ppMdl)
+{
+    *ppSystemBits = pSrc->pBits;
+    *ppMdl = NULL;
+
+    if ((ULONG_PTR)pSrc->pBits >= (ULONG_PTR)MM_USER_PROBE_ADDRESS)
+    {
+        return TRUE;
+    }
+
+    // A rotated source is rare enough (see CopyBitsGeneric) to not bother
+    // working out its rows, and the probe must not even be tried above APC_LEVEL
+    if ((pSrc->Rotation != D3DKMDT_VPPR_IDENTITY) || (KeGetCurrentIrql() > APC_LEVEL))
+    {
+        return FALSE;
+    }
+
+    RECT Bounds = { MAXLONG, MAXLONG, MINLONG, MINLONG };
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        RECT Clipped;
+        if (BltClipRect(pSrc, NULL, &pRects[iRect], &Clipped))
+        {
+            Bounds.left = (Clipped.left < Bounds.left) ? Clipped.left : Bounds.left;
+            Bounds.top = (Clipped.top < Bounds.top) ? Clipped.top : Bounds.top;
+            Bounds.right = (Clipped.right > Bounds.right) ? Clipped.right : Bounds.right;
+            Bounds.bottom = (Clipped.bottom > Bounds.bottom) ? Clipped.bottom : Bounds.bottom;
+        }
+    }
+    if (Bounds.top >= Bounds.bottom)
+    {
+        // Nothing will be read
+        return TRUE;
+    }
+
+    CONST BYTE* pStart = (CONST BYTE*)pSrc->pBits + (LONG_PTR)(Bounds.top + pSrc->Offset.y) * pSrc->Pitch;
+    SIZE_T Length = (SIZE_T)(Bounds.bottom - Bounds.top - 1) * pSrc->Pitch +
+                    (SIZE_T)(Bounds.right + pSrc->Offset.x) * (pSrc->BitsPerPel / BITS_PER_BYTE);
+    BYTE* pSystemStart;
+    *ppMdl = BltLockPages(pStart, Length, &pSystemStart);
+    if (*ppMdl == NULL)
+    {
+        return FALSE;
+    }
+
+    *ppSystemBits = pSystemStart - (pStart - (CONST BYTE*)pSrc->pBits);
+    return TRUE;
+}
+
+VOID BltUnlockSource(_In_opt_ PMDL pMdl)
+{
+    if (pMdl != NULL)
+    {
+        MmUnlockPages(pMdl);
+        IoFreeMdl(pMdl);
+    }
+}
+#endif
+
+// Bands to split a blt into, 0 if it is too small to be worth splitting
+static UINT BltParallelBands(
+    UINT  NumDsts,
+    _In_reads_(NumDsts) CONST BLT_INFO* pDsts,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    SIZE_T Bytes = 0;
+    LONG MaxRows = 0;
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        CONST RECT& rect = pRects[iRect];
+
+        LONG NumRows = rect.bottom - rect.top;
+        for (UINT iDst = 0; iDst < NumDsts; iDst++)
+        {
+            Bytes += (SIZE_T)(rect.right - rect.left) * NumRows * (pDsts[iDst].BitsPerPel / BITS_PER_BYTE);
+        }
+        MaxRows = (NumRows > MaxRows) ? NumRows : MaxRows;
+    }
+
+    UINT NumBands = BltParallelWorkers() + 1;
+    if ((UINT)(MaxRows / BLT_MIN_BAND_ROWS) < NumBands)
+    {
+        NumBands = (UINT)(MaxRows / BLT_MIN_BAND_ROWS);
+    }
+    if ((Bytes < g_BltParallelThreshold) || (NumBands < 2))
+    {
+        return 0;
+    }
+
+    return NumBands;
+}
+
+// Returns FALSE if the blt is too small to split or the pool can not take it
+static BOOLEAN BltBitsParallel(
+    UINT  NumDsts,
+    _In_reads_(NumDsts) BLT_INFO* pDsts,
+    _In_reads_(NumDsts) CONST BLT_INFO* pSrcs,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    NT_ASSERT(NumDsts <= BLT_MAX_CLONES);
+
+    UINT NumBands = BltParallelBands(NumDsts, pDsts, NumRects, pRects);
+    if (NumBands == 0)
+    {
+        return FALSE;
+    }
+
+    BLT_INFO Srcs[BLT_MAX_CLONES];
+    RtlCopyMemory(Srcs, pSrcs, NumDsts * sizeof(BLT_INFO));
+    BLT_BAND_JOB Job = { NumDsts, pDsts, Srcs, NumRects, pRects };
+
+#ifndef BLT_HOST_BUILD
+    // BltParallelRun would refuse above APC_LEVEL anyway, BltLockSource does not even try there
+    PMDL pMdl;
+    VOID* pSystemBits;
+    if (!BltLockSource(&pSrcs[0], NumRects, pRects, &pSystemBits, &pMdl))
+    {
+        return FALSE;
+    }
+    for (UINT iDst = 0; iDst < NumDsts; iDst++)
+    {
+        Srcs[iDst].pBits = pSystemBits;
+    }
+#endif
+
+    BOOLEAN Done = BltParallelRun(BltBand, &Job, NumBands);
+
+#ifndef BLT_HOST_BUILD
+    BltUnlockSource(pMdl);
+#endif
+
+    return Done;
+}
+
+// Logic to decide which of the above functions to call based on Rotation/BPP,
+// for rects that have been through BltClipRect. Big blts are split across
+// the worker pool, see bltpar.cxx.
+static VOID BltClippedRects(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    BOOLEAN Small = IsSmallBlt(pDst, pSrc, NumRects, pRects);
+
+    if (!Small &&
+        BltParallelWorkers() != 0 &&
+        BltBitsParallel(1, pDst, pSrc, NumRects, pRects))
+    {
+        return;
+    }
+
+    // pSrc->pBits might be coming from user-mode. User-mode addresses when accessed by kernel need to be protected by a __try/__except.
+    // This usage is redundant in the sample driver since it is already being used for MmProbeAndLockPages. However, it is very important
+    // to have this in place and to make sure developers don't miss it, it is in these two locations.
+    // The SIMD state is saved outside of the __try so it is restored even if the copy faults.
+    BLT_SIMD_CONTEXT SimdContext;
+    if (!Small)
+    {
+        BltSimdBegin(&SimdContext);
+    }
+
+    __try
+    {
+        if (Small)
+        {
+            CopyBitsSmall(pDst, pSrc, NumRects, pRects);
+        }
+        else
+        {
+            BltRects(pDst, pSrc, NumRects, pRects, &SimdContext);
+        }
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Either dst (0x%p) or src (0x%p) bits encountered exception during access.", pDst->pBits, pSrc->pBits);
+    }
+
+    if (!Small)
+    {
+        BltSimdEnd(&SimdContext);
+    }
+}
+
+// Rects clipped or sorted at a time, more than that are done in chunks
+#define BLT_BATCH_RECTS     64
+
+/****************************Internal*Routine******************************\
+ * BltBits
+ *
+ *
+ * Clips the rects, see BltClipRect, and copies what is left of them.
+ *
+\**************************************************************************/
+VOID BltBits(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    RECT Clipped[BLT_BATCH_RECTS];
+
+    while (NumRects != 0)
+    {
+        UINT NumClipped = 0;
+        UINT NumTaken = (NumRects < BLT_BATCH_RECTS) ? NumRects : BLT_BATCH_RECTS;
+
+        for (UINT iRect = 0; iRect < NumTaken; iRect++)
+        {
+            if (BltClipRect(pDst, pSrc, &pRects[iRect], &Clipped[NumClipped]))
+            {
+                NumClipped++;
+            }
+        }
+
+        if (NumClipped != 0)
+        {
+            BltClippedRects(pDst, pSrc, NumClipped, Clipped);
+        }
+
+        pRects += NumTaken;
+        NumRects -= NumTaken;
+    }
+}
+
+/****************************Internal*Routine******************************\
+ * BltBitsBatch
+ *
+ *
+ * BltBits for a whole present's worth of rects. The rects are clipped and
+ * empty ones dropped up front, then they are sorted by destination address
+ * so the framebuffer is walked in memory order, in chunks of up to
+ * BLT_BATCH_RECTS.
+ *
+\**************************************************************************/
+VOID BltBitsBatch(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    RECT Sorted[BLT_BATCH_RECTS];
+    ULONG_PTR Keys[BLT_BATCH_RECTS];
+
+    while (NumRects != 0)
+    {
+        UINT NumSorted = 0;
+        UINT NumTaken = (NumRects < BLT_BATCH_RECTS) ? NumRects : BLT_BATCH_RECTS;
+
+        for (UINT iRect = 0; iRect < NumTaken; iRect++)
+        {
+            RECT rect;
+            if (!BltClipRect(pDst, pSrc, &pRects[iRect], &rect))
+            {
+                continue;
+            }
+
+            // Insertion sort, presents rarely have more than a handful of rects
+            ULONG_PTR Key = (ULONG_PTR)GetRowStart(pDst, &rect);
+            UINT i = NumSorted++;
+            for (; (i > 0) && (Keys[i - 1] > Key); i--)
+            {
+                Keys[i] = Keys[i - 1];
+                Sorted[i] = Sorted[i - 1];
+            }
+            Keys[i] = Key;
+            Sorted[i] = rect;
+        }
+
+        if (NumSorted != 0)
+        {
+            BltClippedRects(pDst, pSrc, NumSorted, Sorted);
+        }
+
+        pRects += NumTaken;
+        NumRects -= NumTaken;
+    }
+}
+
+// BltClippedRects for clones
+static VOID BltCloneRects(
+    UINT  NumClones,
+    _In_reads_(NumClones) BLT_INFO* pDsts,
+    _In_reads_(NumClones) CONST BLT_INFO* pSrcs,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    if (BltParallelWorkers() != 0 &&
+        BltBitsParallel(NumClones, pDsts, pSrcs, NumRects, pRects))
+    {
+        return;
+    }
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    __try
+    {
+        for (UINT iRect = 0; iRect < NumRects; iRect++)
+        {
+            BltCloneRect(NumClones, pDsts, pSrcs, &pRects[iRect], &SimdContext);
+        }
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Either a clone (0x%p) or src (0x%p) bits encountered exception during access.", pDsts[0].pBits, pSrcs[0].pBits);
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+/****************************Internal*Routine******************************\
+ * BltBitsClone
+ *
+ *
+ * BltBits for a source that is cloned to several framebuffers. pSrcs has
+ * the source as each clone sees it, they differ only in the size a rotated
+ * clone gives it. Every band of the rects is read once and written to all
+ * of pDsts, see BltCloneRect.
+ *
+\**************************************************************************/
+VOID BltBitsClone(
+    UINT  NumClones,
+    _In_reads_(NumClones) BLT_INFO* pDsts,
+    _In_reads_(NumClones) CONST BLT_INFO* pSrcs,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects)
+{
+    NT_ASSERT(NumClones <= BLT_MAX_CLONES);
+
+    if (NumClones <= 1)
+    {
+        if (NumClones == 1)
+        {
+            BltBitsBatch(pDsts, pSrcs, NumRects, pRects);
+        }
+        return;
+    }
+
+    RECT Clipped[BLT_BATCH_RECTS];
+
+    while (NumRects != 0)
+    {
+        UINT NumClipped = 0;
+        UINT NumTaken = (NumRects < BLT_BATCH_RECTS) ? NumRects : BLT_BATCH_RECTS;
+
+        // Clipped to every clone, they normally all have the source's size anyway
+        for (UINT iRect = 0; iRect < NumTaken; iRect++)
+        {
+            BOOLEAN Visible = BltClipRect(&pDsts[0], &pSrcs[0], &pRects[iRect], &Clipped[NumClipped]);
+            for (UINT iClone = 1; Visible && (iClone < NumClones); iClone++)
+            {
+                Visible = BltClipRect(&pDsts[iClone], &pSrcs[iClone], &Clipped[NumClipped], &Clipped[NumClipped]);
+            }
+            if (Visible)
+            {
+                NumClipped++;
+            }
+        }
+
+        if (NumClipped != 0)
+        {
+            BltCloneRects(NumClones, pDsts, pSrcs, NumClipped, Clipped);
+        }
+
+        pRects += NumTaken;
+        NumRects -= NumTaken;
+    }
+}
+
+//
+// Compare before write
+//
+
+// The blts CopyChangedRow32 can do: same 32bpp layout on both sides and
+// nothing done to the pixels on the way
+static FORCEINLINE BOOLEAN BltCanCompare(CONST BLT_INFO* pDst, CONST BLT_INFO* pSrc)
+{
+    return (BltKernelFormat(pDst) == D3DDDIFMT_X8R8G8B8) && (BltKernelFormat(pSrc) == D3DDDIFMT_X8R8G8B8) &&
+           (pDst->Rotation == D3DKMDT_VPPR_IDENTITY) && (pSrc->Rotation == D3DKMDT_VPPR_IDENTITY) &&
+           (pDst->pColorLut == NULL) && (pDst->pSwizzle == NULL);
+}
+
+// CopyBits32_32 through CopyChangedRow32 for one clipped rect. Returns the
+// bounding box of the pixels that changed, or { MAXLONG, MAXLONG, MINLONG,
+// MINLONG } if none did.
+static RECT CopyRectChanged(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    CONST RECT* pRect,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    PFN_BLT_COPY_CHANGED_ROW32 pfnCopyChangedRow = pSimd->pDispatch->CopyChangedRow32;
+    RECT Changed = { MAXLONG, MAXLONG, MINLONG, MINLONG };
+
+    UINT NumPixels = pRect->right - pRect->left;
+    BYTE* pDstRow = GetRowStart(pDst, pRect);
+    CONST BYTE* pSrcRow = GetRowStart(pSrc, pRect);
+    for (LONG y = pRect->top; y < pRect->bottom; y++)
+    {
+        UINT First;
+        UINT End;
+        if (pfnCopyChangedRow(pDstRow, pSrcRow, NumPixels, &First, &End))
+        {
+            LONG Left = pRect->left + (LONG)First;
+            LONG Right = pRect->left + (LONG)End;
+            Changed.left = (Left < Changed.left) ? Left : Changed.left;
+            Changed.right = (Right > Changed.right) ? Right : Changed.right;
+            Changed.top = (y < Changed.top) ? y : Changed.top;
+            Changed.bottom = y + 1;
+        }
+        pDstRow += pDst->Pitch;
+        pSrcRow += pSrc->Pitch;
+    }
+
+    return Changed;
+}
+
+// CopyRectChanged for clipped rects on the calling thread, pChanged gets
+// each rect's bounding box, empty where nothing changed
+static VOID CopyBitsChanged(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pChanged,
+    CONST BLT_SIMD_CONTEXT* pSimd)
+{
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        pChanged[iRect] = CopyRectChanged(pDst, pSrc, &pRects[iRect], pSimd);
+        if (pChanged[iRect].top == MAXLONG)
+        {
+            RtlZeroMemory(&pChanged[iRect], sizeof(RECT));
+        }
+    }
+}
+
+//
+// Compared copies are split across the worker pool the same way as
+// BltBitsParallel. Every band finds the bounding box of what changed in its
+// part of each rect and merges it into the rect's box, see
+// BltMergeChangedRect.
+//
+
+typedef struct _BLT_CHANGED_JOB
+{
+    BLT_INFO*       pDst;
+    CONST BLT_INFO* pSrc;
+    UINT            NumRects;
+    CONST RECT*     pRects;
+    RECT*           pChanged;   // Starts as { MAXLONG, MAXLONG, MINLONG, MINLONG }
+} BLT_CHANGED_JOB;
+
+static FORCEINLINE VOID BltInterlockedMin(LONG volatile* pTarget, LONG Value)
+{
+    LONG Current = *pTarget;
+    while (Value < Current)
+    {
+        LONG Previous = InterlockedCompareExchange(pTarget, Value, Current);
+        if (Previous == Current)
+        {
+            break;
+        }
+        Current = Previous;
+    }
+}
+
+static FORCEINLINE VOID BltInterlockedMax(LONG volatile* pTarget, LONG Value)
+{
+    LONG Current = *pTarget;
+    while (Value > Current)
+    {
+        LONG Previous = InterlockedCompareExchange(pTarget, Value, Current);
+        if (Previous == Current)
+        {
+            break;
+        }
+        Current = Previous;
+    }
+}
+
+// Bands finish in any order, so each side of the box is merged on its own
+static VOID BltMergeChangedRect(RECT* pChanged, CONST RECT* pRect)
+{
+    if (pRect->top < pRect->bottom)
+    {
+        BltInterlockedMin((LONG volatile*)&pChanged->left, pRect->left);
+        BltInterlockedMin((LONG volatile*)&pChanged->top, pRect->top);
+        BltInterlockedMax((LONG volatile*)&pChanged->right, pRect->right);
+        BltInterlockedMax((LONG volatile*)&pChanged->bottom, pRect->bottom);
+    }
+}
+
+static VOID BltChangedBand(VOID* pContext, UINT Band, UINT NumBands)
+{
+    BLT_CHANGED_JOB* pJob = (BLT_CHANGED_JOB*)pContext;
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    UINT iRect = 0;
+    __try
+    {
+        for (; iRect < pJob->NumRects; iRect++)
+        {
+            RECT BandRect;
+            if (BltBandRect(&pJob->pRects[iRect], Band, NumBands, &BandRect))
+            {
+                RECT Changed = CopyRectChanged(pJob->pDst, pJob->pSrc, &BandRect, &SimdContext);
+                BltMergeChangedRect(&pJob->pChanged[iRect], &Changed);
+            }
+        }
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "The source is locked down by BltChangedParallel, this only guards against a bad destination");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Band %u of %u, either dst (0x%p) or src (0x%p) bits encountered exception during access.",
+                      Band, NumBands, pJob->pDst->pBits, pJob->pSrc->pBits);
+
+        // Part of the band of the rect that faulted might have been written
+        RECT BandRect;
+        if ((iRect < pJob->NumRects) && BltBandRect(&pJob->pRects[iRect], Band, NumBands, &BandRect))
+        {
+            BltMergeChangedRect(&pJob->pChanged[iRect], &BandRect);
+        }
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+// CopyBitsChanged across the worker pool. Returns FALSE without copying
+// anything if the blt is too small to split or the pool can not take it.
+static BOOLEAN BltChangedParallel(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pChanged)
+{
+    UINT NumBands = BltParallelBands(1, pDst, NumRects, pRects);
+    if (NumBands == 0)
+    {
+        return FALSE;
+    }
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        pChanged[iRect].left = MAXLONG;
+        pChanged[iRect].top = MAXLONG;
+        pChanged[iRect].right = MINLONG;
+        pChanged[iRect].bottom = MINLONG;
+    }
+
+    BLT_INFO Src = *pSrc;
+    BLT_CHANGED_JOB Job = { pDst, &Src, NumRects, pRects, pChanged };
+
+#ifndef BLT_HOST_BUILD
+    PMDL pMdl;
+    if (!BltLockSource(pSrc, NumRects, pRects, &Src.pBits, &pMdl))
+    {
+        return FALSE;
+    }
+#endif
+
+    BOOLEAN Done = BltParallelRun(BltChangedBand, &Job, NumBands);
+
+#ifndef BLT_HOST_BUILD
+    BltUnlockSource(pMdl);
+#endif
+
+    if (Done)
+    {
+        for (UINT iRect = 0; iRect < NumRects; iRect++)
+        {
+            if (pChanged[iRect].top == MAXLONG)
+            {
+                RtlZeroMemory(&pChanged[iRect], sizeof(RECT));
+            }
+        }
+    }
+
+    return Done;
+}
+
+/****************************Internal*Routine******************************\
+ * BltBitsChanged
+ *
+ *
+ * BltBits that only writes what changes. A 32bpp blt without rotation,
+ * color lookup or swizzle compares every row with the framebuffer and only
+ * stores the cache lines that differ, pChanged gets the bounding box of the
+ * pixels that really changed for each of pRects. Big compared blts are
+ * split across the worker pool like BltBits. Other blts, and ones small
+ * enough for CopyBitsSmall where comparing would cost more than it saves,
+ * are copied the way BltBits does and each rect is reported as changed
+ * where it was clipped to. A rect that is clipped away or did not change
+ * gets an empty rect.
+ *
+\**************************************************************************/
+VOID BltBitsChanged(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pChanged)
+{
+    BOOLEAN Compare = BltCanCompare(pDst, pSrc);
+
+    RECT Clipped[BLT_BATCH_RECTS];
+    RECT ClippedChanged[BLT_BATCH_RECTS];
+    UINT Index[BLT_BATCH_RECTS];
+
+    while (NumRects != 0)
+    {
+        UINT NumClipped = 0;
+        UINT NumTaken = (NumRects < BLT_BATCH_RECTS) ? NumRects : BLT_BATCH_RECTS;
+
+        for (UINT iRect = 0; iRect < NumTaken; iRect++)
+        {
+            RtlZeroMemory(&pChanged[iRect], sizeof(RECT));
+            if (BltClipRect(pDst, pSrc, &pRects[iRect], &Clipped[NumClipped]))
+            {
+                Index[NumClipped++] = iRect;
+            }
+        }
+
+        if ((NumClipped != 0) && (!Compare || IsSmallBlt(pDst, pSrc, NumClipped, Clipped)))
+        {
+            BltClippedRects(pDst, pSrc, NumClipped, Clipped);
+            for (UINT i = 0; i < NumClipped; i++)
+            {
+                pChanged[Index[i]] = Clipped[i];
+            }
+        }
+        else if ((NumClipped != 0) &&
+                 (BltParallelWorkers() != 0) &&
+                 BltChangedParallel(pDst, pSrc, NumClipped, Clipped, ClippedChanged))
+        {
+            for (UINT i = 0; i < NumClipped; i++)
+            {
+                pChanged[Index[i]] = ClippedChanged[i];
+            }
+        }
+        else if (NumClipped != 0)
+        {
+            // The source might be coming from user-mode, see BltClippedRects
+            BLT_SIMD_CONTEXT SimdContext;
+            BltSimdBegin(&SimdContext);
+
+            __try
+            {
+                CopyBitsChanged(pDst, pSrc, NumClipped, Clipped, ClippedChanged, &SimdContext);
+                for (UINT i = 0; i < NumClipped; i++)
+                {
+                    pChanged[Index[i]] = ClippedChanged[i];
+                }
+            }
+            #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+            __except(EXCEPTION_EXECUTE_HANDLER)
+            {
+                BDD_LOG_ERROR("Either dst (0x%p) or src (0x%p) bits encountered exception during access.", pDst->pBits, pSrc->pBits);
+
+                // Part of it might have been written
+                for (UINT i = 0; i < NumClipped; i++)
+                {
+                    pChanged[Index[i]] = Clipped[i];
+                }
+            }
+
+            BltSimdEnd(&SimdContext);
+        }
+
+        pRects += NumTaken;
+        pChanged += NumTaken;
+        NumRects -= NumTaken;
+    }
+}
+
+//
+// Moves
+//
+// A move is a scroll of what is already on the screen, so it is done inside
+// the framebuffer instead of being copied again from the present's source.
+// Both rects are worked out in framebuffer (unrotated) coordinates, where
+// the move is a plain copy between two same-size rects.
+//
+
+// Framebuffer position of desktop pixel (x, y), for any rotation
+static VOID GetPhysicalPoint(CONST BLT_INFO* pBltInfo, LONG x, LONG y, POINT* pPhysical)
+{
+    RECT Pixel = { x, y, x + 1, y + 1 };
+    LONG_PTR Offset = GetRowStart(pBltInfo, &Pixel) - (BYTE*)pBltInfo->pBits;
+    pPhysical->y = (LONG)(Offset / (LONG_PTR)pBltInfo->Pitch);
+    pPhysical->x = (LONG)((Offset % (LONG_PTR)pBltInfo->Pitch) / (pBltInfo->BitsPerPel / BITS_PER_BYTE));
+}
+
+static VOID GetPhysicalRect(CONST BLT_INFO* pBltInfo, CONST RECT* pRect, RECT* pPhysical)
+{
+    POINT First;
+    POINT Last;
+    GetPhysicalPoint(pBltInfo, pRect->left, pRect->top, &First);
+    GetPhysicalPoint(pBltInfo, pRect->right - 1, pRect->bottom - 1, &Last);
+
+    pPhysical->left = (First.x < Last.x) ? First.x : Last.x;
+    pPhysical->top = (First.y < Last.y) ? First.y : Last.y;
+    pPhysical->right = ((First.x > Last.x) ? First.x : Last.x) + 1;
+    pPhysical->bottom = ((First.y > Last.y) ? First.y : Last.y) + 1;
+}
+
+/****************************Internal*Routine******************************\
+ * BltMoveBits
+ *
+ *
+ * Does the moves of a present inside the framebuffer, in order. Each move
+ * copies the DestRect sized rect at SourcePoint to DestRect. Rows are copied
+ * top down or bottom up so an overlapping source is read before it is
+ * overwritten, and a move within the same rows is done with memmove.
+ *
+\**************************************************************************/
+VOID BltMoveBits(
+    BLT_INFO* pFb,
+    UINT  NumMoves,
+    _In_reads_(NumMoves) CONST D3DKMT_MOVE_RECT *pMoves)
+{
+    CONST LONG BytesPerPixel = pFb->BitsPerPel / BITS_PER_BYTE;
+    CONST LONG Pitch = (LONG)pFb->Pitch;
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    for (UINT iMove = 0; iMove < NumMoves; iMove++)
+    {
+        // Both ends of the move are clipped to the framebuffer and kept the same size
+        RECT Whole;
+        RECT DstRect;
+        copy_rect(&Whole, &pMoves[iMove].DestRect);
+        if (!BltClipRect(pFb, NULL, &Whole, &DstRect))
+        {
+            continue;
+        }
+
+        RECT Moved;
+        RECT SrcRect;
+        Moved.left = pMoves[iMove].SourcePoint.x + (DstRect.left - Whole.left);
+        Moved.top = pMoves[iMove].SourcePoint.y + (DstRect.top - Whole.top);
+        Moved.right = Moved.left + (DstRect.right - DstRect.left);
+        Moved.bottom = Moved.top + (DstRect.bottom - DstRect.top);
+        if (!BltClipRect(pFb, NULL, &Moved, &SrcRect))
+        {
+            continue;
+        }
+        DstRect.left += SrcRect.left - Moved.left;
+        DstRect.top += SrcRect.top - Moved.top;
+        DstRect.right -= Moved.right - SrcRect.right;
+        DstRect.bottom -= Moved.bottom - SrcRect.bottom;
+
+        RECT PhysDst;
+        RECT PhysSrc;
+        GetPhysicalRect(pFb, &DstRect, &PhysDst);
+        GetPhysicalRect(pFb, &SrcRect, &PhysSrc);
+
+        SIZE_T RowBytes = (SIZE_T)(PhysDst.right - PhysDst.left) * BytesPerPixel;
+        UINT NumRows = PhysDst.bottom - PhysDst.top;
+        BYTE* pDstRow = (BYTE*)pFb->pBits + (LONG_PTR)PhysDst.top * Pitch + (LONG_PTR)PhysDst.left * BytesPerPixel;
+        CONST BYTE* pSrcRow = (BYTE*)pFb->pBits + (LONG_PTR)PhysSrc.top * Pitch + (LONG_PTR)PhysSrc.left * BytesPerPixel;
+
+        if (PhysDst.top == PhysSrc.top)
+        {
+            // Horizontal scroll, source and destination rows may overlap
+            for (UINT y = 0; y < NumRows; y++)
+            {
+                RtlMoveMemory(pDstRow, pSrcRow, RowBytes);
+                pDstRow += Pitch;
+                pSrcRow += Pitch;
+            }
+            continue;
+        }
+
+        // Different rows never overlap, only the order the rows are done in matters
+        LONG RowStep = Pitch;
+        if (PhysDst.top > PhysSrc.top)
+        {
+            pDstRow += (LONG_PTR)(NumRows - 1) * Pitch;
+            pSrcRow += (LONG_PTR)(NumRows - 1) * Pitch;
+            RowStep = -Pitch;
+        }
+
+        PFN_BLT_COPY_ROW pfnCopyRow = SimdContext.pDispatch->CopyRow;
+        for (UINT y = 0; y < NumRows; y++)
+        {
+            pfnCopyRow(pDstRow, pSrcRow, RowBytes);
+            pDstRow += RowStep;
+            pSrcRow += RowStep;
+        }
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+/****************************Internal*Routine******************************\
+ * BltSwizzleBits
+ *
+ *
+ * Applies pSwizzle in place to every pixel of a 32bpp framebuffer. A swizzle
+ * undoes itself, so this both takes the framebuffer back to B G R A from
+ * the channel order it was written in and takes it to a new one.
+ *
+\**************************************************************************/
+VOID BltSwizzleBits(
+    BLT_INFO* pFb,
+    CONST BLT_SWIZZLE* pSwizzle)
+{
+    NT_ASSERT(pFb->BitsPerPel == 32);
+
+    RECT Rect = { 0, 0, (LONG)pFb->Width, (LONG)pFb->Height };
+    RECT Physical;
+    if ((Rect.right == 0) || (Rect.bottom == 0))
+    {
+        return;
+    }
+    GetPhysicalRect(pFb, &Rect, &Physical);
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    UINT NumPixels = Physical.right - Physical.left;
+    BYTE* pRow = (BYTE*)pFb->pBits + (LONG_PTR)Physical.top * pFb->Pitch + (LONG_PTR)Physical.left * 4;
+    for (LONG y = Physical.top; y < Physical.bottom; y++)
+    {
+        SimdContext.pDispatch->SwizzleRow32(pRow, pRow, NumPixels, pSwizzle);
+        pRow += pFb->Pitch;
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+// Image pixels looked up at a time, a pointer shape row is at most this long
+#define BLT_BLEND_CHUNK     64
+
+// Looks up Count premultiplied A8R8G8B8 pixels in place. The lookup is of
+// colors, so each pixel is taken back to its straight color, looked up and
+// multiplied by its alpha again. A translucent pixel then adds alpha times
+// the looked up color to the framebuffer, which already holds looked up
+// colors.
+static VOID BltColorLutPremultiplied(
+    CONST BLT_SIMD_DISPATCH* pDispatch,
+    _Inout_updates_(Count) BYTE* pPixels,
+    UINT Count,
+    CONST BLT_COLOR_LUT* pLut)
+{
+    for (UINT i = 0; i < Count; i++)
+    {
+        BYTE* pPixel = &pPixels[i * 4];
+        UINT Alpha = pPixel[3];
+        if ((Alpha == 0) || (Alpha == 0xFF))
+        {
+            continue;
+        }
+        for (UINT c = 0; c < 3; c++)
+        {
+            UINT Straight = (pPixel[c] * 0xFF + Alpha / 2) / Alpha;
+            pPixel[c] = (BYTE)((Straight < 0xFF) ? Straight : 0xFF);
+        }
+    }
+
+    pDispatch->ColorLutRow32(pPixels, pPixels, Count, pLut);
+
+    for (UINT i = 0; i < Count; i++)
+    {
+        BYTE* pPixel = &pPixels[i * 4];
+        UINT Alpha = pPixel[3];
+        if (Alpha == 0xFF)
+        {
+            continue;
+        }
+        for (UINT c = 0; c < 3; c++)
+        {
+            pPixel[c] = (BYTE)((pPixel[c] * Alpha + 0x7F) / 0xFF);
+        }
+    }
+}
+
+/****************************Internal*Routine******************************\
+ * BltBlendBits
+ *
+ *
+ * Blends the premultiplied A8R8G8B8 image pImage over a 32bpp framebuffer
+ * within pRect, which is clipped to both. The image goes through the
+ * framebuffer's color lookup like anything else blted there, by its
+ * straight colors, see BltColorLutPremultiplied. A framebuffer in another
+ * channel order is taken to B G R A and back around the blend, a swizzle
+ * undoes itself and the rows of a pointer shape are short.
+ *
+\**************************************************************************/
+VOID BltBlendBits(
+    BLT_INFO* pFb,
+    CONST BLT_INFO* pImage,
+    CONST RECT* pRect)
+{
+    NT_ASSERT((BltKernelFormat(pFb) == D3DDDIFMT_X8R8G8B8) && (pFb->Rotation == D3DKMDT_VPPR_IDENTITY));
+    NT_ASSERT((pImage->BitsPerPel == 32) && (pImage->Rotation == D3DKMDT_VPPR_IDENTITY));
+
+    RECT Clipped;
+    if (!BltClipRect(pFb, pImage, pRect, &Clipped))
+    {
+        return;
+    }
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+    CONST BLT_SIMD_DISPATCH* pDispatch = SimdContext.pDispatch;
+
+    // The image rows go through the lookup a chunk at a time
+    UINT32 Lut[BLT_BLEND_CHUNK];
+
+    UINT NumPixels = Clipped.right - Clipped.left;
+    BYTE* pFbRow = GetRowStart(pFb, &Clipped);
+    CONST BYTE* pImageRow = GetRowStart(pImage, &Clipped);
+    for (LONG y = Clipped.top; y < Clipped.bottom; y++)
+    {
+        for (UINT x = 0; x < NumPixels; x += BLT_BLEND_CHUNK)
+        {
+            UINT Count = ((NumPixels - x) < BLT_BLEND_CHUNK) ? (NumPixels - x) : BLT_BLEND_CHUNK;
+            BYTE* pFbPixel = pFbRow + x * 4;
+            CONST BYTE* pImagePixel = pImageRow + x * 4;
+
+            if (pFb->pColorLut != NULL)
+            {
+                RtlCopyMemory(Lut, pImagePixel, Count * 4);
+                BltColorLutPremultiplied(pDispatch, (BYTE*)Lut, Count, pFb->pColorLut);
+                pImagePixel = (CONST BYTE*)Lut;
+            }
+            if (pFb->pSwizzle != NULL)
+            {
+                pDispatch->SwizzleRow32(pFbPixel, pFbPixel, Count, pFb->pSwizzle);
+            }
+            pDispatch->BlendRow32(pFbPixel, pImagePixel, Count);
+            if (pFb->pSwizzle != NULL)
+            {
+                pDispatch->SwizzleRow32(pFbPixel, pFbPixel, Count, pFb->pSwizzle);
+            }
+        }
+        pFbRow += pFb->Pitch;
+        pImageRow += pImage->Pitch;
+    }
+
+    BltSimdEnd(&SimdContext);
 }
 
 // END: Non-Paged Code
@@ -0,0 +1,144 @@
+/******************************Module*Header*******************************\
+* Module Name: bltfuncs.hxx
+*
+* The surfaces the blts work on and the blt functions. Part of BDD.hxx in
+* the driver, and pulled in by bltport.hxx with BLT_HOST_BUILD, so every
+* blt module builds as a normal program on top of bltport.hxx alone.
+*
+* Only types the WDK and bltport.hxx both have are used here.
+*
+\**************************************************************************/
+
+#ifndef _BLTFUNCS_HXX_
+#define _BLTFUNCS_HXX_
+
+#define BITS_PER_BYTE                  8
+
+// Framebuffers BltBitsClone copies one source to at most
+#define BLT_MAX_CLONES                 6
+
+typedef struct _BLT_INFO
+{
+    PVOID pBits;
+    UINT Pitch;
+    UINT BitsPerPel;
+    D3DDDIFORMAT Format; // Layout of the BitsPerPel pixels, formats of the same bpp differ
+    POINT Offset; // To unrotated top-left of dirty rects
+    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation;
+    UINT Width; // For the unrotated image
+    UINT Height; // For the unrotated image
+    CONST struct _BLT_COLOR_LUT* pColorLut; // Applied to everything blted to this surface, NULL for none
+    BOOLEAN Dither; // Ordered dither for conversions to R5G6B5 and P8, ignored otherwise
+    CONST struct _BLT_SWIZZLE* pSwizzle; // Channel order of everything blted to this surface, NULL for B G R A
+} BLT_INFO;
+
+// A set of pixels as y-x banded rects, see bltregion.hxx
+typedef struct _BLT_REGION
+{
+    RECT Extents; // Bounding box, all zero for an empty region
+    struct _BLT_REGION_DATA* pData; // The rects from the region arena, NULL if Extents is the only one
+} BLT_REGION;
+
+// Hashes of the tiles presents put in a framebuffer, see blttile.hxx
+typedef struct _BLT_TILE_MAP
+{
+    UINT    TileSize;
+    UINT    Columns;
+    UINT    Rows;
+    UINT    Width;      // Of the framebuffer the hashes are of
+    UINT    Height;
+    PVOID   pFbBits;    // A framebuffer that moved or changed its pitch has none of the tiles
+    UINT    FbPitch;
+    UINT64* pHashes;    // Columns * Rows row by row, 0 for a forgotten tile
+} BLT_TILE_MAP;
+
+//
+// Blt functions
+//
+
+// Must be Non-Paged
+VOID BltBits(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects);
+
+// Must be Non-Paged. Normalizes pRect and clips it to pDst and, unless it is
+// NULL, pSrc. Returns FALSE if nothing is left. The blts clip every rect
+// they are given with this.
+BOOLEAN BltClipRect(
+    CONST BLT_INFO* pDst,
+    _In_opt_ CONST BLT_INFO* pSrc,
+    CONST RECT* pRect,
+    _Out_ RECT* pClipped);
+
+// Must be Non-Paged. Sorts the rects into memory order first, use for
+// anything with more than one rect.
+VOID BltBitsBatch(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects);
+
+// Must be Non-Paged. BltBits to every framebuffer a source is cloned to,
+// the source is read once for all of them. pSrcs has the source as each of
+// pDsts sees it.
+VOID BltBitsClone(
+    UINT  NumClones,
+    _In_reads_(NumClones) BLT_INFO* pDsts,
+    _In_reads_(NumClones) CONST BLT_INFO* pSrcs,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects);
+
+// Must be Non-Paged. BltBits that only stores the cache lines of pDst that
+// change, pChanged gets the bounding box of what changed for each rect.
+VOID BltBitsChanged(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pChanged);
+
+// Must be Non-Paged. Does the moves of a present within the framebuffer.
+VOID BltMoveBits(
+    BLT_INFO* pFb,
+    UINT  NumMoves,
+    _In_reads_(NumMoves) CONST D3DKMT_MOVE_RECT *pMoves);
+
+// Must be Non-Paged. Scales rects of pSrc to the size of pDst, see bltstretch.cxx.
+VOID BltStretchBits(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pDstRects);
+
+#ifndef BLT_HOST_BUILD
+// Locks the rows of a user-mode source the rects read so another thread can
+// read them, *ppSystemBits replaces pSrc->pBits there. Returns FALSE if the
+// source can not be locked. Only valid at IRQL <= APC_LEVEL.
+BOOLEAN BltLockSource(
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_ VOID** ppSystemBits,
+    _Out_ PMDL* ppMdl);
+
+VOID BltUnlockSource(_In_opt_ PMDL pMdl);
+#endif
+
+// Must be Non-Paged. Reorders the channels of the whole framebuffer in place.
+VOID BltSwizzleBits(
+    BLT_INFO* pFb,
+    CONST struct _BLT_SWIZZLE* pSwizzle);
+
+// Must be Non-Paged. Blends a premultiplied A8R8G8B8 image over a 32bpp framebuffer.
+VOID BltBlendBits(
+    BLT_INFO* pFb,
+    CONST BLT_INFO* pImage,
+    CONST RECT* pRect);
+
+// Must be Non-Paged. Copies pSrcRect with left <= right and top <= bottom.
+void copy_rect(RECT *pRect, CONST RECT * pSrcRect);
+
+#endif // _BLTFUNCS_HXX_
@@ -9,59 +9,248 @@
 \**************************************************************************/
 
 #include "BDD.hxx"
+#include "bltengine.hxx"
+#include "bltcoalesce.hxx"
+#include "bltregion.hxx"
+#include "blttile.hxx"
 
-typedef struct
-{
-    CONST DXGKRNL_INTERFACE*        DxgkInterface;
-    DXGKARGCB_NOTIFY_INTERRUPT_DATA NotifyInterrupt;
-} SYNC_NOTIFY_INTERRUPT;
+// Commands that give back a framebuffer rect for each rect get this many rects at a time
+#define PRESENT_CHUNK_RECTS     16
 
 #pragma code_seg("PAGE")
 
 
-struct DoPresentMemory
-{
-    PVOID                     DstAddr;
-    UINT                      DstStride;
-    ULONG                     DstBitPerPixel;
-    UINT                      SrcWidth;
-    UINT                      SrcHeight;
-    BYTE*                     SrcAddr;
-    LONG                      SrcPitch;
-    ULONG                     NumMoves;             // in:  Number of screen to screen moves
-    D3DKMT_MOVE_RECT*         Moves;               // in:  Point to the list of moves
-    ULONG                     NumDirtyRects;        // in:  Number of direct rects
-    RECT*                     DirtyRect;           // in:  Point to the list of dirty rects
-    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation;
-    BOOLEAN                   SynchExecution;
-    D3DDDI_VIDEO_PRESENT_SOURCE_ID  SourceID;
-    HANDLE                    hAdapter;
-    PMDL                      Mdl;
-    BDD_HWBLT*                DisplaySource;
-};
-
-
 BDD_HWBLT::BDD_HWBLT():m_BDD (NULL),
-                m_SynchExecution(TRUE),
-                m_hPresentWorkerThread(NULL),
-                m_pPresentWorkerThread(NULL)
+                       m_pCursorImage (NULL),
+                       m_CursorWidth (0),
+                       m_CursorHeight (0),
+                       m_CursorVisible (FALSE),
+                       m_CursorDrawn (FALSE),
+                       m_pCursorUnder (NULL)
 {
     PAGED_CODE();
+
+    m_CursorPos.x = 0;
+    m_CursorPos.y = 0;
+    BltRegionInit(&m_Damage);
+    BltTileMapInit(&m_TileMap);
 }
 
 
 BDD_HWBLT::~BDD_HWBLT()
+{
+    PAGED_CODE();
+
+    if (m_pCursorUnder != NULL)
+    {
+        ExFreePoolWithTag(m_pCursorUnder, BDDTAG);
+    }
+    BltRegionFini(&m_Damage);
+    BltTileMapFree(&m_TileMap);
+}
+
+BOOLEAN
+BDD_HWBLT::GetPresentBltInfo(
+    _In_ BYTE*  DstAddr,
+    _In_ UINT   DstBitPerPixel,
+    _In_ BYTE*  SrcAddr,
+    _In_ UINT   SrcBytesPerPixel,
+    _In_ LONG   SrcPitch,
+    _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation,
+    _Out_ BLT_INFO* pDstBltInfo,
+    _Out_ BLT_INFO* pSrcBltInfo)
+{
+    PAGED_CODE();
+    const CURRENT_BDD_MODE* pModeCur = m_BDD->GetCurrentMode(m_SourceId);
+
+    // A stretched path has a framebuffer the size of the target mode
+    BOOLEAN Stretched = (pModeCur->Scaling == D3DKMDT_VPPS_STRETCHED) &&
+                        ((pModeCur->DispInfo.Width != pModeCur->SrcModeWidth) ||
+                         (pModeCur->DispInfo.Height != pModeCur->SrcModeHeight));
+
+    // Set up destination blt info
+    pDstBltInfo->pBits = DstAddr;
+    pDstBltInfo->Pitch = pModeCur->DispInfo.Pitch;
+    pDstBltInfo->BitsPerPel = DstBitPerPixel;
+    pDstBltInfo->Format = pModeCur->DispInfo.ColorFormat;
+    pDstBltInfo->Offset.x = 0;
+    pDstBltInfo->Offset.y = 0;
+    pDstBltInfo->Rotation = Rotation;
+    pDstBltInfo->Width = Stretched ? pModeCur->DispInfo.Width : pModeCur->SrcModeWidth;
+    pDstBltInfo->Height = Stretched ? pModeCur->DispInfo.Height : pModeCur->SrcModeHeight;
+    pDstBltInfo->pColorLut = pModeCur->pColorLut;
+    pDstBltInfo->Dither = (BOOLEAN)pModeCur->Flags.Dither;
+    pDstBltInfo->pSwizzle = pModeCur->pSwizzle;
+
+    // Set up source blt info
+    pSrcBltInfo->pBits = SrcAddr;
+    pSrcBltInfo->Pitch = SrcPitch;
+    pSrcBltInfo->BitsPerPel = SrcBytesPerPixel * BITS_PER_BYTE;
+    pSrcBltInfo->Format = pModeCur->SrcModeFormat;
+    pSrcBltInfo->Offset.x = 0;
+    pSrcBltInfo->Offset.y = 0;
+    pSrcBltInfo->Rotation = D3DKMDT_VPPR_IDENTITY;
+    if (Rotation == D3DKMDT_VPPR_ROTATE90 ||
+        Rotation == D3DKMDT_VPPR_ROTATE270)
+    {
+        pSrcBltInfo->Width = pModeCur->SrcModeHeight;
+        pSrcBltInfo->Height = pModeCur->SrcModeWidth;
+    }
+    else {
+        pSrcBltInfo->Width = pModeCur->SrcModeWidth;
+        pSrcBltInfo->Height = pModeCur->SrcModeHeight;
+    }
+    pSrcBltInfo->pColorLut = NULL;
+    pSrcBltInfo->Dither = FALSE;
+    pSrcBltInfo->pSwizzle = NULL;
+
+    return Stretched;
+}
+
+BLT_ENGINE*
+BDD_HWBLT::LockPresentSource(
+    _In_ UINT              NumSrcs,
+    _Inout_updates_(NumSrcs) BLT_INFO* pSrcs,
+    _In_ UINT              NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects,
+    _Out_ PMDL*            ppMdl)
+/*++
+
+  Routine Description:
+
+    The method picks the engine a present's commands are submitted to. The
+    offload engine's thread can only read a user-mode source once the rows
+    the rects read are locked; if that fails the commands are run on the
+    presenting thread instead.
+
+  Arguments:
+
+    NumSrcs - number of targets the source is presented to
+    pSrcs - the source as each target sees it, remapped for the engine
+    NumRects - number of rectangles read from the source
+    pRects - rectangles' data
+    ppMdl - gets what BltUnlockSource has to unlock once the present is done
+
+  Return Value:
+
+    The engine, or NULL if the commands are to be run on the presenting thread
+
+--*/
+{
+    PAGED_CODE();
+
+    *ppMdl = NULL;
+
+    BLT_ENGINE* pEngine = m_BDD->GetBltEngine();
+    if ((pEngine == NULL) || pEngine->IsInline())
+    {
+        return pEngine;
+    }
+
+    VOID* pSystemBits;
+    if (!BltLockSource(&pSrcs[0], NumRects, pRects, &pSystemBits, ppMdl))
+    {
+        BDD_LOG_WARNING("XENWDDM!%s can not lock source 0x%p, presenting to %u on the calling thread\n",
+                        __FUNCTION__, pSrcs[0].pBits, m_SourceId);
+        return NULL;
+    }
+
+    for (UINT i = 0; i < NumSrcs; i++)
+    {
+        pSrcs[i].pBits = pSystemBits;
+    }
+    return pEngine;
+}
+
+UINT64
+BDD_HWBLT::RunPresentCommand(
+    _In_opt_ BLT_ENGINE*   pEngine,
+    _In_ CONST BLT_COMMAND* pCommand)
+{
+    PAGED_CODE();
+
+    if (pEngine == NULL)
+    {
+        BltRunCommand(pCommand);
+        return 0;
+    }
+    return pEngine->Submit(pCommand);
+}
+
+VOID
+BDD_HWBLT::RunPresentChunks(
+    _In_opt_ BLT_ENGINE*   pEngine,
+    _In_ CONST BLT_COMMAND* pCommand,
+    _In_ ULONG             NumMoves,
+    _In_reads_opt_(NumMoves) CONST D3DKMT_MOVE_RECT* Moves,
+    _In_ ULONG             NumDirtyRects,
+    _In_reads_(NumDirtyRects) CONST RECT* DirtyRect)
 /*++
 
   Routine Description:
 
-    This routine waits on present worker thread to exit before
-    destroying the object
+    The method runs a command that gives back a framebuffer rect for each
+    of its rects on the moves' destinations and the dirty rects, a chunk of
+    PRESENT_CHUNK_RECTS at a time. Each chunk is done before the next one
+    reuses the rect arrays.
 
   Arguments:
 
+    pEngine - engine to submit to, NULL to run the chunks right here
+    pCommand - the command, its rects are filled in for each chunk
+    NumMoves - number of moves whose destinations are redone
+    Moves - moves' data
+    NumDirtyRects - number of rectangles to be copied
+    DirtyRect - rectangles' data
+
+  Return Value:
+
     None
 
+--*/
+{
+    PAGED_CODE();
+
+    RECT SrcRects[PRESENT_CHUNK_RECTS];
+    RECT DstRects[PRESENT_CHUNK_RECTS];
+    BLT_COMMAND Chunk = *pCommand;
+    Chunk.pRects = SrcRects;
+    Chunk.pDstRects = DstRects;
+
+    UINT NumRects = NumMoves + NumDirtyRects;
+    for (UINT Start = 0; Start < NumRects; Start += PRESENT_CHUNK_RECTS)
+    {
+        Chunk.NumRects = min(NumRects - Start, (UINT)PRESENT_CHUNK_RECTS);
+        for (UINT i = 0; i < Chunk.NumRects; i++)
+        {
+            SrcRects[i] = (Start + i < NumMoves) ? Moves[Start + i].DestRect : DirtyRect[Start + i - NumMoves];
+        }
+
+        UINT64 Fence = RunPresentCommand(pEngine, &Chunk);
+        if (pEngine != NULL)
+        {
+            pEngine->WaitForFence(Fence);
+        }
+    }
+}
+
+VOID
+BDD_HWBLT::PresentDone(
+    _In_ VOID*             pContext,
+    _In_ CONST BLT_COMMAND* pCommand)
+/*++
+
+  Routine Description:
+
+    Completion routine of the present commands, runs once a command is done
+    on whatever thread did it. Sends the framebuffer rects it wrote to the
+    display handler of each of its targets, clipped like the blts clip them.
+
+  Arguments:
+
+    pContext - the BDD_HWBLT of each of the command's destinations
+    pCommand - the command that is done
+
   Return Value:
 
     None
@@ -69,6 +258,40 @@ BDD_HWBLT::~BDD_HWBLT()
 --*/
 {
     PAGED_CODE();
+
+    BDD_HWBLT** ppTargets = (BDD_HWBLT**)pContext;
+    RECT Clipped;
+
+    for (UINT iRect = 0; iRect < pCommand->NumRects; iRect++)
+    {
+        switch (pCommand->Type)
+        {
+        case BLT_COMMAND_MOVE:
+            if (BltClipRect(&pCommand->pDsts[0], NULL, &pCommand->pMoves[iRect].DestRect, &Clipped))
+            {
+                ppTargets[0]->InvalidateRegion(&Clipped);
+            }
+            break;
+
+        case BLT_COMMAND_COPY:
+            for (UINT iDst = 0; iDst < pCommand->NumDsts; iDst++)
+            {
+                if (BltClipRect(&pCommand->pDsts[iDst], &pCommand->pSrcs[iDst], &pCommand->pRects[iRect], &Clipped))
+                {
+                    ppTargets[iDst]->InvalidateRegion(&Clipped);
+                }
+            }
+            break;
+
+        case BLT_COMMAND_STRETCH:
+        case BLT_COMMAND_COPY_CHANGED:
+            if (pCommand->pDstRects[iRect].right > pCommand->pDstRects[iRect].left)
+            {
+                ppTargets[0]->InvalidateRegion(&pCommand->pDstRects[iRect]);
+            }
+            break;
+        }
+    }
 }
 
 NTSTATUS
@@ -81,14 +304,16 @@ BDD_HWBLT::ExecutePresentDisplayOnly(
     _In_ ULONG             NumMoves,
     _In_ D3DKMT_MOVE_RECT* Moves,
     _In_ ULONG             NumDirtyRects,
-    _In_ RECT*             DirtyRect,
+    _In_ CONST RECT*       DirtyRect,
     _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation)
 /*++
 
   Routine Description:
 
-    The method creates present worker thread and provides context
-    for it filled with present commands
+    The method submits the present's commands to the blit engine and waits
+    for them. The source is only the presenting process's until the present
+    returns, and the framebuffer only stays mapped while its mutex is held,
+    so nothing can be left on the engine once it returns.
 
   Arguments:
 
@@ -102,7 +327,6 @@ BDD_HWBLT::ExecutePresentDisplayOnly(
     NumDirtyRects - number of rectangles to be copied
     DirtyRect - rectangles' data
     Rotation - rotation to be performed when executing copy
-    CallBack - callback for present worker thread to report execution status
 
   Return Value:
 
@@ -112,77 +336,584 @@ BDD_HWBLT::ExecutePresentDisplayOnly(
 {
 
     PAGED_CODE();
+
+    BLT_INFO DstBltInfo;
+    BLT_INFO SrcBltInfo;
+    BOOLEAN Stretched = GetPresentBltInfo(DstAddr, DstBitPerPixel, SrcAddr, SrcBytesPerPixel, SrcPitch, Rotation,
+                                          &DstBltInfo, &SrcBltInfo);
+
+    BDD_HWBLT* pTarget = this;
+    BLT_ENGINE* pEngine;
+    PMDL pMdl;
+
+    // Everything after this, the source lock included, only sees the merged rects
+    RECT Coalesced[BLT_COALESCE_RECTS];
+    UINT NumCoalesced;
+    if (m_BDD->GetCurrentMode(m_SourceId)->Flags.CoalesceRects &&
+        BltCoalesceRects(NumDirtyRects, DirtyRect, SrcBytesPerPixel, m_BDD->GetCoalesceWastePercent(),
+                         Coalesced, &NumCoalesced))
+    {
+        NumDirtyRects = NumCoalesced;
+        DirtyRect = Coalesced;
+    }
+
+    // Then only the tiles that changed since they were last presented are
+    // copied, which are whole tiles of the source
     const CURRENT_BDD_MODE* pModeCur = m_BDD->GetCurrentMode(m_SourceId);
-    UNREFERENCED_PARAMETER(SrcBytesPerPixel);
+    BLT_REGION Changed;
+    BltRegionInit(&Changed);
+    if (Stretched || (Rotation != D3DKMDT_VPPR_IDENTITY))
+    {
+        // The hashes are of the source as it is laid out in the framebuffer
+        ForgetTiles(NULL);
+    }
+    else if (pModeCur->Flags.TileHash && BltTileMapPrepare(&m_TileMap, &DstBltInfo, pModeCur->TileSize))
+    {
+        for (ULONG i = 0; i < NumMoves; i++)
+        {
+            BltTileMapForget(&m_TileMap, &Moves[i].DestRect);
+        }
+        if (BltTileMapRefine(&m_TileMap, &SrcBltInfo, NumDirtyRects, DirtyRect, &Changed))
+        {
+            NumDirtyRects = BltRegionGetRects(&Changed, &DirtyRect);
+        }
+    }
 
-    //Do this copy here...
-    // Set up source blt info
+    BOOLEAN CursorHidden = HideCursorForPresent(Stretched, NumMoves, Moves, NumDirtyRects, DirtyRect);
 
-    BLT_INFO DstBltInfo;
-    DstBltInfo.pBits = DstAddr;
-    DstBltInfo.Pitch = pModeCur->DispInfo.Pitch;
-    DstBltInfo.BitsPerPel = DstBitPerPixel;
-    DstBltInfo.Offset.x = 0;
-    DstBltInfo.Offset.y = 0;
-    DstBltInfo.Rotation = Rotation;
-    DstBltInfo.Width = pModeCur->SrcModeWidth;
-    DstBltInfo.Height = pModeCur->SrcModeHeight;
+    if (Stretched)
+    {
+        // The filter reads around the rects, the whole source is locked for it
+        RECT Whole = { 0, 0, (LONG)SrcBltInfo.Width, (LONG)SrcBltInfo.Height };
+        pEngine = LockPresentSource(1, &SrcBltInfo, 1, &Whole, &pMdl);
+
+        // Moves are redone from the source like the dirty rects, the filtered
+        // pixels of a scaled framebuffer do not just shift along with them
+        BLT_COMMAND Stretch = { BLT_COMMAND_STRETCH, 1, &DstBltInfo, &SrcBltInfo, 0, NULL, NULL, NULL,
+                                PresentDone, &pTarget };
+        RunPresentChunks(pEngine, &Stretch, NumMoves, Moves, NumDirtyRects, DirtyRect);
+
+        BltUnlockSource(pMdl);
+        RedrawCursorAfterPresent(CursorHidden);
+        FlushDamage();
+        BltRegionFini(&Changed);
+        return STATUS_SUCCESS;
+    }
 
-    // Set up source blt info
-    BLT_INFO SrcBltInfo;
-    SrcBltInfo.pBits = SrcAddr;
-    SrcBltInfo.Pitch = SrcPitch;
-    SrcBltInfo.BitsPerPel = 32;
-    SrcBltInfo.Offset.x = 0;
-    SrcBltInfo.Offset.y = 0;
-    SrcBltInfo.Rotation = D3DKMDT_VPPR_IDENTITY;
-    if (Rotation == D3DKMDT_VPPR_ROTATE90 ||
-        Rotation == D3DKMDT_VPPR_ROTATE270)
+    pEngine = LockPresentSource(1, &SrcBltInfo, NumDirtyRects, DirtyRect, &pMdl);
+
+    // Do the scrolls within the frame buffer, they have to come before the
+    // dirty rects and the engine keeps its commands in order
+    BLT_COMMAND Move = { BLT_COMMAND_MOVE, 1, &DstBltInfo, NULL, NumMoves, NULL, Moves, NULL,
+                         PresentDone, &pTarget };
+    UINT64 Fence = RunPresentCommand(pEngine, &Move);
+
+    if (pModeCur->Flags.CompareWrites)
     {
-        SrcBltInfo.Width = pModeCur->SrcModeHeight;
-        SrcBltInfo.Height = pModeCur->SrcModeWidth;
+        // Only the pixels that really changed are written and invalidated
+        BLT_COMMAND CopyChanged = { BLT_COMMAND_COPY_CHANGED, 1, &DstBltInfo, &SrcBltInfo, 0, NULL, NULL, NULL,
+                                    PresentDone, &pTarget };
+        RunPresentChunks(pEngine, &CopyChanged, 0, NULL, NumDirtyRects, DirtyRect);
     }
-    else {
-        SrcBltInfo.Width = pModeCur->SrcModeWidth;
-        SrcBltInfo.Height = pModeCur->SrcModeHeight;
+    else
+    {
+        // Copy all the dirty rects from source image to video frame buffer.
+        BLT_COMMAND Copy = { BLT_COMMAND_COPY, 1, &DstBltInfo, &SrcBltInfo, NumDirtyRects, DirtyRect, NULL, NULL,
+                             PresentDone, &pTarget };
+        Fence = RunPresentCommand(pEngine, &Copy);
+    }
+
+    if (pEngine != NULL)
+    {
+        pEngine->WaitForFence(Fence);
     }
 
+    BltUnlockSource(pMdl);
+    RedrawCursorAfterPresent(CursorHidden);
+    FlushDamage();
+    BltRegionFini(&Changed);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+BDD_HWBLT::ExecutePresentClones(
+    _In_reads_(NumClones) BDD_HWBLT** ppClones,
+    _In_ UINT              NumClones,
+    _In_ BYTE*             SrcAddr,
+    _In_ UINT              SrcBytesPerPixel,
+    _In_ LONG              SrcPitch,
+    _In_ ULONG             NumMoves,
+    _In_ D3DKMT_MOVE_RECT* Moves,
+    _In_ ULONG             NumDirtyRects,
+    _In_ CONST RECT*       DirtyRect,
+    _In_ BOOLEAN           Rotate)
+/*++
+
+  Routine Description:
+
+    The method presents a source to every target it is cloned to. The moves
+    are done within each target's framebuffer, then the dirty rects are
+    read once from the source and written to all of the framebuffers. Like
+    for a single target everything is done by the time it returns.
+
+  Arguments:
 
-    // Copy all the scroll rects from source image to video frame buffer.
-    for (UINT i = 0; i < NumMoves; i++)
+    ppClones - the targets, each one's framebuffer mutex is held
+    NumClones - number of targets
+    SrcAddr - address of source surface
+    SrcBytesPerPixel - bytes per pixel of source surface
+    SrcPitch - source surface pitch (bytes in a row)
+    NumMoves - number of moves to be copied
+    Moves - moves' data
+    NumDirtyRects - number of rectangles to be copied
+    DirtyRect - rectangles' data
+    Rotate - TRUE if each target's rotation is done when copying
+
+  Return Value:
+
+    Status
+
+--*/
+{
+    PAGED_CODE();
+
+    BLT_INFO DstBltInfos[MAX_CHILDREN];
+    BLT_INFO SrcBltInfos[MAX_CHILDREN];
+    BDD_HWBLT* pFanOut[MAX_CHILDREN];
+    BOOLEAN CursorHidden[MAX_CHILDREN];
+    UINT NumFanOut = 0;
+
+    for (UINT i = 0; i < NumClones; i++)
     {
-        BltBits(&DstBltInfo,
-            &SrcBltInfo,
-            1, // NumRects
-            &Moves[i].DestRect);
+        BDD_HWBLT* pClone = ppClones[i];
+        const CURRENT_BDD_MODE* pModeCur = pClone->m_BDD->GetCurrentMode(pClone->m_SourceId);
+        BYTE* DstAddr = (BYTE*)pModeCur->FrameBuffer.Ptr;
+        UINT DstBitPerPixel = pClone->m_BDD->BPPFromPixelFormat(pModeCur->DispInfo.ColorFormat);
+        D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation = Rotate ? pModeCur->Rotation : D3DKMDT_VPPR_IDENTITY;
+
+        if (pClone->GetPresentBltInfo(DstAddr, DstBitPerPixel, SrcAddr, SrcBytesPerPixel, SrcPitch, Rotation,
+                                      &DstBltInfos[NumFanOut], &SrcBltInfos[NumFanOut]))
+        {
+            // A stretched clone filters its own rows from the source
+            pClone->ExecutePresentDisplayOnly(DstAddr, DstBitPerPixel, SrcAddr, SrcBytesPerPixel, SrcPitch,
+                                              NumMoves, Moves, NumDirtyRects, DirtyRect, Rotation);
+            continue;
+        }
+        pFanOut[NumFanOut++] = pClone;
+    }
 
-        //Send dirty rects to display handler
-        InvalidateRegion(&Moves[i].DestRect);
+    if (NumFanOut == 0)
+    {
+        return STATUS_SUCCESS;
+    }
 
+    // The rects are shared by the fan-out, they are only merged if every
+    // target of it wants them to be
+    BOOLEAN Coalesce = TRUE;
+    for (UINT i = 0; i < NumFanOut; i++)
+    {
+        Coalesce &= pFanOut[i]->m_BDD->GetCurrentMode(pFanOut[i]->m_SourceId)->Flags.CoalesceRects;
     }
 
-    // Copy all the dirty rects from source image to video frame buffer.
-    for (UINT i = 0; i < NumDirtyRects; i++)
+    RECT Coalesced[BLT_COALESCE_RECTS];
+    UINT NumCoalesced;
+    if (Coalesce &&
+        BltCoalesceRects(NumDirtyRects, DirtyRect, SrcBytesPerPixel, pFanOut[0]->m_BDD->GetCoalesceWastePercent(),
+                         Coalesced, &NumCoalesced))
     {
+        NumDirtyRects = NumCoalesced;
+        DirtyRect = Coalesced;
+    }
+
+    PMDL pMdl;
+    BLT_ENGINE* pEngine = pFanOut[0]->LockPresentSource(NumFanOut, SrcBltInfos, NumDirtyRects, DirtyRect, &pMdl);
 
-        BltBits(&DstBltInfo,
-            &SrcBltInfo,
-            1, // NumRects
-            &DirtyRect[i]);
+    // The scrolls come before the dirty rects, like for a single target
+    for (UINT i = 0; i < NumFanOut; i++)
+    {
+        // The source is read once for all of the fan-out, so it is not
+        // hashed for any of them
+        for (ULONG j = 0; j < NumMoves; j++)
+        {
+            pFanOut[i]->ForgetTiles(&Moves[j].DestRect);
+        }
+        for (ULONG j = 0; j < NumDirtyRects; j++)
+        {
+            pFanOut[i]->ForgetTiles(&DirtyRect[j]);
+        }
+
+        CursorHidden[i] = pFanOut[i]->HideCursorForPresent(FALSE, NumMoves, Moves, NumDirtyRects, DirtyRect);
+
+        BLT_COMMAND Move = { BLT_COMMAND_MOVE, 1, &DstBltInfos[i], NULL, NumMoves, NULL, Moves, NULL,
+                             PresentDone, &pFanOut[i] };
+        RunPresentCommand(pEngine, &Move);
+    }
 
-        //Send dirty rects to display handler
-        InvalidateRegion(&DirtyRect[i]);
+    BLT_COMMAND Copy = { BLT_COMMAND_COPY, NumFanOut, DstBltInfos, SrcBltInfos, NumDirtyRects, DirtyRect, NULL, NULL,
+                         PresentDone, pFanOut };
+    UINT64 Fence = RunPresentCommand(pEngine, &Copy);
+    if (pEngine != NULL)
+    {
+        pEngine->WaitForFence(Fence);
+    }
+
+    BltUnlockSource(pMdl);
+    for (UINT i = 0; i < NumFanOut; i++)
+    {
+        pFanOut[i]->RedrawCursorAfterPresent(CursorHidden[i]);
+        pFanOut[i]->FlushDamage();
     }
- 
     return STATUS_SUCCESS;
 }
 
 
-int BDD_HWBLT::InvalidateRegion(CONST RECT * region)
+VOID BDD_HWBLT::InvalidateRegion(CONST RECT * region)
 {
     PAGED_CODE();
+
+    // Too many rects to keep apart only makes the region coarser
+    BltRegionUnionRect(&m_Damage, region);
+}
+
+VOID BDD_HWBLT::ForgetTiles(_In_opt_ CONST RECT* pRect)
+{
+    PAGED_CODE();
+
+    BltTileMapForget(&m_TileMap, pRect);
+}
+
+VOID BDD_HWBLT::FlushDamage(VOID)
+{
+    PAGED_CODE();
+    const CURRENT_BDD_MODE* pModeCur = m_BDD->GetCurrentMode(m_SourceId);
+
+    // The display handler only takes rects on the framebuffer
+    RECT Screen = { 0, 0, (LONG)pModeCur->DispInfo.Width, (LONG)pModeCur->DispInfo.Height };
+    BltRegionIntersectRect(&m_Damage, &Screen);
+
     //m_sourceID is the target id ....
     PVChild * child(m_BDD->GetPVChild(m_SourceId));
-    return child->send_dirty_rect(region->left, region->top,
-        region->right - region->left, region->bottom - region->top);
+    child->send_dirty_region(&m_Damage);
+    BltRegionFini(&m_Damage);
+}
+
+//
+// Software cursor
+//
+// The pointer shape is blended into the framebuffer at its position and the
+// pixels it covers are kept aside, so moving it only puts those back and
+// blends it again somewhere else. Presents that read or write under it take
+// it out of the framebuffer first and draw it again once they are done, the
+// moves would otherwise scroll it along and a compared copy would see it as
+// a change.
+//
+
+static FORCEINLINE BOOLEAN RectsOverlap(CONST RECT* pA, CONST RECT* pB)
+{
+    return (pA->left < pB->right) && (pB->left < pA->right) &&
+           (pA->top < pB->bottom) && (pB->top < pA->bottom);
+}
+
+// The saved pixels of pRect, MAX_CURSOR_WIDTH to a row
+static VOID GetCursorUnderInfo(_In_ UINT32* pUnder, _In_ CONST RECT* pRect, _Out_ BLT_INFO* pInfo)
+{
+    RtlZeroMemory(pInfo, sizeof(*pInfo));
+    pInfo->pBits = pUnder;
+    pInfo->Pitch = MAX_CURSOR_WIDTH * 4;
+    pInfo->BitsPerPel = 32;
+    pInfo->Format = D3DDDIFMT_A8R8G8B8;
+    pInfo->Offset.x = -pRect->left;
+    pInfo->Offset.y = -pRect->top;
+    pInfo->Rotation = D3DKMDT_VPPR_IDENTITY;
+    pInfo->Width = pRect->right - pRect->left;
+    pInfo->Height = pRect->bottom - pRect->top;
+}
+
+BOOLEAN
+BDD_HWBLT::GetCursorFb(
+    _Out_ BLT_INFO* pFb)
+{
+    PAGED_CODE();
+    const CURRENT_BDD_MODE* pModeCur = m_BDD->GetCurrentMode(m_SourceId);
+
+    RtlZeroMemory(pFb, sizeof(*pFb));
+    if (!pModeCur->Flags.FrameBufferIsActive ||
+        (pModeCur->FrameBuffer.Ptr == NULL) ||
+        ((pModeCur->DispInfo.ColorFormat != D3DDDIFMT_A8R8G8B8) && (pModeCur->DispInfo.ColorFormat != D3DDDIFMT_X8R8G8B8)) ||
+        (pModeCur->Rotation != D3DKMDT_VPPR_IDENTITY))
+    {
+        return FALSE;
+    }
+
+    pFb->pBits = pModeCur->FrameBuffer.Ptr;
+    pFb->Pitch = pModeCur->DispInfo.Pitch;
+    pFb->BitsPerPel = 32;
+    pFb->Format = pModeCur->DispInfo.ColorFormat;
+    pFb->Rotation = D3DKMDT_VPPR_IDENTITY;
+    pFb->Width = pModeCur->DispInfo.Width;
+    pFb->Height = pModeCur->DispInfo.Height;
+    pFb->pColorLut = pModeCur->pColorLut;
+    pFb->pSwizzle = pModeCur->pSwizzle;
+    return TRUE;
+}
+
+VOID
+BDD_HWBLT::RestoreCursor(
+    _Out_ RECT* pRestored)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(pRestored, sizeof(*pRestored));
+    if (!m_CursorDrawn)
+    {
+        return;
+    }
+    m_CursorDrawn = FALSE;
+
+    // A framebuffer that was remapped since has nothing of the cursor in it
+    BLT_INFO Fb;
+    if (!GetCursorFb(&Fb) ||
+        (Fb.pBits != m_CursorFb.pBits) || (Fb.Pitch != m_CursorFb.Pitch) ||
+        (Fb.Width != m_CursorFb.Width) || (Fb.Height != m_CursorFb.Height))
+    {
+        return;
+    }
+
+    // The pixels were saved the way they are in the framebuffer
+    Fb.pColorLut = NULL;
+    Fb.pSwizzle = NULL;
+
+    BLT_INFO Under;
+    GetCursorUnderInfo(m_pCursorUnder, &m_CursorRect, &Under);
+    BltBits(&Fb, &Under, 1, &m_CursorRect);
+    *pRestored = m_CursorRect;
+}
+
+VOID
+BDD_HWBLT::DrawCursor(VOID)
+{
+    PAGED_CODE();
+
+    BLT_INFO Fb;
+    if (!m_CursorVisible || (m_pCursorImage == NULL) || !GetCursorFb(&Fb))
+    {
+        return;
+    }
+
+    // Only the part of the shape on the framebuffer is saved and blended
+    BLT_INFO RawFb = Fb;
+    RawFb.pColorLut = NULL;
+    RawFb.pSwizzle = NULL;
+    RECT Rect = { m_CursorPos.x, m_CursorPos.y,
+                  m_CursorPos.x + (LONG)m_CursorWidth, m_CursorPos.y + (LONG)m_CursorHeight };
+    if (!BltClipRect(&RawFb, NULL, &Rect, &m_CursorRect))
+    {
+        return;
+    }
+
+    BLT_INFO Under;
+    GetCursorUnderInfo(m_pCursorUnder, &m_CursorRect, &Under);
+    BltBits(&Under, &RawFb, 1, &m_CursorRect);
+
+    BLT_INFO Image;
+    RtlZeroMemory(&Image, sizeof(Image));
+    Image.pBits = (PVOID)m_pCursorImage;
+    Image.Pitch = m_CursorWidth * 4;
+    Image.BitsPerPel = 32;
+    Image.Format = D3DDDIFMT_A8R8G8B8;
+    Image.Offset.x = -m_CursorPos.x;
+    Image.Offset.y = -m_CursorPos.y;
+    Image.Rotation = D3DKMDT_VPPR_IDENTITY;
+    Image.Width = m_CursorWidth;
+    Image.Height = m_CursorHeight;
+    BltBlendBits(&Fb, &Image, &m_CursorRect);
+
+    m_CursorFb = Fb;
+    m_CursorDrawn = TRUE;
+}
+
+VOID
+BDD_HWBLT::InvalidateCursor(
+    _In_ CONST RECT* pOld,
+    _In_ CONST RECT* pNew)
+{
+    PAGED_CODE();
+
+    // Both rects go into m_Damage, the region keeps what they share only once
+    InvalidateRegion(pOld);
+    InvalidateRegion(pNew);
+    FlushDamage();
+}
+
+NTSTATUS
+BDD_HWBLT::SetCursorShape(
+    _In_opt_ CONST BYTE* pImage,
+    UINT        Width,
+    UINT        Height)
+/*++
+
+  Routine Description:
+
+    The method takes the pointer over to the software cursor, or back out
+    of it with a NULL pImage. Whatever was drawn of the old shape is put
+    back and the new one is drawn where the pointer is.
+
+  Arguments:
+
+    pImage - premultiplied A8R8G8B8 shape, Width * 4 bytes to a row
+    Width - shape width, at most MAX_CURSOR_WIDTH
+    Height - shape height, at most MAX_CURSOR_HEIGHT
+
+  Return Value:
+
+    STATUS_NOT_SUPPORTED if the current mode can not have a software cursor
+
+--*/
+{
+    PAGED_CODE();
+
+    BLT_INFO Fb;
+    if ((pImage != NULL) && !GetCursorFb(&Fb))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ((pImage != NULL) && (m_pCursorUnder == NULL))
+    {
+        m_pCursorUnder = (UINT32*)ExAllocatePoolWithTag(NonPagedPoolNx, MAX_CURSOR_WIDTH * MAX_CURSOR_HEIGHT * 4, BDDTAG);
+        if (m_pCursorUnder == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    RECT Old;
+    RestoreCursor(&Old);
+
+    m_pCursorImage = pImage;
+    m_CursorWidth = min(Width, (UINT)MAX_CURSOR_WIDTH);
+    m_CursorHeight = min(Height, (UINT)MAX_CURSOR_HEIGHT);
+    DrawCursor();
+
+    RECT New = { 0, 0, 0, 0 };
+    if (m_CursorDrawn)
+    {
+        New = m_CursorRect;
+    }
+    InvalidateCursor(&Old, &New);
+    return STATUS_SUCCESS;
+}
+
+VOID
+BDD_HWBLT::SetCursorPosition(
+    BOOLEAN     Visible,
+    INT         X,
+    INT         Y)
+{
+    PAGED_CODE();
+
+    if ((Visible == m_CursorVisible) &&
+        (!Visible || ((X == m_CursorPos.x) && (Y == m_CursorPos.y))))
+    {
+        return;
+    }
+
+    RECT Old;
+    RestoreCursor(&Old);
+
+    m_CursorVisible = Visible;
+    m_CursorPos.x = X;
+    m_CursorPos.y = Y;
+    DrawCursor();
+
+    RECT New = { 0, 0, 0, 0 };
+    if (m_CursorDrawn)
+    {
+        New = m_CursorRect;
+    }
+    InvalidateCursor(&Old, &New);
+}
+
+VOID
+BDD_HWBLT::HideCursor(
+    _Out_ RECT* pHidden)
+{
+    PAGED_CODE();
+
+    RestoreCursor(pHidden);
+}
+
+VOID
+BDD_HWBLT::ShowCursor(
+    _Out_ RECT* pShown)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(pShown, sizeof(*pShown));
+    DrawCursor();
+    if (m_CursorDrawn)
+    {
+        *pShown = m_CursorRect;
+    }
+}
+
+BOOLEAN
+BDD_HWBLT::HideCursorForPresent(
+    BOOLEAN                Stretched,
+    _In_ ULONG             NumMoves,
+    _In_reads_opt_(NumMoves) CONST D3DKMT_MOVE_RECT* Moves,
+    _In_ ULONG             NumDirtyRects,
+    _In_reads_opt_(NumDirtyRects) CONST RECT* DirtyRect)
+{
+    PAGED_CODE();
+
+    if (!m_CursorDrawn)
+    {
+        return FALSE;
+    }
+
+    // The rects of a stretched present are in source coordinates, the
+    // cursor is in framebuffer ones
+    BOOLEAN Touched = Stretched;
+    for (ULONG i = 0; (i < NumMoves) && !Touched; i++)
+    {
+        CONST RECT* pDest = &Moves[i].DestRect;
+        RECT Source = { Moves[i].SourcePoint.x, Moves[i].SourcePoint.y,
+                        Moves[i].SourcePoint.x + (pDest->right - pDest->left),
+                        Moves[i].SourcePoint.y + (pDest->bottom - pDest->top) };
+        Touched = RectsOverlap(pDest, &m_CursorRect) || RectsOverlap(&Source, &m_CursorRect);
+    }
+    for (ULONG i = 0; (i < NumDirtyRects) && !Touched; i++)
+    {
+        Touched = RectsOverlap(&DirtyRect[i], &m_CursorRect);
+    }
+    if (!Touched)
+    {
+        return FALSE;
+    }
+
+    // What the present writes invalidates itself, what it does not write
+    // is as it was before the cursor went over it
+    RECT Restored;
+    RestoreCursor(&Restored);
+    return TRUE;
+}
+
+VOID
+BDD_HWBLT::RedrawCursorAfterPresent(
+    BOOLEAN Hidden)
+{
+    PAGED_CODE();
+
+    if (!Hidden)
+    {
+        return;
+    }
+
+    DrawCursor();
+    if (m_CursorDrawn)
+    {
+        InvalidateRegion(&m_CursorRect);
+    }
 }
@@ -0,0 +1,272 @@
+/******************************Module*Header*******************************\
+* Module Name: bltpar.cxx
+*
+* Worker pool for splitting big blts across processors.
+*
+* The pool runs one job at a time. A job is a band function and a band count;
+* BltParallelRun wakes as many workers as there are bands beyond the first,
+* and every participant, the caller included, takes the next band with an
+* interlocked increment until they run out. The last participant to finish
+* wakes the caller. A caller that finds the pool busy does its blt itself,
+* so nothing ever waits for the pool.
+*
+* Only the thread creation differs between the driver and BLT_HOST_BUILD, the
+* scheduling itself can be built and benchmarked as a normal program.
+*
+\**************************************************************************/
+
+#include "bltpar.hxx"
+
+#ifdef BLT_HOST_BUILD
+#include <unistd.h>
+typedef pthread_t BLT_THREAD;
+#else
+typedef PKTHREAD BLT_THREAD;
+#endif
+
+// Copying ~1MB takes long enough to be worth waking the workers for
+#define BLT_DEFAULT_PARALLEL_THRESHOLD  (1024 * 1024)
+
+typedef struct _BLT_PARALLEL_JOB
+{
+    PFN_BLT_BAND    pfnBand;
+    VOID*           pContext;
+    UINT            NumBands;
+    volatile LONG   NextBand;
+    volatile LONG   Participants;   // Still working on this job, the caller included
+} BLT_PARALLEL_JOB;
+
+typedef struct _BLT_WORKER
+{
+    BLT_EVENT       Go;
+    BLT_THREAD      Thread;
+} BLT_WORKER;
+
+typedef struct _BLT_PARALLEL_POOL
+{
+    UINT                NumWorkers;
+    volatile LONG       Busy;
+    volatile LONG       Shutdown;
+    BLT_EVENT           Done;
+    BLT_PARALLEL_JOB    Job;
+    BLT_WORKER          Workers[BLT_MAX_WORKERS];
+} BLT_PARALLEL_POOL;
+
+static BLT_PARALLEL_POOL g_BltPool;
+
+SIZE_T g_BltParallelThreshold = BLT_DEFAULT_PARALLEL_THRESHOLD;
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+static VOID BltParallelDoBands(BLT_PARALLEL_JOB* pJob)
+{
+    for (;;)
+    {
+        UINT Band = (UINT)(InterlockedIncrement(&pJob->NextBand) - 1);
+        if (Band >= pJob->NumBands)
+        {
+            break;
+        }
+        pJob->pfnBand(pJob->pContext, Band, pJob->NumBands);
+    }
+}
+
+static VOID BltParallelWorkerLoop(BLT_WORKER* pWorker)
+{
+    for (;;)
+    {
+        BltEventWait(&pWorker->Go);
+        if (g_BltPool.Shutdown)
+        {
+            break;
+        }
+
+        BltParallelDoBands(&g_BltPool.Job);
+        if (InterlockedDecrement(&g_BltPool.Job.Participants) == 0)
+        {
+            BltEventSet(&g_BltPool.Done);
+        }
+    }
+}
+
+#ifdef BLT_HOST_BUILD
+static VOID* BltParallelWorker(VOID* pContext)
+{
+    BltParallelWorkerLoop((BLT_WORKER*)pContext);
+    return NULL;
+}
+#else
+static KSTART_ROUTINE BltParallelWorker;
+
+static VOID BltParallelWorker(PVOID pContext)
+{
+    // Presents wait on the workers with the framebuffer mutex held
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    BltParallelWorkerLoop((BLT_WORKER*)pContext);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+#endif
+
+UINT BltParallelWorkers(VOID)
+{
+    return g_BltPool.NumWorkers;
+}
+
+BOOLEAN BltParallelRun(PFN_BLT_BAND pfnBand, VOID* pContext, UINT NumBands)
+{
+    if ((NumBands < 2) || (g_BltPool.NumWorkers == 0))
+    {
+        return FALSE;
+    }
+
+#ifndef BLT_HOST_BUILD
+    // Waiting for the workers is not possible at bugcheck or from a DPC
+    if (KeGetCurrentIrql() > APC_LEVEL)
+    {
+        return FALSE;
+    }
+#endif
+
+    if (InterlockedCompareExchange(&g_BltPool.Busy, 1, 0) != 0)
+    {
+        return FALSE;
+    }
+
+    UINT NumWorkers = (NumBands - 1 < g_BltPool.NumWorkers) ? NumBands - 1 : g_BltPool.NumWorkers;
+
+    BLT_PARALLEL_JOB* pJob = &g_BltPool.Job;
+    pJob->pfnBand = pfnBand;
+    pJob->pContext = pContext;
+    pJob->NumBands = NumBands;
+    pJob->NextBand = 0;
+    pJob->Participants = (LONG)NumWorkers + 1;
+
+    for (UINT i = 0; i < NumWorkers; i++)
+    {
+        BltEventSet(&g_BltPool.Workers[i].Go);
+    }
+
+    BltParallelDoBands(pJob);
+    if (InterlockedDecrement(&pJob->Participants) != 0)
+    {
+        BltEventWait(&g_BltPool.Done);
+    }
+
+    InterlockedExchange(&g_BltPool.Busy, 0);
+    return TRUE;
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+#pragma code_seg(push)
+#pragma code_seg("PAGE")
+// BEGIN: Paged Code
+
+static UINT BltProcessorCount(VOID)
+{
+    PAGED_CODE();
+
+#ifdef BLT_HOST_BUILD
+    long Count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (Count > 0) ? (UINT)Count : 1;
+#else
+    return KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#endif
+}
+
+static NTSTATUS BltParallelStartWorker(BLT_WORKER* pWorker)
+{
+    PAGED_CODE();
+
+#ifdef BLT_HOST_BUILD
+    return (pthread_create(&pWorker->Thread, NULL, BltParallelWorker, pWorker) == 0) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+#else
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hThread;
+    NTSTATUS Status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, BltParallelWorker, pWorker);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    // Keep the thread object around so BltParallelShutdown can wait for it
+    Status = ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID*)&pWorker->Thread, NULL);
+    NT_ASSERT(NT_SUCCESS(Status));
+    ZwClose(hThread);
+    return Status;
+#endif
+}
+
+static VOID BltParallelStopWorker(BLT_WORKER* pWorker)
+{
+    PAGED_CODE();
+
+#ifdef BLT_HOST_BUILD
+    pthread_join(pWorker->Thread, NULL);
+#else
+    KeWaitForSingleObject(pWorker->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(pWorker->Thread);
+#endif
+}
+
+NTSTATUS BltParallelInitialize(UINT MaxWorkers)
+{
+    PAGED_CODE();
+
+    UINT NumWorkers = (MaxWorkers != 0) ? MaxWorkers : BltProcessorCount() - 1;
+    if (NumWorkers > BLT_MAX_WORKERS)
+    {
+        NumWorkers = BLT_MAX_WORKERS;
+    }
+
+    g_BltPool.NumWorkers = 0;
+    g_BltPool.Busy = 0;
+    g_BltPool.Shutdown = 0;
+    BltEventInitialize(&g_BltPool.Done);
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    for (UINT i = 0; i < NumWorkers; i++)
+    {
+        BltEventInitialize(&g_BltPool.Workers[i].Go);
+        Status = BltParallelStartWorker(&g_BltPool.Workers[i]);
+        if (!NT_SUCCESS(Status))
+        {
+            // Blts still work with fewer workers, or none at all
+            BDD_LOG_WARNING("XENWDDM!%s only started %u of %u blt workers, Status = 0x%I64x\n",
+                            __FUNCTION__, i, NumWorkers, Status);
+            break;
+        }
+        g_BltPool.NumWorkers++;
+    }
+
+    BDD_LOG_EVENT("XENWDDM!%s %u blt workers, parallel above %Iu bytes\n",
+                  __FUNCTION__, g_BltPool.NumWorkers, g_BltParallelThreshold);
+    return Status;
+}
+
+VOID BltParallelShutdown(VOID)
+{
+    PAGED_CODE();
+
+    UINT NumWorkers = g_BltPool.NumWorkers;
+    g_BltPool.NumWorkers = 0;
+
+    InterlockedExchange(&g_BltPool.Shutdown, 1);
+    for (UINT i = 0; i < NumWorkers; i++)
+    {
+        BltEventSet(&g_BltPool.Workers[i].Go);
+    }
+    for (UINT i = 0; i < NumWorkers; i++)
+    {
+        BltParallelStopWorker(&g_BltPool.Workers[i]);
+    }
+}
+
+// END: Paged Code
+#pragma code_seg(pop)
@@ -0,0 +1,38 @@
+/******************************Module*Header*******************************\
+* Module Name: bltpar.hxx
+*
+* Small pool of worker threads that big blts are split across. A blt is cut
+* into bands, the workers and the calling thread each take bands until none
+* are left, and the call returns once every band is done.
+*
+\**************************************************************************/
+
+#ifndef _BLTPAR_HXX_
+#define _BLTPAR_HXX_
+
+#include "bltport.hxx"
+
+#define BLT_MAX_WORKERS     15
+
+// Blts moving fewer bytes than this stay on the calling thread
+extern SIZE_T g_BltParallelThreshold;
+
+// Bands are never made shorter than this many rows
+#define BLT_MIN_BAND_ROWS   16
+
+// Does band Band of NumBands. Called on the workers and on the calling thread.
+typedef VOID (*PFN_BLT_BAND)(VOID* pContext, UINT Band, UINT NumBands);
+
+// Starts MaxWorkers threads, 0 means one per processor besides the calling one
+NTSTATUS BltParallelInitialize(UINT MaxWorkers);
+VOID BltParallelShutdown(VOID);
+
+// Number of worker threads, the calling thread not included
+UINT BltParallelWorkers(VOID);
+
+// Runs pfnBand for every band and returns when all of them are done. Returns
+// FALSE without running anything if the pool can not be used right now, the
+// caller then does the work itself.
+BOOLEAN BltParallelRun(PFN_BLT_BAND pfnBand, VOID* pContext, UINT NumBands);
+
+#endif // _BLTPAR_HXX_
@@ -0,0 +1,315 @@
+/******************************Module*Header*******************************\
+* Module Name: bltport.hxx
+*
+* Portability layer for the blt kernels. Inside the driver this simply pulls
+* in BDD.hxx; defining BLT_HOST_BUILD maps the handful of WDK types and
+* routines the kernels use onto the C runtime and pulls in bltfuncs.hxx, so
+* the blt modules can be built, tested and benchmarked as a normal user-mode
+* program, see test/Makefile.
+*
+\**************************************************************************/
+
+#ifndef _BLTPORT_HXX_
+#define _BLTPORT_HXX_
+
+#ifdef BLT_HOST_BUILD
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+typedef void                VOID;
+typedef uint8_t             BYTE;
+typedef uint8_t             UCHAR;
+typedef uint8_t             UINT8;
+typedef uint8_t             BOOLEAN;
+typedef uint16_t            WORD;
+typedef uint16_t            UINT16;
+typedef int32_t             INT;
+typedef int32_t             INT32;
+typedef int32_t             LONG;
+typedef uint32_t            UINT;
+typedef uint32_t            UINT32;
+typedef uint32_t            ULONG;
+typedef int64_t             LONG64;
+typedef uint64_t            UINT64;
+typedef uint64_t            ULONG64;
+typedef size_t              SIZE_T;
+typedef intptr_t            LONG_PTR;
+typedef uintptr_t           ULONG_PTR;
+typedef void*               PVOID;
+
+typedef struct _RECT
+{
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+} RECT;
+
+typedef struct _POINT
+{
+    LONG x;
+    LONG y;
+} POINT;
+
+#define CONST               const
+#define MAXLONG             0x7fffffff
+#define MINLONG             (-MAXLONG - 1)
+#define MAXUINT             0xffffffffU
+#define MAXUINT64           0xffffffffffffffffULL
+#define TRUE                1
+#define FALSE               0
+#define FORCEINLINE         inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x)   __attribute__((aligned(x)))
+#define C_ASSERT(e)         static_assert((e), #e)
+
+#define ARRAYSIZE(a)        (sizeof(a) / sizeof((a)[0]))
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+
+#define NT_ASSERT(exp)      assert(exp)
+#define PAGED_CODE()
+
+// Annotations for the analyzer, nothing to the compiler
+#define _In_
+#define _In_opt_
+#define _In_reads_(n)
+#define _Out_
+#define _Out_writes_(n)
+#define _Inout_
+#define _Inout_updates_(n)
+
+// There are no structured exceptions, a blt that faults crashes the program
+#define __try               if (1)
+#define __except(Filter)    else if (0)
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+#define BDD_LOG_ASSERTION(...)  assert(!"BDD_LOG_ASSERTION")
+#define BDD_LOG_ERROR(...)
+#define BDD_LOG_WARNING(...)
+#define BDD_LOG_EVENT(...)
+#define BDD_LOG_INFORMATION(...)
+
+#define RtlCopyMemory(d, s, l)  memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)  memmove((d), (s), (l))
+#define RtlZeroMemory(d, l)     memset((d), 0, (l))
+
+typedef LONG                NTSTATUS;
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+
+#define InterlockedIncrement(p)                 __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)                 __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)               __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)               __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, c)     __sync_val_compare_and_swap((p), (c), (v))
+
+// The formats, rotations and moves of the blts, with the WDK's values
+typedef enum _D3DDDIFORMAT
+{
+    D3DDDIFMT_UNKNOWN           = 0,
+    D3DDDIFMT_R8G8B8            = 20,
+    D3DDDIFMT_A8R8G8B8          = 21,
+    D3DDDIFMT_X8R8G8B8          = 22,
+    D3DDDIFMT_R5G6B5            = 23,
+    D3DDDIFMT_A8B8G8R8          = 32,
+    D3DDDIFMT_A2R10G10B10       = 35,
+    D3DDDIFMT_P8                = 41,
+    D3DDDIFMT_A16B16G16R16F     = 113,
+} D3DDDIFORMAT;
+
+typedef enum _D3DKMDT_VIDPN_PRESENT_PATH_ROTATION
+{
+    D3DKMDT_VPPR_UNINITIALIZED  = 0,
+    D3DKMDT_VPPR_IDENTITY       = 1,
+    D3DKMDT_VPPR_ROTATE90       = 2,
+    D3DKMDT_VPPR_ROTATE180      = 3,
+    D3DKMDT_VPPR_ROTATE270      = 4,
+} D3DKMDT_VIDPN_PRESENT_PATH_ROTATION;
+
+typedef struct _D3DKMT_MOVE_RECT
+{
+    POINT   SourcePoint;
+    RECT    DestRect;
+} D3DKMT_MOVE_RECT;
+
+#include "bltfuncs.hxx"
+
+#else  // BLT_HOST_BUILD
+
+#include "BDD.hxx"
+
+#endif // BLT_HOST_BUILD
+
+//
+// Instruction set selection
+//
+// MSVC lets any translation unit use AVX2/AVX-512 intrinsics; GCC and clang
+// need the function itself to be marked for the target ISA.
+//
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BLT_TARGET_SSSE3
+#define BLT_TARGET_SSE41
+#define BLT_TARGET_AVX2
+#define BLT_TARGET_AVX512
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#define BLT_TARGET_SSSE3    __attribute__((target("ssse3")))
+#define BLT_TARGET_SSE41    __attribute__((target("sse4.1")))
+#define BLT_TARGET_AVX2     __attribute__((target("avx2")))
+#define BLT_TARGET_AVX512   __attribute__((target("avx512f,avx512bw")))
+#endif
+
+#define BLT_CPU_SSE2        0x00000001
+#define BLT_CPU_SSSE3       0x00000002
+#define BLT_CPU_SSE41       0x00000004
+#define BLT_CPU_AVX2        0x00000008
+#define BLT_CPU_AVX512      0x00000010 // AVX-512 F and BW
+
+#define BLT_CACHE_LINE      64
+
+//
+// Synchronization for the blt worker pool
+//
+// BLT_EVENT is an auto-reset event: a wait consumes the signal. In the driver
+// it is a KEVENT, waits are not alertable and only valid at IRQL <= APC_LEVEL.
+//
+
+#ifdef BLT_HOST_BUILD
+
+#include <pthread.h>
+
+typedef struct _BLT_EVENT
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t  Cond;
+    BOOLEAN         Signaled;
+} BLT_EVENT;
+
+inline VOID BltEventInitialize(BLT_EVENT* pEvent)
+{
+    pthread_mutex_init(&pEvent->Lock, NULL);
+    pthread_cond_init(&pEvent->Cond, NULL);
+    pEvent->Signaled = FALSE;
+}
+
+inline VOID BltEventSet(BLT_EVENT* pEvent)
+{
+    pthread_mutex_lock(&pEvent->Lock);
+    pEvent->Signaled = TRUE;
+    pthread_cond_signal(&pEvent->Cond);
+    pthread_mutex_unlock(&pEvent->Lock);
+}
+
+inline VOID BltEventWait(BLT_EVENT* pEvent)
+{
+    pthread_mutex_lock(&pEvent->Lock);
+    while (!pEvent->Signaled)
+    {
+        pthread_cond_wait(&pEvent->Cond, &pEvent->Lock);
+    }
+    pEvent->Signaled = FALSE;
+    pthread_mutex_unlock(&pEvent->Lock);
+}
+
+#else  // BLT_HOST_BUILD
+
+typedef KEVENT BLT_EVENT;
+
+#define BltEventInitialize(pEvent)  KeInitializeEvent((pEvent), SynchronizationEvent, FALSE)
+#define BltEventSet(pEvent)         KeSetEvent((pEvent), IO_NO_INCREMENT, FALSE)
+#define BltEventWait(pEvent)        KeWaitForSingleObject((pEvent), Executive, KernelMode, FALSE, NULL)
+
+#endif // BLT_HOST_BUILD
+
+//
+// Scratch memory and a clock, for calibrating the blt cost models when the
+// driver loads. The clock counts nanoseconds from an arbitrary start.
+//
+
+#ifdef BLT_HOST_BUILD
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BltAllocate(Bytes)          malloc(Bytes)
+#define BltFree(p)                  free(p)
+
+inline UINT64 BltQueryTimeNs(VOID)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (UINT64)Now.tv_sec * 1000000000 + (UINT64)Now.tv_nsec;
+}
+
+#else  // BLT_HOST_BUILD
+
+#define BltAllocate(Bytes)          ExAllocatePoolWithTag(NonPagedPoolNx, (Bytes), BDDTAG)
+#define BltFree(p)                  ExFreePoolWithTag((p), BDDTAG)
+
+inline UINT64 BltQueryTimeNs(VOID)
+{
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Counter = KeQueryPerformanceCounter(&Frequency);
+
+    // Whole seconds and the rest apart, the counter times 10^9 would overflow
+    UINT64 Seconds = (UINT64)Counter.QuadPart / (UINT64)Frequency.QuadPart;
+    UINT64 Rest = (UINT64)Counter.QuadPart % (UINT64)Frequency.QuadPart;
+    return Seconds * 1000000000 + (Rest * 1000000000) / (UINT64)Frequency.QuadPart;
+}
+
+#endif // BLT_HOST_BUILD
+
+//
+// BLT_LOCK guards the few fields the blit engine's queue shares between the
+// submitting threads and the engine thread. It is only ever held for a few
+// instructions and nothing is waited for with it held. In the driver it is a
+// spin lock, BLT_LOCK_STATE is the IRQL it was acquired from.
+//
+
+#ifdef BLT_HOST_BUILD
+
+typedef pthread_mutex_t BLT_LOCK;
+typedef INT             BLT_LOCK_STATE;
+
+#define BltLockInitialize(pLock)        pthread_mutex_init((pLock), NULL)
+#define BltLockAcquire(pLock, pState)   (*(pState) = 0, pthread_mutex_lock(pLock))
+#define BltLockRelease(pLock, State)    ((void)(State), pthread_mutex_unlock(pLock))
+
+#else  // BLT_HOST_BUILD
+
+typedef KSPIN_LOCK      BLT_LOCK;
+typedef KIRQL           BLT_LOCK_STATE;
+
+#define BltLockInitialize(pLock)        KeInitializeSpinLock(pLock)
+#define BltLockAcquire(pLock, pState)   KeAcquireSpinLock((pLock), (pState))
+#define BltLockRelease(pLock, State)    KeReleaseSpinLock((pLock), (State))
+
+#endif // BLT_HOST_BUILD
+
+//
+// Memory ordering for the rings shared with another thread or the host
+// without a lock, see bltring.hxx. BltMemoryBarrier orders stores before
+// it against loads after it, which acquire and release do not.
+//
+
+#ifdef BLT_HOST_BUILD
+
+#define BltReadAcquire(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BltWriteRelease(p, v)       __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define BltMemoryBarrier()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#else  // BLT_HOST_BUILD
+
+#define BltReadAcquire(p)           ReadULongAcquire(p)
+#define BltWriteRelease(p, v)       WriteULongRelease((p), (v))
+#define BltMemoryBarrier()          KeMemoryBarrier()
+
+#endif // BLT_HOST_BUILD
+
+#endif // _BLTPORT_HXX_
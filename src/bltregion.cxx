@@ -0,0 +1,501 @@
+/******************************Module*Header*******************************\
+* Module Name: bltregion.cxx
+*
+* Banded regions, see bltregion.hxx.
+*
+* All three set operations are one sweep down both regions. Between two
+* consecutive band edges of either region the pixels of a row are the same
+* all the way down, so each such stretch of rows gets one band: its spans
+* come from a sweep across the spans of the bands of both regions there,
+* keeping what the operation wants of each stretch of columns. A band with
+* the same spans as the one right above it only makes that one taller.
+*
+\**************************************************************************/
+
+#include "bltregion.hxx"
+
+#if BLT_REGION_ARENA_BLOCKS > 32
+#error The free blocks of the arena are a LONG bit mask
+#endif
+
+typedef enum _BLT_REGION_OP
+{
+    BLT_REGION_OP_UNION,
+    BLT_REGION_OP_INTERSECT,
+    BLT_REGION_OP_SUBTRACT,
+} BLT_REGION_OP;
+
+typedef struct _BLT_REGION_DATA
+{
+    UINT NumRects;
+    RECT Rects[BLT_REGION_RECTS];
+} BLT_REGION_DATA;
+
+static BLT_REGION_DATA g_BltRegionArena[BLT_REGION_ARENA_BLOCKS];
+
+// A bit for every block of g_BltRegionArena that is free
+static volatile LONG g_BltRegionArenaFree = (LONG)(((UINT64)1 << BLT_REGION_ARENA_BLOCKS) - 1);
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+static BLT_REGION_DATA* AllocData(VOID)
+{
+    for (;;)
+    {
+        LONG Free = g_BltRegionArenaFree;
+        if (Free == 0)
+        {
+            return NULL;
+        }
+
+        UINT Block = 0;
+        while (!(Free & (LONG)(1U << Block)))
+        {
+            Block++;
+        }
+        if (InterlockedCompareExchange(&g_BltRegionArenaFree, Free & ~(LONG)(1U << Block), Free) == Free)
+        {
+            return &g_BltRegionArena[Block];
+        }
+    }
+}
+
+static VOID FreeData(_In_ BLT_REGION_DATA* pData)
+{
+    LONG Bit = (LONG)(1U << (UINT)(pData - g_BltRegionArena));
+    for (;;)
+    {
+        LONG Free = g_BltRegionArenaFree;
+        if (InterlockedCompareExchange(&g_BltRegionArenaFree, Free | Bit, Free) == Free)
+        {
+            return;
+        }
+    }
+}
+
+static FORCEINLINE LONG LongMin(LONG A, LONG B)
+{
+    return (A < B) ? A : B;
+}
+
+static FORCEINLINE LONG LongMax(LONG A, LONG B)
+{
+    return (A > B) ? A : B;
+}
+
+static FORCEINLINE BOOLEAN RectIsEmpty(CONST RECT* pRect)
+{
+    return (pRect->left >= pRect->right) || (pRect->top >= pRect->bottom);
+}
+
+static FORCEINLINE BOOLEAN OpKeeps(BLT_REGION_OP Op, BOOLEAN InA, BOOLEAN InB)
+{
+    switch (Op)
+    {
+    case BLT_REGION_OP_UNION:       return InA || InB;
+    case BLT_REGION_OP_INTERSECT:   return InA && InB;
+    default:                        return InA && !InB;
+    }
+}
+
+// The first rect past the band that starts at pRects[First]
+static FORCEINLINE UINT BandEnd(CONST RECT* pRects, UINT NumRects, UINT First)
+{
+    LONG Top = pRects[First].top;
+    UINT Last = First + 1;
+    while ((Last < NumRects) && (pRects[Last].top == Top))
+    {
+        Last++;
+    }
+    return Last;
+}
+
+// Appends the spans of rows Top to Bottom that the operation keeps of the
+// spans of a band of each region, either of which may have none
+static BOOLEAN OpSpans(
+    BLT_REGION_OP   Op,
+    _In_reads_(NumA) CONST RECT* pA,
+    UINT            NumA,
+    _In_reads_(NumB) CONST RECT* pB,
+    UINT            NumB,
+    LONG            Top,
+    LONG            Bottom,
+    _Inout_updates_(BLT_REGION_RECTS) RECT* pOut,
+    _Inout_ UINT*   pNumOut)
+{
+    UINT NumOut = *pNumOut;
+    UINT First = NumOut;
+    UINT iA = 0;
+    UINT iB = 0;
+    LONG X = (NumA > 0) ? pA[0].left : MAXLONG;
+    X = ((NumB > 0) && (pB[0].left < X)) ? pB[0].left : X;
+
+    for (;;)
+    {
+        BOOLEAN InA = (iA < NumA) && (pA[iA].left <= X);
+        BOOLEAN InB = (iB < NumB) && (pB[iB].left <= X);
+
+        // The next column either region starts or stops a span at
+        LONG Next = MAXLONG;
+        if (iA < NumA)
+        {
+            Next = InA ? pA[iA].right : pA[iA].left;
+        }
+        if (iB < NumB)
+        {
+            LONG NextB = InB ? pB[iB].right : pB[iB].left;
+            Next = (NextB < Next) ? NextB : Next;
+        }
+        if (Next == MAXLONG)
+        {
+            break;
+        }
+
+        if (OpKeeps(Op, InA, InB))
+        {
+            if ((NumOut > First) && (pOut[NumOut - 1].right == X))
+            {
+                pOut[NumOut - 1].right = Next;
+            }
+            else
+            {
+                if (NumOut == BLT_REGION_RECTS)
+                {
+                    return FALSE;
+                }
+                pOut[NumOut].left = X;
+                pOut[NumOut].top = Top;
+                pOut[NumOut].right = Next;
+                pOut[NumOut].bottom = Bottom;
+                NumOut++;
+            }
+        }
+
+        if (InA && (pA[iA].right == Next))
+        {
+            iA++;
+        }
+        if (InB && (pB[iB].right == Next))
+        {
+            iB++;
+        }
+        X = Next;
+    }
+
+    *pNumOut = NumOut;
+    return TRUE;
+}
+
+// Banded rects of the operation on two lists of banded rects, FALSE if
+// they do not fit BLT_REGION_RECTS
+static BOOLEAN OpRects(
+    BLT_REGION_OP   Op,
+    _In_reads_(NumA) CONST RECT* pA,
+    UINT            NumA,
+    _In_reads_(NumB) CONST RECT* pB,
+    UINT            NumB,
+    _Out_writes_(BLT_REGION_RECTS) RECT* pOut,
+    _Out_ UINT*     pNumOut)
+{
+    UINT NumOut = 0;
+    UINT PrevBand = 0;      // First rect of the last band put out
+    UINT iA = 0;
+    UINT iB = 0;
+    LONG Y = (NumA > 0) ? pA[0].top : MAXLONG;
+    Y = ((NumB > 0) && (pB[0].top < Y)) ? pB[0].top : Y;
+
+    *pNumOut = 0;
+    for (;;)
+    {
+        BOOLEAN InA = (iA < NumA) && (pA[iA].top <= Y);
+        BOOLEAN InB = (iB < NumB) && (pB[iB].top <= Y);
+        UINT EndA = InA ? BandEnd(pA, NumA, iA) : iA;
+        UINT EndB = InB ? BandEnd(pB, NumB, iB) : iB;
+
+        // The next row either region starts or stops a band at
+        LONG Next = MAXLONG;
+        if (iA < NumA)
+        {
+            Next = InA ? pA[iA].bottom : pA[iA].top;
+        }
+        if (iB < NumB)
+        {
+            LONG NextB = InB ? pB[iB].bottom : pB[iB].top;
+            Next = (NextB < Next) ? NextB : Next;
+        }
+        if (Next == MAXLONG)
+        {
+            break;
+        }
+
+        UINT Band = NumOut;
+        if (!OpSpans(Op, &pA[iA], EndA - iA, &pB[iB], EndB - iB, Y, Next, pOut, &NumOut))
+        {
+            return FALSE;
+        }
+
+        if (NumOut > Band)
+        {
+            // Rows with the same spans as the band right above only make it taller
+            BOOLEAN Same = (Band > PrevBand) && (pOut[PrevBand].bottom == Y) &&
+                           (NumOut - Band == Band - PrevBand);
+            for (UINT i = 0; Same && (i < NumOut - Band); i++)
+            {
+                Same = (pOut[PrevBand + i].left == pOut[Band + i].left) &&
+                       (pOut[PrevBand + i].right == pOut[Band + i].right);
+            }
+
+            if (Same)
+            {
+                for (UINT i = PrevBand; i < Band; i++)
+                {
+                    pOut[i].bottom = Next;
+                }
+                NumOut = Band;
+            }
+            else
+            {
+                PrevBand = Band;
+            }
+        }
+
+        if (InA && (pA[iA].bottom == Next))
+        {
+            iA = EndA;
+        }
+        if (InB && (pB[iB].bottom == Next))
+        {
+            iB = EndB;
+        }
+        Y = Next;
+    }
+
+    *pNumOut = NumOut;
+    return TRUE;
+}
+
+static BOOLEAN RegionOp(
+    BLT_REGION_OP   Op,
+    _Inout_ BLT_REGION* pDst,
+    _In_ CONST BLT_REGION* pA,
+    _In_ CONST BLT_REGION* pB)
+{
+    // What the result is approximated by, worked out before pDst changes
+    // since it may be one of the others
+    RECT Bound = { 0, 0, 0, 0 };
+    BOOLEAN EmptyA = BltRegionIsEmpty(pA);
+    BOOLEAN EmptyB = BltRegionIsEmpty(pB);
+    switch (Op)
+    {
+    case BLT_REGION_OP_UNION:
+        if (EmptyA || EmptyB)
+        {
+            Bound = EmptyA ? pB->Extents : pA->Extents;
+        }
+        else
+        {
+            Bound.left = LongMin(pA->Extents.left, pB->Extents.left);
+            Bound.top = LongMin(pA->Extents.top, pB->Extents.top);
+            Bound.right = LongMax(pA->Extents.right, pB->Extents.right);
+            Bound.bottom = LongMax(pA->Extents.bottom, pB->Extents.bottom);
+        }
+        break;
+
+    case BLT_REGION_OP_INTERSECT:
+        Bound.left = LongMax(pA->Extents.left, pB->Extents.left);
+        Bound.top = LongMax(pA->Extents.top, pB->Extents.top);
+        Bound.right = LongMin(pA->Extents.right, pB->Extents.right);
+        Bound.bottom = LongMin(pA->Extents.bottom, pB->Extents.bottom);
+        break;
+
+    default:
+        Bound = pA->Extents;
+        break;
+    }
+    if (RectIsEmpty(&Bound))
+    {
+        BltRegionFini(pDst);
+        return TRUE;
+    }
+
+    CONST RECT* pRectsA;
+    CONST RECT* pRectsB;
+    UINT NumA = BltRegionGetRects(pA, &pRectsA);
+    UINT NumB = BltRegionGetRects(pB, &pRectsB);
+
+    BLT_REGION_DATA* pData = AllocData();
+    BOOLEAN Exact = (pData != NULL) &&
+                    OpRects(Op, pRectsA, NumA, pRectsB, NumB, pData->Rects, &pData->NumRects);
+
+    BltRegionFini(pDst);
+    if (!Exact)
+    {
+        if (pData != NULL)
+        {
+            FreeData(pData);
+        }
+        pDst->Extents = Bound;
+        return FALSE;
+    }
+
+    if (pData->NumRects <= 1)
+    {
+        if (pData->NumRects == 1)
+        {
+            pDst->Extents = pData->Rects[0];
+        }
+        FreeData(pData);
+        return TRUE;
+    }
+
+    // The bands are in order, only left and right have to be looked for
+    CONST RECT* pRects = pData->Rects;
+    pDst->Extents.top = pRects[0].top;
+    pDst->Extents.bottom = pRects[pData->NumRects - 1].bottom;
+    pDst->Extents.left = pRects[0].left;
+    pDst->Extents.right = pRects[0].right;
+    for (UINT i = 1; i < pData->NumRects; i++)
+    {
+        pDst->Extents.left = LongMin(pDst->Extents.left, pRects[i].left);
+        pDst->Extents.right = LongMax(pDst->Extents.right, pRects[i].right);
+    }
+    pDst->pData = pData;
+    return TRUE;
+}
+
+VOID BltRegionInit(_Out_ BLT_REGION* pRegion)
+{
+    RtlZeroMemory(&pRegion->Extents, sizeof(pRegion->Extents));
+    pRegion->pData = NULL;
+}
+
+VOID BltRegionInitRect(_Out_ BLT_REGION* pRegion, _In_ CONST RECT* pRect)
+{
+    BltRegionInit(pRegion);
+    if (!RectIsEmpty(pRect))
+    {
+        pRegion->Extents = *pRect;
+    }
+}
+
+VOID BltRegionFini(_Inout_ BLT_REGION* pRegion)
+{
+    if (pRegion->pData != NULL)
+    {
+        FreeData(pRegion->pData);
+    }
+    BltRegionInit(pRegion);
+}
+
+UINT BltRegionGetRects(_In_ CONST BLT_REGION* pRegion, _Out_ CONST RECT** ppRects)
+{
+    if (pRegion->pData != NULL)
+    {
+        *ppRects = pRegion->pData->Rects;
+        return pRegion->pData->NumRects;
+    }
+
+    *ppRects = &pRegion->Extents;
+    return BltRegionIsEmpty(pRegion) ? 0 : 1;
+}
+
+BOOLEAN BltRegionUnion(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB)
+{
+    return RegionOp(BLT_REGION_OP_UNION, pDst, pA, pB);
+}
+
+BOOLEAN BltRegionIntersect(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB)
+{
+    return RegionOp(BLT_REGION_OP_INTERSECT, pDst, pA, pB);
+}
+
+BOOLEAN BltRegionSubtract(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB)
+{
+    return RegionOp(BLT_REGION_OP_SUBTRACT, pDst, pA, pB);
+}
+
+BOOLEAN BltRegionUnionRect(_Inout_ BLT_REGION* pRegion, _In_ CONST RECT* pRect)
+{
+    // Nothing to do for a rect the region already has all of, which is
+    // what repeated damage of the same spot mostly is
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetRects(pRegion, &pRects);
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        if ((pRect->left >= pRects[i].left) && (pRect->right <= pRects[i].right) &&
+            (pRect->top >= pRects[i].top) && (pRect->bottom <= pRects[i].bottom))
+        {
+            return TRUE;
+        }
+    }
+
+    BLT_REGION Rect;
+    BltRegionInitRect(&Rect, pRect);
+    return RegionOp(BLT_REGION_OP_UNION, pRegion, pRegion, &Rect);
+}
+
+BOOLEAN BltRegionIntersectRect(_Inout_ BLT_REGION* pRegion, _In_ CONST RECT* pRect)
+{
+    BLT_REGION Rect;
+    BltRegionInitRect(&Rect, pRect);
+    return RegionOp(BLT_REGION_OP_INTERSECT, pRegion, pRegion, &Rect);
+}
+
+VOID BltRegionTranslate(_Inout_ BLT_REGION* pRegion, LONG Dx, LONG Dy)
+{
+    if (BltRegionIsEmpty(pRegion))
+    {
+        return;
+    }
+
+    pRegion->Extents.left += Dx;
+    pRegion->Extents.top += Dy;
+    pRegion->Extents.right += Dx;
+    pRegion->Extents.bottom += Dy;
+    if (pRegion->pData != NULL)
+    {
+        for (UINT i = 0; i < pRegion->pData->NumRects; i++)
+        {
+            pRegion->pData->Rects[i].left += Dx;
+            pRegion->pData->Rects[i].top += Dy;
+            pRegion->pData->Rects[i].right += Dx;
+            pRegion->pData->Rects[i].bottom += Dy;
+        }
+    }
+}
+
+UINT BltRegionGetBatch(_In_ CONST BLT_REGION* pRegion, UINT MaxRects, _Out_ CONST RECT** ppRects)
+{
+    UINT NumRects = BltRegionGetRects(pRegion, ppRects);
+    if (NumRects > MaxRects)
+    {
+        // Every rect is a message the host has to answer, reading a few
+        // more pixels is cheaper than a long list of them
+        *ppRects = &pRegion->Extents;
+        NumRects = 1;
+    }
+    return NumRects;
+}
+
+int BltRegionSend(_In_ CONST BLT_REGION* pRegion, UINT MaxRects, PFN_BLT_REGION_SEND pfnSend, _In_opt_ VOID* pContext)
+{
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetBatch(pRegion, MaxRects, &pRects);
+
+    int Result = 0;
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        int Status = pfnSend(pContext, (UINT32)pRects[i].left, (UINT32)pRects[i].top,
+                             (UINT32)(pRects[i].right - pRects[i].left), (UINT32)(pRects[i].bottom - pRects[i].top));
+        if (Status != 0)
+        {
+            Result = Status;
+        }
+    }
+    return Result;
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
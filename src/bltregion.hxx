@@ -0,0 +1,79 @@
+/******************************Module*Header*******************************\
+* Module Name: bltregion.hxx
+*
+* Regions of the framebuffer, for collecting what a target has to have
+* invalidated on the host before sending it off.
+*
+* A region is a list of y-x banded rects like the pixman ones: the rects
+* are sorted by top and then by left, the rects of a band share their top
+* and bottom and neither overlap nor touch, bands never overlap and two
+* bands that touch never have the same spans. That makes the rects of a
+* region the fewest non-overlapping ones its operations can come up with,
+* and the same pixels always give the same rects.
+*
+* A region of up to one rect is just its extents. The rects of bigger ones
+* come from a fixed arena of BLT_REGION_ARENA_BLOCKS blocks of
+* BLT_REGION_RECTS each, so the operations never touch pool and can be used
+* at any IRQL. A result that does not fit a block, or finds the arena
+* empty, is approximated by a single rect that holds all of it, which is
+* always safe for damage.
+*
+\**************************************************************************/
+
+#ifndef _BLTREGION_HXX_
+#define _BLTREGION_HXX_
+
+#include "bltport.hxx"
+
+// Rects a region can have before it is approximated by its extents
+#define BLT_REGION_RECTS            128
+
+// Regions of more than one rect that can be around at the same time. Every
+// target keeps one and each operation needs one more for its result.
+#define BLT_REGION_ARENA_BLOCKS     32
+
+inline BOOLEAN BltRegionIsEmpty(CONST BLT_REGION* pRegion)
+{
+    return (pRegion->Extents.left >= pRegion->Extents.right) ||
+           (pRegion->Extents.top >= pRegion->Extents.bottom);
+}
+
+// Makes an empty region
+VOID BltRegionInit(_Out_ BLT_REGION* pRegion);
+
+// Makes a region of pRect, which may be empty
+VOID BltRegionInitRect(_Out_ BLT_REGION* pRegion, _In_ CONST RECT* pRect);
+
+// Gives the rects of a region back to the arena, it is empty afterwards
+VOID BltRegionFini(_Inout_ BLT_REGION* pRegion);
+
+// Points *ppRects at the banded rects of a region and returns how many there are
+UINT BltRegionGetRects(_In_ CONST BLT_REGION* pRegion, _Out_ CONST RECT** ppRects);
+
+// Set operations, pDst may be pA or pB. They return FALSE if the result
+// was approximated by a rect that holds all of it.
+BOOLEAN BltRegionUnion(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB);
+BOOLEAN BltRegionIntersect(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB);
+BOOLEAN BltRegionSubtract(_Inout_ BLT_REGION* pDst, _In_ CONST BLT_REGION* pA, _In_ CONST BLT_REGION* pB);
+
+// Adds a rect to a region
+BOOLEAN BltRegionUnionRect(_Inout_ BLT_REGION* pRegion, _In_ CONST RECT* pRect);
+
+// Clips a region to a rect
+BOOLEAN BltRegionIntersectRect(_Inout_ BLT_REGION* pRegion, _In_ CONST RECT* pRect);
+
+// Moves every rect of a region by Dx, Dy
+VOID BltRegionTranslate(_Inout_ BLT_REGION* pRegion, LONG Dx, LONG Dy);
+
+// Points *ppRects at the rects of a region if it has at most MaxRects of
+// them, at its extents otherwise, and returns how many that is
+UINT BltRegionGetBatch(_In_ CONST BLT_REGION* pRegion, UINT MaxRects, _Out_ CONST RECT** ppRects);
+
+// Tells a display handler about a rect of damage, shaped like pv_display's invalidate_region
+typedef int (*PFN_BLT_REGION_SEND)(VOID* pContext, UINT32 X, UINT32 Y, UINT32 Width, UINT32 Height);
+
+// Hands a region to pfnSend in at most MaxRects calls, see BltRegionGetBatch.
+// Returns the last error pfnSend gave, 0 if there was none.
+int BltRegionSend(_In_ CONST BLT_REGION* pRegion, UINT MaxRects, PFN_BLT_REGION_SEND pfnSend, _In_opt_ VOID* pContext);
+
+#endif // _BLTREGION_HXX_
@@ -0,0 +1,318 @@
+/******************************Module*Header*******************************\
+* Module Name: bltring.cxx
+*
+* Damage rings and the damage forwarder, see bltring.hxx.
+*
+* Push publishes Head with a release and Pop publishes Tail with one, each
+* then has a full barrier before it reads the other side's index. Either
+* the producer sees the Tail of a ring the consumer has just emptied and
+* kicks it, or the consumer sees the new Head before it goes to sleep, so
+* no damage waits in the ring for the next kick.
+*
+* The producer keeps the last record free for a record of the whole
+* screen, so there is always room for one when damage does not fit.
+*
+* Only the thread creation differs between the driver and BLT_HOST_BUILD.
+*
+\**************************************************************************/
+
+#include "bltring.hxx"
+
+#ifdef BLT_HOST_BUILD
+typedef pthread_t BLT_THREAD;
+#else
+typedef PKTHREAD BLT_THREAD;
+#endif
+
+C_ASSERT(sizeof(BLT_DAMAGE_RING) <= BLT_DAMAGE_RING_BYTES);
+
+// Records the forwarder thread takes from the ring at a time
+#define BLT_FORWARDER_BATCH     16
+
+struct _BLT_DAMAGE_FORWARDER
+{
+    BLT_DAMAGE_RING*        pRing;
+    BLT_DAMAGE_PRODUCER     Producer;
+    BLT_EVENT               Kick;       // Set by the producer and by destroy
+    volatile ULONG          Stop;
+    BLT_THREAD              Thread;
+    PFN_BLT_REGION_SEND     pfnSend;
+    VOID*                   pContext;
+};
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+BOOLEAN BltDamagePush(
+    _Inout_ BLT_DAMAGE_PRODUCER* pProducer,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects)
+{
+    if (NumRects == 0)
+    {
+        return TRUE;
+    }
+
+    BLT_DAMAGE_RING* pRing = pProducer->pRing;
+    ULONG Head = pProducer->Head;
+    ULONG Tail = BltReadAcquire(&pRing->Tail);
+    ULONG Used = Head - Tail;
+
+    if (pProducer->FullPending)
+    {
+        if ((LONG)(pProducer->FullRecord - Tail) > 0)
+        {
+            // Not read yet, and the host reads the framebuffer after it
+            return FALSE;
+        }
+        pProducer->FullPending = FALSE;
+    }
+
+    // Only the last record may fill the ring and that is always one of the
+    // whole screen, which was handled above. Anything else is a Tail the
+    // consumer should not have written.
+    if (Used >= BLT_DAMAGE_RING_RECORDS)
+    {
+        BDD_LOG_ERROR("XENWDDM!%s bad ring, Head = %u, Tail = %u\n", __FUNCTION__, Head, Tail);
+        return FALSE;
+    }
+
+    BOOLEAN Fits = (NumRects < BLT_DAMAGE_RING_RECORDS - Used);
+    if (Fits)
+    {
+        for (UINT i = 0; i < NumRects; i++, Head++)
+        {
+            BLT_DAMAGE_RECORD* pRecord = &pRing->Records[Head % BLT_DAMAGE_RING_RECORDS];
+            pRecord->X = (UINT32)pRects[i].left;
+            pRecord->Y = (UINT32)pRects[i].top;
+            pRecord->Width = (UINT32)(pRects[i].right - pRects[i].left);
+            pRecord->Height = (UINT32)(pRects[i].bottom - pRects[i].top);
+        }
+    }
+    else
+    {
+        BLT_DAMAGE_RECORD* pRecord = &pRing->Records[Head % BLT_DAMAGE_RING_RECORDS];
+        pRecord->X = 0;
+        pRecord->Y = 0;
+        pRecord->Width = BLT_DAMAGE_FULL;
+        pRecord->Height = BLT_DAMAGE_FULL;
+        Head++;
+
+        pProducer->FullRecord = Head;
+        pProducer->FullPending = TRUE;
+    }
+
+    ULONG OldHead = pProducer->Head;
+    pProducer->Head = Head;
+    BltWriteRelease(&pRing->Head, Head);
+    BltMemoryBarrier();
+
+    if (BltReadAcquire(&pRing->Tail) == OldHead)
+    {
+        pProducer->pfnKick(pProducer->pKickContext);
+    }
+    return Fits;
+}
+
+UINT BltDamagePop(
+    _Inout_ BLT_DAMAGE_RING* pRing,
+    _Out_writes_(MaxRecords) BLT_DAMAGE_RECORD* pRecords,
+    UINT  MaxRecords)
+{
+    ULONG Tail = pRing->Tail;
+    ULONG Head = BltReadAcquire(&pRing->Head);
+    UINT Count = Head - Tail;
+    NT_ASSERT(Count <= BLT_DAMAGE_RING_RECORDS);
+
+    Count = (Count < MaxRecords) ? Count : MaxRecords;
+    for (UINT i = 0; i < Count; i++)
+    {
+        pRecords[i] = pRing->Records[(Tail + i) % BLT_DAMAGE_RING_RECORDS];
+    }
+
+    if (Count != 0)
+    {
+        BltWriteRelease(&pRing->Tail, Tail + Count);
+    }
+    BltMemoryBarrier();
+    return Count;
+}
+
+static VOID BltForwarderKick(VOID* pContext)
+{
+    BltEventSet(&((BLT_DAMAGE_FORWARDER*)pContext)->Kick);
+}
+
+VOID BltDamageForward(_Inout_ BLT_DAMAGE_FORWARDER* pForwarder, _In_ CONST BLT_REGION* pRegion, UINT MaxRects)
+{
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetBatch(pRegion, MaxRects, &pRects);
+
+    BltDamagePush(&pForwarder->Producer, NumRects, pRects);
+}
+
+static VOID BltForwarderRun(_Inout_ BLT_DAMAGE_FORWARDER* pForwarder)
+{
+    BLT_DAMAGE_RECORD Records[BLT_FORWARDER_BATCH];
+
+    for (;;)
+    {
+        // Read before the ring, whatever was forwarded before destroy is
+        // then seen by this Pop at the latest
+        BOOLEAN Stopping = (BltReadAcquire(&pForwarder->Stop) != 0);
+
+        UINT Count = BltDamagePop(pForwarder->pRing, Records, ARRAYSIZE(Records));
+        for (UINT i = 0; i < Count; i++)
+        {
+            pForwarder->pfnSend(pForwarder->pContext, Records[i].X, Records[i].Y, Records[i].Width, Records[i].Height);
+        }
+
+        if (Count == 0)
+        {
+            if (Stopping)
+            {
+                break;
+            }
+            BltEventWait(&pForwarder->Kick);
+        }
+    }
+}
+
+#ifdef BLT_HOST_BUILD
+static VOID* BltForwarderThread(VOID* pContext)
+{
+    BltForwarderRun((BLT_DAMAGE_FORWARDER*)pContext);
+    return NULL;
+}
+#else
+static KSTART_ROUTINE BltForwarderThread;
+
+static VOID BltForwarderThread(PVOID pContext)
+{
+    BltForwarderRun((BLT_DAMAGE_FORWARDER*)pContext);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+#endif
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+#pragma code_seg(push)
+#pragma code_seg("PAGE")
+// BEGIN: Paged Code
+
+VOID BltDamageRingInit(_Out_ BLT_DAMAGE_RING* pRing)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(pRing, sizeof(*pRing));
+}
+
+VOID BltDamageProducerInit(
+    _Out_ BLT_DAMAGE_PRODUCER* pProducer,
+    _In_ BLT_DAMAGE_RING* pRing,
+    PFN_BLT_DAMAGE_KICK pfnKick,
+    _In_opt_ VOID* pKickContext)
+{
+    PAGED_CODE();
+
+    pProducer->pRing = pRing;
+    pProducer->Head = pRing->Head;
+    pProducer->FullRecord = 0;
+    pProducer->FullPending = FALSE;
+    pProducer->pfnKick = pfnKick;
+    pProducer->pKickContext = pKickContext;
+}
+
+static NTSTATUS BltStartForwarderThread(_Inout_ BLT_DAMAGE_FORWARDER* pForwarder)
+{
+    PAGED_CODE();
+
+#ifdef BLT_HOST_BUILD
+    if (pthread_create(&pForwarder->Thread, NULL, BltForwarderThread, pForwarder) != 0)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return STATUS_SUCCESS;
+#else
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hThread;
+    NTSTATUS Status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, BltForwarderThread, pForwarder);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    // Keep the thread object around so destroy can wait for it
+    Status = ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID*)&pForwarder->Thread, NULL);
+    NT_ASSERT(NT_SUCCESS(Status));
+    ZwClose(hThread);
+    return Status;
+#endif
+}
+
+BLT_DAMAGE_FORWARDER* BltCreateDamageForwarder(PFN_BLT_REGION_SEND pfnSend, _In_opt_ VOID* pContext)
+{
+    PAGED_CODE();
+
+    BLT_DAMAGE_FORWARDER* pForwarder = (BLT_DAMAGE_FORWARDER*)BltAllocate(sizeof(BLT_DAMAGE_FORWARDER));
+    if (pForwarder == NULL)
+    {
+        return NULL;
+    }
+    RtlZeroMemory(pForwarder, sizeof(*pForwarder));
+
+    pForwarder->pRing = (BLT_DAMAGE_RING*)BltAllocate(BLT_DAMAGE_RING_BYTES);
+    if (pForwarder->pRing == NULL)
+    {
+        BltFree(pForwarder);
+        return NULL;
+    }
+
+    BltDamageRingInit(pForwarder->pRing);
+    BltDamageProducerInit(&pForwarder->Producer, pForwarder->pRing, BltForwarderKick, pForwarder);
+    BltEventInitialize(&pForwarder->Kick);
+    pForwarder->pfnSend = pfnSend;
+    pForwarder->pContext = pContext;
+
+    NTSTATUS Status = BltStartForwarderThread(pForwarder);
+    if (!NT_SUCCESS(Status))
+    {
+        BDD_LOG_ERROR("XENWDDM!%s failed to start the damage forwarder thread, Status = 0x%I64x\n", __FUNCTION__, Status);
+        BltFree(pForwarder->pRing);
+        BltFree(pForwarder);
+        return NULL;
+    }
+
+    BDD_LOG_EVENT("XENWDDM!%s damage forwarder, %u records deep\n", __FUNCTION__, BLT_DAMAGE_RING_RECORDS);
+    return pForwarder;
+}
+
+VOID BltDestroyDamageForwarder(_In_opt_ BLT_DAMAGE_FORWARDER* pForwarder)
+{
+    PAGED_CODE();
+
+    if (pForwarder == NULL)
+    {
+        return;
+    }
+
+    BltWriteRelease(&pForwarder->Stop, 1);
+    BltEventSet(&pForwarder->Kick);
+
+#ifdef BLT_HOST_BUILD
+    pthread_join(pForwarder->Thread, NULL);
+#else
+    KeWaitForSingleObject(pForwarder->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(pForwarder->Thread);
+#endif
+
+    BltFree(pForwarder->pRing);
+    BltFree(pForwarder);
+}
+
+// END: Paged Code
+#pragma code_seg(pop)
@@ -0,0 +1,111 @@
+/******************************Module*Header*******************************\
+* Module Name: bltring.hxx
+*
+* Damage rings, for handing a target's damage to whoever tells the host
+* about it without a lock and without waiting for it.
+*
+* A ring is a page shared by one producer and one consumer. Head and Tail
+* count the records written and read since the ring was made, the producer
+* only writes Head and the records, the consumer only writes Tail. The
+* producer kicks the consumer only when it puts records in a ring it sees
+* empty, a consumer sleeps until it is kicked once it finds the ring empty.
+*
+* A ring that has no room left gets a record of the whole screen instead of
+* the damage that does not fit. Nothing else is written while that record
+* is unread, it already covers everything.
+*
+* A damage forwarder is a ring with a thread of its own as its consumer,
+* which hands the records to a display handler. Like the blit engines the
+* rings and the forwarder build as a normal program with BLT_HOST_BUILD,
+* the forwarder then runs on a pthread.
+*
+\**************************************************************************/
+
+#ifndef _BLTRING_HXX_
+#define _BLTRING_HXX_
+
+#include "bltport.hxx"
+#include "bltregion.hxx"
+
+#define BLT_DAMAGE_RING_RECORDS     128
+
+// A ring is allocated as a page of its own, so it can be granted to the host
+#define BLT_DAMAGE_RING_BYTES       4096
+
+// Width and Height of a record of the whole screen, the consumer clips it
+#define BLT_DAMAGE_FULL             MAXUINT
+
+typedef struct _BLT_DAMAGE_RECORD
+{
+    UINT32  X;
+    UINT32  Y;
+    UINT32  Width;
+    UINT32  Height;
+} BLT_DAMAGE_RECORD;
+
+// What is shared, Head and Tail each have a cache line to themselves. The
+// consumer may be the host, so the producer never trusts Tail to be sane.
+typedef struct _BLT_DAMAGE_RING
+{
+    volatile ULONG      Head;
+    BYTE                HeadPad[BLT_CACHE_LINE - sizeof(ULONG)];
+    volatile ULONG      Tail;
+    BYTE                TailPad[BLT_CACHE_LINE - sizeof(ULONG)];
+    BLT_DAMAGE_RECORD   Records[BLT_DAMAGE_RING_RECORDS];
+} BLT_DAMAGE_RING;
+
+// Wakes the consumer of a ring, the event channel kick for the host
+typedef VOID (*PFN_BLT_DAMAGE_KICK)(VOID* pContext);
+
+// What only the producer knows, kept out of the shared page
+typedef struct _BLT_DAMAGE_PRODUCER
+{
+    BLT_DAMAGE_RING*    pRing;
+    ULONG               Head;
+    ULONG               FullRecord;     // Head after the last record of the whole screen
+    BOOLEAN             FullPending;    // FullRecord may not have been read yet
+    PFN_BLT_DAMAGE_KICK pfnKick;
+    VOID*               pKickContext;
+} BLT_DAMAGE_PRODUCER;
+
+// Makes an empty ring
+VOID BltDamageRingInit(_Out_ BLT_DAMAGE_RING* pRing);
+
+VOID BltDamageProducerInit(
+    _Out_ BLT_DAMAGE_PRODUCER* pProducer,
+    _In_ BLT_DAMAGE_RING* pRing,
+    PFN_BLT_DAMAGE_KICK pfnKick,
+    _In_opt_ VOID* pKickContext);
+
+// Puts the rects in the ring, the damage has to be in the framebuffer
+// already. Returns FALSE if they went as the whole screen, either because
+// they did not fit or because a record of it was still unread.
+BOOLEAN BltDamagePush(
+    _Inout_ BLT_DAMAGE_PRODUCER* pProducer,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects);
+
+// Takes up to MaxRecords records from the ring and returns how many. The
+// framebuffer is only to be read after that, once it returns 0 the
+// consumer waits for a kick.
+UINT BltDamagePop(
+    _Inout_ BLT_DAMAGE_RING* pRing,
+    _Out_writes_(MaxRecords) BLT_DAMAGE_RECORD* pRecords,
+    UINT  MaxRecords);
+
+struct _BLT_DAMAGE_FORWARDER;
+typedef struct _BLT_DAMAGE_FORWARDER BLT_DAMAGE_FORWARDER;
+
+// Starts a forwarder that calls pfnSend for every record on its own
+// thread. pfnSend gets BLT_DAMAGE_FULL for the whole screen. Returns NULL
+// if it can not be created.
+BLT_DAMAGE_FORWARDER* BltCreateDamageForwarder(PFN_BLT_REGION_SEND pfnSend, _In_opt_ VOID* pContext);
+
+// Queues a region as at most MaxRects records, see BltRegionGetBatch. Only
+// one thread at a time may forward to a forwarder.
+VOID BltDamageForward(_Inout_ BLT_DAMAGE_FORWARDER* pForwarder, _In_ CONST BLT_REGION* pRegion, UINT MaxRects);
+
+// Sends whatever is still queued and stops the thread
+VOID BltDestroyDamageForwarder(_In_opt_ BLT_DAMAGE_FORWARDER* pForwarder);
+
+#endif // _BLTRING_HXX_
@@ -0,0 +1,2114 @@
+/******************************Module*Header*******************************\
+* Module Name: bltsimd.cxx
+*
+* SIMD row kernels for the blt functions and their runtime dispatch.
+*
+* Every kernel comes in an SSE2, AVX2 and AVX-512 flavour plus a plain C
+* fallback. BltSimdInitialize picks the best tier from CPUID once, and each
+* BltBits call brackets its work with BltSimdBegin/BltSimdEnd which save the
+* extended processor state the tier needs (AVX on x64, everything on x86).
+*
+* This file only depends on bltport.hxx so it can be built with
+* BLT_HOST_BUILD defined and benchmarked against a plain memcpy.
+*
+\**************************************************************************/
+
+#include "bltsimd.hxx"
+
+// Extended processor state each tier touches. x64 kernel code may use
+// XMM registers freely, x86 has to save them like any other FPU state.
+#if defined(BLT_HOST_BUILD)
+#define BLT_XSTATE_SSE      0
+#define BLT_XSTATE_AVX      0
+#define BLT_XSTATE_AVX512   0
+#else
+#if defined(_M_IX86)
+#define BLT_XSTATE_SSE      XSTATE_MASK_LEGACY
+#else
+#define BLT_XSTATE_SSE      0
+#endif
+#define BLT_XSTATE_AVX      (BLT_XSTATE_SSE | XSTATE_MASK_AVX)
+#ifdef XSTATE_MASK_AVX512
+#define BLT_XSTATE_AVX512   (BLT_XSTATE_AVX | XSTATE_MASK_AVX512)
+#endif
+#endif
+
+// Used when nothing is known about the cache hierarchy
+#define BLT_DEFAULT_LLC_SIZE    (8 * 1024 * 1024)
+
+// Rows shorter than this are not worth aligning for streaming stores
+#define BLT_MIN_STREAM_ROW      256
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+//
+// Plain C
+//
+
+static VOID CopyRowScalar(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    RtlCopyMemory(pDst, pSrc, Bytes);
+}
+
+//
+// SSE2
+//
+
+static VOID CopyRowSse2(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < 16)
+    {
+        RtlCopyMemory(pDst, pSrc, Bytes);
+        return;
+    }
+
+    // The last 16 bytes are always written by one unaligned store which may
+    // overlap what the loop wrote, so no scalar tail is needed.
+    __m128i Last = _mm_loadu_si128((CONST __m128i*)(pSrc + Bytes - 16));
+    BYTE* pLast = pDst + Bytes - 16;
+
+    while (Bytes >= 64)
+    {
+        __m128i a = _mm_loadu_si128((CONST __m128i*)(pSrc + 0));
+        __m128i b = _mm_loadu_si128((CONST __m128i*)(pSrc + 16));
+        __m128i c = _mm_loadu_si128((CONST __m128i*)(pSrc + 32));
+        __m128i d = _mm_loadu_si128((CONST __m128i*)(pSrc + 48));
+        _mm_storeu_si128((__m128i*)(pDst + 0), a);
+        _mm_storeu_si128((__m128i*)(pDst + 16), b);
+        _mm_storeu_si128((__m128i*)(pDst + 32), c);
+        _mm_storeu_si128((__m128i*)(pDst + 48), d);
+        pDst += 64;
+        pSrc += 64;
+        Bytes -= 64;
+    }
+    while (Bytes >= 16)
+    {
+        _mm_storeu_si128((__m128i*)pDst, _mm_loadu_si128((CONST __m128i*)pSrc));
+        pDst += 16;
+        pSrc += 16;
+        Bytes -= 16;
+    }
+    _mm_storeu_si128((__m128i*)pLast, Last);
+}
+
+static VOID CopyRowStreamSse2(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < BLT_MIN_STREAM_ROW)
+    {
+        CopyRowSse2(pDst, pSrc, Bytes);
+        return;
+    }
+
+    // Unaligned head, then advance to the first 16 byte aligned destination
+    __m128i Last = _mm_loadu_si128((CONST __m128i*)(pSrc + Bytes - 16));
+    BYTE* pLast = pDst + Bytes - 16;
+    _mm_storeu_si128((__m128i*)pDst, _mm_loadu_si128((CONST __m128i*)pSrc));
+    SIZE_T Skew = 16 - ((ULONG_PTR)pDst & 15);
+    pDst += Skew;
+    pSrc += Skew;
+    Bytes -= Skew;
+
+    while (Bytes >= 64)
+    {
+        __m128i a = _mm_loadu_si128((CONST __m128i*)(pSrc + 0));
+        __m128i b = _mm_loadu_si128((CONST __m128i*)(pSrc + 16));
+        __m128i c = _mm_loadu_si128((CONST __m128i*)(pSrc + 32));
+        __m128i d = _mm_loadu_si128((CONST __m128i*)(pSrc + 48));
+        _mm_stream_si128((__m128i*)(pDst + 0), a);
+        _mm_stream_si128((__m128i*)(pDst + 16), b);
+        _mm_stream_si128((__m128i*)(pDst + 32), c);
+        _mm_stream_si128((__m128i*)(pDst + 48), d);
+        pDst += 64;
+        pSrc += 64;
+        Bytes -= 64;
+    }
+    while (Bytes >= 16)
+    {
+        _mm_stream_si128((__m128i*)pDst, _mm_loadu_si128((CONST __m128i*)pSrc));
+        pDst += 16;
+        pSrc += 16;
+        Bytes -= 16;
+    }
+    _mm_storeu_si128((__m128i*)pLast, Last);
+}
+
+//
+// AVX2
+//
+
+BLT_TARGET_AVX2
+static VOID CopyRowAvx2(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < 32)
+    {
+        CopyRowSse2(pDst, pSrc, Bytes);
+        return;
+    }
+
+    __m256i Last = _mm256_loadu_si256((CONST __m256i*)(pSrc + Bytes - 32));
+    BYTE* pLast = pDst + Bytes - 32;
+
+    while (Bytes >= 128)
+    {
+        __m256i a = _mm256_loadu_si256((CONST __m256i*)(pSrc + 0));
+        __m256i b = _mm256_loadu_si256((CONST __m256i*)(pSrc + 32));
+        __m256i c = _mm256_loadu_si256((CONST __m256i*)(pSrc + 64));
+        __m256i d = _mm256_loadu_si256((CONST __m256i*)(pSrc + 96));
+        _mm256_storeu_si256((__m256i*)(pDst + 0), a);
+        _mm256_storeu_si256((__m256i*)(pDst + 32), b);
+        _mm256_storeu_si256((__m256i*)(pDst + 64), c);
+        _mm256_storeu_si256((__m256i*)(pDst + 96), d);
+        pDst += 128;
+        pSrc += 128;
+        Bytes -= 128;
+    }
+    while (Bytes >= 32)
+    {
+        _mm256_storeu_si256((__m256i*)pDst, _mm256_loadu_si256((CONST __m256i*)pSrc));
+        pDst += 32;
+        pSrc += 32;
+        Bytes -= 32;
+    }
+    _mm256_storeu_si256((__m256i*)pLast, Last);
+}
+
+BLT_TARGET_AVX2
+static VOID CopyRowStreamAvx2(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < BLT_MIN_STREAM_ROW)
+    {
+        CopyRowAvx2(pDst, pSrc, Bytes);
+        return;
+    }
+
+    __m256i Last = _mm256_loadu_si256((CONST __m256i*)(pSrc + Bytes - 32));
+    BYTE* pLast = pDst + Bytes - 32;
+    _mm256_storeu_si256((__m256i*)pDst, _mm256_loadu_si256((CONST __m256i*)pSrc));
+    SIZE_T Skew = 32 - ((ULONG_PTR)pDst & 31);
+    pDst += Skew;
+    pSrc += Skew;
+    Bytes -= Skew;
+
+    while (Bytes >= 128)
+    {
+        __m256i a = _mm256_loadu_si256((CONST __m256i*)(pSrc + 0));
+        __m256i b = _mm256_loadu_si256((CONST __m256i*)(pSrc + 32));
+        __m256i c = _mm256_loadu_si256((CONST __m256i*)(pSrc + 64));
+        __m256i d = _mm256_loadu_si256((CONST __m256i*)(pSrc + 96));
+        _mm256_stream_si256((__m256i*)(pDst + 0), a);
+        _mm256_stream_si256((__m256i*)(pDst + 32), b);
+        _mm256_stream_si256((__m256i*)(pDst + 64), c);
+        _mm256_stream_si256((__m256i*)(pDst + 96), d);
+        pDst += 128;
+        pSrc += 128;
+        Bytes -= 128;
+    }
+    while (Bytes >= 32)
+    {
+        _mm256_stream_si256((__m256i*)pDst, _mm256_loadu_si256((CONST __m256i*)pSrc));
+        pDst += 32;
+        pSrc += 32;
+        Bytes -= 32;
+    }
+    _mm256_storeu_si256((__m256i*)pLast, Last);
+}
+
+//
+// AVX-512
+//
+
+BLT_TARGET_AVX512
+static VOID CopyRowAvx512(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < 64)
+    {
+        // Masked moves handle the short rows without touching other bytes
+        __mmask64 Mask = ((__mmask64)1 << Bytes) - 1;
+        _mm512_mask_storeu_epi8(pDst, Mask, _mm512_maskz_loadu_epi8(Mask, pSrc));
+        return;
+    }
+
+    __m512i Last = _mm512_loadu_si512((CONST VOID*)(pSrc + Bytes - 64));
+    BYTE* pLast = pDst + Bytes - 64;
+
+    while (Bytes >= 256)
+    {
+        __m512i a = _mm512_loadu_si512((CONST VOID*)(pSrc + 0));
+        __m512i b = _mm512_loadu_si512((CONST VOID*)(pSrc + 64));
+        __m512i c = _mm512_loadu_si512((CONST VOID*)(pSrc + 128));
+        __m512i d = _mm512_loadu_si512((CONST VOID*)(pSrc + 192));
+        _mm512_storeu_si512((VOID*)(pDst + 0), a);
+        _mm512_storeu_si512((VOID*)(pDst + 64), b);
+        _mm512_storeu_si512((VOID*)(pDst + 128), c);
+        _mm512_storeu_si512((VOID*)(pDst + 192), d);
+        pDst += 256;
+        pSrc += 256;
+        Bytes -= 256;
+    }
+    while (Bytes >= 64)
+    {
+        _mm512_storeu_si512((VOID*)pDst, _mm512_loadu_si512((CONST VOID*)pSrc));
+        pDst += 64;
+        pSrc += 64;
+        Bytes -= 64;
+    }
+    _mm512_storeu_si512((VOID*)pLast, Last);
+}
+
+BLT_TARGET_AVX512
+static VOID CopyRowStreamAvx512(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    if (Bytes < BLT_MIN_STREAM_ROW)
+    {
+        CopyRowAvx512(pDst, pSrc, Bytes);
+        return;
+    }
+
+    __m512i Last = _mm512_loadu_si512((CONST VOID*)(pSrc + Bytes - 64));
+    BYTE* pLast = pDst + Bytes - 64;
+    _mm512_storeu_si512((VOID*)pDst, _mm512_loadu_si512((CONST VOID*)pSrc));
+    SIZE_T Skew = 64 - ((ULONG_PTR)pDst & 63);
+    pDst += Skew;
+    pSrc += Skew;
+    Bytes -= Skew;
+
+    while (Bytes >= 256)
+    {
+        __m512i a = _mm512_loadu_si512((CONST VOID*)(pSrc + 0));
+        __m512i b = _mm512_loadu_si512((CONST VOID*)(pSrc + 64));
+        __m512i c = _mm512_loadu_si512((CONST VOID*)(pSrc + 128));
+        __m512i d = _mm512_loadu_si512((CONST VOID*)(pSrc + 192));
+        _mm512_stream_si512((__m512i*)(pDst + 0), a);
+        _mm512_stream_si512((__m512i*)(pDst + 64), b);
+        _mm512_stream_si512((__m512i*)(pDst + 128), c);
+        _mm512_stream_si512((__m512i*)(pDst + 192), d);
+        pDst += 256;
+        pSrc += 256;
+        Bytes -= 256;
+    }
+    while (Bytes >= 64)
+    {
+        _mm512_stream_si512((__m512i*)pDst, _mm512_loadu_si512((CONST VOID*)pSrc));
+        pDst += 64;
+        pSrc += 64;
+        Bytes -= 64;
+    }
+    _mm512_storeu_si512((VOID*)pLast, Last);
+}
+
+//
+// Rotation
+//
+// ROTATE90/270 turn source rows into destination columns. Walking a whole
+// source row at a time touches one cache line (and often one page) per
+// destination row, so both are done in BLT_ROTATE_TILE square tiles where
+// every destination row of the tile is a single cache line.
+//
+
+#define BLT_ROTATED_PIXEL(pDst, DstPixelPitch, DstRowPitch, x, y) \
+    ((UINT32*)((pDst) + (LONG_PTR)(x) * (DstPixelPitch) + (LONG_PTR)(y) * (DstRowPitch)))
+
+static VOID Rotate32TileScalar(BYTE* pDst, LONG DstPixelPitch, LONG DstRowPitch,
+                               CONST BYTE* pSrc, LONG SrcPitch,
+                               UINT x0, UINT y0, UINT x1, UINT y1)
+{
+    for (UINT y = y0; y < y1; ++y)
+    {
+        CONST UINT32* pSrcRow = (CONST UINT32*)(pSrc + (LONG_PTR)y * SrcPitch);
+        for (UINT x = x0; x < x1; ++x)
+        {
+            *BLT_ROTATED_PIXEL(pDst, DstPixelPitch, DstRowPitch, x, y) = pSrcRow[x];
+        }
+    }
+}
+
+static VOID Rotate32Scalar(BYTE* pDst, LONG DstPixelPitch, LONG DstRowPitch,
+                           CONST BYTE* pSrc, LONG SrcPitch, UINT Width, UINT Height)
+{
+    for (UINT ty = 0; ty < Height; ty += BLT_ROTATE_TILE)
+    {
+        UINT y1 = (Height - ty < BLT_ROTATE_TILE) ? Height : ty + BLT_ROTATE_TILE;
+        for (UINT tx = 0; tx < Width; tx += BLT_ROTATE_TILE)
+        {
+            UINT x1 = (Width - tx < BLT_ROTATE_TILE) ? Width : tx + BLT_ROTATE_TILE;
+            Rotate32TileScalar(pDst, DstPixelPitch, DstRowPitch, pSrc, SrcPitch, tx, ty, x1, y1);
+        }
+    }
+}
+
+static VOID ReverseRow32Scalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        *(pDstPixel - i) = pSrcPixel[i];
+    }
+}
+
+static VOID Rotate32Sse2(BYTE* pDst, LONG DstPixelPitch, LONG DstRowPitch,
+                         CONST BYTE* pSrc, LONG SrcPitch, UINT Width, UINT Height)
+{
+    // With a negative row pitch the four pixels of a transposed column land
+    // in memory in reverse order, so they are stored from the last one back
+    BOOLEAN Reverse = (DstRowPitch < 0);
+    UINT Width4 = Width & ~3u;
+    UINT Height4 = Height & ~3u;
+
+    for (UINT ty = 0; ty < Height4; ty += BLT_ROTATE_TILE)
+    {
+        UINT y1 = (Height4 - ty < BLT_ROTATE_TILE) ? Height4 : ty + BLT_ROTATE_TILE;
+        for (UINT tx = 0; tx < Width4; tx += BLT_ROTATE_TILE)
+        {
+            UINT x1 = (Width4 - tx < BLT_ROTATE_TILE) ? Width4 : tx + BLT_ROTATE_TILE;
+            for (UINT y = ty; y < y1; y += 4)
+            {
+                CONST BYTE* pSrcBlock = pSrc + (LONG_PTR)y * SrcPitch;
+                BYTE* pDstBlock = (BYTE*)BLT_ROTATED_PIXEL(pDst, DstPixelPitch, DstRowPitch, 0, Reverse ? y + 3 : y);
+
+                for (UINT x = tx; x < x1; x += 4)
+                {
+                    // 4x4 transpose in registers
+                    __m128i r0 = _mm_loadu_si128((CONST __m128i*)(pSrcBlock + 0 * (LONG_PTR)SrcPitch + x * 4));
+                    __m128i r1 = _mm_loadu_si128((CONST __m128i*)(pSrcBlock + 1 * (LONG_PTR)SrcPitch + x * 4));
+                    __m128i r2 = _mm_loadu_si128((CONST __m128i*)(pSrcBlock + 2 * (LONG_PTR)SrcPitch + x * 4));
+                    __m128i r3 = _mm_loadu_si128((CONST __m128i*)(pSrcBlock + 3 * (LONG_PTR)SrcPitch + x * 4));
+                    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+                    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+                    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+                    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+                    __m128i c0 = _mm_unpacklo_epi64(t0, t1);
+                    __m128i c1 = _mm_unpackhi_epi64(t0, t1);
+                    __m128i c2 = _mm_unpacklo_epi64(t2, t3);
+                    __m128i c3 = _mm_unpackhi_epi64(t2, t3);
+
+                    if (Reverse)
+                    {
+                        c0 = _mm_shuffle_epi32(c0, _MM_SHUFFLE(0, 1, 2, 3));
+                        c1 = _mm_shuffle_epi32(c1, _MM_SHUFFLE(0, 1, 2, 3));
+                        c2 = _mm_shuffle_epi32(c2, _MM_SHUFFLE(0, 1, 2, 3));
+                        c3 = _mm_shuffle_epi32(c3, _MM_SHUFFLE(0, 1, 2, 3));
+                    }
+
+                    BYTE* pCol = pDstBlock + (LONG_PTR)x * DstPixelPitch;
+                    _mm_storeu_si128((__m128i*)(pCol + 0 * (LONG_PTR)DstPixelPitch), c0);
+                    _mm_storeu_si128((__m128i*)(pCol + 1 * (LONG_PTR)DstPixelPitch), c1);
+                    _mm_storeu_si128((__m128i*)(pCol + 2 * (LONG_PTR)DstPixelPitch), c2);
+                    _mm_storeu_si128((__m128i*)(pCol + 3 * (LONG_PTR)DstPixelPitch), c3);
+                }
+            }
+        }
+    }
+
+    // Right and bottom edges that do not fill a 4x4 block
+    if (Width4 < Width)
+    {
+        Rotate32TileScalar(pDst, DstPixelPitch, DstRowPitch, pSrc, SrcPitch, Width4, 0, Width, Height);
+    }
+    if (Height4 < Height)
+    {
+        Rotate32TileScalar(pDst, DstPixelPitch, DstRowPitch, pSrc, SrcPitch, 0, Height4, Width4, Height);
+    }
+}
+
+static VOID ReverseRow32Sse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4));
+        _mm_storeu_si128((__m128i*)(pDst - (LONG_PTR)(i + 3) * 4),
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+    ReverseRow32Scalar(pDst - (LONG_PTR)i * 4, pSrc + i * 4, Pixels - i);
+}
+
+//
+// R5G6B5
+//
+// The 16bpp conversions of bltfuncs.cxx neither replicate the top bits into
+// the low ones on unpack nor round on pack, they just move the bits. The
+// kernels below do the same so both paths give identical results.
+//
+
+static VOID Unpack565RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT16* pSrcPixel = (CONST UINT16*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstPixel[i] = ((Pixel & 0xF800) << 8) | ((Pixel & 0x07E0) << 5) | ((Pixel & 0x001F) << 3);
+    }
+}
+
+static VOID Pack565RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT16* pDstPixel = (UINT16*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstPixel[i] = (UINT16)(((Pixel >> 8) & 0xF800) | ((Pixel >> 5) & 0x07E0) | ((Pixel >> 3) & 0x001F));
+    }
+}
+
+static FORCEINLINE __m128i Unpack565Sse2(__m128i Pixels)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(Pixels, _mm_set1_epi32(0xF800)), 8),
+                                     _mm_slli_epi32(_mm_and_si128(Pixels, _mm_set1_epi32(0x07E0)), 5)),
+                        _mm_slli_epi32(_mm_and_si128(Pixels, _mm_set1_epi32(0x001F)), 3));
+}
+
+// Leaves the 565 value zero extended in each 32 bit lane
+static FORCEINLINE __m128i Pack565Sse2(__m128i Pixels)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(Pixels, 8), _mm_set1_epi32(0xF800)),
+                                     _mm_and_si128(_mm_srli_epi32(Pixels, 5), _mm_set1_epi32(0x07E0))),
+                        _mm_and_si128(_mm_srli_epi32(Pixels, 3), _mm_set1_epi32(0x001F)));
+}
+
+static VOID Unpack565RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m128i Zero = _mm_setzero_si128();
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m128i s = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 2));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), Unpack565Sse2(_mm_unpacklo_epi16(s, Zero)));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4 + 16), Unpack565Sse2(_mm_unpackhi_epi16(s, Zero)));
+    }
+    Unpack565RowScalar(pDst + i * 4, pSrc + i * 2, Pixels - i);
+}
+
+static VOID Pack565RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m128i lo = Pack565Sse2(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4)));
+        __m128i hi = Pack565Sse2(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 16)));
+        // SSE2 only has a signed 32 to 16 bit pack, sign extend the lanes so it does not saturate
+        lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+        hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+        _mm_storeu_si128((__m128i*)(pDst + i * 2), _mm_packs_epi32(lo, hi));
+    }
+    Pack565RowScalar(pDst + i * 2, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static VOID Unpack565RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m256i RMask = _mm256_set1_epi32(0xF800);
+    CONST __m256i GMask = _mm256_set1_epi32(0x07E0);
+    CONST __m256i BMask = _mm256_set1_epi32(0x001F);
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 2)));
+        __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 2 + 16)));
+        a = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(a, RMask), 8),
+                                            _mm256_slli_epi32(_mm256_and_si256(a, GMask), 5)),
+                            _mm256_slli_epi32(_mm256_and_si256(a, BMask), 3));
+        b = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(b, RMask), 8),
+                                            _mm256_slli_epi32(_mm256_and_si256(b, GMask), 5)),
+                            _mm256_slli_epi32(_mm256_and_si256(b, BMask), 3));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), a);
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4 + 32), b);
+    }
+    Unpack565RowScalar(pDst + i * 4, pSrc + i * 2, Pixels - i);
+}
+
+// 16 pixels to 565, in pixel order
+BLT_TARGET_AVX2
+static FORCEINLINE __m256i Pack565Avx2(__m256i a, __m256i b)
+{
+    CONST __m256i RMask = _mm256_set1_epi32(0xF800);
+    CONST __m256i GMask = _mm256_set1_epi32(0x07E0);
+    CONST __m256i BMask = _mm256_set1_epi32(0x001F);
+
+    a = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(a, 8), RMask),
+                                        _mm256_and_si256(_mm256_srli_epi32(a, 5), GMask)),
+                        _mm256_and_si256(_mm256_srli_epi32(a, 3), BMask));
+    b = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(b, 8), RMask),
+                                        _mm256_and_si256(_mm256_srli_epi32(b, 5), GMask)),
+                        _mm256_and_si256(_mm256_srli_epi32(b, 3), BMask));
+    // The pack works per 128 bit lane, put the quadwords back in pixel order
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+BLT_TARGET_AVX2
+static VOID Pack565RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i b = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4 + 32));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 2), Pack565Avx2(a, b));
+    }
+    Pack565RowScalar(pDst + i * 2, pSrc + i * 4, Pixels - i);
+}
+
+//
+// 8bpp palette quantization
+//
+
+static VOID Quantize8RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i, pSrc += 4)
+    {
+        pDst[i] = (BYTE)((BLT_DIV43(pSrc[2]) * 36) + (BLT_DIV43(pSrc[1]) * 6) + BLT_DIV43(pSrc[0]));
+    }
+}
+
+// Palette index of 8 pixels as 16 bit lanes
+static FORCEINLINE __m128i Quantize8Sse2(__m128i Pixels0, __m128i Pixels1)
+{
+    CONST __m128i ByteMask = _mm_set1_epi32(0xFF);
+    CONST __m128i Div43 = _mm_set1_epi16(BLT_DIV43_MULTIPLIER);
+
+    __m128i b = _mm_packs_epi32(_mm_and_si128(Pixels0, ByteMask),
+                                _mm_and_si128(Pixels1, ByteMask));
+    __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(Pixels0, 8), ByteMask),
+                                _mm_and_si128(_mm_srli_epi32(Pixels1, 8), ByteMask));
+    __m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(Pixels0, 16), ByteMask),
+                                _mm_and_si128(_mm_srli_epi32(Pixels1, 16), ByteMask));
+
+    b = _mm_mulhi_epu16(b, Div43);
+    g = _mm_mulhi_epu16(g, Div43);
+    r = _mm_mulhi_epu16(r, Div43);
+
+    return _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(36)),
+                                       _mm_mullo_epi16(g, _mm_set1_epi16(6))),
+                         b);
+}
+
+static VOID Quantize8RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        CONST BYTE* p = pSrc + i * 4;
+        __m128i lo = Quantize8Sse2(_mm_loadu_si128((CONST __m128i*)(p)),
+                                   _mm_loadu_si128((CONST __m128i*)(p + 16)));
+        __m128i hi = Quantize8Sse2(_mm_loadu_si128((CONST __m128i*)(p + 32)),
+                                   _mm_loadu_si128((CONST __m128i*)(p + 48)));
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(lo, hi));
+    }
+    Quantize8RowScalar(pDst + i, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static FORCEINLINE __m256i Quantize8Avx2(__m256i Pixels0, __m256i Pixels1)
+{
+    CONST __m256i ByteMask = _mm256_set1_epi32(0xFF);
+    CONST __m256i Div43 = _mm256_set1_epi16(BLT_DIV43_MULTIPLIER);
+
+    __m256i b = _mm256_packs_epi32(_mm256_and_si256(Pixels0, ByteMask),
+                                   _mm256_and_si256(Pixels1, ByteMask));
+    __m256i g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(Pixels0, 8), ByteMask),
+                                   _mm256_and_si256(_mm256_srli_epi32(Pixels1, 8), ByteMask));
+    __m256i r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(Pixels0, 16), ByteMask),
+                                   _mm256_and_si256(_mm256_srli_epi32(Pixels1, 16), ByteMask));
+
+    b = _mm256_mulhi_epu16(b, Div43);
+    g = _mm256_mulhi_epu16(g, Div43);
+    r = _mm256_mulhi_epu16(r, Div43);
+
+    return _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(36)),
+                                             _mm256_mullo_epi16(g, _mm256_set1_epi16(6))),
+                            b);
+}
+
+BLT_TARGET_AVX2
+static VOID Quantize8RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    // Both packs interleave the 128 bit lanes, which leaves the 4 pixel
+    // groups of the 4 loads in the dword order 0 4 1 5 2 6 3 7
+    CONST __m256i Order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    UINT i = 0;
+    for (; i + 32 <= Pixels; i += 32)
+    {
+        CONST BYTE* p = pSrc + i * 4;
+        __m256i lo = Quantize8Avx2(_mm256_loadu_si256((CONST __m256i*)(p)),
+                                   _mm256_loadu_si256((CONST __m256i*)(p + 32)));
+        __m256i hi = Quantize8Avx2(_mm256_loadu_si256((CONST __m256i*)(p + 64)),
+                                   _mm256_loadu_si256((CONST __m256i*)(p + 96)));
+        __m256i Packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), Order);
+        _mm256_storeu_si256((__m256i*)(pDst + i), Packed);
+    }
+    Quantize8RowSse2(pDst + i, pSrc + i * 4, Pixels - i);
+}
+
+//
+// Ordered dither
+//
+// A 4x4 Bayer matrix is scaled to the step of each channel (8 for the 5 bit
+// channels, 4 for green of 565, 43 for the palette) and added to the
+// channels with a saturating add before the truncating conversions above.
+// A channel between two levels then lands on the upper one at the rate of
+// its distance from the lower one, which hides the banding of truncation.
+//
+// A row of the matrix repeats every 4 pixels, which is one 128 bit register
+// of X8R8G8B8 pixels, so the vector kernels load the bias once per row and
+// cost a single add per register over the plain conversions. The rows are
+// stored twice over so the 4 pixels from any X can be loaded directly.
+//
+
+static CONST UINT32 g_BltDither565[4][8] =
+{
+    { 0x00000000, 0x00040204, 0x00010001, 0x00050205, 0x00000000, 0x00040204, 0x00010001, 0x00050205 },
+    { 0x00060306, 0x00020102, 0x00070307, 0x00030103, 0x00060306, 0x00020102, 0x00070307, 0x00030103 },
+    { 0x00010001, 0x00050205, 0x00000000, 0x00040204, 0x00010001, 0x00050205, 0x00000000, 0x00040204 },
+    { 0x00070307, 0x00030103, 0x00060306, 0x00020102, 0x00070307, 0x00030103, 0x00060306, 0x00020102 },
+};
+
+static CONST UINT32 g_BltDither8[4][8] =
+{
+    { 0x00000000, 0x00151515, 0x00050505, 0x001A1A1A, 0x00000000, 0x00151515, 0x00050505, 0x001A1A1A },
+    { 0x00202020, 0x000A0A0A, 0x00252525, 0x00101010, 0x00202020, 0x000A0A0A, 0x00252525, 0x00101010 },
+    { 0x00080808, 0x001D1D1D, 0x00020202, 0x00181818, 0x00080808, 0x001D1D1D, 0x00020202, 0x00181818 },
+    { 0x00282828, 0x00121212, 0x00222222, 0x000D0D0D, 0x00282828, 0x00121212, 0x00222222, 0x000D0D0D },
+};
+
+#define BLT_ADD_SATURATE(c, Bias)   (((UINT)(c) + (Bias) > 0xFF) ? 0xFF : (UINT)(c) + (Bias))
+
+static VOID Dither565RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST UINT32* pBias = g_BltDither565[Y & 3];
+    UINT16* pDstPixel = (UINT16*)pDst;
+    for (UINT i = 0; i < Pixels; ++i, pSrc += 4)
+    {
+        UINT32 Bias = pBias[(X + i) & 3];
+        UINT b = BLT_ADD_SATURATE(pSrc[0], Bias & 0xFF);
+        UINT g = BLT_ADD_SATURATE(pSrc[1], (Bias >> 8) & 0xFF);
+        UINT r = BLT_ADD_SATURATE(pSrc[2], (Bias >> 16) & 0xFF);
+        pDstPixel[i] = (UINT16)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+    }
+}
+
+static VOID Dither8RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST UINT32* pBias = g_BltDither8[Y & 3];
+    for (UINT i = 0; i < Pixels; ++i, pSrc += 4)
+    {
+        UINT Bias = pBias[(X + i) & 3] & 0xFF;
+        pDst[i] = (BYTE)((BLT_DIV43(BLT_ADD_SATURATE(pSrc[2], Bias)) * 36) +
+                         (BLT_DIV43(BLT_ADD_SATURATE(pSrc[1], Bias)) * 6) +
+                         BLT_DIV43(BLT_ADD_SATURATE(pSrc[0], Bias)));
+    }
+}
+
+static VOID Dither565RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST __m128i Bias = _mm_loadu_si128((CONST __m128i*)&g_BltDither565[Y & 3][X & 3]);
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m128i lo = Pack565Sse2(_mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4)), Bias));
+        __m128i hi = Pack565Sse2(_mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 16)), Bias));
+        lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+        hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+        _mm_storeu_si128((__m128i*)(pDst + i * 2), _mm_packs_epi32(lo, hi));
+    }
+    Dither565RowScalar(pDst + i * 2, pSrc + i * 4, Pixels - i, X + i, Y);
+}
+
+static VOID Dither8RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST __m128i Bias = _mm_loadu_si128((CONST __m128i*)&g_BltDither8[Y & 3][X & 3]);
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        CONST BYTE* p = pSrc + i * 4;
+        __m128i lo = Quantize8Sse2(_mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(p)), Bias),
+                                   _mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(p + 16)), Bias));
+        __m128i hi = Quantize8Sse2(_mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(p + 32)), Bias),
+                                   _mm_adds_epu8(_mm_loadu_si128((CONST __m128i*)(p + 48)), Bias));
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(lo, hi));
+    }
+    Dither8RowScalar(pDst + i, pSrc + i * 4, Pixels - i, X + i, Y);
+}
+
+BLT_TARGET_AVX2
+static VOID Dither565RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST __m256i Bias = _mm256_broadcastsi128_si256(_mm_loadu_si128((CONST __m128i*)&g_BltDither565[Y & 3][X & 3]));
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m256i a = _mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4)), Bias);
+        __m256i b = _mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4 + 32)), Bias);
+        _mm256_storeu_si256((__m256i*)(pDst + i * 2), Pack565Avx2(a, b));
+    }
+    Dither565RowScalar(pDst + i * 2, pSrc + i * 4, Pixels - i, X + i, Y);
+}
+
+BLT_TARGET_AVX2
+static VOID Dither8RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y)
+{
+    CONST __m256i Order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    CONST __m256i Bias = _mm256_broadcastsi128_si256(_mm_loadu_si128((CONST __m128i*)&g_BltDither8[Y & 3][X & 3]));
+    UINT i = 0;
+    for (; i + 32 <= Pixels; i += 32)
+    {
+        CONST BYTE* p = pSrc + i * 4;
+        __m256i lo = Quantize8Avx2(_mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(p)), Bias),
+                                   _mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(p + 32)), Bias));
+        __m256i hi = Quantize8Avx2(_mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(p + 64)), Bias),
+                                   _mm256_adds_epu8(_mm256_loadu_si256((CONST __m256i*)(p + 96)), Bias));
+        __m256i Packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), Order);
+        _mm256_storeu_si256((__m256i*)(pDst + i), Packed);
+    }
+    Dither8RowSse2(pDst + i, pSrc + i * 4, Pixels - i, X + i, Y);
+}
+
+//
+// 24bpp
+//
+// Packed RGB is regrouped with byte shuffles, 16 pixels (48 bytes packed,
+// 64 bytes unpacked) per iteration. Loads and stores are unaligned so rows
+// can start anywhere, the remainder of a row is done by the scalar kernels.
+//
+
+static VOID Unpack24RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i, pDst += 4, pSrc += 3)
+    {
+        pDst[0] = pSrc[0];
+        pDst[1] = pSrc[1];
+        pDst[2] = pSrc[2];
+    }
+}
+
+static VOID Pack24RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i, pDst += 3, pSrc += 4)
+    {
+        pDst[0] = pSrc[0];
+        pDst[1] = pSrc[1];
+        pDst[2] = pSrc[2];
+    }
+}
+
+static VOID CopyRgb32RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        pDstPixel[i] = (pDstPixel[i] & 0xFF000000) | (pSrcPixel[i] & 0x00FFFFFF);
+    }
+}
+
+static VOID CopyRgb32RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m128i AlphaMask = _mm_set1_epi32((int)0xFF000000);
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((CONST __m128i*)(pDst + i * 4));
+        __m128i s = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4),
+                         _mm_or_si128(_mm_and_si128(d, AlphaMask), _mm_andnot_si128(AlphaMask, s)));
+    }
+    CopyRgb32RowScalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_SSSE3
+static VOID Unpack24RowSsse3(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    // 4 packed pixels to 4 pixels with a zero alpha byte
+    CONST __m128i Expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    CONST __m128i AlphaMask = _mm_set1_epi32((int)0xFF000000);
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        CONST BYTE* s = pSrc + i * 3;
+        BYTE* d = pDst + i * 4;
+        __m128i s0 = _mm_loadu_si128((CONST __m128i*)(s));
+        __m128i s1 = _mm_loadu_si128((CONST __m128i*)(s + 16));
+        __m128i s2 = _mm_loadu_si128((CONST __m128i*)(s + 32));
+
+        __m128i p0 = _mm_shuffle_epi8(s0, Expand);
+        __m128i p1 = _mm_shuffle_epi8(_mm_alignr_epi8(s1, s0, 12), Expand);
+        __m128i p2 = _mm_shuffle_epi8(_mm_alignr_epi8(s2, s1, 8), Expand);
+        __m128i p3 = _mm_shuffle_epi8(_mm_srli_si128(s2, 4), Expand);
+
+        _mm_storeu_si128((__m128i*)(d),      _mm_or_si128(p0, _mm_and_si128(_mm_loadu_si128((CONST __m128i*)(d)), AlphaMask)));
+        _mm_storeu_si128((__m128i*)(d + 16), _mm_or_si128(p1, _mm_and_si128(_mm_loadu_si128((CONST __m128i*)(d + 16)), AlphaMask)));
+        _mm_storeu_si128((__m128i*)(d + 32), _mm_or_si128(p2, _mm_and_si128(_mm_loadu_si128((CONST __m128i*)(d + 32)), AlphaMask)));
+        _mm_storeu_si128((__m128i*)(d + 48), _mm_or_si128(p3, _mm_and_si128(_mm_loadu_si128((CONST __m128i*)(d + 48)), AlphaMask)));
+    }
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        // 12 bytes of source, read as 8 + 4 so nothing past the row is touched
+        BYTE* d = pDst + i * 4;
+        __m128i s = _mm_unpacklo_epi64(_mm_loadl_epi64((CONST __m128i*)(pSrc + i * 3)),
+                                       _mm_cvtsi32_si128(*(CONST int*)(pSrc + i * 3 + 8)));
+        _mm_storeu_si128((__m128i*)(d), _mm_or_si128(_mm_shuffle_epi8(s, Expand),
+                                                     _mm_and_si128(_mm_loadu_si128((CONST __m128i*)(d)), AlphaMask)));
+    }
+    Unpack24RowScalar(pDst + i * 4, pSrc + i * 3, Pixels - i);
+}
+
+BLT_TARGET_SSSE3
+static VOID Pack24RowSsse3(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    // 4 pixels to 12 packed bytes at the bottom of the register
+    CONST __m128i Compact = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        CONST BYTE* s = pSrc + i * 4;
+        BYTE* d = pDst + i * 3;
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((CONST __m128i*)(s)), Compact);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((CONST __m128i*)(s + 16)), Compact);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((CONST __m128i*)(s + 32)), Compact);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((CONST __m128i*)(s + 48)), Compact);
+
+        _mm_storeu_si128((__m128i*)(d),      _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i*)(d + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i*)(d + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        // 12 bytes of destination, written as 8 + 4
+        __m128i p = _mm_shuffle_epi8(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4)), Compact);
+        _mm_storel_epi64((__m128i*)(pDst + i * 3), p);
+        *(int*)(pDst + i * 3 + 8) = _mm_cvtsi128_si32(_mm_srli_si128(p, 8));
+    }
+    Pack24RowScalar(pDst + i * 3, pSrc + i * 4, Pixels - i);
+}
+
+//
+// Color lookup
+//
+// Three table lookups per pixel. AVX2 does them with gathers, 8 pixels per
+// iteration, which also keeps the loop free of the extract/insert work a
+// scalar lookup into vector registers would need.
+//
+
+static VOID ColorLutRow32Scalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_COLOR_LUT* pLut)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstPixel[i] = (Pixel & 0xFF000000) |
+                       pLut->Red[(Pixel >> 16) & 0xFF] |
+                       pLut->Green[(Pixel >> 8) & 0xFF] |
+                       pLut->Blue[Pixel & 0xFF];
+    }
+}
+
+BLT_TARGET_AVX2
+static VOID ColorLutRow32Avx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_COLOR_LUT* pLut)
+{
+    CONST __m256i ByteMask = _mm256_set1_epi32(0xFF);
+    CONST __m256i AlphaMask = _mm256_set1_epi32((int)0xFF000000);
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i r = _mm256_i32gather_epi32((CONST int*)pLut->Red, _mm256_and_si256(_mm256_srli_epi32(p, 16), ByteMask), 4);
+        __m256i g = _mm256_i32gather_epi32((CONST int*)pLut->Green, _mm256_and_si256(_mm256_srli_epi32(p, 8), ByteMask), 4);
+        __m256i b = _mm256_i32gather_epi32((CONST int*)pLut->Blue, _mm256_and_si256(p, ByteMask), 4);
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4),
+                            _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(p, AlphaMask), r),
+                                            _mm256_or_si256(g, b)));
+    }
+    ColorLutRow32Scalar(pDst + i * 4, pSrc + i * 4, Pixels - i, pLut);
+}
+
+//
+// Channel order
+//
+// A swizzle is one byte shuffle per register, it is applied on the way
+// through a copy or in place on rows that were just written.
+//
+
+static CONST BLT_SWIZZLE g_BltSwizzles[BLT_CHANNEL_ORDER_COUNT] =
+{
+    { { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 } },   // BGRA, never used
+    { { 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 } },   // RGBA
+    { { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 } },   // XRGB
+};
+
+static VOID SwizzleRow32Scalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_SWIZZLE* pSwizzle)
+{
+    CONST BYTE* Shuffle = pSwizzle->Shuffle;
+    for (UINT i = 0; i < Pixels; ++i, pDst += 4, pSrc += 4)
+    {
+        // Read the whole pixel first, pDst may be pSrc
+        BYTE Pixel[4] = { pSrc[0], pSrc[1], pSrc[2], pSrc[3] };
+        pDst[0] = Pixel[Shuffle[0]];
+        pDst[1] = Pixel[Shuffle[1]];
+        pDst[2] = Pixel[Shuffle[2]];
+        pDst[3] = Pixel[Shuffle[3]];
+    }
+}
+
+BLT_TARGET_SSSE3
+static VOID SwizzleRow32Ssse3(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_SWIZZLE* pSwizzle)
+{
+    CONST __m128i Shuffle = _mm_loadu_si128((CONST __m128i*)pSwizzle->Shuffle);
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4));
+        __m128i b = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 16));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_shuffle_epi8(a, Shuffle));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4 + 16), _mm_shuffle_epi8(b, Shuffle));
+    }
+    SwizzleRow32Scalar(pDst + i * 4, pSrc + i * 4, Pixels - i, pSwizzle);
+}
+
+BLT_TARGET_AVX2
+static VOID SwizzleRow32Avx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_SWIZZLE* pSwizzle)
+{
+    CONST __m256i Shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((CONST __m128i*)pSwizzle->Shuffle));
+    UINT i = 0;
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i b = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4 + 32));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_shuffle_epi8(a, Shuffle));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4 + 32), _mm256_shuffle_epi8(b, Shuffle));
+    }
+    SwizzleRow32Ssse3(pDst + i * 4, pSrc + i * 4, Pixels - i, pSwizzle);
+}
+
+CONST BLT_SWIZZLE* BltGetSwizzle(BLT_CHANNEL_ORDER Order)
+{
+    if ((Order <= BLT_CHANNEL_ORDER_BGRA) || (Order >= BLT_CHANNEL_ORDER_COUNT))
+    {
+        return NULL;
+    }
+    return &g_BltSwizzles[Order];
+}
+
+//
+// Compare before write
+//
+// The framebuffer is shared with the host, every cache line written to it
+// is one the host has to read again. CopyChangedRow32 compares a row with
+// the framebuffer a destination cache line (16 pixels) at a time and only
+// stores the lines that differ. The pixels before the row's first line
+// boundary and after its last one are compared one at a time.
+//
+
+#define BLT_CHANGED_NONE    MAXUINT
+
+// Index of the lowest and of the highest set bit of a non-zero mask
+static FORCEINLINE UINT LowestSetBit(UINT32 Mask)
+{
+#if defined(_MSC_VER)
+    ULONG Index;
+    _BitScanForward(&Index, Mask);
+    return Index;
+#else
+    return (UINT)__builtin_ctz(Mask);
+#endif
+}
+
+static FORCEINLINE UINT HighestSetBit(UINT32 Mask)
+{
+#if defined(_MSC_VER)
+    ULONG Index;
+    _BitScanReverse(&Index, Mask);
+    return Index;
+#else
+    return 31 - (UINT)__builtin_clz(Mask);
+#endif
+}
+
+// Adds the changed pixels of a line at Start, Diff has a bit for each of them
+static FORCEINLINE VOID AddChangedPixels(UINT Start, UINT32 Diff, UINT* pFirst, UINT* pEnd)
+{
+    if (*pFirst == BLT_CHANGED_NONE)
+    {
+        *pFirst = Start + LowestSetBit(Diff);
+    }
+    *pEnd = Start + HighestSetBit(Diff) + 1;
+}
+
+static BOOLEAN CopyChangedRow32Scalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT* pFirst, UINT* pEnd)
+{
+    UINT32* pDst32 = (UINT32*)pDst;
+    CONST UINT32* pSrc32 = (CONST UINT32*)pSrc;
+
+    *pFirst = BLT_CHANGED_NONE;
+    *pEnd = 0;
+    for (UINT i = 0; i < Pixels; i++)
+    {
+        if (pDst32[i] != pSrc32[i])
+        {
+            pDst32[i] = pSrc32[i];
+            AddChangedPixels(i, 1, pFirst, pEnd);
+        }
+    }
+    return (*pFirst != BLT_CHANGED_NONE);
+}
+
+// Pixels of a row before pDst's first cache line boundary
+static FORCEINLINE UINT ChangedRowHead(CONST BYTE* pDst, UINT Pixels)
+{
+    UINT Head = (UINT)((BLT_CACHE_LINE - ((ULONG_PTR)pDst & (BLT_CACHE_LINE - 1))) & (BLT_CACHE_LINE - 1)) / 4;
+    return (Head < Pixels) ? Head : Pixels;
+}
+
+// Does the pixels of the row from Start on one at a time
+static FORCEINLINE BOOLEAN CopyChangedRowTail(BYTE* pDst, CONST BYTE* pSrc, UINT Start, UINT Pixels, UINT* pFirst, UINT* pEnd)
+{
+    UINT First;
+    UINT End;
+    if (CopyChangedRow32Scalar(pDst + Start * 4, pSrc + Start * 4, Pixels - Start, &First, &End))
+    {
+        if (*pFirst == BLT_CHANGED_NONE)
+        {
+            *pFirst = Start + First;
+        }
+        *pEnd = Start + End;
+    }
+    return (*pFirst != BLT_CHANGED_NONE);
+}
+
+static BOOLEAN CopyChangedRow32Sse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT* pFirst, UINT* pEnd)
+{
+    UINT i = ChangedRowHead(pDst, Pixels);
+    CopyChangedRow32Scalar(pDst, pSrc, i, pFirst, pEnd);
+
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m128i s0 = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4));
+        __m128i s1 = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 16));
+        __m128i s2 = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 32));
+        __m128i s3 = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4 + 48));
+        UINT32 Equal = (UINT32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(s0, _mm_load_si128((CONST __m128i*)(pDst + i * 4))))) |
+                       ((UINT32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(s1, _mm_load_si128((CONST __m128i*)(pDst + i * 4 + 16))))) << 4) |
+                       ((UINT32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(s2, _mm_load_si128((CONST __m128i*)(pDst + i * 4 + 32))))) << 8) |
+                       ((UINT32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(s3, _mm_load_si128((CONST __m128i*)(pDst + i * 4 + 48))))) << 12);
+        if (Equal != 0xFFFF)
+        {
+            _mm_store_si128((__m128i*)(pDst + i * 4), s0);
+            _mm_store_si128((__m128i*)(pDst + i * 4 + 16), s1);
+            _mm_store_si128((__m128i*)(pDst + i * 4 + 32), s2);
+            _mm_store_si128((__m128i*)(pDst + i * 4 + 48), s3);
+            AddChangedPixels(i, ~Equal & 0xFFFF, pFirst, pEnd);
+        }
+    }
+
+    return CopyChangedRowTail(pDst, pSrc, i, Pixels, pFirst, pEnd);
+}
+
+BLT_TARGET_AVX2
+static BOOLEAN CopyChangedRow32Avx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT* pFirst, UINT* pEnd)
+{
+    UINT i = ChangedRowHead(pDst, Pixels);
+    CopyChangedRow32Scalar(pDst, pSrc, i, pFirst, pEnd);
+
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m256i s0 = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i s1 = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4 + 32));
+        UINT32 Equal = (UINT32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s0, _mm256_load_si256((CONST __m256i*)(pDst + i * 4))))) |
+                       ((UINT32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s1, _mm256_load_si256((CONST __m256i*)(pDst + i * 4 + 32))))) << 8);
+        if (Equal != 0xFFFF)
+        {
+            _mm256_store_si256((__m256i*)(pDst + i * 4), s0);
+            _mm256_store_si256((__m256i*)(pDst + i * 4 + 32), s1);
+            AddChangedPixels(i, ~Equal & 0xFFFF, pFirst, pEnd);
+        }
+    }
+
+    return CopyChangedRowTail(pDst, pSrc, i, Pixels, pFirst, pEnd);
+}
+
+BLT_TARGET_AVX512
+static BOOLEAN CopyChangedRow32Avx512(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT* pFirst, UINT* pEnd)
+{
+    UINT i = ChangedRowHead(pDst, Pixels);
+    CopyChangedRow32Scalar(pDst, pSrc, i, pFirst, pEnd);
+
+    // A register is a whole line
+    for (; i + 16 <= Pixels; i += 16)
+    {
+        __m512i s = _mm512_loadu_si512((CONST VOID*)(pSrc + i * 4));
+        UINT32 Diff = (UINT32)_mm512_cmpneq_epi32_mask(s, _mm512_load_si512((CONST VOID*)(pDst + i * 4)));
+        if (Diff != 0)
+        {
+            _mm512_store_si512((VOID*)(pDst + i * 4), s);
+            AddChangedPixels(i, Diff, pFirst, pEnd);
+        }
+    }
+
+    return CopyChangedRowTail(pDst, pSrc, i, Pixels, pFirst, pEnd);
+}
+
+//
+// Alpha blending
+//
+// A premultiplied pixel goes over the framebuffer as Src + Dst * (255 - A)
+// / 255 for every channel, alpha included. The division is rounded with
+// (t + 128 + ((t + 128) >> 8)) >> 8, which is exact for t up to 255 * 255,
+// and the vector kernels do the same in 16 bit lanes so all tiers agree.
+// The add saturates so shapes that are not really premultiplied can not
+// wrap around.
+//
+
+static VOID BlendRow32Scalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i, pDst += 4, pSrc += 4)
+    {
+        UINT InvAlpha = 255 - pSrc[3];
+        for (UINT c = 0; c < 4; c++)
+        {
+            UINT t = pDst[c] * InvAlpha + 128;
+            UINT Value = pSrc[c] + ((t + (t >> 8)) >> 8);
+            pDst[c] = (BYTE)((Value > 255) ? 255 : Value);
+        }
+    }
+}
+
+// 4 pixels widened to 16 bit lanes, times 255 - alpha, divided by 255
+static FORCEINLINE __m128i BlendLanesSse2(__m128i Dst, __m128i Src)
+{
+    CONST __m128i Bias = _mm_set1_epi16(128);
+    __m128i InvAlpha = _mm_sub_epi16(_mm_set1_epi16(255), Src);
+    InvAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(InvAlpha, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(Dst, InvAlpha), Bias);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static VOID BlendRow32Sse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m128i Zero = _mm_setzero_si128();
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((CONST __m128i*)(pSrc + i * 4));
+        __m128i d = _mm_loadu_si128((CONST __m128i*)(pDst + i * 4));
+        __m128i Lo = BlendLanesSse2(_mm_unpacklo_epi8(d, Zero), _mm_unpacklo_epi8(s, Zero));
+        __m128i Hi = BlendLanesSse2(_mm_unpackhi_epi8(d, Zero), _mm_unpackhi_epi8(s, Zero));
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_adds_epu8(s, _mm_packus_epi16(Lo, Hi)));
+    }
+    BlendRow32Scalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static FORCEINLINE __m256i BlendLanesAvx2(__m256i Dst, __m256i Src)
+{
+    CONST __m256i Bias = _mm256_set1_epi16(128);
+    __m256i InvAlpha = _mm256_sub_epi16(_mm256_set1_epi16(255), Src);
+    InvAlpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(InvAlpha, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(Dst, InvAlpha), Bias);
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+BLT_TARGET_AVX2
+static VOID BlendRow32Avx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m256i Zero = _mm256_setzero_si256();
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256i s = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i d = _mm256_loadu_si256((CONST __m256i*)(pDst + i * 4));
+        // Unpacking and packing both work within 128 bit lanes, so the pixels stay in place
+        __m256i Lo = BlendLanesAvx2(_mm256_unpacklo_epi8(d, Zero), _mm256_unpacklo_epi8(s, Zero));
+        __m256i Hi = BlendLanesAvx2(_mm256_unpackhi_epi8(d, Zero), _mm256_unpackhi_epi8(s, Zero));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_adds_epu8(s, _mm256_packus_epi16(Lo, Hi)));
+    }
+    BlendRow32Sse2(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+//
+// Tile hashing
+//
+// A row is hashed as BLT_HASH_BLOCK byte blocks spread over BLT_HASH_LANES
+// 64 bit accumulators, the way XXH3 accumulates its stripes: every lane
+// adds the product of the low and high halves of its data xored with a key,
+// and the data of its neighbour. The keys move on by BLT_HASH_KEY_STEP for
+// every block and by the caller's salt for every row, so the same pixels
+// somewhere else in a tile hash differently. The last partial block is
+// hashed as if padded with zeros by the same scalar code in every tier, so
+// all tiers give the same hash.
+//
+
+static CONST UINT64 g_BltHashKeys[BLT_HASH_LANES] =
+{
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+};
+
+#define BLT_HASH_KEY_STEP   0x9e3779b97f4a7c15ULL
+
+static FORCEINLINE VOID HashBlockScalar(UINT64* pAcc, CONST BYTE* pBlock, UINT64 KeyOffset)
+{
+    UINT64 Data[BLT_HASH_LANES];
+    RtlCopyMemory(Data, pBlock, sizeof(Data));
+    for (UINT i = 0; i < BLT_HASH_LANES; i++)
+    {
+        UINT64 Keyed = Data[i] ^ (g_BltHashKeys[i] + KeyOffset);
+        pAcc[i] += (Keyed & 0xffffffff) * (Keyed >> 32) + Data[i ^ 1];
+    }
+}
+
+static VOID HashRowTail(UINT64* pAcc, CONST BYTE* pRow, UINT Bytes, UINT Done, UINT64 Salt)
+{
+    if (Done < Bytes)
+    {
+        DECLSPEC_ALIGN(16) BYTE Block[BLT_HASH_BLOCK];
+        RtlZeroMemory(Block, sizeof(Block));
+        RtlCopyMemory(Block, pRow + Done, Bytes - Done);
+        HashBlockScalar(pAcc, Block, Salt + (Done / BLT_HASH_BLOCK) * BLT_HASH_KEY_STEP);
+    }
+}
+
+static VOID HashRowScalar(UINT64* pAcc, CONST BYTE* pRow, UINT Bytes, UINT64 Salt)
+{
+    UINT i = 0;
+    for (; i + BLT_HASH_BLOCK <= Bytes; i += BLT_HASH_BLOCK)
+    {
+        HashBlockScalar(pAcc, pRow + i, Salt + (i / BLT_HASH_BLOCK) * BLT_HASH_KEY_STEP);
+    }
+    HashRowTail(pAcc, pRow, Bytes, i, Salt);
+}
+
+// Lanes 0-1 and 2-3 of a block, the data swap stays within 128 bits
+static FORCEINLINE __m128i HashLanesSse2(__m128i Acc, __m128i Data, __m128i Key)
+{
+    __m128i Keyed = _mm_xor_si128(Data, Key);
+    __m128i Product = _mm_mul_epu32(Keyed, _mm_srli_epi64(Keyed, 32));
+    __m128i Swapped = _mm_shuffle_epi32(Data, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm_add_epi64(Acc, _mm_add_epi64(Product, Swapped));
+}
+
+static VOID HashRowSse2(UINT64* pAcc, CONST BYTE* pRow, UINT Bytes, UINT64 Salt)
+{
+    CONST __m128i Step = _mm_set1_epi64x((LONG64)BLT_HASH_KEY_STEP);
+    __m128i Acc0 = _mm_loadu_si128((CONST __m128i*)&pAcc[0]);
+    __m128i Acc1 = _mm_loadu_si128((CONST __m128i*)&pAcc[2]);
+    __m128i Key0 = _mm_set_epi64x((LONG64)(g_BltHashKeys[1] + Salt), (LONG64)(g_BltHashKeys[0] + Salt));
+    __m128i Key1 = _mm_set_epi64x((LONG64)(g_BltHashKeys[3] + Salt), (LONG64)(g_BltHashKeys[2] + Salt));
+
+    UINT i = 0;
+    for (; i + BLT_HASH_BLOCK <= Bytes; i += BLT_HASH_BLOCK)
+    {
+        Acc0 = HashLanesSse2(Acc0, _mm_loadu_si128((CONST __m128i*)(pRow + i)), Key0);
+        Acc1 = HashLanesSse2(Acc1, _mm_loadu_si128((CONST __m128i*)(pRow + i + 16)), Key1);
+        Key0 = _mm_add_epi64(Key0, Step);
+        Key1 = _mm_add_epi64(Key1, Step);
+    }
+
+    _mm_storeu_si128((__m128i*)&pAcc[0], Acc0);
+    _mm_storeu_si128((__m128i*)&pAcc[2], Acc1);
+    HashRowTail(pAcc, pRow, Bytes, i, Salt);
+}
+
+BLT_TARGET_AVX2
+static FORCEINLINE __m256i HashLanesAvx2(__m256i Acc, __m256i Data, __m256i Key)
+{
+    __m256i Keyed = _mm256_xor_si256(Data, Key);
+    __m256i Product = _mm256_mul_epu32(Keyed, _mm256_srli_epi64(Keyed, 32));
+    __m256i Swapped = _mm256_shuffle_epi32(Data, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm256_add_epi64(Acc, _mm256_add_epi64(Product, Swapped));
+}
+
+BLT_TARGET_AVX2
+static VOID HashRowAvx2(UINT64* pAcc, CONST BYTE* pRow, UINT Bytes, UINT64 Salt)
+{
+    // Two blocks at a time into two accumulators, the sums do not care
+    // which block was added first
+    CONST __m256i Step = _mm256_set1_epi64x((LONG64)BLT_HASH_KEY_STEP);
+    CONST __m256i Step2 = _mm256_add_epi64(Step, Step);
+    __m256i Acc0 = _mm256_loadu_si256((CONST __m256i*)pAcc);
+    __m256i Acc1 = _mm256_setzero_si256();
+    __m256i Key0 = _mm256_add_epi64(_mm256_loadu_si256((CONST __m256i*)g_BltHashKeys), _mm256_set1_epi64x((LONG64)Salt));
+    __m256i Key1 = _mm256_add_epi64(Key0, Step);
+
+    UINT i = 0;
+    for (; i + 2 * BLT_HASH_BLOCK <= Bytes; i += 2 * BLT_HASH_BLOCK)
+    {
+        Acc0 = HashLanesAvx2(Acc0, _mm256_loadu_si256((CONST __m256i*)(pRow + i)), Key0);
+        Acc1 = HashLanesAvx2(Acc1, _mm256_loadu_si256((CONST __m256i*)(pRow + i + BLT_HASH_BLOCK)), Key1);
+        Key0 = _mm256_add_epi64(Key0, Step2);
+        Key1 = _mm256_add_epi64(Key1, Step2);
+    }
+    if (i + BLT_HASH_BLOCK <= Bytes)
+    {
+        Acc0 = HashLanesAvx2(Acc0, _mm256_loadu_si256((CONST __m256i*)(pRow + i)), Key0);
+        i += BLT_HASH_BLOCK;
+    }
+
+    _mm256_storeu_si256((__m256i*)pAcc, _mm256_add_epi64(Acc0, Acc1));
+    HashRowTail(pAcc, pRow, Bytes, i, Salt);
+}
+
+//
+// 10 bit and FP16
+//
+// A2R10G10B10 widens each channel by repeating its top bits in the new low
+// ones, so 0 and 255 map to 0 and 1023 and narrowing back with a shift gives
+// the original byte. The 2 bit alpha is widened the same way.
+//
+// A16B16G16R16F is linear scRGB, 8 bit channels are sRGB encoded. Bytes are
+// decoded through g_BltSrgbToHalf, halves are encoded through
+// g_BltHalfToSrgb, which holds the correctly rounded code of every half from
+// 0 to 1. Positive halves sort like their bit patterns, so the table is just
+// the number of code boundaries at or below each of them. Negative halves
+// clamp to black, anything above 1 (infinities and NaNs included) to white.
+// Alpha is not carried, FP16 surfaces are written as opaque and read as
+// opaque.
+//
+// AVX2 does the FP16 lookups with gathers, the tables are padded so the 4
+// bytes a gather reads at the last entry stay inside them.
+//
+
+static CONST UINT16 g_BltSrgbToHalf[256 + 1] =
+{
+    0x0000, 0x0cf9, 0x10f9, 0x1376, 0x14f9, 0x1637, 0x1776, 0x185a, 0x18f9, 0x1998, 0x1a37, 0x1adb,
+    0x1b88, 0x1c1f, 0x1c7f, 0x1ce4, 0x1d4e, 0x1dbd, 0x1e32, 0x1eab, 0x1f2a, 0x1fae, 0x201c, 0x2063,
+    0x20ad, 0x20fa, 0x214a, 0x219d, 0x21f2, 0x224a, 0x22a6, 0x2304, 0x2365, 0x23c9, 0x2418, 0x244d,
+    0x2484, 0x24bc, 0x24f6, 0x2532, 0x256f, 0x25ad, 0x25ed, 0x262f, 0x2673, 0x26b8, 0x26ff, 0x2747,
+    0x2791, 0x27dd, 0x2815, 0x283d, 0x2865, 0x288f, 0x28b9, 0x28e4, 0x2910, 0x293d, 0x296a, 0x2999,
+    0x29c9, 0x29f9, 0x2a2a, 0x2a5d, 0x2a90, 0x2ac4, 0x2af9, 0x2b2f, 0x2b66, 0x2b9e, 0x2bd7, 0x2c08,
+    0x2c26, 0x2c44, 0x2c62, 0x2c81, 0x2ca0, 0x2cc0, 0x2ce0, 0x2d01, 0x2d22, 0x2d44, 0x2d66, 0x2d89,
+    0x2dad, 0x2dd0, 0x2df5, 0x2e1a, 0x2e3f, 0x2e65, 0x2e8b, 0x2eb2, 0x2ed9, 0x2f01, 0x2f2a, 0x2f53,
+    0x2f7c, 0x2fa7, 0x2fd1, 0x2ffc, 0x3014, 0x302a, 0x3040, 0x3057, 0x306e, 0x3085, 0x309d, 0x30b4,
+    0x30cc, 0x30e5, 0x30fd, 0x3116, 0x312f, 0x3149, 0x3162, 0x317c, 0x3197, 0x31b1, 0x31cc, 0x31e7,
+    0x3203, 0x321e, 0x323a, 0x3257, 0x3273, 0x3290, 0x32ad, 0x32cb, 0x32e8, 0x3306, 0x3325, 0x3343,
+    0x3362, 0x3381, 0x33a1, 0x33c1, 0x33e1, 0x3401, 0x3411, 0x3422, 0x3432, 0x3443, 0x3454, 0x3465,
+    0x3476, 0x3488, 0x3499, 0x34ab, 0x34bd, 0x34cf, 0x34e1, 0x34f4, 0x3506, 0x3519, 0x352c, 0x353f,
+    0x3552, 0x3565, 0x3578, 0x358c, 0x35a0, 0x35b4, 0x35c8, 0x35dc, 0x35f1, 0x3605, 0x361a, 0x362f,
+    0x3644, 0x3659, 0x366f, 0x3684, 0x369a, 0x36b0, 0x36c6, 0x36dc, 0x36f2, 0x3709, 0x3720, 0x3736,
+    0x374d, 0x3765, 0x377c, 0x3794, 0x37ab, 0x37c3, 0x37db, 0x37f3, 0x3806, 0x3812, 0x381f, 0x382b,
+    0x3838, 0x3844, 0x3851, 0x385e, 0x386b, 0x3877, 0x3885, 0x3892, 0x389f, 0x38ac, 0x38ba, 0x38c7,
+    0x38d5, 0x38e2, 0x38f0, 0x38fe, 0x390c, 0x391a, 0x3928, 0x3936, 0x3944, 0x3953, 0x3961, 0x3970,
+    0x397e, 0x398d, 0x399c, 0x39ab, 0x39ba, 0x39c9, 0x39d8, 0x39e7, 0x39f7, 0x3a06, 0x3a16, 0x3a25,
+    0x3a35, 0x3a45, 0x3a55, 0x3a65, 0x3a75, 0x3a85, 0x3a95, 0x3aa5, 0x3ab6, 0x3ac6, 0x3ad7, 0x3ae8,
+    0x3af9, 0x3b09, 0x3b1a, 0x3b2c, 0x3b3d, 0x3b4e, 0x3b5f, 0x3b71, 0x3b82, 0x3b94, 0x3ba6, 0x3bb8,
+    0x3bca, 0x3bdc, 0x3bee, 0x3c00,
+    0x0000,
+};
+// First half of each code above 0, see BltBuildHalfToSrgb
+static CONST UINT16 g_BltSrgbHalfBound[255] =
+{
+    0x08fa, 0x0f76, 0x1238, 0x145a, 0x1599, 0x16d7, 0x180b, 0x18aa, 0x1949, 0x19e8, 0x1a88, 0x1b30,
+    0x1be2, 0x1c4f, 0x1cb2, 0x1d19, 0x1d86, 0x1df7, 0x1e6e, 0x1eea, 0x1f6c, 0x1ff2, 0x203f, 0x2088,
+    0x20d4, 0x2122, 0x2173, 0x21c7, 0x221e, 0x2278, 0x22d5, 0x2335, 0x2397, 0x23fd, 0x2433, 0x2469,
+    0x24a1, 0x24da, 0x2514, 0x2550, 0x258e, 0x25ce, 0x260f, 0x2651, 0x2695, 0x26db, 0x2723, 0x276c,
+    0x27b7, 0x2802, 0x2829, 0x2851, 0x287a, 0x28a4, 0x28cf, 0x28fa, 0x2927, 0x2954, 0x2982, 0x29b1,
+    0x29e1, 0x2a12, 0x2a44, 0x2a77, 0x2aaa, 0x2adf, 0x2b15, 0x2b4b, 0x2b82, 0x2bbb, 0x2bf4, 0x2c17,
+    0x2c35, 0x2c53, 0x2c72, 0x2c91, 0x2cb0, 0x2cd1, 0x2cf1, 0x2d12, 0x2d34, 0x2d56, 0x2d78, 0x2d9b,
+    0x2dbf, 0x2de3, 0x2e08, 0x2e2d, 0x2e52, 0x2e78, 0x2e9f, 0x2ec6, 0x2eee, 0x2f16, 0x2f3f, 0x2f68,
+    0x2f92, 0x2fbc, 0x2fe7, 0x300a, 0x301f, 0x3036, 0x304c, 0x3063, 0x307a, 0x3091, 0x30a9, 0x30c1,
+    0x30d9, 0x30f2, 0x310a, 0x3123, 0x313d, 0x3156, 0x3170, 0x318a, 0x31a4, 0x31bf, 0x31da, 0x31f5,
+    0x3211, 0x322d, 0x3249, 0x3265, 0x3282, 0x329f, 0x32bc, 0x32da, 0x32f8, 0x3316, 0x3334, 0x3353,
+    0x3372, 0x3392, 0x33b1, 0x33d1, 0x33f2, 0x3409, 0x341a, 0x342a, 0x343b, 0x344c, 0x345d, 0x346e,
+    0x3480, 0x3491, 0x34a3, 0x34b5, 0x34c6, 0x34d9, 0x34eb, 0x34fd, 0x3510, 0x3523, 0x3536, 0x3549,
+    0x355c, 0x356f, 0x3583, 0x3596, 0x35aa, 0x35be, 0x35d3, 0x35e7, 0x35fb, 0x3610, 0x3625, 0x363a,
+    0x364f, 0x3664, 0x367a, 0x368f, 0x36a5, 0x36bb, 0x36d1, 0x36e8, 0x36fe, 0x3715, 0x372b, 0x3742,
+    0x375a, 0x3771, 0x3788, 0x37a0, 0x37b8, 0x37d0, 0x37e8, 0x3800, 0x380d, 0x3819, 0x3825, 0x3832,
+    0x383e, 0x384b, 0x3858, 0x3865, 0x3871, 0x387e, 0x388c, 0x3899, 0x38a6, 0x38b3, 0x38c1, 0x38ce,
+    0x38dc, 0x38ea, 0x38f7, 0x3905, 0x3913, 0x3921, 0x392f, 0x393e, 0x394c, 0x395a, 0x3969, 0x3978,
+    0x3986, 0x3995, 0x39a4, 0x39b3, 0x39c2, 0x39d1, 0x39e0, 0x39ef, 0x39ff, 0x3a0e, 0x3a1e, 0x3a2e,
+    0x3a3d, 0x3a4d, 0x3a5d, 0x3a6d, 0x3a7d, 0x3a8d, 0x3a9e, 0x3aae, 0x3abf, 0x3acf, 0x3ae0, 0x3af1,
+    0x3b02, 0x3b12, 0x3b24, 0x3b35, 0x3b46, 0x3b57, 0x3b69, 0x3b7a, 0x3b8c, 0x3b9d, 0x3baf, 0x3bc1,
+    0x3bd3, 0x3be5, 0x3bf7,
+};
+static BYTE g_BltHalfToSrgb[BLT_HALF_ONE + 1 + 3];
+
+#define BLT_WIDEN_8_TO_10(c)    (((c) << 2) | ((c) >> 6))
+
+static FORCEINLINE UINT HalfToSrgb(UINT Half)
+{
+    return g_BltHalfToSrgb[(Half & 0x8000) ? 0 : ((Half < BLT_HALF_ONE) ? Half : BLT_HALF_ONE)];
+}
+
+static VOID Unpack2101010RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstPixel[i] = ((Pixel >> 30) * 0x55000000) |
+                       ((Pixel >> 6) & 0xFF0000) |
+                       ((Pixel >> 4) & 0xFF00) |
+                       ((Pixel >> 2) & 0xFF);
+    }
+}
+
+static VOID Pack2101010RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstPixel[i] = (Pixel & 0xC0000000) |
+                       (BLT_WIDEN_8_TO_10((Pixel >> 16) & 0xFF) << 20) |
+                       (BLT_WIDEN_8_TO_10((Pixel >> 8) & 0xFF) << 10) |
+                       BLT_WIDEN_8_TO_10(Pixel & 0xFF);
+    }
+}
+
+static VOID UnpackFp16RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT32* pDstPixel = (UINT32*)pDst;
+    CONST UINT16* pSrcChannel = (CONST UINT16*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        pDstPixel[i] = 0xFF000000 |
+                       (HalfToSrgb(pSrcChannel[4 * i]) << 16) |
+                       (HalfToSrgb(pSrcChannel[4 * i + 1]) << 8) |
+                       HalfToSrgb(pSrcChannel[4 * i + 2]);
+    }
+}
+
+static VOID PackFp16RowScalar(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT16* pDstChannel = (UINT16*)pDst;
+    CONST UINT32* pSrcPixel = (CONST UINT32*)pSrc;
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        UINT32 Pixel = pSrcPixel[i];
+        pDstChannel[4 * i] = g_BltSrgbToHalf[(Pixel >> 16) & 0xFF];
+        pDstChannel[4 * i + 1] = g_BltSrgbToHalf[(Pixel >> 8) & 0xFF];
+        pDstChannel[4 * i + 2] = g_BltSrgbToHalf[Pixel & 0xFF];
+        pDstChannel[4 * i + 3] = BLT_HALF_ONE;
+    }
+}
+
+static FORCEINLINE __m128i Unpack2101010Sse2(__m128i p)
+{
+    // The 2 bit alpha is repeated down through the whole byte
+    __m128i a = _mm_and_si128(p, _mm_set1_epi32((int)0xC0000000));
+    a = _mm_or_si128(a, _mm_srli_epi32(a, 2));
+    a = _mm_or_si128(a, _mm_srli_epi32(a, 4));
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0xFF0000));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 4), _mm_set1_epi32(0xFF00));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 2), _mm_set1_epi32(0xFF));
+    return _mm_or_si128(_mm_or_si128(a, r), _mm_or_si128(g, b));
+}
+
+static FORCEINLINE __m128i Pack2101010Sse2(__m128i p)
+{
+    __m128i r = _mm_and_si128(p, _mm_set1_epi32(0xFF0000));
+    __m128i g = _mm_and_si128(p, _mm_set1_epi32(0xFF00));
+    __m128i b = _mm_and_si128(p, _mm_set1_epi32(0xFF));
+    r = _mm_or_si128(_mm_slli_epi32(r, 6), _mm_and_si128(_mm_srli_epi32(r, 2), _mm_set1_epi32(0x300000)));
+    g = _mm_or_si128(_mm_slli_epi32(g, 4), _mm_and_si128(_mm_srli_epi32(g, 4), _mm_set1_epi32(0xC00)));
+    b = _mm_or_si128(_mm_slli_epi32(b, 2), _mm_srli_epi32(b, 6));
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(p, _mm_set1_epi32((int)0xC0000000)), r), _mm_or_si128(g, b));
+}
+
+static VOID Unpack2101010RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), Unpack2101010Sse2(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4))));
+    }
+    Unpack2101010RowScalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+static VOID Pack2101010RowSse2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), Pack2101010Sse2(_mm_loadu_si128((CONST __m128i*)(pSrc + i * 4))));
+    }
+    Pack2101010RowScalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static VOID Unpack2101010RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i a = _mm256_and_si256(p, _mm256_set1_epi32((int)0xC0000000));
+        a = _mm256_or_si256(a, _mm256_srli_epi32(a, 2));
+        a = _mm256_or_si256(a, _mm256_srli_epi32(a, 4));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 6), _mm256_set1_epi32(0xFF0000));
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 4), _mm256_set1_epi32(0xFF00));
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 2), _mm256_set1_epi32(0xFF));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_or_si256(_mm256_or_si256(a, r), _mm256_or_si256(g, b)));
+    }
+    Unpack2101010RowScalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static VOID Pack2101010RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i r = _mm256_and_si256(p, _mm256_set1_epi32(0xFF0000));
+        __m256i g = _mm256_and_si256(p, _mm256_set1_epi32(0xFF00));
+        __m256i b = _mm256_and_si256(p, _mm256_set1_epi32(0xFF));
+        r = _mm256_or_si256(_mm256_slli_epi32(r, 6), _mm256_and_si256(_mm256_srli_epi32(r, 2), _mm256_set1_epi32(0x300000)));
+        g = _mm256_or_si256(_mm256_slli_epi32(g, 4), _mm256_and_si256(_mm256_srli_epi32(g, 4), _mm256_set1_epi32(0xC00)));
+        b = _mm256_or_si256(_mm256_slli_epi32(b, 2), _mm256_srli_epi32(b, 6));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4),
+                            _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(p, _mm256_set1_epi32((int)0xC0000000)), r),
+                                            _mm256_or_si256(g, b)));
+    }
+    Pack2101010RowScalar(pDst + i * 4, pSrc + i * 4, Pixels - i);
+}
+
+// Code of 8 halves, each zero extended in its 32 bit lane
+BLT_TARGET_AVX2
+static FORCEINLINE __m256i HalfToSrgbAvx2(__m256i Half)
+{
+    // Sign extending makes the negative halves negative, then both ends clamp
+    Half = _mm256_srai_epi32(_mm256_slli_epi32(Half, 16), 16);
+    Half = _mm256_min_epi32(_mm256_max_epi32(Half, _mm256_setzero_si256()), _mm256_set1_epi32(BLT_HALF_ONE));
+    return _mm256_and_si256(_mm256_i32gather_epi32((CONST int*)g_BltHalfToSrgb, Half, 1), _mm256_set1_epi32(0xFF));
+}
+
+BLT_TARGET_AVX2
+static VOID UnpackFp16RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m256i LowHalf = _mm256_set1_epi32(0xFFFF);
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256 p0 = _mm256_castsi256_ps(_mm256_loadu_si256((CONST __m256i*)(pSrc + i * 8)));
+        __m256 p1 = _mm256_castsi256_ps(_mm256_loadu_si256((CONST __m256i*)(pSrc + i * 8 + 32)));
+
+        // R | G and B | A of pixels 0, 1, 4, 5, 2, 3, 6, 7
+        __m256i rg = _mm256_castps_si256(_mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256i ba = _mm256_castps_si256(_mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+        __m256i r = HalfToSrgbAvx2(_mm256_and_si256(rg, LowHalf));
+        __m256i g = HalfToSrgbAvx2(_mm256_srli_epi32(rg, 16));
+        __m256i b = HalfToSrgbAvx2(_mm256_and_si256(ba, LowHalf));
+        __m256i Out = _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32((int)0xFF000000), _mm256_slli_epi32(r, 16)),
+                                      _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_permute4x64_epi64(Out, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    UnpackFp16RowScalar(pDst + i * 4, pSrc + i * 8, Pixels - i);
+}
+
+BLT_TARGET_AVX2
+static VOID PackFp16RowAvx2(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels)
+{
+    CONST __m256i ByteMask = _mm256_set1_epi32(0xFF);
+    CONST __m256i LowHalf = _mm256_set1_epi32(0xFFFF);
+    CONST __m256i OpaqueAlpha = _mm256_set1_epi32(BLT_HALF_ONE << 16);
+    UINT i = 0;
+    for (; i + 8 <= Pixels; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((CONST __m256i*)(pSrc + i * 4));
+        __m256i r = _mm256_i32gather_epi32((CONST int*)g_BltSrgbToHalf, _mm256_and_si256(_mm256_srli_epi32(p, 16), ByteMask), 2);
+        __m256i g = _mm256_i32gather_epi32((CONST int*)g_BltSrgbToHalf, _mm256_and_si256(_mm256_srli_epi32(p, 8), ByteMask), 2);
+        __m256i b = _mm256_i32gather_epi32((CONST int*)g_BltSrgbToHalf, _mm256_and_si256(p, ByteMask), 2);
+
+        __m256i rg = _mm256_or_si256(_mm256_and_si256(r, LowHalf), _mm256_slli_epi32(g, 16));
+        __m256i ba = _mm256_or_si256(_mm256_and_si256(b, LowHalf), OpaqueAlpha);
+
+        // Pixels 0, 1, 4, 5 and 2, 3, 6, 7
+        __m256i Lo = _mm256_unpacklo_epi32(rg, ba);
+        __m256i Hi = _mm256_unpackhi_epi32(rg, ba);
+        _mm256_storeu_si256((__m256i*)(pDst + i * 8), _mm256_permute2x128_si256(Lo, Hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(pDst + i * 8 + 32), _mm256_permute2x128_si256(Lo, Hi, 0x31));
+    }
+    PackFp16RowScalar(pDst + i * 8, pSrc + i * 4, Pixels - i);
+}
+
+//
+// Stretching
+//
+// All the arithmetic is integer and the SSE2 kernels give the same bits as
+// the scalar ones. A span pixel is 4 16 bit channels, so the SSE2 kernels
+// work on one (horizontal) or two (vertical) pixels per register.
+//
+
+static VOID BilinearSpanScalar(UINT16* pSpan, CONST BYTE* pSrcRow, CONST BLT_STRETCH_TAP* pTaps, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        CONST BYTE* p = pSrcRow + pTaps[i].X * 4;
+        UINT Weight = pTaps[i].Weight;
+        for (UINT c = 0; c < 4; ++c)
+        {
+            pSpan[i * 4 + c] = (UINT16)(p[c] * (256 - Weight) + p[c + 4] * Weight);
+        }
+    }
+}
+
+static VOID BoxSpanScalar(UINT16* pSpan, CONST BYTE* pSrcRow, CONST BLT_STRETCH_TAP* pTaps, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        CONST BYTE* p = pSrcRow + pTaps[i].X * 4;
+        UINT Sum[4] = { 0, 0, 0, 0 };
+        for (UINT k = 0; k < pTaps[i].Count; ++k)
+        {
+            Sum[0] += p[k * 4 + 0];
+            Sum[1] += p[k * 4 + 1];
+            Sum[2] += p[k * 4 + 2];
+            Sum[3] += p[k * 4 + 3];
+        }
+        for (UINT c = 0; c < 4; ++c)
+        {
+            pSpan[i * 4 + c] = (UINT16)((Sum[c] * pTaps[i].Weight) >> 8);
+        }
+    }
+}
+
+static VOID LerpSpansScalar(BYTE* pDst, CONST UINT16* pSpan0, CONST UINT16* pSpan1, UINT Weight, UINT Pixels)
+{
+    // Weights are scaled to add up to 65535 so each product keeps 16 bits
+    UINT Weight1 = Weight << 8;
+    UINT Weight0 = 65535 - Weight1;
+    for (UINT i = 0; i < Pixels * 4; ++i)
+    {
+        UINT Value = ((pSpan0[i] * Weight0) >> 16) + ((pSpan1[i] * Weight1) >> 16) + 128;
+        pDst[i] = (BYTE)(((Value < 65535) ? Value : 65535) >> 8);
+    }
+}
+
+static VOID AccumulateSpanScalar(UINT32* pSum, CONST UINT16* pSpan, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels * 4; ++i)
+    {
+        pSum[i] += pSpan[i];
+    }
+}
+
+static VOID ResolveSpanScalar(BYTE* pDst, CONST UINT32* pSum, UINT Weight, UINT Pixels)
+{
+    for (UINT i = 0; i < Pixels * 4; ++i)
+    {
+        pDst[i] = (BYTE)(((UINT64)pSum[i] * Weight + (1 << 23)) >> 24);
+    }
+}
+
+static VOID BilinearSpanSse2(UINT16* pSpan, CONST BYTE* pSrcRow, CONST BLT_STRETCH_TAP* pTaps, UINT Pixels)
+{
+    CONST __m128i Zero = _mm_setzero_si128();
+    CONST __m128i Full = _mm_set1_epi16(256);
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        // Both source pixels in one load, each weighted then the halves added
+        __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((CONST __m128i*)(pSrcRow + pTaps[i].X * 4)), Zero);
+        __m128i w = _mm_set1_epi16((short)pTaps[i].Weight);
+        __m128i Product = _mm_mullo_epi16(p, _mm_unpacklo_epi64(_mm_sub_epi16(Full, w), w));
+        _mm_storel_epi64((__m128i*)(pSpan + i * 4), _mm_add_epi16(Product, _mm_srli_si128(Product, 8)));
+    }
+}
+
+static VOID BoxSpanSse2(UINT16* pSpan, CONST BYTE* pSrcRow, CONST BLT_STRETCH_TAP* pTaps, UINT Pixels)
+{
+    CONST __m128i Zero = _mm_setzero_si128();
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        CONST BYTE* p = pSrcRow + pTaps[i].X * 4;
+        __m128i Sum = _mm_setzero_si128();
+        for (UINT k = 0; k < pTaps[i].Count; ++k)
+        {
+            Sum = _mm_add_epi16(Sum, _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(CONST int*)(p + k * 4)), Zero));
+        }
+
+        // (Sum * Weight) >> 8 from the two halves of the 32 bit products
+        __m128i w = _mm_set1_epi16((short)pTaps[i].Weight);
+        __m128i Lo = _mm_mullo_epi16(Sum, w);
+        __m128i Hi = _mm_mulhi_epu16(Sum, w);
+        _mm_storel_epi64((__m128i*)(pSpan + i * 4), _mm_or_si128(_mm_slli_epi16(Hi, 8), _mm_srli_epi16(Lo, 8)));
+    }
+}
+
+static FORCEINLINE __m128i LerpSse2(CONST UINT16* pSpan0, CONST UINT16* pSpan1, __m128i Weight0, __m128i Weight1)
+{
+    __m128i Value = _mm_add_epi16(_mm_mulhi_epu16(_mm_loadu_si128((CONST __m128i*)pSpan0), Weight0),
+                                  _mm_mulhi_epu16(_mm_loadu_si128((CONST __m128i*)pSpan1), Weight1));
+    return _mm_srli_epi16(_mm_adds_epu16(Value, _mm_set1_epi16(128)), 8);
+}
+
+static VOID LerpSpansSse2(BYTE* pDst, CONST UINT16* pSpan0, CONST UINT16* pSpan1, UINT Weight, UINT Pixels)
+{
+    CONST __m128i Weight1 = _mm_set1_epi16((short)(Weight << 8));
+    CONST __m128i Weight0 = _mm_set1_epi16((short)(65535 - (Weight << 8)));
+    UINT i = 0;
+    for (; i + 4 <= Pixels; i += 4)
+    {
+        __m128i a = LerpSse2(pSpan0 + i * 4, pSpan1 + i * 4, Weight0, Weight1);
+        __m128i b = LerpSse2(pSpan0 + i * 4 + 8, pSpan1 + i * 4 + 8, Weight0, Weight1);
+        _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_packus_epi16(a, b));
+    }
+    LerpSpansScalar(pDst + i * 4, pSpan0 + i * 4, pSpan1 + i * 4, Weight, Pixels - i);
+}
+
+static VOID AccumulateSpanSse2(UINT32* pSum, CONST UINT16* pSpan, UINT Pixels)
+{
+    CONST __m128i Zero = _mm_setzero_si128();
+    UINT i = 0;
+    for (; i + 2 <= Pixels; i += 2)
+    {
+        __m128i s = _mm_loadu_si128((CONST __m128i*)(pSpan + i * 4));
+        __m128i* p = (__m128i*)(pSum + i * 4);
+        _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), _mm_unpacklo_epi16(s, Zero)));
+        _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), _mm_unpackhi_epi16(s, Zero)));
+    }
+    AccumulateSpanScalar(pSum + i * 4, pSpan + i * 4, Pixels - i);
+}
+
+static VOID ResolveSpanSse2(BYTE* pDst, CONST UINT32* pSum, UINT Weight, UINT Pixels)
+{
+    // 32 x 32 bit multiplies into 64 bit lanes, the even channels then the odd ones
+    CONST __m128i w = _mm_set1_epi32((int)Weight);
+    CONST __m128i Round = _mm_set1_epi64x(1 << 23);
+    for (UINT i = 0; i < Pixels; ++i)
+    {
+        __m128i s = _mm_loadu_si128((CONST __m128i*)(pSum + i * 4));
+        __m128i Even = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(s, w), Round), 24);
+        __m128i Odd = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(s, 32), w), Round), 24);
+        __m128i Value = _mm_or_si128(Even, _mm_slli_epi64(Odd, 32));
+        Value = _mm_packs_epi32(Value, Value);
+        *(int*)(pDst + i * 4) = _mm_cvtsi128_si32(_mm_packus_epi16(Value, Value));
+    }
+}
+
+//
+// Dispatch
+//
+
+// Ordered best first. A tier is usable when the CPU has all of its CpuFeatures.
+static CONST BLT_SIMD_DISPATCH g_BltSimdTiers[] =
+{
+#ifdef BLT_XSTATE_AVX512
+    {
+        "AVX-512", BLT_CPU_SSE2 | BLT_CPU_SSSE3 | BLT_CPU_AVX2 | BLT_CPU_AVX512, BLT_XSTATE_AVX512,
+        CopyRowAvx512, CopyRowStreamAvx512,
+        Rotate32Sse2, ReverseRow32Sse2,
+        Unpack565RowAvx2, Pack565RowAvx2,
+        Quantize8RowAvx2, Dither565RowAvx2, Dither8RowAvx2,
+        Unpack24RowSsse3, Pack24RowSsse3, CopyRgb32RowSse2,
+        Unpack2101010RowAvx2, Pack2101010RowAvx2, UnpackFp16RowAvx2, PackFp16RowAvx2,
+        ColorLutRow32Avx2, SwizzleRow32Avx2, CopyChangedRow32Avx512, BlendRow32Avx2, HashRowAvx2,
+        BilinearSpanSse2, BoxSpanSse2, LerpSpansSse2, AccumulateSpanSse2, ResolveSpanSse2,
+    },
+#endif
+    {
+        "AVX2", BLT_CPU_SSE2 | BLT_CPU_SSSE3 | BLT_CPU_AVX2, BLT_XSTATE_AVX,
+        CopyRowAvx2, CopyRowStreamAvx2,
+        Rotate32Sse2, ReverseRow32Sse2,
+        Unpack565RowAvx2, Pack565RowAvx2,
+        Quantize8RowAvx2, Dither565RowAvx2, Dither8RowAvx2,
+        Unpack24RowSsse3, Pack24RowSsse3, CopyRgb32RowSse2,
+        Unpack2101010RowAvx2, Pack2101010RowAvx2, UnpackFp16RowAvx2, PackFp16RowAvx2,
+        ColorLutRow32Avx2, SwizzleRow32Avx2, CopyChangedRow32Avx2, BlendRow32Avx2, HashRowAvx2,
+        BilinearSpanSse2, BoxSpanSse2, LerpSpansSse2, AccumulateSpanSse2, ResolveSpanSse2,
+    },
+    {
+        "SSSE3", BLT_CPU_SSE2 | BLT_CPU_SSSE3, BLT_XSTATE_SSE,
+        CopyRowSse2, CopyRowStreamSse2,
+        Rotate32Sse2, ReverseRow32Sse2,
+        Unpack565RowSse2, Pack565RowSse2,
+        Quantize8RowSse2, Dither565RowSse2, Dither8RowSse2,
+        Unpack24RowSsse3, Pack24RowSsse3, CopyRgb32RowSse2,
+        Unpack2101010RowSse2, Pack2101010RowSse2, UnpackFp16RowScalar, PackFp16RowScalar,
+        ColorLutRow32Scalar, SwizzleRow32Ssse3, CopyChangedRow32Sse2, BlendRow32Sse2, HashRowSse2,
+        BilinearSpanSse2, BoxSpanSse2, LerpSpansSse2, AccumulateSpanSse2, ResolveSpanSse2,
+    },
+    {
+        "SSE2", BLT_CPU_SSE2, BLT_XSTATE_SSE,
+        CopyRowSse2, CopyRowStreamSse2,
+        Rotate32Sse2, ReverseRow32Sse2,
+        Unpack565RowSse2, Pack565RowSse2,
+        Quantize8RowSse2, Dither565RowSse2, Dither8RowSse2,
+        Unpack24RowScalar, Pack24RowScalar, CopyRgb32RowSse2,
+        Unpack2101010RowSse2, Pack2101010RowSse2, UnpackFp16RowScalar, PackFp16RowScalar,
+        ColorLutRow32Scalar, SwizzleRow32Scalar, CopyChangedRow32Sse2, BlendRow32Sse2, HashRowSse2,
+        BilinearSpanSse2, BoxSpanSse2, LerpSpansSse2, AccumulateSpanSse2, ResolveSpanSse2,
+    },
+    {
+        "Scalar", 0, 0,
+        CopyRowScalar, NULL,
+        Rotate32Scalar, ReverseRow32Scalar,
+        Unpack565RowScalar, Pack565RowScalar,
+        Quantize8RowScalar, Dither565RowScalar, Dither8RowScalar,
+        Unpack24RowScalar, Pack24RowScalar, CopyRgb32RowScalar,
+        Unpack2101010RowScalar, Pack2101010RowScalar, UnpackFp16RowScalar, PackFp16RowScalar,
+        ColorLutRow32Scalar, SwizzleRow32Scalar, CopyChangedRow32Scalar, BlendRow32Scalar, HashRowScalar,
+        BilinearSpanScalar, BoxSpanScalar, LerpSpansScalar, AccumulateSpanScalar, ResolveSpanScalar,
+    },
+};
+
+static CONST BLT_SIMD_DISPATCH* g_pBltSimd = &g_BltSimdTiers[ARRAYSIZE(g_BltSimdTiers) - 1];
+static CONST BLT_SIMD_DISPATCH* g_pBltSimdNoXState = &g_BltSimdTiers[ARRAYSIZE(g_BltSimdTiers) - 1];
+
+SIZE_T g_BltStreamThreshold = BLT_DEFAULT_LLC_SIZE;
+
+VOID BltSimdBegin(BLT_SIMD_CONTEXT* pContext)
+{
+    pContext->pDispatch = g_pBltSimd;
+
+#ifndef BLT_HOST_BUILD
+    pContext->XStateSaved = FALSE;
+    if (g_pBltSimd->XStateMask != 0)
+    {
+        if ((KeGetCurrentIrql() <= DISPATCH_LEVEL) &&
+            NT_SUCCESS(KeSaveExtendedProcessorState(g_pBltSimd->XStateMask, &pContext->XState)))
+        {
+            pContext->XStateSaved = TRUE;
+        }
+        else
+        {
+            pContext->pDispatch = g_pBltSimdNoXState;
+        }
+    }
+#endif
+}
+
+VOID BltSimdEnd(BLT_SIMD_CONTEXT* pContext)
+{
+#ifndef BLT_HOST_BUILD
+    if (pContext->XStateSaved)
+    {
+        KeRestoreExtendedProcessorState(&pContext->XState);
+        pContext->XStateSaved = FALSE;
+    }
+#endif
+    pContext->pDispatch = NULL;
+}
+
+VOID BltSimdCopyRows(CONST BLT_SIMD_CONTEXT* pContext,
+                     BYTE*       pDst,
+                     LONG        DstPitch,
+                     CONST BYTE* pSrc,
+                     LONG        SrcPitch,
+                     SIZE_T      RowBytes,
+                     UINT        NumRows)
+{
+    CONST BLT_SIMD_DISPATCH* pDispatch = pContext->pDispatch;
+    PFN_BLT_COPY_ROW pfnCopyRow = pDispatch->CopyRow;
+    BOOLEAN Stream = FALSE;
+
+    if ((pDispatch->CopyRowStream != NULL) &&
+        (RowBytes * NumRows > g_BltStreamThreshold))
+    {
+        pfnCopyRow = pDispatch->CopyRowStream;
+        Stream = TRUE;
+    }
+
+    // Full width rects of two surfaces with the same pitch are one contiguous copy
+    if ((DstPitch == SrcPitch) && ((SIZE_T)DstPitch == RowBytes))
+    {
+        pfnCopyRow(pDst, pSrc, RowBytes * NumRows);
+    }
+    else
+    {
+        for (UINT i = 0; i < NumRows; ++i)
+        {
+            pfnCopyRow(pDst, pSrc, RowBytes);
+            pDst += DstPitch;
+            pSrc += SrcPitch;
+        }
+    }
+
+    if (Stream)
+    {
+        // Make the non-temporal stores globally visible before the host is told about them
+        _mm_sfence();
+    }
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+//
+// CPU detection, only run from DriverEntry
+//
+
+#pragma code_seg(push)
+#pragma code_seg("INIT")
+
+static VOID BltCpuid(ULONG Leaf, ULONG SubLeaf, ULONG Regs[4])
+{
+#if defined(_MSC_VER)
+    int Info[4];
+    __cpuidex(Info, (int)Leaf, (int)SubLeaf);
+    Regs[0] = (ULONG)Info[0];
+    Regs[1] = (ULONG)Info[1];
+    Regs[2] = (ULONG)Info[2];
+    Regs[3] = (ULONG)Info[3];
+#else
+    __cpuid_count(Leaf, SubLeaf, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+}
+
+// Returns the XCR0 bits the OS has enabled, i.e. which register files it context switches
+static ULONG64 BltEnabledXState(VOID)
+{
+#if !defined(BLT_HOST_BUILD)
+    return RtlGetEnabledExtendedFeatures((ULONG64)-1);
+#elif defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    ULONG Lo, Hi;
+    __asm__ __volatile__("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+    return ((ULONG64)Hi << 32) | Lo;
+#endif
+}
+
+ULONG BltQueryCpuFeatures(VOID)
+{
+    ULONG Regs[4];
+    ULONG Features = 0;
+
+    BltCpuid(0, 0, Regs);
+    ULONG MaxLeaf = Regs[0];
+    if (MaxLeaf < 1)
+    {
+        return 0;
+    }
+
+    BltCpuid(1, 0, Regs);
+    if (Regs[3] & (1 << 26)) Features |= BLT_CPU_SSE2;
+    if (Regs[2] & (1 << 9))  Features |= BLT_CPU_SSSE3;
+    if (Regs[2] & (1 << 19)) Features |= BLT_CPU_SSE41;
+
+    BOOLEAN OsXSave = (Regs[2] & (1 << 27)) != 0;
+    BOOLEAN Avx = (Regs[2] & (1 << 28)) != 0;
+    if (!OsXSave || !Avx || (MaxLeaf < 7))
+    {
+        return Features;
+    }
+
+    // YMM (bits 1-2) and for AVX-512 also opmask/ZMM (bits 5-7) must be enabled by the OS
+    ULONG64 XState = BltEnabledXState();
+    BltCpuid(7, 0, Regs);
+    if (((XState & 0x06) == 0x06) && (Regs[1] & (1 << 5)))
+    {
+        Features |= BLT_CPU_AVX2;
+
+        if (((XState & 0xE6) == 0xE6) && (Regs[1] & (1 << 16)) && (Regs[1] & (1UL << 30)))
+        {
+            Features |= BLT_CPU_AVX512;
+        }
+    }
+
+    return Features;
+}
+
+SIZE_T BltQueryLastLevelCacheSize(VOID)
+{
+    ULONG Regs[4];
+    SIZE_T LlcSize = 0;
+    ULONG LlcLevel = 0;
+
+    BltCpuid(0, 0, Regs);
+    if (Regs[0] >= 4)
+    {
+        // Intel deterministic cache parameters
+        for (ULONG SubLeaf = 0; SubLeaf < 16; ++SubLeaf)
+        {
+            BltCpuid(4, SubLeaf, Regs);
+            ULONG Type = Regs[0] & 0x1F;
+            ULONG Level = (Regs[0] >> 5) & 0x7;
+            if (Type == 0)
+            {
+                break;
+            }
+            if ((Type == 2) || (Level < LlcLevel))
+            {
+                // Instruction caches do not matter here
+                continue;
+            }
+
+            SIZE_T Ways = ((Regs[1] >> 22) & 0x3FF) + 1;
+            SIZE_T Partitions = ((Regs[1] >> 12) & 0x3FF) + 1;
+            SIZE_T LineSize = (Regs[1] & 0xFFF) + 1;
+            SIZE_T Sets = (SIZE_T)Regs[2] + 1;
+            LlcSize = Ways * Partitions * LineSize * Sets;
+            LlcLevel = Level;
+        }
+    }
+
+    if (LlcSize == 0)
+    {
+        // AMD reports L2/L3 through the extended leaves
+        BltCpuid(0x80000000, 0, Regs);
+        if (Regs[0] >= 0x80000006)
+        {
+            BltCpuid(0x80000006, 0, Regs);
+            SIZE_T L3 = (SIZE_T)(Regs[3] >> 18) * 512 * 1024;
+            SIZE_T L2 = (SIZE_T)(Regs[2] >> 16) * 1024;
+            LlcSize = (L3 != 0) ? L3 : L2;
+        }
+    }
+
+    return (LlcSize != 0) ? LlcSize : BLT_DEFAULT_LLC_SIZE;
+}
+
+CONST BLT_SIMD_DISPATCH* BltSimdSelect(ULONG CpuFeatures)
+{
+    g_pBltSimd = NULL;
+    g_pBltSimdNoXState = NULL;
+
+    for (UINT i = 0; i < ARRAYSIZE(g_BltSimdTiers); ++i)
+    {
+        CONST BLT_SIMD_DISPATCH* pTier = &g_BltSimdTiers[i];
+        if ((pTier->CpuFeatures & CpuFeatures) != pTier->CpuFeatures)
+        {
+            continue;
+        }
+        if (g_pBltSimd == NULL)
+        {
+            g_pBltSimd = pTier;
+        }
+        if ((g_pBltSimdNoXState == NULL) && (pTier->XStateMask == 0))
+        {
+            g_pBltSimdNoXState = pTier;
+        }
+    }
+
+    // The scalar tier always matches and never needs extended state
+    NT_ASSERT((g_pBltSimd != NULL) && (g_pBltSimdNoXState != NULL));
+    return g_pBltSimd;
+}
+
+// Fills g_BltHalfToSrgb, the code of a half is the number of code boundaries at or below it
+static VOID BltBuildHalfToSrgb(VOID)
+{
+    PAGED_CODE();
+
+    UINT Code = 0;
+    for (UINT Half = 0; Half < ARRAYSIZE(g_BltHalfToSrgb); Half++)
+    {
+        while ((Code < ARRAYSIZE(g_BltSrgbHalfBound)) && (Half >= g_BltSrgbHalfBound[Code]))
+        {
+            Code++;
+        }
+        g_BltHalfToSrgb[Half] = (BYTE)Code;
+    }
+}
+
+VOID BltSimdInitialize(VOID)
+{
+    PAGED_CODE();
+
+    BltBuildHalfToSrgb();
+
+    ULONG Features = BltQueryCpuFeatures();
+    g_BltStreamThreshold = BltQueryLastLevelCacheSize();
+
+    CONST BLT_SIMD_DISPATCH* pTier = BltSimdSelect(Features);
+    UNREFERENCED_PARAMETER(pTier);
+    BDD_LOG_EVENT("XENWDDM!%s using %s blt kernels, features 0x%x, streaming above %Iu bytes\n",
+                  __FUNCTION__, pTier->Name, Features, g_BltStreamThreshold);
+}
+
+#pragma code_seg(pop)
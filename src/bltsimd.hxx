@@ -0,0 +1,214 @@
+/******************************Module*Header*******************************\
+* Module Name: bltsimd.hxx
+*
+* SIMD row kernels used by the blt functions, and the dispatch table that
+* selects between them. The table is chosen once from CPUID at DriverEntry.
+*
+\**************************************************************************/
+
+#ifndef _BLTSIMD_HXX_
+#define _BLTSIMD_HXX_
+
+#include "bltport.hxx"
+
+// Copies Bytes from pSrc to pDst, the two must not overlap
+typedef VOID (*PFN_BLT_COPY_ROW)(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes);
+
+// Writes source pixel (x, y) of a Width x Height 32bpp rect to
+// pDst + x * DstPixelPitch + y * DstRowPitch, where DstRowPitch is +4 or -4.
+// This is the transposing copy ROTATE90 and ROTATE270 need.
+typedef VOID (*PFN_BLT_ROTATE32)(BYTE*       pDst,
+                                 LONG        DstPixelPitch,
+                                 LONG        DstRowPitch,
+                                 CONST BYTE* pSrc,
+                                 LONG        SrcPitch,
+                                 UINT        Width,
+                                 UINT        Height);
+
+// Writes source pixel i to pDst - 4 * i, i.e. the row of a ROTATE180 blt
+typedef VOID (*PFN_BLT_REVERSE_ROW32)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels);
+
+// Converts Pixels contiguous pixels from one format to another
+typedef VOID (*PFN_BLT_CONVERT_ROW)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels);
+
+// Same as PFN_BLT_CONVERT_ROW, with an ordered dither. X and Y are the
+// destination coordinates of the first pixel, they place the row in the
+// 4x4 dither matrix so the pattern stays put across rects.
+typedef VOID (*PFN_BLT_DITHER_ROW)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT X, UINT Y);
+
+// A16B16G16R16F value of 1.0, the top of the range 8 bit channels map to
+#define BLT_HALF_ONE            0x3C00
+
+// Per channel color lookup, e.g. a gamma ramp. Entries are already shifted
+// to their channel's place in an X8R8G8B8 pixel, so a pixel maps to
+// Blue[b] | Green[g] | Red[r].
+typedef struct _BLT_COLOR_LUT
+{
+    UINT32 Blue[256];
+    UINT32 Green[256];
+    UINT32 Red[256];
+} BLT_COLOR_LUT;
+
+// Copies Pixels X8R8G8B8 pixels through pLut, alpha is copied as is.
+// pDst may be pSrc to apply the lookup in place.
+typedef VOID (*PFN_BLT_COLOR_LUT_ROW32)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_COLOR_LUT* pLut);
+
+// Byte order of the pixels of a framebuffer as its consumer reads them
+typedef enum _BLT_CHANNEL_ORDER
+{
+    BLT_CHANNEL_ORDER_BGRA = 0, // D3DDDIFMT_A8R8G8B8, what the blts write
+    BLT_CHANNEL_ORDER_RGBA,     // D3DDDIFMT_A8B8G8R8
+    BLT_CHANNEL_ORDER_XRGB,     // The unused alpha byte first
+    BLT_CHANNEL_ORDER_COUNT
+} BLT_CHANNEL_ORDER;
+
+// Byte shuffle from B G R A to another channel order, byte i of every 4
+// pixels comes from byte Shuffle[i] (a pshufb control). Every order only
+// swaps pairs of bytes, so applying a swizzle twice gives the pixels back.
+typedef struct _BLT_SWIZZLE
+{
+    BYTE Shuffle[16];
+} BLT_SWIZZLE;
+
+// Copies Pixels X8R8G8B8 pixels through pSwizzle. pDst may be pSrc.
+typedef VOID (*PFN_BLT_SWIZZLE_ROW32)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, CONST BLT_SWIZZLE* pSwizzle);
+
+// Copies Pixels 32bpp pixels, only storing the cache lines of pDst whose
+// pixels differ from pSrc. Returns FALSE if none did, otherwise the first
+// changed pixel is *pFirst and the last one is *pEnd - 1.
+typedef BOOLEAN (*PFN_BLT_COPY_CHANGED_ROW32)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels, UINT* pFirst, UINT* pEnd);
+
+// Blends Pixels premultiplied A8R8G8B8 pixels of pSrc over the 32bpp pixels of pDst
+typedef VOID (*PFN_BLT_BLEND_ROW32)(BYTE* pDst, CONST BYTE* pSrc, UINT Pixels);
+
+// Rows are hashed a block of BLT_HASH_BLOCK bytes at a time into
+// BLT_HASH_LANES accumulators, see bltsimd.cxx
+#define BLT_HASH_LANES      4
+#define BLT_HASH_BLOCK      32
+
+// Adds Bytes bytes of a row to the accumulators of a hash. Salt tells the
+// rows of a hash apart, every tier gives the same accumulators.
+typedef VOID (*PFN_BLT_HASH_ROW)(UINT64* pAcc, CONST BYTE* pRow, UINT Bytes, UINT64 Salt);
+
+// One output pixel of a horizontal stretch pass. Bilinear taps blend source
+// pixels X and X + 1 as 256 - Weight and Weight (0-256). Box taps average
+// Count (1-256) source pixels from X, Weight is 65535 / Count.
+typedef struct _BLT_STRETCH_TAP
+{
+    UINT X;
+    UINT Count;
+    UINT Weight;
+} BLT_STRETCH_TAP;
+
+// Stretching is done in two passes. Source rows are first filtered
+// horizontally into spans of 16 bits per channel (channel value * 256, same
+// B, G, R, A order as the pixels), then spans are combined vertically.
+
+// Filters one source row into Pixels span pixels, one per tap
+typedef VOID (*PFN_BLT_STRETCH_SPAN)(UINT16* pSpan, CONST BYTE* pSrcRow, CONST BLT_STRETCH_TAP* pTaps, UINT Pixels);
+
+// Blends two spans as 256 - Weight and Weight (0-255) into X8R8G8B8 pixels
+typedef VOID (*PFN_BLT_LERP_SPANS)(BYTE* pDst, CONST UINT16* pSpan0, CONST UINT16* pSpan1, UINT Weight, UINT Pixels);
+
+// Adds a span to per channel 32 bit sums
+typedef VOID (*PFN_BLT_ACCUMULATE_SPAN)(UINT32* pSum, CONST UINT16* pSpan, UINT Pixels);
+
+// Turns sums of Rows spans into X8R8G8B8 pixels, Weight is 65535 / Rows
+typedef VOID (*PFN_BLT_RESOLVE_SPAN)(BYTE* pDst, CONST UINT32* pSum, UINT Weight, UINT Pixels);
+
+typedef struct _BLT_SIMD_DISPATCH
+{
+    CONST char*             Name;
+    ULONG                   CpuFeatures;    // BLT_CPU_* flags the kernels below require
+    ULONG64                 XStateMask;     // Extended state that has to be saved before using them in kernel mode
+
+    PFN_BLT_COPY_ROW        CopyRow;        // Regular (cached) stores
+    PFN_BLT_COPY_ROW        CopyRowStream;  // Non-temporal stores, NULL if not supported. Caller must fence.
+
+    PFN_BLT_ROTATE32        Rotate32;       // Cache blocked, works on BLT_ROTATE_TILE square tiles
+    PFN_BLT_REVERSE_ROW32   ReverseRow32;
+
+    PFN_BLT_CONVERT_ROW     Unpack565Row;   // R5G6B5 to X8R8G8B8, same bits as CONVERT_16BPP_TO_32BPP
+    PFN_BLT_CONVERT_ROW     Pack565Row;     // X8R8G8B8 to R5G6B5, same bits as CONVERT_32BPP_TO_16BPP
+    PFN_BLT_CONVERT_ROW     Quantize8Row;   // X8R8G8B8 to the 6x6x6 palette, same index as CONVERT_32BPP_TO_8BPP
+    PFN_BLT_DITHER_ROW      Dither565Row;   // Pack565Row with the dither added before truncating
+    PFN_BLT_DITHER_ROW      Dither8Row;     // Quantize8Row with the dither added before quantizing
+
+    // 24bpp only ever moves the three color bytes, the alpha byte of a 32bpp destination is left alone
+    PFN_BLT_CONVERT_ROW     Unpack24Row;    // R8G8B8 to X8R8G8B8
+    PFN_BLT_CONVERT_ROW     Pack24Row;      // X8R8G8B8 to R8G8B8
+    PFN_BLT_CONVERT_ROW     CopyRgb32Row;   // X8R8G8B8 to X8R8G8B8, color bytes only
+
+    // 10 bit and linear FP16 surfaces, the conversions are described in bltsimd.cxx
+    PFN_BLT_CONVERT_ROW     Unpack2101010Row;   // A2R10G10B10 to A8R8G8B8
+    PFN_BLT_CONVERT_ROW     Pack2101010Row;     // A8R8G8B8 to A2R10G10B10
+    PFN_BLT_CONVERT_ROW     UnpackFp16Row;      // A16B16G16R16F to X8R8G8B8
+    PFN_BLT_CONVERT_ROW     PackFp16Row;        // X8R8G8B8 to A16B16G16R16F
+
+    PFN_BLT_COLOR_LUT_ROW32 ColorLutRow32;
+    PFN_BLT_SWIZZLE_ROW32   SwizzleRow32;
+    PFN_BLT_COPY_CHANGED_ROW32 CopyChangedRow32; // Compare before write, pDst 4 byte aligned
+    PFN_BLT_BLEND_ROW32     BlendRow32;
+    PFN_BLT_HASH_ROW        HashRow;        // pAcc has BLT_HASH_LANES entries
+
+    // Stretch scaling, see bltstretch.cxx
+    PFN_BLT_STRETCH_SPAN    BilinearSpan;
+    PFN_BLT_STRETCH_SPAN    BoxSpan;
+    PFN_BLT_LERP_SPANS      LerpSpans;
+    PFN_BLT_ACCUMULATE_SPAN AccumulateSpan;
+    PFN_BLT_RESOLVE_SPAN    ResolveSpan;
+} BLT_SIMD_DISPATCH;
+
+// Channel / 43 for a channel value of 0-255, exact over that whole range.
+// The multiplier fits 16 bits so it maps onto a single high-half multiply.
+#define BLT_DIV43_MULTIPLIER    1525
+#define BLT_DIV43_SHIFT         16
+#define BLT_DIV43(c)            (((UINT)(c) * BLT_DIV43_MULTIPLIER) >> BLT_DIV43_SHIFT)
+
+// Side of the square tiles rotations are done in. 16 pixels at 32bpp is one
+// cache line per destination row of a tile.
+#define BLT_ROTATE_TILE     16
+
+// Per-call state, set up by BltSimdBegin and torn down by BltSimdEnd.
+// pDispatch may be a lesser tier than the selected one if the extended
+// processor state could not be saved (i.e. above DISPATCH_LEVEL at bugcheck).
+typedef struct _BLT_SIMD_CONTEXT
+{
+    CONST BLT_SIMD_DISPATCH* pDispatch;
+#ifndef BLT_HOST_BUILD
+    XSTATE_SAVE              XState;
+    BOOLEAN                  XStateSaved;
+#endif
+} BLT_SIMD_CONTEXT;
+
+// Copies bigger than this many bytes use non-temporal stores
+extern SIZE_T g_BltStreamThreshold;
+
+// Must be called once before any blt, picks the best tier for this CPU and
+// builds the tables the FP16 kernels use
+VOID BltSimdInitialize(VOID);
+
+// Forces the tier to the best one supported by CpuFeatures, returns its dispatch table.
+// Used by BltSimdInitialize and by host benchmarks that want to compare tiers.
+CONST BLT_SIMD_DISPATCH* BltSimdSelect(ULONG CpuFeatures);
+
+// The swizzle for Order, NULL for BLT_CHANNEL_ORDER_BGRA which needs none
+CONST BLT_SWIZZLE* BltGetSwizzle(BLT_CHANNEL_ORDER Order);
+
+ULONG  BltQueryCpuFeatures(VOID);
+SIZE_T BltQueryLastLevelCacheSize(VOID);
+
+VOID BltSimdBegin(BLT_SIMD_CONTEXT* pContext);
+VOID BltSimdEnd(BLT_SIMD_CONTEXT* pContext);
+
+// Copies NumRows rows of RowBytes each. Rects bigger than g_BltStreamThreshold
+// are written with non-temporal stores so they do not evict the working set.
+VOID BltSimdCopyRows(CONST BLT_SIMD_CONTEXT* pContext,
+                     BYTE*       pDst,
+                     LONG        DstPitch,
+                     CONST BYTE* pSrc,
+                     LONG        SrcPitch,
+                     SIZE_T      RowBytes,
+                     UINT        NumRows);
+
+#endif // _BLTSIMD_HXX_
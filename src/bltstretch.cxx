@@ -0,0 +1,270 @@
+/******************************Module*Header*******************************\
+* Module Name: bltstretch.cxx
+*
+* Stretched presents, the source mode is scaled to the framebuffer size.
+*
+* Scaling up or by less than 2 is bilinear, scaling down further is a box
+* filter so every source pixel still contributes. The filter is picked for
+* each axis on its own, a mode squeezed into a narrower but taller screen
+* is boxed across and bilinear down. Both are separable: each source row a
+* destination row needs is filtered horizontally into a span, then spans
+* are combined vertically. Rects are done in spans of at most
+* BLT_STRETCH_SPAN destination pixels so the scratch rows fit on the stack.
+*
+\**************************************************************************/
+
+#include "bltport.hxx"
+#include "bltsimd.hxx"
+
+// Destination pixels filtered at a time
+#define BLT_STRETCH_SPAN        64
+
+// Longest box, sums of 256 8 bit channels still fit 16 bits
+#define BLT_STRETCH_MAX_BOX     256
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+typedef struct _BLT_STRETCH
+{
+    CONST BLT_SIMD_DISPATCH* pDispatch;
+    BLT_INFO*       pDst;
+    CONST BLT_INFO* pSrc;
+    BOOLEAN         BoxX;
+    BOOLEAN         BoxY;
+} BLT_STRETCH;
+
+// Center of destination pixel i in source pixels, 16.16 fixed point
+static FORCEINLINE LONG64 StretchCenter(UINT i, UINT SrcSize, UINT DstSize)
+{
+    LONG64 Center = ((LONG64)(2 * i + 1) * SrcSize * 65536) / (2 * (LONG64)DstSize) - 32768;
+    return (Center > 0) ? Center : 0;
+}
+
+// Source pixels [*pFirst, *pFirst + return value) that destination pixel i averages
+static FORCEINLINE UINT StretchBox(UINT i, UINT SrcSize, UINT DstSize, UINT* pFirst)
+{
+    UINT First = (UINT)(((UINT64)i * SrcSize) / DstSize);
+    UINT Last = (UINT)(((UINT64)(i + 1) * SrcSize) / DstSize);
+    UINT Count = (Last > First) ? Last - First : 1;
+    *pFirst = First;
+    return (Count < BLT_STRETCH_MAX_BOX) ? Count : BLT_STRETCH_MAX_BOX;
+}
+
+static VOID StretchTaps(CONST BLT_STRETCH* pStretch, UINT x, UINT NumPixels, BLT_STRETCH_TAP* pTaps)
+{
+    UINT SrcWidth = pStretch->pSrc->Width;
+    UINT DstWidth = pStretch->pDst->Width;
+
+    for (UINT i = 0; i < NumPixels; i++)
+    {
+        if (pStretch->BoxX)
+        {
+            pTaps[i].Count = StretchBox(x + i, SrcWidth, DstWidth, &pTaps[i].X);
+            pTaps[i].Weight = 65535 / pTaps[i].Count;
+            continue;
+        }
+
+        LONG64 Center = StretchCenter(x + i, SrcWidth, DstWidth);
+        pTaps[i].X = (UINT)(Center >> 16);
+        pTaps[i].Count = 2;
+        pTaps[i].Weight = (UINT)(Center >> 8) & 0xFF;
+        if (pTaps[i].X >= SrcWidth - 1)
+        {
+            // Both source pixels are always read, the last one is reached as the second of the pair
+            pTaps[i].X = SrcWidth - 2;
+            pTaps[i].Weight = 256;
+        }
+    }
+}
+
+// Filtering is only done on 8 bit channels
+static FORCEINLINE BOOLEAN StretchFormat(CONST BLT_INFO* pBltInfo)
+{
+    return (pBltInfo->Format == D3DDDIFMT_X8R8G8B8) || (pBltInfo->Format == D3DDDIFMT_A8R8G8B8);
+}
+
+static FORCEINLINE CONST BYTE* StretchSrcRow(CONST BLT_INFO* pSrc, UINT y)
+{
+    return (CONST BYTE*)pSrc->pBits + (LONG_PTR)(y + pSrc->Offset.y) * pSrc->Pitch + (LONG_PTR)pSrc->Offset.x * 4;
+}
+
+// Fills destination pixels [x, x + NumPixels) of rows [Top, Bottom)
+static VOID StretchSpan(CONST BLT_STRETCH* pStretch, UINT x, UINT NumPixels, UINT Top, UINT Bottom)
+{
+    CONST BLT_SIMD_DISPATCH* pDispatch = pStretch->pDispatch;
+    CONST BLT_INFO* pDst = pStretch->pDst;
+    CONST BLT_INFO* pSrc = pStretch->pSrc;
+
+    BLT_STRETCH_TAP Taps[BLT_STRETCH_SPAN];
+    UINT16 Spans[2][BLT_STRETCH_SPAN * 4];
+    StretchTaps(pStretch, x, NumPixels, Taps);
+
+    PFN_BLT_STRETCH_SPAN pfnSpan = pStretch->BoxX ? pDispatch->BoxSpan : pDispatch->BilinearSpan;
+    BYTE* pDstRow = (BYTE*)pDst->pBits + (LONG_PTR)(Top + pDst->Offset.y) * pDst->Pitch + (LONG_PTR)(x + pDst->Offset.x) * 4;
+
+    // Source rows held in Spans[0] and Spans[1], consecutive destination rows mostly reuse them
+    UINT SpanRow[2] = { MAXUINT, MAXUINT };
+
+    for (UINT y = Top; y < Bottom; y++)
+    {
+        if (pStretch->BoxY)
+        {
+            UINT32 Sum[BLT_STRETCH_SPAN * 4];
+            RtlZeroMemory(Sum, NumPixels * 4 * sizeof(UINT32));
+
+            UINT First;
+            UINT Count = StretchBox(y, pSrc->Height, pDst->Height, &First);
+            for (UINT Row = First; Row < First + Count; Row++)
+            {
+                pfnSpan(Spans[0], StretchSrcRow(pSrc, Row), Taps, NumPixels);
+                pDispatch->AccumulateSpan(Sum, Spans[0], NumPixels);
+            }
+            pDispatch->ResolveSpan(pDstRow, Sum, 65535 / Count, NumPixels);
+        }
+        else
+        {
+            LONG64 Center = StretchCenter(y, pSrc->Height, pDst->Height);
+            UINT Row = (UINT)(Center >> 16);
+            UINT Weight = (UINT)(Center >> 8) & 0xFF;
+            if (Row >= pSrc->Height - 1)
+            {
+                Row = pSrc->Height - 1;
+                Weight = 0;
+            }
+
+            for (UINT i = 0; i < 2; i++)
+            {
+                UINT NeededRow = (Row + i < pSrc->Height) ? Row + i : Row;
+                if (SpanRow[i] == NeededRow)
+                {
+                    continue;
+                }
+
+                // Moving down one row, the old second span becomes the first
+                if ((i == 0) && (SpanRow[1] == NeededRow))
+                {
+                    RtlCopyMemory(Spans[0], Spans[1], NumPixels * 4 * sizeof(UINT16));
+                }
+                else
+                {
+                    pfnSpan(Spans[i], StretchSrcRow(pSrc, NeededRow), Taps, NumPixels);
+                }
+                SpanRow[i] = NeededRow;
+            }
+            pDispatch->LerpSpans(pDstRow, Spans[0], Spans[1], Weight, NumPixels);
+        }
+
+        if (pDst->pColorLut != NULL)
+        {
+            pDispatch->ColorLutRow32(pDstRow, pDstRow, NumPixels, pDst->pColorLut);
+        }
+        if (pDst->pSwizzle != NULL)
+        {
+            pDispatch->SwizzleRow32(pDstRow, pDstRow, NumPixels, pDst->pSwizzle);
+        }
+        pDstRow += pDst->Pitch;
+    }
+}
+
+// Destination pixels [*pFirst, *pLast) that source pixels [First, Last) contribute to
+static VOID StretchRange(LONG First, LONG Last, UINT SrcSize, UINT DstSize, LONG* pFirst, LONG* pLast)
+{
+    // One source pixel of slack either way covers the bilinear neighbours and box rounding
+    First = (First > 0) ? First - 1 : 0;
+    Last = ((UINT)Last < SrcSize) ? Last + 1 : (LONG)SrcSize;
+    *pFirst = (LONG)(((UINT64)First * DstSize) / SrcSize);
+    *pLast = (LONG)(((UINT64)Last * DstSize + SrcSize - 1) / SrcSize);
+}
+
+static VOID StretchRects(
+    CONST BLT_STRETCH* pStretch,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pDstRects)
+{
+    CONST BLT_INFO* pDst = pStretch->pDst;
+    CONST BLT_INFO* pSrc = pStretch->pSrc;
+
+    for (UINT iRect = 0; iRect < NumRects; iRect++)
+    {
+        RECT rect;
+        copy_rect(&rect, &pRects[iRect]);
+        rect.left = (rect.left > 0) ? rect.left : 0;
+        rect.top = (rect.top > 0) ? rect.top : 0;
+        rect.right = ((UINT)rect.right < pSrc->Width) ? rect.right : (LONG)pSrc->Width;
+        rect.bottom = ((UINT)rect.bottom < pSrc->Height) ? rect.bottom : (LONG)pSrc->Height;
+
+        RECT* pDstRect = &pDstRects[iRect];
+        if ((rect.left >= rect.right) || (rect.top >= rect.bottom))
+        {
+            RtlZeroMemory(pDstRect, sizeof(RECT));
+            continue;
+        }
+
+        StretchRange(rect.left, rect.right, pSrc->Width, pDst->Width, &pDstRect->left, &pDstRect->right);
+        StretchRange(rect.top, rect.bottom, pSrc->Height, pDst->Height, &pDstRect->top, &pDstRect->bottom);
+
+        for (LONG x = pDstRect->left; x < pDstRect->right; x += BLT_STRETCH_SPAN)
+        {
+            UINT NumPixels = ((pDstRect->right - x) < BLT_STRETCH_SPAN) ? (UINT)(pDstRect->right - x) : BLT_STRETCH_SPAN;
+            StretchSpan(pStretch, (UINT)x, NumPixels, (UINT)pDstRect->top, (UINT)pDstRect->bottom);
+        }
+    }
+}
+
+/****************************Internal*Routine******************************\
+ * BltStretchBits
+ *
+ *
+ * Scales the source rects from pSrc->Width x pSrc->Height to the
+ * pDst->Width x pDst->Height destination, and returns the destination rect
+ * each of them changed in pDstRects. Both surfaces have to be unrotated
+ * X8R8G8B8 and at least 2 x 2 pixels. The destination's color lookup is
+ * applied to each row as it is written.
+ *
+\**************************************************************************/
+VOID BltStretchBits(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects,
+    _Out_writes_(NumRects) RECT *pDstRects)
+{
+    if (!StretchFormat(pDst) || !StretchFormat(pSrc) ||
+        (pDst->Rotation != D3DKMDT_VPPR_IDENTITY) || (pSrc->Rotation != D3DKMDT_VPPR_IDENTITY) ||
+        (pSrc->Width < 2) || (pSrc->Height < 2) || (pDst->Width == 0) || (pDst->Height == 0))
+    {
+        BDD_LOG_ERROR("Can not stretch format %u %ux%u to format %u %ux%u",
+                      pSrc->Format, pSrc->Width, pSrc->Height, pDst->Format, pDst->Width, pDst->Height);
+        RtlZeroMemory(pDstRects, NumRects * sizeof(RECT));
+        return;
+    }
+
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    BLT_STRETCH Stretch;
+    Stretch.pDispatch = SimdContext.pDispatch;
+    Stretch.pDst = pDst;
+    Stretch.pSrc = pSrc;
+    Stretch.BoxX = (pSrc->Width >= 2 * pDst->Width);
+    Stretch.BoxY = (pSrc->Height >= 2 * pDst->Height);
+
+    // pSrc->pBits might be coming from user-mode, see BltBits
+    __try
+    {
+        StretchRects(&Stretch, NumRects, pRects, pDstRects);
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Either dst (0x%p) or src (0x%p) bits encountered exception during stretch.", pDst->pBits, pSrc->pBits);
+    }
+
+    BltSimdEnd(&SimdContext);
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
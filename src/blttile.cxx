@@ -0,0 +1,300 @@
+/******************************Module*Header*******************************\
+* Module Name: blttile.cxx
+*
+* Tile hash maps, see blttile.hxx.
+*
+* A tile is hashed row by row with the HashRow kernel of the selected SIMD
+* tier, each row salted with its place in the tile, and the accumulators
+* are folded into 64 bits with the MurmurHash3 finalizer. Reading a tile
+* of the source is far cheaper than writing it to the framebuffer and
+* having the host read it back, and the framebuffer is never read at all.
+*
+* Changed tiles next to each other in a row go into the region as one
+* rect, the region merges the rows.
+*
+\**************************************************************************/
+
+#include "blttile.hxx"
+#include "bltsimd.hxx"
+#include "bltregion.hxx"
+
+// Tells the rows of a tile apart, any odd constant far from the key step does
+#define BLT_TILE_ROW_SALT   0xc2b2ae3d27d4eb4fULL
+
+#pragma code_seg(push)
+#pragma code_seg()
+// BEGIN: Non-Paged Code
+
+static FORCEINLINE UINT64 RotateLeft64(UINT64 Value, UINT Shift)
+{
+    return (Value << Shift) | (Value >> (64 - Shift));
+}
+
+// The tiles of pRect clipped to the map, FALSE if it has none
+static BOOLEAN GetTileRange(
+    _In_ CONST BLT_TILE_MAP* pMap,
+    _In_ CONST RECT* pRect,
+    _Out_ RECT* pTiles)
+{
+    LONG Left = (pRect->left > 0) ? pRect->left : 0;
+    LONG Top = (pRect->top > 0) ? pRect->top : 0;
+    LONG Right = (pRect->right < (LONG)pMap->Width) ? pRect->right : (LONG)pMap->Width;
+    LONG Bottom = (pRect->bottom < (LONG)pMap->Height) ? pRect->bottom : (LONG)pMap->Height;
+    if ((Left >= Right) || (Top >= Bottom))
+    {
+        return FALSE;
+    }
+
+    pTiles->left = Left / (LONG)pMap->TileSize;
+    pTiles->top = Top / (LONG)pMap->TileSize;
+    pTiles->right = (Right + (LONG)pMap->TileSize - 1) / (LONG)pMap->TileSize;
+    pTiles->bottom = (Bottom + (LONG)pMap->TileSize - 1) / (LONG)pMap->TileSize;
+    return TRUE;
+}
+
+static UINT64 HashTile(
+    _In_ CONST BLT_SIMD_DISPATCH* pDispatch,
+    _In_ CONST BLT_INFO* pSrc,
+    _In_ CONST RECT* pTile)
+{
+    UINT BytesPerPixel = pSrc->BitsPerPel / BITS_PER_BYTE;
+    UINT RowBytes = (pTile->right - pTile->left) * BytesPerPixel;
+    UINT64 Acc[BLT_HASH_LANES] = { 0 };
+
+    CONST BYTE* pRow = (CONST BYTE*)pSrc->pBits +
+                       (pTile->top + pSrc->Offset.y) * (LONG_PTR)pSrc->Pitch +
+                       (pTile->left + pSrc->Offset.x) * (LONG_PTR)BytesPerPixel;
+    for (LONG y = pTile->top; y < pTile->bottom; y++, pRow += pSrc->Pitch)
+    {
+        pDispatch->HashRow(Acc, pRow, RowBytes, (UINT64)(y - pTile->top) * BLT_TILE_ROW_SALT);
+    }
+
+    UINT64 Hash = Acc[0] ^ RotateLeft64(Acc[1], 17) ^ RotateLeft64(Acc[2], 31) ^ RotateLeft64(Acc[3], 47);
+    Hash ^= Hash >> 33;
+    Hash *= 0xff51afd7ed558ccdULL;
+    Hash ^= Hash >> 33;
+    Hash *= 0xc4ceb9fe1a85ec53ULL;
+    Hash ^= Hash >> 33;
+
+    // 0 is a forgotten tile
+    return Hash | 1;
+}
+
+static FORCEINLINE BOOLEAN TileTouched(
+    _In_ CONST RECT* pTile,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects)
+{
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        if ((pRects[i].left < pTile->right) && (pTile->left < pRects[i].right) &&
+            (pRects[i].top < pTile->bottom) && (pTile->top < pRects[i].bottom))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Everything BltTileMapRefine does that reads the source
+static VOID HashTiles(
+    _Inout_ BLT_TILE_MAP* pMap,
+    _In_ CONST BLT_SIMD_DISPATCH* pDispatch,
+    _In_ CONST BLT_INFO* pSrc,
+    _In_ CONST RECT* pTiles,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects,
+    _Inout_ BLT_REGION* pChanged)
+{
+    LONG TileSize = (LONG)pMap->TileSize;
+
+    for (LONG ty = pTiles->top; ty < pTiles->bottom; ty++)
+    {
+        LONG Bottom = (ty + 1) * TileSize;
+        RECT Run = { 0, ty * TileSize, 0, (Bottom < (LONG)pMap->Height) ? Bottom : (LONG)pMap->Height };
+
+        for (LONG tx = pTiles->left; tx <= pTiles->right; tx++)
+        {
+            BOOLEAN Changed = FALSE;
+            if (tx < pTiles->right)
+            {
+                LONG Right = (tx + 1) * TileSize;
+                RECT Tile = { tx * TileSize, Run.top, (Right < (LONG)pMap->Width) ? Right : (LONG)pMap->Width, Run.bottom };
+                if (TileTouched(&Tile, NumRects, pRects))
+                {
+                    UINT64 Hash = HashTile(pDispatch, pSrc, &Tile);
+                    UINT64* pHash = &pMap->pHashes[ty * pMap->Columns + tx];
+                    Changed = (Hash != *pHash);
+                    *pHash = Hash;
+                }
+
+                if (Changed)
+                {
+                    if (Run.right == Run.left)
+                    {
+                        Run.left = Tile.left;
+                    }
+                    Run.right = Tile.right;
+                    continue;
+                }
+            }
+
+            if (Run.right > Run.left)
+            {
+                BltRegionUnionRect(pChanged, &Run);
+                Run.left = Run.right;
+            }
+        }
+    }
+}
+
+VOID BltTileMapForget(_Inout_ BLT_TILE_MAP* pMap, _In_opt_ CONST RECT* pRect)
+{
+    if (pMap->pHashes == NULL)
+    {
+        return;
+    }
+
+    if (pRect == NULL)
+    {
+        RtlZeroMemory(pMap->pHashes, pMap->Columns * pMap->Rows * sizeof(UINT64));
+        return;
+    }
+
+    RECT Tiles;
+    if (GetTileRange(pMap, pRect, &Tiles))
+    {
+        for (LONG ty = Tiles.top; ty < Tiles.bottom; ty++)
+        {
+            RtlZeroMemory(&pMap->pHashes[ty * pMap->Columns + Tiles.left], (Tiles.right - Tiles.left) * sizeof(UINT64));
+        }
+    }
+}
+
+/****************************Internal*Routine******************************\
+ * BltTileMapRefine
+ *
+ *
+ * The tiles are only hashed where the map and the source overlap. Tiles at
+ * the right and bottom edges are smaller than TileSize, they are hashed as
+ * they are.
+ *
+\**************************************************************************/
+BOOLEAN BltTileMapRefine(
+    _Inout_ BLT_TILE_MAP* pMap,
+    _In_ CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects,
+    _Inout_ BLT_REGION* pChanged)
+{
+    NT_ASSERT(pMap->pHashes != NULL);
+    NT_ASSERT((pSrc->Width >= pMap->Width) && (pSrc->Height >= pMap->Height));
+
+    RECT Bounds = { MAXLONG, MAXLONG, MINLONG, MINLONG };
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        Bounds.left = (pRects[i].left < Bounds.left) ? pRects[i].left : Bounds.left;
+        Bounds.top = (pRects[i].top < Bounds.top) ? pRects[i].top : Bounds.top;
+        Bounds.right = (pRects[i].right > Bounds.right) ? pRects[i].right : Bounds.right;
+        Bounds.bottom = (pRects[i].bottom > Bounds.bottom) ? pRects[i].bottom : Bounds.bottom;
+    }
+
+    RECT Tiles;
+    if (!GetTileRange(pMap, &Bounds, &Tiles))
+    {
+        return TRUE;
+    }
+
+    // pSrc->pBits might be coming from user-mode, see BltClippedRects. The
+    // SIMD state is saved outside of the __try so it is restored even if
+    // the hashing faults.
+    BOOLEAN Read = TRUE;
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+
+    __try
+    {
+        HashTiles(pMap, SimdContext.pDispatch, pSrc, &Tiles, NumRects, pRects, pChanged);
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        BDD_LOG_ERROR("Src (0x%p) bits encountered exception during access.", pSrc->pBits);
+        Read = FALSE;
+    }
+
+    BltSimdEnd(&SimdContext);
+
+    if (!Read)
+    {
+        // Some of the hashes may be new ones of tiles that are not copied
+        for (UINT i = 0; i < NumRects; i++)
+        {
+            BltTileMapForget(pMap, &pRects[i]);
+        }
+    }
+    return Read;
+}
+
+// END: Non-Paged Code
+#pragma code_seg(pop)
+
+#pragma code_seg(push)
+#pragma code_seg("PAGE")
+// BEGIN: Paged Code
+
+VOID BltTileMapInit(_Out_ BLT_TILE_MAP* pMap)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(pMap, sizeof(*pMap));
+}
+
+VOID BltTileMapFree(_Inout_ BLT_TILE_MAP* pMap)
+{
+    PAGED_CODE();
+
+    if (pMap->pHashes != NULL)
+    {
+        BltFree(pMap->pHashes);
+    }
+    BltTileMapInit(pMap);
+}
+
+BOOLEAN BltTileMapPrepare(_Inout_ BLT_TILE_MAP* pMap, _In_ CONST BLT_INFO* pFb, UINT TileSize)
+{
+    PAGED_CODE();
+    NT_ASSERT((TileSize >= BLT_TILE_MIN_SIZE) && (TileSize <= BLT_TILE_MAX_SIZE));
+
+    if ((pMap->pHashes == NULL) || (pMap->TileSize != TileSize) ||
+        (pMap->Width != pFb->Width) || (pMap->Height != pFb->Height))
+    {
+        BltTileMapFree(pMap);
+
+        UINT Columns = (pFb->Width + TileSize - 1) / TileSize;
+        UINT Rows = (pFb->Height + TileSize - 1) / TileSize;
+        pMap->pHashes = (UINT64*)BltAllocate(Columns * Rows * sizeof(UINT64));
+        if (pMap->pHashes == NULL)
+        {
+            return FALSE;
+        }
+
+        pMap->TileSize = TileSize;
+        pMap->Columns = Columns;
+        pMap->Rows = Rows;
+        pMap->Width = pFb->Width;
+        pMap->Height = pFb->Height;
+        pMap->pFbBits = NULL;
+    }
+
+    if ((pMap->pFbBits != pFb->pBits) || (pMap->FbPitch != pFb->Pitch))
+    {
+        BltTileMapForget(pMap, NULL);
+        pMap->pFbBits = pFb->pBits;
+        pMap->FbPitch = pFb->Pitch;
+    }
+    return TRUE;
+}
+
+// END: Paged Code
+#pragma code_seg(pop)
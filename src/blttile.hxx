@@ -0,0 +1,50 @@
+/******************************Module*Header*******************************\
+* Module Name: blttile.hxx
+*
+* Tile hashes of what a target's presents put in its framebuffer. Windows
+* often reports far more damage than changed, a blinking caret can dirty a
+* whole window. With a tile map the present hashes the source tiles its
+* dirty rects touch and only copies and invalidates the tiles whose hash
+* differs from the one they were last presented with.
+*
+* A hash only says what the framebuffer holds while the presents are the
+* only ones writing there. Everything else that writes to the framebuffer
+* has the tiles it wrote forgotten, a forgotten tile always counts as
+* changed.
+*
+\**************************************************************************/
+
+#ifndef _BLTTILE_HXX_
+#define _BLTTILE_HXX_
+
+#include "bltport.hxx"
+
+#define BLT_TILE_DEFAULT_SIZE   64
+#define BLT_TILE_MIN_SIZE       16
+#define BLT_TILE_MAX_SIZE       256
+
+VOID BltTileMapInit(_Out_ BLT_TILE_MAP* pMap);
+
+VOID BltTileMapFree(_Inout_ BLT_TILE_MAP* pMap);
+
+// Gets the map ready for presents to pFb, which are as big as its Width and
+// Height, in tiles of TileSize between BLT_TILE_MIN_SIZE and BLT_TILE_MAX_SIZE.
+// Every tile is forgotten if the framebuffer or TileSize changed.
+// Returns FALSE if there is no memory for the hashes.
+BOOLEAN BltTileMapPrepare(_Inout_ BLT_TILE_MAP* pMap, _In_ CONST BLT_INFO* pFb, UINT TileSize);
+
+// Forgets the tiles pRect touches, all of them for NULL
+VOID BltTileMapForget(_Inout_ BLT_TILE_MAP* pMap, _In_opt_ CONST RECT* pRect);
+
+// Hashes the tiles of pSrc that the rects touch, stores the new hashes and
+// adds the tiles whose hash changed to pChanged. pSrc is the whole image in
+// framebuffer coordinates and may be user-mode memory. Returns FALSE if it
+// could not be read, the tiles of the rects are forgotten then.
+BOOLEAN BltTileMapRefine(
+    _Inout_ BLT_TILE_MAP* pMap,
+    _In_ CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT* pRects,
+    _Inout_ BLT_REGION* pChanged);
+
+#endif // _BLTTILE_HXX_
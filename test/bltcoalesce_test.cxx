@@ -0,0 +1,140 @@
+/******************************Module*Header*******************************\
+* Module Name: bltcoalesce_test.cxx
+*
+* Checks the calibration lands within its bounds, the merges the cost model
+* has to make and the ones it must not, and that random lists coalesce to
+* no more rects than they had, that still cover every pixel of them and
+* stay within the bounds of the screen.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltcoalesce.hxx"
+
+#include <vector>
+
+#define TEST_WIDTH      1920
+#define TEST_HEIGHT     1080
+
+static BOOLEAN Covers(UINT NumRects, CONST RECT* pRects, CONST RECT* pRect)
+{
+    for (LONG y = pRect->top; y < pRect->bottom; y++)
+    {
+        for (LONG x = pRect->left; x < pRect->right; x++)
+        {
+            BOOLEAN Inside = FALSE;
+            for (UINT i = 0; (i < NumRects) && !Inside; i++)
+            {
+                Inside = (x >= pRects[i].left) && (x < pRects[i].right) && (y >= pRects[i].top) && (y < pRects[i].bottom);
+            }
+            if (!Inside)
+            {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+// Coalesces two rects at 32bpp and returns how many came out, 0 if it refused
+static UINT CoalescePair(RECT First, RECT Second, UINT WastePercent, RECT* pOut)
+{
+    RECT Rects[2] = { First, Second };
+    UINT NumOut;
+    return BltCoalesceRects(2, Rects, 4, WastePercent, pOut, &NumOut) ? NumOut : 0;
+}
+
+static VOID TestMerges(VOID)
+{
+    RECT Out[BLT_COALESCE_RECTS];
+
+    BLT_CHECK(CoalescePair({ 0, 0, 100, 100 }, { 50, 0, 150, 100 }, 0, Out) == 1, "overlapping rects were not merged");
+    BLT_CHECK(CoalescePair({ 0, 0, 100, 100 }, { 50, 50, 150, 150 }, 0, Out) == 2, "diagonal rects were merged");
+    BLT_CHECK(CoalescePair({ 0, 0, 100, 100 }, { 102, 0, 200, 100 }, 0, Out) == 1, "rects 2 pixels apart were not merged");
+    BLT_CHECK(CoalescePair({ 0, 0, 100, 100 }, { 100, 0, 200, 100 }, 0, Out) == 1, "touching rects were not merged");
+    BLT_CHECK(Out[0].right == 200, "touching rects merged to %d,%d-%d,%d", Out[0].left, Out[0].top, Out[0].right, Out[0].bottom);
+    BLT_CHECK(CoalescePair({ 0, 0, 500, 500 }, { 1500, 900, 1900, 1000 }, 0, Out) == 2, "big rects far apart were merged");
+    BLT_CHECK(CoalescePair({ 0, 0, 500, 500 }, { 1500, 900, 1900, 1000 }, 100, Out) == 1, "any waste did not give the bounds");
+
+    RECT Nested[3] = { { 0, 0, 100, 100 }, { 10, 10, 20, 20 }, { 40, 40, 45, 45 } };
+    UINT NumOut = 0;
+    BLT_CHECK(BltCoalesceRects(3, Nested, 4, 0, Out, &NumOut) && (NumOut == 1), "nested rects gave %u", NumOut);
+
+    BLT_CHECK(!BltCoalesceRects(1, Nested, 4, 25, Out, &NumOut), "a single rect was coalesced");
+
+    // More than BLT_COALESCE_RECTS are only ever collapsed into the bounds
+    std::vector<RECT> Grid;
+    for (LONG i = 0; i < 100; i++)
+    {
+        LONG x = (i % 10) * 400;
+        LONG y = (i / 10) * 400;
+        Grid.push_back({ x, y, x + 100, y + 100 });
+    }
+    BLT_CHECK(!BltCoalesceRects((UINT)Grid.size(), Grid.data(), 4, 0, Out, &NumOut), "a long list was coalesced");
+    BLT_CHECK(BltCoalesceRects((UINT)Grid.size(), Grid.data(), 4, 100, Out, &NumOut) && (NumOut == 1),
+              "a long list was not collapsed into its bounds");
+}
+
+static VOID TestRandom(VOID)
+{
+    RECT Out[BLT_COALESCE_RECTS];
+
+    for (UINT Iteration = 0; Iteration < 300; Iteration++)
+    {
+        UINT NumRects = 2 + BltTestRandom() % 40;
+        std::vector<RECT> Rects(NumRects);
+        for (UINT i = 0; i < NumRects; i++)
+        {
+            LONG x = BltTestRandom() % TEST_WIDTH;
+            LONG y = BltTestRandom() % TEST_HEIGHT;
+            LONG Width = 1 + BltTestRandom() % ((Iteration & 1) ? 30 : 400);
+            LONG Height = 1 + BltTestRandom() % ((Iteration & 2) ? 20 : 300);
+            Rects[i].left = x;
+            Rects[i].top = y;
+            Rects[i].right = (x + Width < TEST_WIDTH) ? x + Width : TEST_WIDTH;
+            Rects[i].bottom = (y + Height < TEST_HEIGHT) ? y + Height : TEST_HEIGHT;
+
+            // Some empty ones, which are dropped
+            if (BltTestRandom() % 10 == 0)
+            {
+                Rects[i].right = Rects[i].left;
+            }
+        }
+
+        UINT NumOut;
+        if (!BltCoalesceRects(NumRects, Rects.data(), 4, BltTestRandom() % 60, Out, &NumOut))
+        {
+            continue;
+        }
+
+        BLT_CHECK(NumOut <= NumRects, "%u rects grew to %u", NumRects, NumOut);
+        for (UINT i = 0; i < NumRects; i++)
+        {
+            if (Rects[i].left < Rects[i].right)
+            {
+                BLT_CHECK(Covers(NumOut, Out, &Rects[i]), "iteration %u lost rect %u", Iteration, i);
+            }
+        }
+        for (UINT i = 0; i < NumOut; i++)
+        {
+            BLT_CHECK((Out[i].left >= 0) && (Out[i].top >= 0) && (Out[i].right <= TEST_WIDTH) && (Out[i].bottom <= TEST_HEIGHT),
+                      "iteration %u made %d,%d-%d,%d", Iteration, Out[i].left, Out[i].top, Out[i].right, Out[i].bottom);
+        }
+    }
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    BltCoalesceInitialize();
+    printf("a rect costs %u bytes\n", g_BltRectCostBytes);
+    BLT_CHECK((g_BltRectCostBytes >= 64) && (g_BltRectCostBytes <= 1024 * 1024), "the rect cost is out of bounds");
+
+    // The merges below are for the default cost, not for this machine's
+    g_BltRectCostBytes = 4096;
+    TestMerges();
+    TestRandom();
+
+    return BltTestReport("bltcoalesce_test");
+}
@@ -0,0 +1,171 @@
+/******************************Module*Header*******************************\
+* Module Name: bltengine_test.cxx
+*
+* Checks that the offload engine does what the inline engine does. The
+* same sequence of copies and moves goes to both, the surfaces have to
+* come out the same and every command has to be completed once. Two
+* threads then submit to one offload engine at the same time, which keeps
+* its ring full, and destroying an engine has to finish what is queued.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltengine.hxx"
+#include "bltpar.hxx"
+
+#include <thread>
+#include <vector>
+
+#define TEST_WIDTH      640
+#define TEST_HEIGHT     480
+#define TEST_COMMANDS   200
+
+static VOID CountDone(VOID* pContext, CONST BLT_COMMAND* pCommand)
+{
+    UNREFERENCED_PARAMETER(pCommand);
+    InterlockedIncrement((volatile LONG*)pContext);
+}
+
+// Its own generator, so sequences on different threads do not mix
+static UINT32 NextRandom(UINT32* pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+// A sequence of copies with a move every few, each seed gives its own
+static VOID RunSequence(BLT_ENGINE* pEngine, std::vector<BYTE>* pDstBits, UINT32 Seed, volatile LONG* pDone)
+{
+    std::vector<BYTE> SrcBits(TEST_WIDTH * 4 * TEST_HEIGHT);
+    for (SIZE_T i = 0; i < SrcBits.size(); i++)
+    {
+        SrcBits[i] = (BYTE)NextRandom(&Seed);
+    }
+    pDstBits->assign(SrcBits.size(), 0);
+
+    BLT_INFO Dst = BltTestSurface(pDstBits->data(), TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    BLT_INFO Src = BltTestSurface(SrcBits.data(), TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH * 4, 32, D3DKMDT_VPPR_IDENTITY);
+
+    // Commands only point at these, they stay put until the last fence
+    std::vector<RECT> Rects(TEST_COMMANDS);
+    std::vector<D3DKMT_MOVE_RECT> Moves(TEST_COMMANDS);
+
+    UINT64 Fence = 0;
+    for (UINT i = 0; i < TEST_COMMANDS; i++)
+    {
+        LONG Left = NextRandom(&Seed) % TEST_WIDTH;
+        LONG Top = NextRandom(&Seed) % TEST_HEIGHT;
+        Rects[i].left = Left;
+        Rects[i].top = Top;
+        Rects[i].right = Left + NextRandom(&Seed) % 200;
+        Rects[i].bottom = Top + NextRandom(&Seed) % 200;
+
+        BLT_COMMAND Copy = { BLT_COMMAND_COPY, 1, &Dst, &Src, 1, &Rects[i], NULL, NULL, CountDone, (VOID*)pDone };
+        Fence = pEngine->Submit(&Copy);
+
+        if (i % 7 == 0)
+        {
+            Left = NextRandom(&Seed) % TEST_WIDTH;
+            Top = NextRandom(&Seed) % TEST_HEIGHT;
+            Moves[i].DestRect.left = Left;
+            Moves[i].DestRect.top = Top;
+            Moves[i].DestRect.right = Left + NextRandom(&Seed) % 100;
+            Moves[i].DestRect.bottom = Top + NextRandom(&Seed) % 100;
+            Moves[i].SourcePoint.x = NextRandom(&Seed) % TEST_WIDTH;
+            Moves[i].SourcePoint.y = NextRandom(&Seed) % TEST_HEIGHT;
+
+            BLT_COMMAND Move = { BLT_COMMAND_MOVE, 1, &Dst, NULL, 1, NULL, &Moves[i], NULL, CountDone, (VOID*)pDone };
+            Fence = pEngine->Submit(&Move);
+        }
+    }
+
+    pEngine->WaitForFence(Fence);
+    BLT_CHECK(pEngine->CompletedFence() >= Fence, "fence %llu is not complete after waiting for it", (unsigned long long)Fence);
+}
+
+static VOID TestSequences(BLT_ENGINE* pInline, BLT_ENGINE* pOffload)
+{
+    for (UINT32 Seed = 1; Seed < 6; Seed++)
+    {
+        std::vector<BYTE> Expected, Actual;
+        volatile LONG ExpectedDone = 0, ActualDone = 0;
+
+        RunSequence(pInline, &Expected, Seed, &ExpectedDone);
+        RunSequence(pOffload, &Actual, Seed, &ActualDone);
+        BLT_CHECK(Actual == Expected, "seed %u differs from the inline engine", Seed);
+        BLT_CHECK(ActualDone == ExpectedDone, "seed %u completed %d commands, not %d", Seed, ActualDone, ExpectedDone);
+    }
+}
+
+static VOID TestConcurrent(BLT_ENGINE* pInline, BLT_ENGINE* pOffload)
+{
+    std::vector<BYTE> Expected[2], Actual[2];
+    volatile LONG Done[2] = { 0, 0 };
+    volatile LONG InlineDone = 0;
+
+    std::thread First(RunSequence, pOffload, &Actual[0], 11, &Done[0]);
+    std::thread Second(RunSequence, pOffload, &Actual[1], 12, &Done[1]);
+    First.join();
+    Second.join();
+
+    RunSequence(pInline, &Expected[0], 11, &InlineDone);
+    RunSequence(pInline, &Expected[1], 12, &InlineDone);
+    for (UINT i = 0; i < 2; i++)
+    {
+        BLT_CHECK(Actual[i] == Expected[i], "submitter %u differs from the inline engine", i);
+    }
+    BLT_CHECK(Done[0] + Done[1] == InlineDone, "%d commands completed, not %d", Done[0] + Done[1], InlineDone);
+}
+
+static VOID TestDestroy(VOID)
+{
+    std::vector<UINT32> DstBits(64 * 64, 0);
+    std::vector<UINT32> SrcBits(64 * 64, 0x123456);
+    BLT_INFO Dst = BltTestSurface(DstBits.data(), 64, 64, 64 * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    BLT_INFO Src = BltTestSurface(SrcBits.data(), 64, 64, 64 * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    RECT Whole = { 0, 0, 64, 64 };
+
+    BLT_ENGINE* pEngine = BltCreateEngine(BLT_ENGINE_OFFLOAD);
+    BLT_CHECK(pEngine != NULL, "the offload engine could not be created");
+    if (pEngine == NULL)
+    {
+        return;
+    }
+
+    volatile LONG Done = 0;
+    for (UINT i = 0; i < 40; i++)
+    {
+        BLT_COMMAND Copy = { BLT_COMMAND_COPY, 1, &Dst, &Src, 1, &Whole, NULL, NULL, CountDone, (VOID*)&Done };
+        pEngine->Submit(&Copy);
+    }
+    BltDestroyEngine(pEngine);
+
+    BLT_CHECK(Done == 40, "destroy left %d of 40 commands", 40 - Done);
+    BLT_CHECK(DstBits == SrcBits, "destroy did not finish the copies");
+}
+
+int main()
+{
+    BltSimdInitialize();
+    BltParallelInitialize(2);
+
+    BLT_ENGINE* pInline = BltCreateEngine(BLT_ENGINE_INLINE);
+    BLT_ENGINE* pOffload = BltCreateEngine(BLT_ENGINE_OFFLOAD);
+    BLT_CHECK((pInline != NULL) && pInline->IsInline(), "no inline engine");
+    BLT_CHECK((pOffload != NULL) && !pOffload->IsInline(), "no offload engine");
+
+    if ((pInline != NULL) && (pOffload != NULL))
+    {
+        TestSequences(pInline, pOffload);
+        TestConcurrent(pInline, pOffload);
+    }
+    TestDestroy();
+
+    BltDestroyEngine(pInline);
+    BltDestroyEngine(pOffload);
+    BltParallelShutdown();
+
+    return BltTestReport("bltengine_test");
+}
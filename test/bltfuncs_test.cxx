@@ -0,0 +1,408 @@
+/******************************Module*Header*******************************\
+* Module Name: bltfuncs_test.cxx
+*
+* Checks the specialized kernels BltBits picks from g_BltKernels against
+* CopyBitsGeneric, byte for byte. Every dst | src pair CopyBitsGeneric
+* lists, and the 10 bit and FP16 pairs to and from X8R8G8B8, is blted in
+* all four rotations with every SIMD tier this CPU has, to surfaces with
+* odd sizes and padded pitches and to rects that touch the edges, a single
+* pixel and the whole surface. Blending a pointer
+* shape through a color lookup is checked against floating point.
+* BltBitsChanged has to report the pixels that changed in each rect, or the
+* whole clipped rect for blts it can not compare, on the calling thread and
+* split across the worker pool, and leave what BltBits would.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltpar.hxx"
+
+#include <math.h>
+#include <vector>
+
+// The reference the kernel table is checked against, not in any header
+VOID CopyBitsGeneric(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects);
+
+static CONST D3DDDIFORMAT s_Formats[][2] =
+{
+    // dst, src
+    { D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_X8R8G8B8 },
+    { D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_R8G8B8 },
+    { D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_R5G6B5 },
+    { D3DDDIFMT_R8G8B8,        D3DDDIFMT_X8R8G8B8 },
+    { D3DDDIFMT_R5G6B5,        D3DDDIFMT_X8R8G8B8 },
+    { D3DDDIFMT_P8,            D3DDDIFMT_X8R8G8B8 },
+    { D3DDDIFMT_R8G8B8,        D3DDDIFMT_R8G8B8 },
+    { D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_A2R10G10B10 },
+    { D3DDDIFMT_A2R10G10B10,   D3DDDIFMT_X8R8G8B8 },
+    { D3DDDIFMT_X8R8G8B8,      D3DDDIFMT_A16B16G16R16F },
+    { D3DDDIFMT_A16B16G16R16F, D3DDDIFMT_X8R8G8B8 },
+};
+
+// The scalar tier, whose row conversions stand in for CopyBitsGeneric on
+// the 10 bit and FP16 surfaces. bltsimd_test checks the other tiers' against them.
+static CONST BLT_SIMD_DISPATCH* s_pScalar;
+
+static UINT FormatBpp(D3DDDIFORMAT Format)
+{
+    switch (Format)
+    {
+    case D3DDDIFMT_A16B16G16R16F: return 64;
+    case D3DDDIFMT_X8R8G8B8:
+    case D3DDDIFMT_A2R10G10B10:   return 32;
+    case D3DDDIFMT_R8G8B8:        return 24;
+    case D3DDDIFMT_R5G6B5:        return 16;
+    default:                      return 8;
+    }
+}
+
+static BOOLEAN IsWide(D3DDDIFORMAT Format)
+{
+    return (Format == D3DDDIFMT_A2R10G10B10) || (Format == D3DDDIFMT_A16B16G16R16F);
+}
+
+// CopyBitsGeneric, which can not do 10 bit or FP16 surfaces. A wide source
+// is unpacked to X8R8G8B8 first. A wide destination gets the blt done to
+// X8R8G8B8 and packed wherever the rects cover it.
+static VOID CopyBitsReference(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    CONST RECT *pRects)
+{
+    if (IsWide(pSrc->Format))
+    {
+        PFN_BLT_CONVERT_ROW pfnUnpack = (pSrc->Format == D3DDDIFMT_A2R10G10B10) ?
+                                        s_pScalar->Unpack2101010Row : s_pScalar->UnpackFp16Row;
+        std::vector<UINT32> Unpacked(pSrc->Width * pSrc->Height);
+        for (UINT y = 0; y < pSrc->Height; y++)
+        {
+            pfnUnpack((BYTE*)&Unpacked[y * pSrc->Width], (BYTE*)pSrc->pBits + y * pSrc->Pitch, pSrc->Width);
+        }
+
+        BLT_INFO Src = *pSrc;
+        Src.pBits = Unpacked.data();
+        Src.Pitch = pSrc->Width * 4;
+        Src.BitsPerPel = 32;
+        Src.Format = D3DDDIFMT_X8R8G8B8;
+        CopyBitsGeneric(pDst, &Src, NumRects, pRects);
+        return;
+    }
+
+    if (!IsWide(pDst->Format))
+    {
+        CopyBitsGeneric(pDst, pSrc, NumRects, pRects);
+        return;
+    }
+
+    // Covered is set wherever a blt from an all ones source writes
+    std::vector<UINT32> Blted(pDst->Width * pDst->Height);
+    std::vector<UINT32> Covered(pDst->Width * pDst->Height);
+    BLT_INFO Dst = *pDst;
+    Dst.Pitch = pDst->Width * 4;
+    Dst.BitsPerPel = 32;
+    Dst.Format = D3DDDIFMT_X8R8G8B8;
+    Dst.pBits = Blted.data();
+    CopyBitsGeneric(&Dst, pSrc, NumRects, pRects);
+
+    std::vector<BYTE> Ones((SIZE_T)pSrc->Pitch * pSrc->Height, 0xff);
+    BLT_INFO OnesSrc = *pSrc;
+    OnesSrc.pBits = Ones.data();
+    Dst.pBits = Covered.data();
+    CopyBitsGeneric(&Dst, &OnesSrc, NumRects, pRects);
+
+    PFN_BLT_CONVERT_ROW pfnPack = (pDst->Format == D3DDDIFMT_A2R10G10B10) ?
+                                  s_pScalar->Pack2101010Row : s_pScalar->PackFp16Row;
+    UINT BytesPerPixel = pDst->BitsPerPel / BITS_PER_BYTE;
+    for (UINT y = 0; y < pDst->Height; y++)
+    {
+        for (UINT x = 0; x < pDst->Width; x++)
+        {
+            if (Covered[y * pDst->Width + x] != 0)
+            {
+                pfnPack((BYTE*)pDst->pBits + y * pDst->Pitch + x * BytesPerPixel, (BYTE*)&Blted[y * pDst->Width + x], 1);
+            }
+        }
+    }
+}
+
+static VOID TestKernels(UINT Width, UINT Height)
+{
+    UINT Kernels = 0;
+
+    for (UINT f = 0; f < ARRAYSIZE(s_Formats); f++)
+    {
+        for (UINT r = D3DKMDT_VPPR_IDENTITY; r <= D3DKMDT_VPPR_ROTATE270; r++)
+        {
+            D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation = (D3DKMDT_VIDPN_PRESENT_PATH_ROTATION)r;
+            UINT DstBpp = FormatBpp(s_Formats[f][0]);
+            UINT SrcBpp = FormatBpp(s_Formats[f][1]);
+
+            // The source is what the framebuffer shows, so rotated by 90 or
+            // 270 it has the framebuffer's width and height swapped
+            BOOLEAN Swap = (Rotation == D3DKMDT_VPPR_ROTATE90) || (Rotation == D3DKMDT_VPPR_ROTATE270);
+            UINT SrcWidth = Swap ? Height : Width;
+            UINT SrcHeight = Swap ? Width : Height;
+
+            UINT SrcPitch = SrcWidth * SrcBpp / BITS_PER_BYTE + 12;
+            std::vector<BYTE> SrcBits(SrcPitch * SrcHeight);
+            BltTestFill(SrcBits.data(), SrcBits.size());
+            BLT_INFO Src = BltTestSurface(SrcBits.data(), SrcWidth, SrcHeight, SrcPitch, SrcBpp, D3DKMDT_VPPR_IDENTITY);
+            Src.Format = s_Formats[f][1];
+
+            UINT DstPitch = Width * DstBpp / BITS_PER_BYTE + 20;
+            std::vector<BYTE> Expected(DstPitch * Height);
+            BltTestFill(Expected.data(), Expected.size());
+            std::vector<BYTE> Actual(Expected);
+
+            RECT Rects[] =
+            {
+                { 3, 5, (LONG)SrcWidth - 7, (LONG)SrcHeight - 2 },
+                { 0, 0, (LONG)SrcWidth, 1 },
+                { (LONG)SrcWidth - 1, 0, (LONG)SrcWidth, (LONG)SrcHeight },
+                { 10, 10, 11, 11 },
+                { 1, 2, 18, 37 },
+            };
+
+            BLT_INFO Dst = BltTestSurface(Expected.data(), Width, Height, DstPitch, DstBpp, Rotation);
+            Dst.Format = s_Formats[f][0];
+            CopyBitsReference(&Dst, &Src, ARRAYSIZE(Rects), Rects);
+            Dst.pBits = Actual.data();
+            BltBits(&Dst, &Src, ARRAYSIZE(Rects), Rects);
+            BLT_CHECK(Actual == Expected, "%u | %u rotation %u at %ux%u differs from the reference",
+                      (UINT)s_Formats[f][0], (UINT)s_Formats[f][1], r, Width, Height);
+
+            // The whole surface, which is what most presents are
+            RECT Whole = { 0, 0, (LONG)SrcWidth, (LONG)SrcHeight };
+            Dst.pBits = Expected.data();
+            CopyBitsReference(&Dst, &Src, 1, &Whole);
+            Dst.pBits = Actual.data();
+            BltBits(&Dst, &Src, 1, &Whole);
+            BLT_CHECK(Actual == Expected, "%u | %u rotation %u at %ux%u, whole surface, differs from the reference",
+                      (UINT)s_Formats[f][0], (UINT)s_Formats[f][1], r, Width, Height);
+
+            Kernels++;
+        }
+    }
+
+    BLT_CHECK(Kernels == 44, "%u kernels checked", Kernels);
+}
+
+// A pointer shape blended over a framebuffer with a gamma ramp. The result
+// has to be the looked up straight color over the framebuffer, which holds
+// looked up colors already.
+static VOID TestBlend(VOID)
+{
+    CONST UINT Width = 256;
+
+    static BLT_COLOR_LUT Lut;
+    BYTE Ramp[256];
+    for (UINT i = 0; i < 256; i++)
+    {
+        Ramp[i] = (BYTE)(pow(i / 255.0, 1 / 2.2) * 255 + 0.5);
+        Lut.Blue[i] = Ramp[i];
+        Lut.Green[i] = (UINT32)Ramp[i] << 8;
+        Lut.Red[i] = (UINT32)Ramp[i] << 16;
+    }
+
+    std::vector<UINT32> FbBits(Width);
+    std::vector<UINT32> ImageBits(Width);
+    std::vector<BYTE> Straight(Width * 4);
+    BltTestFill(FbBits.data(), Width * 4);
+    BltTestFill(Straight.data(), Width * 4);
+    std::vector<UINT32> Under(FbBits);
+
+    // Every alpha once, colors premultiplied the way the shapes are
+    for (UINT i = 0; i < Width; i++)
+    {
+        BYTE* pPixel = (BYTE*)&ImageBits[i];
+        pPixel[3] = (BYTE)i;
+        for (UINT c = 0; c < 3; c++)
+        {
+            pPixel[c] = (BYTE)((Straight[i * 4 + c] * i + 127) / 255);
+        }
+    }
+
+    BLT_INFO Fb = BltTestSurface(FbBits.data(), Width, 1, Width * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    Fb.pColorLut = &Lut;
+    BLT_INFO Image = BltTestSurface(ImageBits.data(), Width, 1, Width * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    Image.Format = D3DDDIFMT_A8R8G8B8;
+    RECT Whole = { 0, 0, (LONG)Width, 1 };
+    BltBlendBits(&Fb, &Image, &Whole);
+
+    for (UINT i = 0; i < Width; i++)
+    {
+        for (UINT c = 0; c < 3; c++)
+        {
+            // The straight color as far as it survived being premultiplied
+            UINT Premultiplied = ((BYTE*)&ImageBits[i])[c];
+            UINT Color = (i == 0) ? 0 : (Premultiplied * 255 + i / 2) / i;
+            Color = (Color < 255) ? Color : 255;
+
+            double Alpha = i / 255.0;
+            double Expected = Alpha * Ramp[Color] + (1 - Alpha) * ((BYTE*)&Under[i])[c];
+            double Actual = ((BYTE*)&FbBits[i])[c];
+            BLT_CHECK((Actual - Expected <= 1.5) && (Expected - Actual <= 1.5),
+                      "blend of channel %u at alpha %u is %.0f, not %.1f", c, i, Actual, Expected);
+        }
+    }
+}
+
+// BltBitsChanged on a copy of the framebuffer pDst has, checked against
+// pExpected and against BltBits on another copy
+static VOID CheckChanged(
+    CONST BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT NumRects,
+    CONST RECT* pRects,
+    CONST RECT* pExpected,
+    CONST char* pCase)
+{
+    SIZE_T Bytes = (SIZE_T)pDst->Pitch * pDst->Height;
+    std::vector<BYTE> Expected((BYTE*)pDst->pBits, (BYTE*)pDst->pBits + Bytes);
+    std::vector<BYTE> Actual(Expected);
+
+    BLT_INFO Dst = *pDst;
+    Dst.pBits = Expected.data();
+    BltBits(&Dst, pSrc, NumRects, pRects);
+
+    std::vector<RECT> Changed(NumRects);
+    Dst.pBits = Actual.data();
+    BltBitsChanged(&Dst, pSrc, NumRects, pRects, Changed.data());
+
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        CONST RECT& a = Changed[i];
+        CONST RECT& e = pExpected[i];
+        BLT_CHECK((a.left == e.left) && (a.top == e.top) && (a.right == e.right) && (a.bottom == e.bottom),
+                  "%s at %ux%u, rect %u changed (%d, %d, %d, %d), not (%d, %d, %d, %d)",
+                  pCase, Dst.Width, Dst.Height, i, a.left, a.top, a.right, a.bottom, e.left, e.top, e.right, e.bottom);
+    }
+    BLT_CHECK(Actual == Expected, "%s at %ux%u differs from BltBits", pCase, Dst.Width, Dst.Height);
+}
+
+// A source that differs from the framebuffer in a few pixels, blted with
+// rects that hold some of them, none of them or are clipped, through the
+// compared copy and through the blts it can not compare
+static VOID TestChanged(UINT Width, UINT Height)
+{
+    LONG W = (LONG)Width;
+    LONG H = (LONG)Height;
+
+    UINT FbPitch = Width * 4 + 20;
+    std::vector<BYTE> FbBits(FbPitch * Height);
+    BltTestFill(FbBits.data(), FbBits.size());
+    BLT_INFO Fb = BltTestSurface(FbBits.data(), Width, Height, FbPitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+    UINT SrcPitch = Width * 4 + 12;
+    std::vector<BYTE> SrcBits(SrcPitch * Height);
+    for (UINT y = 0; y < Height; y++)
+    {
+        memcpy(&SrcBits[y * SrcPitch], &FbBits[y * FbPitch], Width * 4);
+    }
+    BLT_INFO Src = BltTestSurface(SrcBits.data(), Width, Height, SrcPitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+    CONST POINT Points[] = { { 5, 9 }, { W / 2 - 1, 3 }, { 7, H / 2 - 1 }, { W - 1, H - 1 }, { 3, H / 2 + 2 }, { W / 2, H - 2 } };
+    for (UINT i = 0; i < ARRAYSIZE(Points); i++)
+    {
+        ((UINT32*)&SrcBits[Points[i].y * SrcPitch])[Points[i].x] ^= 0x00808080;
+    }
+
+    CONST RECT Rects[] =
+    {
+        { 2, 2, W / 2, H / 2 },
+        { W / 2, 0, W, H / 2 },             // Nothing changed
+        { W - 20, H / 2, W + 30, H + 10 },  // Partly clipped
+        { W, 0, W + 16, 8 },                // Clipped away
+        { 0, H / 2, 16, H / 2 + 4 },
+        { 20, H / 2 + 5, W - 21, H - 1 },
+    };
+    CONST RECT Boxes[] =
+    {
+        { 5, 3, W / 2, H / 2 },
+        { 0, 0, 0, 0 },
+        { W - 1, H - 1, W, H },
+        { 0, 0, 0, 0 },
+        { 3, H / 2 + 2, 4, H / 2 + 3 },
+        { W / 2, H - 2, W / 2 + 1, H - 1 },
+    };
+    CONST RECT Clipped[] =
+    {
+        Rects[0],
+        Rects[1],
+        { W - 20, H / 2, W, H },
+        { 0, 0, 0, 0 },
+        Rects[4],
+        Rects[5],
+    };
+    CONST RECT None[ARRAYSIZE(Rects)] = {};
+
+    CheckChanged(&Fb, &Src, ARRAYSIZE(Rects), Rects, Boxes, "compared copy");
+
+    // Once the framebuffer has the source nothing changes
+    std::vector<BYTE> Copied(FbBits);
+    BLT_INFO Same = Fb;
+    Same.pBits = Copied.data();
+    BltBits(&Same, &Src, ARRAYSIZE(Rects), Rects);
+    CheckChanged(&Same, &Src, ARRAYSIZE(Rects), Rects, None, "compared copy of the same pixels");
+
+    // Narrow enough for CopyBitsSmall, reported where they were clipped to
+    CONST RECT Small[] = { { 4, 8, 12, 10 }, { 20, 20, 36, 22 }, { W, 0, W + 4, 1 } };
+    CONST RECT SmallClipped[] = { Small[0], Small[1], { 0, 0, 0, 0 } };
+    CheckChanged(&Fb, &Src, ARRAYSIZE(Small), Small, SmallClipped, "small copy");
+
+    static BLT_COLOR_LUT Lut;
+    for (UINT i = 0; i < 256; i++)
+    {
+        Lut.Blue[i] = 255 - i;
+        Lut.Green[i] = (UINT32)i << 8;
+        Lut.Red[i] = (UINT32)(i / 2) << 16;
+    }
+    BLT_INFO Looked = Fb;
+    Looked.pColorLut = &Lut;
+    CheckChanged(&Looked, &Src, ARRAYSIZE(Rects), Rects, Clipped, "color lookup");
+
+    BLT_INFO Swizzled = Fb;
+    Swizzled.pSwizzle = BltGetSwizzle(BLT_CHANNEL_ORDER_RGBA);
+    CheckChanged(&Swizzled, &Src, ARRAYSIZE(Rects), Rects, Clipped, "swizzle");
+
+    UINT Fb16Pitch = Width * 2 + 6;
+    std::vector<BYTE> Fb16Bits(Fb16Pitch * Height);
+    BltTestFill(Fb16Bits.data(), Fb16Bits.size());
+    BLT_INFO Fb16 = BltTestSurface(Fb16Bits.data(), Width, Height, Fb16Pitch, 16, D3DKMDT_VPPR_IDENTITY);
+    CheckChanged(&Fb16, &Src, ARRAYSIZE(Rects), Rects, Clipped, "16bpp framebuffer");
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    ULONG Tiers[8];
+    UINT NumTiers = BltTestTiers(Tiers, ARRAYSIZE(Tiers));
+    s_pScalar = BltSimdSelect(0);
+    for (UINT t = 0; t < NumTiers; t++)
+    {
+        CONST BLT_SIMD_DISPATCH* pTier = BltSimdSelect(Tiers[t]);
+        printf("tier %s\n", pTier->Name);
+
+        TestKernels(61, 43);
+        TestKernels(640, 480);
+        TestKernels(1923, 1081);
+        TestBlend();
+        TestChanged(61, 43);
+        TestChanged(1923, 1081);
+    }
+
+    // Big compared copies are split across the worker pool
+    if (NT_SUCCESS(BltParallelInitialize(3)))
+    {
+        TestChanged(1923, 1081);
+        BltParallelShutdown();
+    }
+
+    return BltTestReport("bltfuncs_test");
+}
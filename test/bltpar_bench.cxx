@@ -0,0 +1,74 @@
+/******************************Module*Header*******************************\
+* Module Name: bltpar_bench.cxx
+*
+* Times a 4K present of each 32bpp source rotation with 0 to N workers,
+* N being one per processor besides the calling thread and at least 3.
+* 0 workers is BltBits on the calling thread alone. On a machine with
+* fewer processors than participants the extra workers only add overhead.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltpar.hxx"
+
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_WIDTH     3840
+#define BENCH_HEIGHT    2160
+#define BENCH_RUNS      10
+
+int main()
+{
+    BltSimdInitialize();
+
+    long Processors = sysconf(_SC_NPROCESSORS_ONLN);
+    UINT MaxWorkers = (Processors > 4) ? (UINT)(Processors - 1) : 3;
+    MaxWorkers = (MaxWorkers < BLT_MAX_WORKERS) ? MaxWorkers : BLT_MAX_WORKERS;
+
+    printf("%ld processors, %ux%u, best of %u, ms\n", Processors, BENCH_WIDTH, BENCH_HEIGHT, BENCH_RUNS);
+    printf("workers   identity     90      180      270\n");
+
+    for (UINT Workers = 0; Workers <= MaxWorkers; Workers++)
+    {
+        if ((Workers != 0) && !NT_SUCCESS(BltParallelInitialize(Workers)))
+        {
+            printf("starting %u workers failed\n", Workers);
+            return 1;
+        }
+
+        printf("%7u", BltParallelWorkers());
+        for (UINT r = D3DKMDT_VPPR_IDENTITY; r <= D3DKMDT_VPPR_ROTATE270; r++)
+        {
+            D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation = (D3DKMDT_VIDPN_PRESENT_PATH_ROTATION)r;
+            BOOLEAN Swap = (Rotation == D3DKMDT_VPPR_ROTATE90) || (Rotation == D3DKMDT_VPPR_ROTATE270);
+            UINT SrcWidth = Swap ? BENCH_HEIGHT : BENCH_WIDTH;
+            UINT SrcHeight = Swap ? BENCH_WIDTH : BENCH_HEIGHT;
+
+            std::vector<BYTE> SrcBits(SrcWidth * 4 * SrcHeight);
+            BltTestFill(SrcBits.data(), SrcBits.size());
+            BLT_INFO Src = BltTestSurface(SrcBits.data(), SrcWidth, SrcHeight, SrcWidth * 4, 32, D3DKMDT_VPPR_IDENTITY);
+
+            std::vector<BYTE> DstBits(BENCH_WIDTH * 4 * BENCH_HEIGHT);
+            BLT_INFO Dst = BltTestSurface(DstBits.data(), BENCH_WIDTH, BENCH_HEIGHT, BENCH_WIDTH * 4, 32, Rotation);
+
+            RECT Whole = { 0, 0, (LONG)SrcWidth, (LONG)SrcHeight };
+            UINT64 Best = MAXUINT64;
+            for (UINT i = 0; i < BENCH_RUNS; i++)
+            {
+                UINT64 Start = BltQueryTimeNs();
+                BltBits(&Dst, &Src, 1, &Whole);
+                UINT64 Elapsed = BltQueryTimeNs() - Start;
+                Best = (Elapsed < Best) ? Elapsed : Best;
+            }
+            printf("%9.3f", BltTestMs(Best));
+        }
+        printf("\n");
+
+        if (Workers != 0)
+        {
+            BltParallelShutdown();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/******************************Module*Header*******************************\
+* Module Name: bltpar_test.cxx
+*
+* Checks that the worker pool runs every band of a job exactly once, with
+* any number of workers, that it leaves a single band to the caller, and
+* that BltBits split across the pool writes what CopyBitsGeneric does.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltpar.hxx"
+
+#include <vector>
+
+VOID CopyBitsGeneric(
+    BLT_INFO* pDst,
+    CONST BLT_INFO* pSrc,
+    UINT  NumRects,
+    _In_reads_(NumRects) CONST RECT *pRects);
+
+#define TEST_MAX_BANDS  64
+
+typedef struct _TEST_JOB
+{
+    volatile LONG   Runs[TEST_MAX_BANDS];
+    volatile LONG   BadCount;
+} TEST_JOB;
+
+static UINT s_NumBands;
+
+static VOID CountBand(VOID* pContext, UINT Band, UINT NumBands)
+{
+    TEST_JOB* pJob = (TEST_JOB*)pContext;
+    if ((NumBands != s_NumBands) || (Band >= NumBands))
+    {
+        InterlockedIncrement(&pJob->BadCount);
+        return;
+    }
+    InterlockedIncrement(&pJob->Runs[Band]);
+}
+
+static VOID TestBands(VOID)
+{
+    TEST_JOB Job;
+    memset(&Job, 0, sizeof(Job));
+    s_NumBands = 1;
+    BLT_CHECK(!BltParallelRun(CountBand, &Job, 1), "the pool took a single band");
+
+    for (s_NumBands = 2; s_NumBands <= TEST_MAX_BANDS; s_NumBands++)
+    {
+        for (UINT Repeat = 0; Repeat < 50; Repeat++)
+        {
+            TEST_JOB Job;
+            memset(&Job, 0, sizeof(Job));
+
+            if (!BltParallelRun(CountBand, &Job, s_NumBands))
+            {
+                BLT_CHECK(FALSE, "the pool refused %u bands", s_NumBands);
+                continue;
+            }
+
+            BLT_CHECK(Job.BadCount == 0, "%u bands got a bad band", s_NumBands);
+            for (UINT Band = 0; Band < s_NumBands; Band++)
+            {
+                BLT_CHECK(Job.Runs[Band] == 1, "band %u of %u ran %d times", Band, s_NumBands, Job.Runs[Band]);
+            }
+        }
+    }
+}
+
+// A 4K present in every rotation, well over g_BltParallelThreshold
+static VOID TestBlt(VOID)
+{
+    CONST UINT Width = 3840;
+    CONST UINT Height = 2160;
+
+    for (UINT r = D3DKMDT_VPPR_IDENTITY; r <= D3DKMDT_VPPR_ROTATE270; r++)
+    {
+        D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation = (D3DKMDT_VIDPN_PRESENT_PATH_ROTATION)r;
+        BOOLEAN Swap = (Rotation == D3DKMDT_VPPR_ROTATE90) || (Rotation == D3DKMDT_VPPR_ROTATE270);
+        UINT SrcWidth = Swap ? Height : Width;
+        UINT SrcHeight = Swap ? Width : Height;
+
+        UINT SrcPitch = SrcWidth * 4 + 12;
+        std::vector<BYTE> SrcBits(SrcPitch * SrcHeight);
+        BltTestFill(SrcBits.data(), SrcBits.size());
+        BLT_INFO Src = BltTestSurface(SrcBits.data(), SrcWidth, SrcHeight, SrcPitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+        UINT DstPitch = Width * 4 + 20;
+        std::vector<BYTE> Expected(DstPitch * Height, 7);
+        std::vector<BYTE> Actual(Expected);
+
+        RECT Rects[] =
+        {
+            { 3, 5, (LONG)SrcWidth - 7, (LONG)SrcHeight - 2 },
+            { 10, 10, 13, 11 },
+        };
+
+        BLT_INFO Dst = BltTestSurface(Expected.data(), Width, Height, DstPitch, 32, Rotation);
+        CopyBitsGeneric(&Dst, &Src, ARRAYSIZE(Rects), Rects);
+        Dst.pBits = Actual.data();
+        BltBits(&Dst, &Src, ARRAYSIZE(Rects), Rects);
+        BLT_CHECK(Actual == Expected, "rotation %u with %u workers differs from CopyBitsGeneric", r, BltParallelWorkers());
+    }
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    // Worker counts that do not divide the bands evenly too, whatever the
+    // number of processors
+    UINT WorkerCounts[] = { 1, 3, 7 };
+    for (UINT i = 0; i < ARRAYSIZE(WorkerCounts); i++)
+    {
+        NTSTATUS Status = BltParallelInitialize(WorkerCounts[i]);
+        BLT_CHECK(NT_SUCCESS(Status), "starting %u workers failed", WorkerCounts[i]);
+        if (NT_SUCCESS(Status))
+        {
+            printf("workers %u\n", BltParallelWorkers());
+            TestBands();
+            TestBlt();
+        }
+        BltParallelShutdown();
+    }
+
+    return BltTestReport("bltpar_test");
+}
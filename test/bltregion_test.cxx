@@ -0,0 +1,319 @@
+/******************************Module*Header*******************************\
+* Module Name: bltregion_test.cxx
+*
+* Checks the region operations against bitmaps of the pixels they should
+* hold, and that every result is banded the way bltregion.hxx says. Then
+* regions are sent to a stand-in for pv_display, which paints what the
+* host would read: no more calls than asked for, every damaged pixel has
+* to be read, short lists of exact regions have to arrive exactly and
+* errors come back.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltregion.hxx"
+
+#include <vector>
+
+// Side of the bitmaps the operations are checked on
+#define TEST_SIDE       48
+
+typedef std::vector<BYTE> TEST_BITMAP;
+
+static TEST_BITMAP Bitmap(CONST BLT_REGION* pRegion, LONG Dx)
+{
+    TEST_BITMAP Pixels(TEST_SIDE * TEST_SIDE, 0);
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetRects(pRegion, &pRects);
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        for (LONG y = pRects[i].top; y < pRects[i].bottom; y++)
+        {
+            for (LONG x = pRects[i].left - Dx; x < pRects[i].right - Dx; x++)
+            {
+                if ((x >= 0) && (x < TEST_SIDE) && (y >= 0) && (y < TEST_SIDE))
+                {
+                    Pixels[y * TEST_SIDE + x] = 1;
+                }
+            }
+        }
+    }
+    return Pixels;
+}
+
+// The rects are y-x banded, bands that touch differ and the extents hold them exactly
+static VOID CheckBanded(CONST BLT_REGION* pRegion, CONST char* pWhat)
+{
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetRects(pRegion, &pRects);
+    if (NumRects == 0)
+    {
+        BLT_CHECK(BltRegionIsEmpty(pRegion), "%s has no rects but extents", pWhat);
+        return;
+    }
+
+    RECT Extents = { MAXLONG, MAXLONG, MINLONG, MINLONG };
+    UINT BandStart = 0;
+    UINT PrevBandStart = 0;
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        CONST RECT* pRect = &pRects[i];
+        BLT_CHECK((pRect->left < pRect->right) && (pRect->top < pRect->bottom), "%s has an empty rect", pWhat);
+        Extents.left = (pRect->left < Extents.left) ? pRect->left : Extents.left;
+        Extents.top = (pRect->top < Extents.top) ? pRect->top : Extents.top;
+        Extents.right = (pRect->right > Extents.right) ? pRect->right : Extents.right;
+        Extents.bottom = (pRect->bottom > Extents.bottom) ? pRect->bottom : Extents.bottom;
+
+        if (i == 0)
+        {
+            continue;
+        }
+
+        CONST RECT* pPrev = &pRects[i - 1];
+        if (pPrev->top == pRect->top)
+        {
+            BLT_CHECK((pPrev->bottom == pRect->bottom) && (pPrev->right < pRect->left), "%s has a bad band", pWhat);
+            continue;
+        }
+        BLT_CHECK(pPrev->bottom <= pRect->top, "%s has overlapping bands", pWhat);
+
+        // A new band, the one before it must not be the same spans touching it
+        PrevBandStart = BandStart;
+        BandStart = i;
+        UINT End = BandStart;
+        while ((End < NumRects) && (pRects[End].top == pRect->top))
+        {
+            End++;
+        }
+        if ((pRects[PrevBandStart].bottom == pRect->top) && (End - BandStart == BandStart - PrevBandStart))
+        {
+            BOOLEAN Same = TRUE;
+            for (UINT k = 0; k < End - BandStart; k++)
+            {
+                Same = Same && (pRects[PrevBandStart + k].left == pRects[BandStart + k].left) &&
+                               (pRects[PrevBandStart + k].right == pRects[BandStart + k].right);
+            }
+            BLT_CHECK(!Same, "%s has touching bands with the same spans", pWhat);
+        }
+    }
+
+    BLT_CHECK(memcmp(&Extents, &pRegion->Extents, sizeof(Extents)) == 0, "%s has the wrong extents", pWhat);
+}
+
+static VOID RandomRegion(BLT_REGION* pRegion, UINT NumRects)
+{
+    BltRegionInit(pRegion);
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        LONG x = BltTestRandom() % TEST_SIDE;
+        LONG y = BltTestRandom() % TEST_SIDE;
+        LONG Right = x + 1 + BltTestRandom() % 15;
+        LONG Bottom = y + 1 + BltTestRandom() % 15;
+        RECT Rect = { x, y, (Right < TEST_SIDE) ? Right : TEST_SIDE, (Bottom < TEST_SIDE) ? Bottom : TEST_SIDE };
+        BltRegionUnionRect(pRegion, &Rect);
+    }
+}
+
+static VOID TestOperations(VOID)
+{
+    for (UINT Iteration = 0; Iteration < 20000; Iteration++)
+    {
+        BLT_REGION A, B, C;
+        RandomRegion(&A, BltTestRandom() % 8);
+        RandomRegion(&B, BltTestRandom() % 8);
+        BltRegionInit(&C);
+        CheckBanded(&A, "a random region");
+        CheckBanded(&B, "a random region");
+
+        TEST_BITMAP PixelsA = Bitmap(&A, 0);
+        TEST_BITMAP PixelsB = Bitmap(&B, 0);
+
+        // The result may go to either operand too
+        UINT Operation = BltTestRandom() % 3;
+        UINT Alias = BltTestRandom() % 3;
+        BLT_REGION* pDst = (Alias == 0) ? &C : (Alias == 1) ? &A : &B;
+
+        BOOLEAN Exact;
+        switch (Operation)
+        {
+        case 0:  Exact = BltRegionUnion(pDst, &A, &B); break;
+        case 1:  Exact = BltRegionIntersect(pDst, &A, &B); break;
+        default: Exact = BltRegionSubtract(pDst, &A, &B); break;
+        }
+        BLT_CHECK(Exact, "operation %u was approximated", Operation);
+        CheckBanded(pDst, "a result");
+
+        TEST_BITMAP Result = Bitmap(pDst, 0);
+        for (UINT i = 0; i < TEST_SIDE * TEST_SIDE; i++)
+        {
+            BYTE Expected = (Operation == 0) ? (PixelsA[i] | PixelsB[i]) :
+                            (Operation == 1) ? (PixelsA[i] & PixelsB[i]) :
+                                               (PixelsA[i] & !PixelsB[i]);
+            if (Result[i] != Expected)
+            {
+                BLT_CHECK(FALSE, "iteration %u, operation %u is wrong at pixel %u", Iteration, Operation, i);
+                break;
+            }
+        }
+
+        LONG Dx = (LONG)(BltTestRandom() % 7) - 3;
+        BltRegionTranslate(pDst, Dx, 0);
+        BLT_CHECK(Bitmap(pDst, Dx) == Result, "translating by %d is wrong", Dx);
+
+        BltRegionFini(&A);
+        BltRegionFini(&B);
+        BltRegionFini(&C);
+    }
+}
+
+static VOID TestLimits(VOID)
+{
+    // A checkerboard of more rects than a block holds becomes its extents
+    BLT_REGION Region;
+    BltRegionInit(&Region);
+    BOOLEAN Exact = TRUE;
+    for (LONG y = 0; y < 40; y += 2)
+    {
+        for (LONG x = 0; x < 40; x += 2)
+        {
+            RECT Rect = { x, y, x + 1, y + 1 };
+            Exact = BltRegionUnionRect(&Region, &Rect) && Exact;
+        }
+    }
+    CheckBanded(&Region, "an overflowed region");
+    RECT Box = { 0, 0, 39, 39 };
+    BLT_CHECK(!Exact && (memcmp(&Region.Extents, &Box, sizeof(Box)) == 0), "an overflowed region is not its extents");
+    BltRegionFini(&Region);
+
+    // With the arena used up results become their extents, and it recovers
+    std::vector<BLT_REGION> Regions(BLT_REGION_ARENA_BLOCKS + 3);
+    RECT First = { 0, 0, 2, 2 };
+    RECT Second = { 5, 5, 7, 7 };
+    for (SIZE_T i = 0; i < Regions.size(); i++)
+    {
+        BltRegionInit(&Regions[i]);
+        BltRegionUnionRect(&Regions[i], &First);
+        Exact = BltRegionUnionRect(&Regions[i], &Second);
+    }
+    BLT_CHECK(!Exact && (Regions.back().pData == NULL), "a region got rects from an empty arena");
+    for (SIZE_T i = 0; i < Regions.size(); i++)
+    {
+        BltRegionFini(&Regions[i]);
+    }
+
+    BltRegionInit(&Region);
+    BltRegionUnionRect(&Region, &First);
+    BLT_CHECK(BltRegionUnionRect(&Region, &Second) && (Region.pData != NULL), "the arena did not recover");
+    BltRegionFini(&Region);
+}
+
+// Stand-in for pv_display, invalidate_region paints what the host would read
+typedef struct _TEST_DISPLAY
+{
+    UINT32              Width;
+    UINT32              Height;
+    UINT                Calls;
+    UINT                FailAt;     // Call that returns an error
+    BOOLEAN             OutOfBounds;
+    std::vector<BYTE>   Read;
+} TEST_DISPLAY;
+
+#define TEST_SEND_ERROR     -5
+
+static int TestInvalidateRegion(VOID* pContext, UINT32 X, UINT32 Y, UINT32 Width, UINT32 Height)
+{
+    TEST_DISPLAY* pDisplay = (TEST_DISPLAY*)pContext;
+    pDisplay->Calls++;
+    for (UINT32 y = Y; y < Y + Height; y++)
+    {
+        for (UINT32 x = X; x < X + Width; x++)
+        {
+            if ((x >= pDisplay->Width) || (y >= pDisplay->Height))
+            {
+                pDisplay->OutOfBounds = TRUE;
+                continue;
+            }
+            pDisplay->Read[y * pDisplay->Width + x] = 1;
+        }
+    }
+    return (pDisplay->Calls == pDisplay->FailAt) ? TEST_SEND_ERROR : 0;
+}
+
+static VOID TestSend(VOID)
+{
+    CONST UINT32 Width = 200;
+    CONST UINT32 Height = 150;
+    CONST UINT MaxRects = 8;
+
+    for (UINT Iteration = 0; Iteration < 20000; Iteration++)
+    {
+        TEST_DISPLAY Display;
+        Display.Width = Width;
+        Display.Height = Height;
+        Display.Calls = 0;
+        Display.FailAt = 3;
+        Display.OutOfBounds = FALSE;
+        Display.Read.assign(Width * Height, 0);
+
+        std::vector<BYTE> Damage(Width * Height, 0);
+        BLT_REGION Region;
+        BltRegionInit(&Region);
+        BOOLEAN Exact = TRUE;
+
+        UINT NumDamaged = BltTestRandom() % ((Iteration % 10 == 0) ? 200 : 12);
+        for (UINT i = 0; i < NumDamaged; i++)
+        {
+            LONG x = BltTestRandom() % Width;
+            LONG y = BltTestRandom() % Height;
+            LONG Right = x + 1 + BltTestRandom() % 40;
+            LONG Bottom = y + 1 + BltTestRandom() % 40;
+            RECT Rect = { x, y, (Right < (LONG)Width) ? Right : (LONG)Width, (Bottom < (LONG)Height) ? Bottom : (LONG)Height };
+            Exact = BltRegionUnionRect(&Region, &Rect) && Exact;
+            for (LONG py = Rect.top; py < Rect.bottom; py++)
+            {
+                for (LONG px = Rect.left; px < Rect.right; px++)
+                {
+                    Damage[py * Width + px] = 1;
+                }
+            }
+        }
+
+        CONST RECT* pRects;
+        UINT NumRects = BltRegionGetRects(&Region, &pRects);
+        int Error = BltRegionSend(&Region, MaxRects, TestInvalidateRegion, &Display);
+
+        BLT_CHECK(Display.Calls <= MaxRects, "%u calls", Display.Calls);
+        BLT_CHECK((NumDamaged != 0) || (Display.Calls == 0), "an empty region was sent");
+        BLT_CHECK(!Display.OutOfBounds, "a rect was sent off the screen");
+        for (UINT i = 0; i < Width * Height; i++)
+        {
+            if (Damage[i] && !Display.Read[i])
+            {
+                BLT_CHECK(FALSE, "iteration %u missed pixel %u", Iteration, i);
+                break;
+            }
+        }
+
+        if (NumRects <= MaxRects)
+        {
+            BLT_CHECK(Display.Calls == NumRects, "%u rects took %u calls", NumRects, Display.Calls);
+            BLT_CHECK(!Exact || (Display.Read == Damage), "iteration %u did not arrive exactly", Iteration);
+        }
+        else
+        {
+            BLT_CHECK(Display.Calls == 1, "%u rects were not sent as one box", NumRects);
+        }
+        BLT_CHECK((Display.Calls >= Display.FailAt) == (Error == TEST_SEND_ERROR), "the error was not passed back");
+
+        BltRegionFini(&Region);
+    }
+}
+
+int main()
+{
+    TestOperations();
+    TestLimits();
+    TestSend();
+
+    return BltTestReport("bltregion_test");
+}
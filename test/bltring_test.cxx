@@ -0,0 +1,222 @@
+/******************************Module*Header*******************************\
+* Module Name: bltring_test.cxx
+*
+* Checks a damage ring on one thread first: records come out as they
+* went in, the consumer is only kicked for a ring it left empty, a full
+* ring gets one record of the whole screen and nothing after it until
+* that is read, the indexes wrap and a Tail the producer did not expect
+* is refused. Then a producer forwards regions to a forwarder on a
+* pthread as fast as it can. The sink clears what it is told about, so
+* once the forwarder is destroyed no pixel may be left damaged.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltring.hxx"
+
+#include <unistd.h>
+#include <vector>
+
+static UINT s_Kicks;
+
+static VOID CountKick(VOID* pContext)
+{
+    UNREFERENCED_PARAMETER(pContext);
+    s_Kicks++;
+}
+
+static VOID TestRing(VOID)
+{
+    BLT_DAMAGE_RING* pRing = (BLT_DAMAGE_RING*)BltAllocate(BLT_DAMAGE_RING_BYTES);
+    BltDamageRingInit(pRing);
+    BLT_DAMAGE_PRODUCER Producer;
+    BltDamageProducerInit(&Producer, pRing, CountKick, NULL);
+
+    BLT_DAMAGE_RECORD Records[2 * BLT_DAMAGE_RING_RECORDS];
+    RECT Rects[200];
+    for (LONG i = 0; i < (LONG)ARRAYSIZE(Rects); i++)
+    {
+        Rects[i].left = i;
+        Rects[i].top = 2 * i;
+        Rects[i].right = i + 3;
+        Rects[i].bottom = 2 * i + 5;
+    }
+
+    BLT_CHECK(BltDamagePop(pRing, Records, ARRAYSIZE(Records)) == 0, "a new ring is not empty");
+
+    // Only the push to an empty ring kicks
+    BLT_CHECK(BltDamagePush(&Producer, 3, Rects), "3 rects did not fit");
+    BLT_CHECK(s_Kicks == 1, "%u kicks for an empty ring", s_Kicks);
+    BLT_CHECK(BltDamagePush(&Producer, 2, Rects + 3), "2 more rects did not fit");
+    BLT_CHECK(s_Kicks == 1, "a ring that was not empty was kicked");
+
+    UINT Count = BltDamagePop(pRing, Records, ARRAYSIZE(Records));
+    BLT_CHECK(Count == 5, "%u records, not 5", Count);
+    for (UINT i = 0; i < Count; i++)
+    {
+        BLT_CHECK((Records[i].X == i) && (Records[i].Y == 2 * i) && (Records[i].Width == 3) && (Records[i].Height == 5),
+                  "record %u is %u,%u %ux%u", i, Records[i].X, Records[i].Y, Records[i].Width, Records[i].Height);
+    }
+    BLT_CHECK(BltDamagePop(pRing, Records, ARRAYSIZE(Records)) == 0, "an emptied ring is not empty");
+
+    BLT_CHECK(BltDamagePush(&Producer, 1, Rects), "a rect did not fit");
+    BLT_CHECK(s_Kicks == 2, "an emptied ring was not kicked");
+
+    // A stalled consumer, the ring fills up to its last record and that
+    // one gets the whole screen
+    BLT_CHECK(BltDamagePush(&Producer, BLT_DAMAGE_RING_RECORDS - 2, Rects), "the ring filled up early");
+    BLT_CHECK(!BltDamagePush(&Producer, 1, Rects), "a rect went into the last record");
+    BLT_CHECK(!BltDamagePush(&Producer, 5, Rects), "rects went in after the whole screen");
+    BLT_CHECK(s_Kicks == 2, "a full ring was kicked");
+
+    Count = BltDamagePop(pRing, Records, ARRAYSIZE(Records));
+    BLT_CHECK(Count == BLT_DAMAGE_RING_RECORDS, "%u records from a full ring", Count);
+    BLT_CHECK((Records[Count - 1].Width == BLT_DAMAGE_FULL) && (Records[Count - 1].Height == BLT_DAMAGE_FULL),
+              "the last record of a full ring is not the whole screen");
+
+    // More than fits an empty ring
+    BLT_CHECK(!BltDamagePush(&Producer, ARRAYSIZE(Rects), Rects), "%u rects fit", (UINT)ARRAYSIZE(Rects));
+    BLT_CHECK(s_Kicks == 3, "the whole screen did not kick");
+    Count = BltDamagePop(pRing, Records, ARRAYSIZE(Records));
+    BLT_CHECK((Count == 1) && (Records[0].Width == BLT_DAMAGE_FULL), "too many rects were not the whole screen");
+
+    // A ring that was only partly read is not empty, a push does not kick it
+    BLT_CHECK(BltDamagePush(&Producer, BLT_DAMAGE_RING_RECORDS - 1, Rects), "the ring filled up early");
+    BLT_CHECK(BltDamagePop(pRing, Records, 10) == 10, "a partial read did not take 10");
+    BLT_CHECK(s_Kicks == 4, "%u kicks", s_Kicks);
+    BLT_CHECK(BltDamagePush(&Producer, 1, Rects), "a rect did not fit in a partly read ring");
+    BLT_CHECK(s_Kicks == 4, "a ring that was not empty was kicked");
+
+    // Head and Tail wrap
+    pRing->Head = 0xFFFFFFF0;
+    pRing->Tail = 0xFFFFFFF0;
+    BltDamageProducerInit(&Producer, pRing, CountKick, NULL);
+    for (UINT i = 0; i < 100; i++)
+    {
+        BLT_CHECK(BltDamagePush(&Producer, 7, Rects), "7 rects did not fit at %u", i);
+        Count = BltDamagePop(pRing, Records, ARRAYSIZE(Records));
+        BLT_CHECK((Count == 7) && (Records[6].X == 6), "wrapping lost records at %u", i);
+    }
+
+    // A Tail past Head is not believed
+    pRing->Tail = Producer.Head + 5;
+    BLT_CHECK(!BltDamagePush(&Producer, 1, Rects), "a Tail past Head was believed");
+
+    BltFree(pRing);
+}
+
+// What the forwarder tells the host about is cleared
+typedef struct _TEST_SINK
+{
+    UINT32              Width;
+    UINT32              Height;
+    volatile LONG*      pDamage;
+    volatile LONG       Calls;
+    volatile LONG       Full;
+} TEST_SINK;
+
+static int ClearDamage(VOID* pContext, UINT32 X, UINT32 Y, UINT32 Width, UINT32 Height)
+{
+    TEST_SINK* pSink = (TEST_SINK*)pContext;
+    InterlockedIncrement(&pSink->Calls);
+    if (Width == BLT_DAMAGE_FULL)
+    {
+        InterlockedIncrement(&pSink->Full);
+        X = 0;
+        Y = 0;
+        Width = pSink->Width;
+        Height = pSink->Height;
+    }
+
+    for (UINT32 y = Y; (y < Y + Height) && (y < pSink->Height); y++)
+    {
+        for (UINT32 x = X; (x < X + Width) && (x < pSink->Width); x++)
+        {
+            InterlockedExchange(&pSink->pDamage[y * pSink->Width + x], 0);
+        }
+    }
+
+    // A slow host now and then, so the ring fills up
+    if (BltTestRandom() % 3 == 0)
+    {
+        usleep(50);
+    }
+    return 0;
+}
+
+static VOID TestForwarder(VOID)
+{
+    CONST UINT32 Width = 300;
+    CONST UINT32 Height = 200;
+
+    // The producer has a generator of its own, the sink uses BltTestRandom
+    UINT32 Seed = 0x9e3779b9;
+
+    for (UINT Round = 0; Round < 40; Round++)
+    {
+        std::vector<LONG> Damage(Width * Height, 0);
+        TEST_SINK Sink;
+        Sink.Width = Width;
+        Sink.Height = Height;
+        Sink.pDamage = Damage.data();
+        Sink.Calls = 0;
+        Sink.Full = 0;
+
+        BLT_DAMAGE_FORWARDER* pForwarder = BltCreateDamageForwarder(ClearDamage, &Sink);
+        BLT_CHECK(pForwarder != NULL, "no forwarder");
+        if (pForwarder == NULL)
+        {
+            return;
+        }
+
+        for (UINT Frame = 0; Frame < 3000; Frame++)
+        {
+            BLT_REGION Region;
+            BltRegionInit(&Region);
+
+            UINT NumRects = 1 + (Seed = Seed * 1103515245 + 12345) % ((Round % 4 == 0) ? 40 : 6);
+            for (UINT i = 0; i < NumRects; i++)
+            {
+                LONG x = (Seed = Seed * 1103515245 + 12345) % Width;
+                LONG y = (Seed = Seed * 1103515245 + 12345) % Height;
+                LONG Right = x + 1 + (Seed = Seed * 1103515245 + 12345) % 30;
+                LONG Bottom = y + 1 + (Seed = Seed * 1103515245 + 12345) % 30;
+                RECT Rect = { x, y, (Right < (LONG)Width) ? Right : (LONG)Width, (Bottom < (LONG)Height) ? Bottom : (LONG)Height };
+
+                // Damage is in the framebuffer before it is forwarded
+                for (LONG py = Rect.top; py < Rect.bottom; py++)
+                {
+                    for (LONG px = Rect.left; px < Rect.right; px++)
+                    {
+                        InterlockedExchange(&Damage[py * Width + px], 1);
+                    }
+                }
+                BltRegionUnionRect(&Region, &Rect);
+            }
+
+            BltDamageForward(pForwarder, &Region, 8);
+            BltRegionFini(&Region);
+        }
+        BltDestroyDamageForwarder(pForwarder);
+
+        UINT Left = 0;
+        for (UINT i = 0; i < Width * Height; i++)
+        {
+            Left += (Damage[i] != 0);
+        }
+        BLT_CHECK(Left == 0, "round %u left %u pixels damaged", Round, Left);
+
+        if ((Round == 0) || (Round == 4))
+        {
+            printf("round %u, %d calls, %d of the whole screen\n", Round, Sink.Calls, Sink.Full);
+        }
+    }
+}
+
+int main()
+{
+    TestRing();
+    TestForwarder();
+
+    return BltTestReport("bltring_test");
+}
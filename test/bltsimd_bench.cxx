@@ -0,0 +1,105 @@
+/******************************Module*Header*******************************\
+* Module Name: bltsimd_bench.cxx
+*
+* Times the row copy of every SIMD tier this CPU has against memcpy, with
+* regular and with non-temporal stores. The sizes run from a row that
+* stays in L1 to copies well past the last level cache, where streaming
+* stores are meant to pay off. Each copy is checked before it is timed.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+
+#include <immintrin.h>
+#include <vector>
+
+#define BENCH_RUNS      20
+
+// memcpy in the shape of a row copy
+static VOID MemcpyRow(BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    memcpy(pDst, pSrc, Bytes);
+}
+
+// GB/s of the best of BENCH_RUNS, 0 if the copy is wrong
+static double TimeCopy(PFN_BLT_COPY_ROW pfnCopy, BOOLEAN Stream, BYTE* pDst, CONST BYTE* pSrc, SIZE_T Bytes)
+{
+    memset(pDst, 0, Bytes);
+    pfnCopy(pDst, pSrc, Bytes);
+    if (Stream)
+    {
+        _mm_sfence();
+    }
+    if (memcmp(pDst, pSrc, Bytes) != 0)
+    {
+        return 0;
+    }
+
+    // Enough copies of a small size that the timer does not matter
+    UINT Repeat = (UINT)((1 << 24) / Bytes) + 1;
+    UINT64 Best = MAXUINT64;
+    for (UINT i = 0; i < BENCH_RUNS; i++)
+    {
+        UINT64 Start = BltQueryTimeNs();
+        for (UINT j = 0; j < Repeat; j++)
+        {
+            pfnCopy(pDst, pSrc, Bytes);
+        }
+        if (Stream)
+        {
+            _mm_sfence();
+        }
+        UINT64 Elapsed = BltQueryTimeNs() - Start;
+        Best = (Elapsed < Best) ? Elapsed : Best;
+    }
+    return (double)Bytes * Repeat / (double)Best;
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    SIZE_T LastLevel = BltQueryLastLevelCacheSize();
+    printf("last level cache %zu KB, best of %u, GB/s\n", LastLevel / 1024, BENCH_RUNS);
+
+    SIZE_T Sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024, LastLevel / 2, LastLevel * 2 };
+    std::vector<BYTE> Src(Sizes[ARRAYSIZE(Sizes) - 1]);
+    std::vector<BYTE> Dst(Src.size());
+    BltTestFill(Src.data(), Src.size());
+
+    ULONG Tiers[8];
+    UINT NumTiers = BltTestTiers(Tiers, ARRAYSIZE(Tiers));
+
+    printf("%-16s", "KB");
+    for (UINT s = 0; s < ARRAYSIZE(Sizes); s++)
+    {
+        printf("%10zu", Sizes[s] / 1024);
+    }
+    printf("\n%-16s", "memcpy");
+    for (UINT s = 0; s < ARRAYSIZE(Sizes); s++)
+    {
+        printf("%10.2f", TimeCopy(MemcpyRow, FALSE, Dst.data(), Src.data(), Sizes[s]));
+    }
+    printf("\n");
+
+    for (UINT t = 0; t < NumTiers; t++)
+    {
+        CONST BLT_SIMD_DISPATCH* pTier = BltSimdSelect(Tiers[t]);
+        for (UINT Stream = 0; Stream < 2; Stream++)
+        {
+            PFN_BLT_COPY_ROW pfnCopy = Stream ? pTier->CopyRowStream : pTier->CopyRow;
+            if (pfnCopy == NULL)
+            {
+                continue;
+            }
+
+            printf("%-8s%-8s", pTier->Name, Stream ? "stream" : "");
+            for (UINT s = 0; s < ARRAYSIZE(Sizes); s++)
+            {
+                printf("%10.2f", TimeCopy(pfnCopy, Stream, Dst.data(), Src.data(), Sizes[s]));
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
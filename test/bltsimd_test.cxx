@@ -0,0 +1,275 @@
+/******************************Module*Header*******************************\
+* Module Name: bltsimd_test.cxx
+*
+* Checks every SIMD tier this CPU has against the scalar tier, byte for
+* byte. Each row kernel of BLT_SIMD_DISPATCH runs on every length up to a
+* few hundred pixels and at every alignment, so the vector bodies and the
+* tails are all covered. Whatever a kernel writes past its row is also
+* compared, a kernel that overruns fails.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+
+#include <stddef.h>
+
+#define TEST_ROW_BYTES      8192
+#define TEST_GUARD          64
+
+static BYTE s_Src[TEST_ROW_BYTES];
+static BYTE s_Expected[TEST_ROW_BYTES + 2 * TEST_GUARD];
+static BYTE s_Actual[TEST_ROW_BYTES + 2 * TEST_GUARD];
+
+// Fresh source and destinations, the two destinations the same
+static VOID NewRows(VOID)
+{
+    BltTestFill(s_Src, sizeof(s_Src));
+    BltTestFill(s_Expected, sizeof(s_Expected));
+    memcpy(s_Actual, s_Expected, sizeof(s_Actual));
+}
+
+static BOOLEAN SameRows(VOID)
+{
+    return memcmp(s_Expected, s_Actual, sizeof(s_Actual)) == 0;
+}
+
+// The member at Offset of a dispatch table
+template <typename T>
+static T Kernel(CONST BLT_SIMD_DISPATCH* pTier, SIZE_T Offset)
+{
+    return *(CONST T*)((CONST BYTE*)pTier + Offset);
+}
+
+static VOID TestCopy(CONST BLT_SIMD_DISPATCH* pTier)
+{
+    for (UINT Stream = 0; Stream < 2; Stream++)
+    {
+        PFN_BLT_COPY_ROW pfnCopy = Stream ? pTier->CopyRowStream : pTier->CopyRow;
+        if (pfnCopy == NULL)
+        {
+            continue;
+        }
+
+        for (UINT Bytes = 0; Bytes < 1200; Bytes++)
+        {
+            for (UINT Align = 0; Align < 8; Align++)
+            {
+                NewRows();
+                memcpy(s_Expected + TEST_GUARD + Align, s_Src + Align, Bytes);
+                pfnCopy(s_Actual + TEST_GUARD + Align, s_Src + Align, Bytes);
+                BLT_CHECK(SameRows(), "%s CopyRow%s of %u bytes at %u", pTier->Name, Stream ? "Stream" : "", Bytes, Align);
+            }
+        }
+    }
+}
+
+static VOID TestConvert(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier, SIZE_T Offset, CONST char* pName)
+{
+    PFN_BLT_CONVERT_ROW pfnExpected = Kernel<PFN_BLT_CONVERT_ROW>(pScalar, Offset);
+    PFN_BLT_CONVERT_ROW pfnActual = Kernel<PFN_BLT_CONVERT_ROW>(pTier, Offset);
+
+    for (UINT Pixels = 0; Pixels < 300; Pixels++)
+    {
+        for (UINT Align = 0; Align < 4; Align++)
+        {
+            NewRows();
+            pfnExpected(s_Expected + TEST_GUARD + Align, s_Src + Align, Pixels);
+            pfnActual(s_Actual + TEST_GUARD + Align, s_Src + Align, Pixels);
+            BLT_CHECK(SameRows(), "%s %s of %u pixels at %u", pTier->Name, pName, Pixels, Align);
+        }
+    }
+}
+
+static VOID TestDither(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier, SIZE_T Offset, CONST char* pName)
+{
+    PFN_BLT_DITHER_ROW pfnExpected = Kernel<PFN_BLT_DITHER_ROW>(pScalar, Offset);
+    PFN_BLT_DITHER_ROW pfnActual = Kernel<PFN_BLT_DITHER_ROW>(pTier, Offset);
+
+    for (UINT Pixels = 0; Pixels < 200; Pixels++)
+    {
+        for (UINT X = 0; X < 8; X++)
+        {
+            for (UINT Y = 0; Y < 4; Y++)
+            {
+                UINT Align = X % 4;
+                NewRows();
+                pfnExpected(s_Expected + TEST_GUARD + Align, s_Src + Align, Pixels, X, Y + 7);
+                pfnActual(s_Actual + TEST_GUARD + Align, s_Src + Align, Pixels, X, Y + 7);
+                BLT_CHECK(SameRows(), "%s %s of %u pixels at %u, %u", pTier->Name, pName, Pixels, X, Y);
+            }
+        }
+    }
+}
+
+static VOID TestRotate(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier)
+{
+    for (UINT Pixels = 0; Pixels < 100; Pixels++)
+    {
+        NewRows();
+        pScalar->ReverseRow32(s_Expected + TEST_GUARD + 600, s_Src, Pixels);
+        pTier->ReverseRow32(s_Actual + TEST_GUARD + 600, s_Src, Pixels);
+        BLT_CHECK(SameRows(), "%s ReverseRow32 of %u pixels", pTier->Name, Pixels);
+    }
+
+    // A 32x32 destination, walked in each of the four directions
+    CONST LONG Side = 32;
+    CONST LONG Pitch = Side * 4;
+    for (UINT Width = 1; Width <= (UINT)Side; Width += 3)
+    {
+        for (UINT Height = 1; Height <= (UINT)Side; Height += 5)
+        {
+            for (UINT Direction = 0; Direction < 4; Direction++)
+            {
+                LONG PixelPitch = (Direction & 1) ? -Pitch : Pitch;
+                LONG RowPitch = (Direction & 2) ? -4 : 4;
+                SIZE_T Start = ((Direction & 1) ? (Side - 1) * Pitch : 0) + ((Direction & 2) ? (Side - 1) * 4 : 0);
+
+                NewRows();
+                pScalar->Rotate32(s_Expected + TEST_GUARD + Start, PixelPitch, RowPitch, s_Src, Pitch, Width, Height);
+                pTier->Rotate32(s_Actual + TEST_GUARD + Start, PixelPitch, RowPitch, s_Src, Pitch, Width, Height);
+                BLT_CHECK(SameRows(), "%s Rotate32 of %ux%u, direction %u", pTier->Name, Width, Height, Direction);
+            }
+        }
+    }
+}
+
+static VOID TestColor(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier)
+{
+    static BLT_COLOR_LUT Lut;
+    for (UINT i = 0; i < 256; i++)
+    {
+        Lut.Blue[i] = BltTestRandom() & 0xff;
+        Lut.Green[i] = (BltTestRandom() & 0xff) << 8;
+        Lut.Red[i] = (BltTestRandom() & 0xff) << 16;
+    }
+
+    for (UINT Pixels = 0; Pixels < 100; Pixels++)
+    {
+        NewRows();
+        pScalar->ColorLutRow32(s_Expected + TEST_GUARD, s_Src, Pixels, &Lut);
+        pTier->ColorLutRow32(s_Actual + TEST_GUARD, s_Src, Pixels, &Lut);
+        BLT_CHECK(SameRows(), "%s ColorLutRow32 of %u pixels", pTier->Name, Pixels);
+
+        pScalar->ColorLutRow32(s_Expected + TEST_GUARD, s_Expected + TEST_GUARD, Pixels, &Lut);
+        pTier->ColorLutRow32(s_Actual + TEST_GUARD, s_Actual + TEST_GUARD, Pixels, &Lut);
+        BLT_CHECK(SameRows(), "%s ColorLutRow32 in place of %u pixels", pTier->Name, Pixels);
+
+        for (UINT Order = BLT_CHANNEL_ORDER_RGBA; Order < BLT_CHANNEL_ORDER_COUNT; Order++)
+        {
+            CONST BLT_SWIZZLE* pSwizzle = BltGetSwizzle((BLT_CHANNEL_ORDER)Order);
+            pScalar->SwizzleRow32(s_Expected + TEST_GUARD, s_Src + 1, Pixels, pSwizzle);
+            pTier->SwizzleRow32(s_Actual + TEST_GUARD, s_Src + 1, Pixels, pSwizzle);
+            BLT_CHECK(SameRows(), "%s SwizzleRow32 to order %u of %u pixels", pTier->Name, Order, Pixels);
+        }
+    }
+}
+
+static VOID TestChanged(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier)
+{
+    for (UINT Pixels = 0; Pixels < 200; Pixels++)
+    {
+        for (UINT Align = 0; Align < 16; Align += 4)
+        {
+            for (UINT Changes = 0; Changes < 6; Changes++)
+            {
+                BYTE* pExpected = s_Expected + TEST_GUARD + Align;
+                BYTE* pActual = s_Actual + TEST_GUARD + Align;
+
+                NewRows();
+                memcpy(s_Src, pExpected, Pixels * 4);
+                for (UINT i = 0; (i < Changes) && (Pixels != 0); i++)
+                {
+                    s_Src[(BltTestRandom() % Pixels) * 4 + BltTestRandom() % 4] ^= 1 + BltTestRandom() % 255;
+                }
+
+                UINT ExpectedFirst = 0, ExpectedEnd = 0, ActualFirst = 0, ActualEnd = 0;
+                BOOLEAN ExpectedChanged = pScalar->CopyChangedRow32(pExpected, s_Src, Pixels, &ExpectedFirst, &ExpectedEnd);
+                BOOLEAN ActualChanged = pTier->CopyChangedRow32(pActual, s_Src, Pixels, &ActualFirst, &ActualEnd);
+
+                BLT_CHECK(memcmp(pActual, s_Src, Pixels * 4) == 0, "%s CopyChangedRow32 of %u pixels did not copy", pTier->Name, Pixels);
+                BLT_CHECK(SameRows(), "%s CopyChangedRow32 of %u pixels", pTier->Name, Pixels);
+                BLT_CHECK((ExpectedChanged == ActualChanged) &&
+                          (!ExpectedChanged || ((ExpectedFirst == ActualFirst) && (ExpectedEnd == ActualEnd))),
+                          "%s CopyChangedRow32 of %u pixels found %u-%u, not %u-%u",
+                          pTier->Name, Pixels, ActualFirst, ActualEnd, ExpectedFirst, ExpectedEnd);
+            }
+        }
+    }
+}
+
+static VOID TestBlendAndHash(CONST BLT_SIMD_DISPATCH* pScalar, CONST BLT_SIMD_DISPATCH* pTier)
+{
+    for (UINT Pixels = 0; Pixels < 300; Pixels++)
+    {
+        NewRows();
+
+        // Premultiplied, no channel above its alpha
+        for (UINT i = 0; i < Pixels; i++)
+        {
+            BYTE* pPixel = &s_Src[i * 4];
+            for (UINT c = 0; c < 3; c++)
+            {
+                pPixel[c] = (pPixel[c] > pPixel[3]) ? pPixel[3] : pPixel[c];
+            }
+        }
+
+        pScalar->BlendRow32(s_Expected + TEST_GUARD, s_Src, Pixels);
+        pTier->BlendRow32(s_Actual + TEST_GUARD, s_Src, Pixels);
+        BLT_CHECK(SameRows(), "%s BlendRow32 of %u pixels", pTier->Name, Pixels);
+    }
+
+    for (UINT Bytes = 0; Bytes < 600; Bytes++)
+    {
+        UINT64 Expected[BLT_HASH_LANES] = { 1, 2, 3, 4 };
+        UINT64 Actual[BLT_HASH_LANES] = { 1, 2, 3, 4 };
+
+        BltTestFill(s_Src, Bytes + 3);
+        pScalar->HashRow(Expected, s_Src + 3, Bytes, 77);
+        pTier->HashRow(Actual, s_Src + 3, Bytes, 77);
+        BLT_CHECK(memcmp(Expected, Actual, sizeof(Actual)) == 0, "%s HashRow of %u bytes", pTier->Name, Bytes);
+    }
+}
+
+#define TEST_CONVERT(Name)  TestConvert(pScalar, pTier, offsetof(BLT_SIMD_DISPATCH, Name), #Name)
+#define TEST_DITHER(Name)   TestDither(pScalar, pTier, offsetof(BLT_SIMD_DISPATCH, Name), #Name)
+
+int main()
+{
+    BltSimdInitialize();
+
+    ULONG Tiers[8];
+    UINT NumTiers = BltTestTiers(Tiers, ARRAYSIZE(Tiers));
+    CONST BLT_SIMD_DISPATCH* pScalar = BltSimdSelect(0);
+
+    for (UINT t = 0; t < NumTiers; t++)
+    {
+        CONST BLT_SIMD_DISPATCH* pTier = BltSimdSelect(Tiers[t]);
+        printf("tier %s\n", pTier->Name);
+
+        TestCopy(pTier);
+        if (pTier == pScalar)
+        {
+            continue;
+        }
+
+        TEST_CONVERT(Unpack565Row);
+        TEST_CONVERT(Pack565Row);
+        TEST_CONVERT(Quantize8Row);
+        TEST_CONVERT(Unpack24Row);
+        TEST_CONVERT(Pack24Row);
+        TEST_CONVERT(CopyRgb32Row);
+        TEST_CONVERT(Unpack2101010Row);
+        TEST_CONVERT(Pack2101010Row);
+        TEST_CONVERT(UnpackFp16Row);
+        TEST_CONVERT(PackFp16Row);
+        TEST_DITHER(Dither565Row);
+        TEST_DITHER(Dither8Row);
+
+        TestRotate(pScalar, pTier);
+        TestColor(pScalar, pTier);
+        TestChanged(pScalar, pTier);
+        TestBlendAndHash(pScalar, pTier);
+    }
+
+    return BltTestReport("bltsimd_test");
+}
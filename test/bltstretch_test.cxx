@@ -0,0 +1,131 @@
+/******************************Module*Header*******************************\
+* Module Name: bltstretch_test.cxx
+*
+* Checks BltStretchBits against a floating point filter, one axis at a
+* time. A source that only changes along x must come out as that axis
+* filtered on its own, whatever the other axis does, and the same for y.
+* Scales are picked so each axis gets the box filter in some cases and
+* bilinear in others, with the other axis going the other way.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+
+#include <vector>
+
+typedef struct _TEST_SCALE
+{
+    UINT SrcWidth;
+    UINT SrcHeight;
+    UINT DstWidth;
+    UINT DstHeight;
+} TEST_SCALE;
+
+static CONST TEST_SCALE s_Scales[] =
+{
+    { 1600,  300,  400,  900 },     // Box across, bilinear down
+    {  300, 1600,  900,  400 },     // Bilinear across, box down
+    { 1024,  768,  256,  192 },     // Box both ways
+    {  640,  480, 1280,  960 },     // Bilinear both ways
+    { 1280,  720, 1000,  700 },     // Bilinear, by less than 2
+};
+
+// A channel of the source at position k along the axis that changes, not
+// smooth, so the two filters give different results
+static BYTE SourceValue(UINT k, UINT Channel)
+{
+    return (BYTE)(k * 37 + (k * k) % 11 + 50 * Channel);
+}
+
+// Destination pixel i of the filter stretch picks for scaling SrcSize to DstSize
+static double ExpectedValue(UINT i, UINT SrcSize, UINT DstSize, UINT Channel)
+{
+    if (SrcSize >= 2 * DstSize)
+    {
+        UINT First = (UINT)(((UINT64)i * SrcSize) / DstSize);
+        UINT Last = (UINT)(((UINT64)(i + 1) * SrcSize) / DstSize);
+        UINT Count = (Last > First) ? Last - First : 1;
+        double Sum = 0;
+        for (UINT k = First; k < First + Count; k++)
+        {
+            Sum += SourceValue(k, Channel);
+        }
+        return Sum / Count;
+    }
+
+    LONG64 Center = ((LONG64)(2 * i + 1) * SrcSize * 65536) / (2 * (LONG64)DstSize) - 32768;
+    Center = (Center > 0) ? Center : 0;
+    UINT k = (UINT)(Center >> 16);
+    if (k >= SrcSize - 1)
+    {
+        return SourceValue(SrcSize - 1, Channel);
+    }
+    double Weight = (double)((Center >> 8) & 0xFF) / 256;
+    return SourceValue(k, Channel) * (1 - Weight) + SourceValue(k + 1, Channel) * Weight;
+}
+
+static VOID TestScale(CONST TEST_SCALE* pScale, BOOLEAN AlongX)
+{
+    UINT SrcPitch = pScale->SrcWidth * 4;
+    std::vector<BYTE> SrcBits(SrcPitch * pScale->SrcHeight);
+    for (UINT y = 0; y < pScale->SrcHeight; y++)
+    {
+        for (UINT x = 0; x < pScale->SrcWidth; x++)
+        {
+            for (UINT c = 0; c < 4; c++)
+            {
+                SrcBits[y * SrcPitch + x * 4 + c] = SourceValue(AlongX ? x : y, c);
+            }
+        }
+    }
+    BLT_INFO Src = BltTestSurface(SrcBits.data(), pScale->SrcWidth, pScale->SrcHeight, SrcPitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+    UINT DstPitch = pScale->DstWidth * 4;
+    std::vector<BYTE> DstBits(DstPitch * pScale->DstHeight);
+    BLT_INFO Dst = BltTestSurface(DstBits.data(), pScale->DstWidth, pScale->DstHeight, DstPitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+    RECT Whole = { 0, 0, (LONG)pScale->SrcWidth, (LONG)pScale->SrcHeight };
+    RECT DstRect;
+    BltStretchBits(&Dst, &Src, 1, &Whole, &DstRect);
+    BLT_CHECK((DstRect.left == 0) && (DstRect.top == 0) &&
+              (DstRect.right == (LONG)pScale->DstWidth) && (DstRect.bottom == (LONG)pScale->DstHeight),
+              "%ux%u to %ux%u changed %d,%d-%d,%d", pScale->SrcWidth, pScale->SrcHeight, pScale->DstWidth, pScale->DstHeight,
+              DstRect.left, DstRect.top, DstRect.right, DstRect.bottom);
+
+    UINT SrcSize = AlongX ? pScale->SrcWidth : pScale->SrcHeight;
+    UINT DstSize = AlongX ? pScale->DstWidth : pScale->DstHeight;
+    for (UINT y = 0; y < pScale->DstHeight; y++)
+    {
+        for (UINT x = 0; x < pScale->DstWidth; x++)
+        {
+            for (UINT c = 0; c < 4; c++)
+            {
+                double Expected = ExpectedValue(AlongX ? x : y, SrcSize, DstSize, c);
+                double Actual = DstBits[y * DstPitch + x * 4 + c];
+                BLT_CHECK((Actual - Expected <= 1.5) && (Expected - Actual <= 1.5),
+                          "%ux%u to %ux%u along %s, pixel %u, %u channel %u is %.0f, not %.1f",
+                          pScale->SrcWidth, pScale->SrcHeight, pScale->DstWidth, pScale->DstHeight,
+                          AlongX ? "x" : "y", x, y, c, Actual, Expected);
+            }
+        }
+    }
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    ULONG Tiers[8];
+    UINT NumTiers = BltTestTiers(Tiers, ARRAYSIZE(Tiers));
+    for (UINT t = 0; t < NumTiers; t++)
+    {
+        printf("tier %s\n", BltSimdSelect(Tiers[t])->Name);
+        for (UINT i = 0; i < ARRAYSIZE(s_Scales); i++)
+        {
+            TestScale(&s_Scales[i], TRUE);
+            TestScale(&s_Scales[i], FALSE);
+        }
+    }
+
+    return BltTestReport("bltstretch_test");
+}
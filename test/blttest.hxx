@@ -0,0 +1,128 @@
+/******************************Module*Header*******************************\
+* Module Name: blttest.hxx
+*
+* What the host tests and benchmarks of the blt modules share. They are
+* built with BLT_HOST_BUILD against the sources in ../src, see Makefile.
+*
+* A test prints what failed and returns non-zero from main through
+* BltTestReport. Random data comes from a fixed seed so a failure repeats.
+*
+\**************************************************************************/
+
+#ifndef _BLTTEST_HXX_
+#define _BLTTEST_HXX_
+
+#include "bltport.hxx"
+#include "bltsimd.hxx"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static UINT g_BltTestFailures;
+static UINT32 g_BltTestSeed = 0x2545f491;
+
+// Prints the first few failures only, a broken kernel fails everywhere
+#define BLT_CHECK(Condition, ...)                                   \
+    do                                                              \
+    {                                                               \
+        if (!(Condition) && (g_BltTestFailures++ < 20))             \
+        {                                                           \
+            printf("%s:%d: ", __FILE__, __LINE__);                  \
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+        }                                                           \
+    } while (0)
+
+static inline UINT32 BltTestRandom(VOID)
+{
+    g_BltTestSeed ^= g_BltTestSeed << 13;
+    g_BltTestSeed ^= g_BltTestSeed >> 17;
+    g_BltTestSeed ^= g_BltTestSeed << 5;
+    return g_BltTestSeed;
+}
+
+static inline VOID BltTestFill(VOID* pBytes, SIZE_T Bytes)
+{
+    for (SIZE_T i = 0; i < Bytes; i++)
+    {
+        ((BYTE*)pBytes)[i] = (BYTE)BltTestRandom();
+    }
+}
+
+// The format the blts expect for a bpp
+static inline D3DDDIFORMAT BltTestFormat(UINT BitsPerPel)
+{
+    switch (BitsPerPel)
+    {
+    case 64: return D3DDDIFMT_A16B16G16R16F;
+    case 32: return D3DDDIFMT_X8R8G8B8;
+    case 24: return D3DDDIFMT_R8G8B8;
+    case 16: return D3DDDIFMT_R5G6B5;
+    case 8:  return D3DDDIFMT_P8;
+    default: return D3DDDIFMT_UNKNOWN;
+    }
+}
+
+// A surface with its own bits, BLT_INFO is all zero besides what is given
+static inline BLT_INFO BltTestSurface(
+    VOID* pBits,
+    UINT Width,
+    UINT Height,
+    UINT Pitch,
+    UINT BitsPerPel,
+    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation)
+{
+    BLT_INFO Info;
+    RtlZeroMemory(&Info, sizeof(Info));
+    Info.pBits = pBits;
+    Info.Pitch = Pitch;
+    Info.BitsPerPel = BitsPerPel;
+    Info.Format = BltTestFormat(BitsPerPel);
+    Info.Rotation = Rotation;
+    Info.Width = Width;
+    Info.Height = Height;
+    return Info;
+}
+
+// The tiers of bltsimd.cxx this CPU can run, best last. BltSimdSelect
+// makes the one returned the one the blts use.
+static inline UINT BltTestTiers(ULONG* pFeatures, UINT MaxTiers)
+{
+    static CONST ULONG Tiers[] =
+    {
+        0,
+        BLT_CPU_SSE2,
+        BLT_CPU_SSE2 | BLT_CPU_SSSE3 | BLT_CPU_SSE41,
+        BLT_CPU_SSE2 | BLT_CPU_SSSE3 | BLT_CPU_SSE41 | BLT_CPU_AVX2,
+        BLT_CPU_SSE2 | BLT_CPU_SSSE3 | BLT_CPU_SSE41 | BLT_CPU_AVX2 | BLT_CPU_AVX512,
+    };
+
+    ULONG Cpu = BltQueryCpuFeatures();
+    UINT NumTiers = 0;
+    for (UINT i = 0; (i < ARRAYSIZE(Tiers)) && (NumTiers < MaxTiers); i++)
+    {
+        if ((Tiers[i] & Cpu) == Tiers[i])
+        {
+            pFeatures[NumTiers++] = Tiers[i];
+        }
+    }
+    return NumTiers;
+}
+
+static inline double BltTestMs(UINT64 Ns)
+{
+    return (double)Ns / 1000000.0;
+}
+
+static inline int BltTestReport(CONST char* pName)
+{
+    if (g_BltTestFailures != 0)
+    {
+        printf("%s: %u failures\n", pName, g_BltTestFailures);
+        return 1;
+    }
+    printf("%s: ok\n", pName);
+    return 0;
+}
+
+#endif // _BLTTEST_HXX_
@@ -0,0 +1,69 @@
+/******************************Module*Header*******************************\
+* Module Name: blttile_bench.cxx
+*
+* Times hashing every tile of a 1920x1080 present against copying it, for
+* every SIMD tier this CPU has. A tile map only pays off if refining a
+* present costs about what reading it does.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltregion.hxx"
+#include "blttile.hxx"
+
+#include <vector>
+
+#define BENCH_WIDTH     1920
+#define BENCH_HEIGHT    1080
+#define BENCH_RUNS      10
+
+int main()
+{
+    BltSimdInitialize();
+
+    std::vector<UINT32> SrcBits(BENCH_WIDTH * BENCH_HEIGHT);
+    std::vector<UINT32> DstBits(BENCH_WIDTH * BENCH_HEIGHT);
+    BltTestFill(SrcBits.data(), SrcBits.size() * 4);
+    BLT_INFO Src = BltTestSurface(SrcBits.data(), BENCH_WIDTH, BENCH_HEIGHT, BENCH_WIDTH * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    BLT_INFO Dst = BltTestSurface(DstBits.data(), BENCH_WIDTH, BENCH_HEIGHT, BENCH_WIDTH * 4, 32, D3DKMDT_VPPR_IDENTITY);
+    RECT Whole = { 0, 0, BENCH_WIDTH, BENCH_HEIGHT };
+
+    printf("%ux%u in tiles of %u, best of %u, ms\n", BENCH_WIDTH, BENCH_HEIGHT, BLT_TILE_DEFAULT_SIZE, BENCH_RUNS);
+    printf("tier         hash      copy\n");
+
+    ULONG Tiers[8];
+    UINT NumTiers = BltTestTiers(Tiers, ARRAYSIZE(Tiers));
+    for (UINT t = 0; t < NumTiers; t++)
+    {
+        CONST BLT_SIMD_DISPATCH* pTier = BltSimdSelect(Tiers[t]);
+
+        BLT_TILE_MAP Map;
+        BltTileMapInit(&Map);
+        if (!BltTileMapPrepare(&Map, &Dst, BLT_TILE_DEFAULT_SIZE))
+        {
+            printf("no memory for the tile map\n");
+            return 1;
+        }
+
+        UINT64 BestHash = MAXUINT64;
+        UINT64 BestCopy = MAXUINT64;
+        for (UINT i = 0; i < BENCH_RUNS; i++)
+        {
+            BLT_REGION Changed;
+            BltRegionInit(&Changed);
+            UINT64 Start = BltQueryTimeNs();
+            BltTileMapRefine(&Map, &Src, 1, &Whole, &Changed);
+            UINT64 Hashed = BltQueryTimeNs();
+            BltBits(&Dst, &Src, 1, &Whole);
+            UINT64 Copied = BltQueryTimeNs();
+            BltRegionFini(&Changed);
+
+            BestHash = (Hashed - Start < BestHash) ? Hashed - Start : BestHash;
+            BestCopy = (Copied - Hashed < BestCopy) ? Copied - Hashed : BestCopy;
+        }
+        printf("%-8s %9.3f %9.3f\n", pTier->Name, BltTestMs(BestHash), BltTestMs(BestCopy));
+
+        BltTileMapFree(&Map);
+    }
+    return 0;
+}
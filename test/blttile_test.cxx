@@ -0,0 +1,222 @@
+/******************************Module*Header*******************************\
+* Module Name: blttile_test.cxx
+*
+* Checks that the row hash sees swapped lanes, swapped blocks, any single
+* bit and the salt, and that BltTileMapRefine reports exactly the tiles
+* whose pixels changed among those the rects touch. Forgotten tiles and a
+* moved framebuffer have to count as changed. That every tier hashes the
+* same is checked by bltsimd_test.
+*
+\**************************************************************************/
+
+#include "blttest.hxx"
+#include "bltregion.hxx"
+#include "blttile.hxx"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+static UINT64 HashRow(CONST std::vector<BYTE>& Row, UINT64 Salt)
+{
+    UINT64 Acc[BLT_HASH_LANES] = { 0, 0, 0, 0 };
+    BLT_SIMD_CONTEXT SimdContext;
+    BltSimdBegin(&SimdContext);
+    SimdContext.pDispatch->HashRow(Acc, Row.data(), (UINT)Row.size(), Salt);
+    BltSimdEnd(&SimdContext);
+
+    UINT64 Hash = 0;
+    for (UINT i = 0; i < BLT_HASH_LANES; i++)
+    {
+        Hash = Hash * 31 + Acc[i];
+    }
+    return Hash;
+}
+
+static VOID TestHash(VOID)
+{
+    for (UINT Iteration = 0; Iteration < 2000; Iteration++)
+    {
+        UINT Bytes = 2 * BLT_HASH_BLOCK + (BltTestRandom() % 8) * BLT_HASH_BLOCK;
+        std::vector<BYTE> Row(Bytes);
+        BltTestFill(Row.data(), Bytes);
+        UINT64 Hash = HashRow(Row, 7);
+
+        // Two 8 byte lanes of a block swapped
+        std::vector<BYTE> Changed(Row);
+        UINT Block = (BltTestRandom() % (Bytes / BLT_HASH_BLOCK)) * BLT_HASH_BLOCK;
+        std::swap_ranges(Changed.begin() + Block, Changed.begin() + Block + 8, Changed.begin() + Block + 8);
+        BLT_CHECK((Changed == Row) || (HashRow(Changed, 7) != Hash), "swapping two lanes kept the hash");
+
+        // The first two blocks swapped
+        Changed = Row;
+        std::swap_ranges(Changed.begin(), Changed.begin() + BLT_HASH_BLOCK, Changed.begin() + BLT_HASH_BLOCK);
+        BLT_CHECK((Changed == Row) || (HashRow(Changed, 7) != Hash), "swapping two blocks kept the hash");
+
+        Changed = Row;
+        UINT Bit = BltTestRandom() % (Bytes * 8);
+        Changed[Bit / 8] ^= (BYTE)(1 << (Bit % 8));
+        BLT_CHECK(HashRow(Changed, 7) != Hash, "flipping bit %u kept the hash", Bit);
+
+        BLT_CHECK(HashRow(Row, 8) != Hash, "another salt kept the hash");
+    }
+}
+
+// The tile of every pixel a region holds
+static std::set<UINT> RegionTiles(CONST BLT_REGION* pRegion, UINT TileSize, UINT Columns)
+{
+    std::set<UINT> Tiles;
+    CONST RECT* pRects;
+    UINT NumRects = BltRegionGetRects(pRegion, &pRects);
+    for (UINT i = 0; i < NumRects; i++)
+    {
+        for (LONG y = pRects[i].top; y < pRects[i].bottom; y++)
+        {
+            for (LONG x = pRects[i].left; x < pRects[i].right; x++)
+            {
+                Tiles.insert((y / TileSize) * Columns + x / TileSize);
+            }
+        }
+    }
+    return Tiles;
+}
+
+static VOID TestRefine(VOID)
+{
+    for (UINT Iteration = 0; Iteration < 400; Iteration++)
+    {
+        UINT Width = 100 + BltTestRandom() % 300;
+        UINT Height = 80 + BltTestRandom() % 200;
+        UINT TileSize = BLT_TILE_MIN_SIZE << (BltTestRandom() % 3);
+        UINT Pitch = Width * 4 + (BltTestRandom() % 3) * 16;
+        UINT Columns = (Width + TileSize - 1) / TileSize;
+        UINT Rows = (Height + TileSize - 1) / TileSize;
+
+        std::vector<BYTE> SrcBits(Pitch * Height);
+        BltTestFill(SrcBits.data(), SrcBits.size());
+
+        // The map only looks at where the framebuffer is, never into it
+        BLT_INFO Fb = BltTestSurface((VOID*)0x1000, Width, Height, Width * 4, 32, D3DKMDT_VPPR_IDENTITY);
+        BLT_INFO Src = BltTestSurface(SrcBits.data(), Width, Height, Pitch, 32, D3DKMDT_VPPR_IDENTITY);
+
+        BLT_TILE_MAP Map;
+        BltTileMapInit(&Map);
+        if (!BltTileMapPrepare(&Map, &Fb, TileSize))
+        {
+            BLT_CHECK(FALSE, "no memory for %ux%u in tiles of %u", Width, Height, TileSize);
+            continue;
+        }
+
+        RECT Whole = { 0, 0, (LONG)Width, (LONG)Height };
+        BLT_REGION Changed;
+        BltRegionInit(&Changed);
+        BltTileMapRefine(&Map, &Src, 1, &Whole, &Changed);
+        BLT_CHECK(memcmp(&Changed.Extents, &Whole, sizeof(Whole)) == 0, "the first present was not all changed");
+        BltRegionFini(&Changed);
+
+        // Tiles changed since they were last presented
+        std::set<UINT> Pending;
+        for (UINT Step = 0; Step < 6; Step++)
+        {
+            UINT NumChanges = BltTestRandom() % 5;
+            for (UINT i = 0; i < NumChanges; i++)
+            {
+                UINT x = BltTestRandom() % Width;
+                UINT y = BltTestRandom() % Height;
+                SrcBits[y * Pitch + x * 4 + BltTestRandom() % 4] ^= (BYTE)(1 + BltTestRandom() % 255);
+                Pending.insert((y / TileSize) * Columns + x / TileSize);
+            }
+
+            UINT NumRects = 1 + BltTestRandom() % 4;
+            std::vector<RECT> Rects(NumRects);
+            for (UINT i = 0; i < NumRects; i++)
+            {
+                LONG x = BltTestRandom() % Width;
+                LONG y = BltTestRandom() % Height;
+                Rects[i].left = x;
+                Rects[i].top = y;
+                Rects[i].right = std::min<LONG>(Width, x + 1 + BltTestRandom() % (Width / 2));
+                Rects[i].bottom = std::min<LONG>(Height, y + 1 + BltTestRandom() % (Height / 2));
+            }
+            if (BltTestRandom() % 2)
+            {
+                Rects[0] = Whole;
+            }
+
+            std::set<UINT> Expected;
+            for (UINT Tile : Pending)
+            {
+                LONG Left = (LONG)((Tile % Columns) * TileSize);
+                LONG Top = (LONG)((Tile / Columns) * TileSize);
+                for (UINT i = 0; i < NumRects; i++)
+                {
+                    if ((Rects[i].left < Left + (LONG)TileSize) && (Left < Rects[i].right) &&
+                        (Rects[i].top < Top + (LONG)TileSize) && (Top < Rects[i].bottom))
+                    {
+                        Expected.insert(Tile);
+                        break;
+                    }
+                }
+            }
+
+            BltRegionInit(&Changed);
+            BltTileMapRefine(&Map, &Src, NumRects, Rects.data(), &Changed);
+            BLT_CHECK(RegionTiles(&Changed, TileSize, Columns) == Expected,
+                      "iteration %u step %u found %zu changed tiles, not %zu", Iteration, Step,
+                      RegionTiles(&Changed, TileSize, Columns).size(), Expected.size());
+
+            CONST RECT* pRects;
+            UINT NumChanged = BltRegionGetRects(&Changed, &pRects);
+            for (UINT i = 0; i < NumChanged; i++)
+            {
+                BLT_CHECK((pRects[i].left % TileSize == 0) && (pRects[i].top % TileSize == 0) &&
+                          ((pRects[i].right % TileSize == 0) || (pRects[i].right == (LONG)Width)) &&
+                          ((pRects[i].bottom % TileSize == 0) || (pRects[i].bottom == (LONG)Height)),
+                          "a changed rect is not whole tiles");
+            }
+            BltRegionFini(&Changed);
+
+            for (UINT Tile : Expected)
+            {
+                Pending.erase(Tile);
+            }
+
+            // Forgotten tiles count as changed until they are presented again
+            if (Step == 3)
+            {
+                RECT Forget = { (LONG)(BltTestRandom() % Width), (LONG)(BltTestRandom() % Height), (LONG)Width, (LONG)Height };
+                BltTileMapForget(&Map, &Forget);
+                for (UINT ty = 0; ty < Rows; ty++)
+                {
+                    for (UINT tx = 0; tx < Columns; tx++)
+                    {
+                        if (((LONG)((tx + 1) * TileSize) > Forget.left) && ((LONG)((ty + 1) * TileSize) > Forget.top))
+                        {
+                            Pending.insert(ty * Columns + tx);
+                        }
+                    }
+                }
+            }
+        }
+
+        // A framebuffer that moved has nothing known about it
+        Fb.pBits = (VOID*)0x2000;
+        BltTileMapPrepare(&Map, &Fb, TileSize);
+        BltRegionInit(&Changed);
+        BltTileMapRefine(&Map, &Src, 1, &Whole, &Changed);
+        BLT_CHECK(memcmp(&Changed.Extents, &Whole, sizeof(Whole)) == 0, "a moved framebuffer was not all changed");
+        BltRegionFini(&Changed);
+
+        BltTileMapFree(&Map);
+    }
+}
+
+int main()
+{
+    BltSimdInitialize();
+
+    TestHash();
+    TestRefine();
+
+    return BltTestReport("blttile_test");
+}